@@ -0,0 +1,1318 @@
+/*
+    bench.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Throughput benchmark of the demux on synthetic streams held in memory.
+ * Each scenario is demuxed in every output mode: once to check that the ES
+ * data of all modes hash the same, then a few timed runs of which the best
+ * is reported. Allocations are counted by wrapping malloc(), calloc() and
+ * realloc() at link time (-Wl,--wrap), see the bench target of the Makefile.
+ * Each scenario is also demuxed on many handles at once, whose states then
+ * compete for the cache.
+ * A time range of each scenario is then demuxed, and each ES is checked to be
+ * the whole PES presented in the range. The key pictures are extracted and
+ * checked to be the PES of the I frames. Last, each feature around the demux
+ * is checked once on the stream: the seek index, the probe, the live input,
+ * the asynchronous I/O, the statistics, the asynchronous reports and the
+ * program selection.
+ */
+#include "ts2es/ts2es.h"
+#include "ts2es/ts_thread.h"
+#include "ts_gen.h"
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* ===========================================================================
+ * allocation counters
+ * ==========================================================================*/
+static uint64_t g_alloc_calls;
+static uint64_t g_alloc_bytes;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t num, size_t size);
+void *__real_realloc(void *p, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    ts2es_atomic_add64(&g_alloc_calls, 1);
+    ts2es_atomic_add64(&g_alloc_bytes, size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t num, size_t size)
+{
+    ts2es_atomic_add64(&g_alloc_calls, 1);
+    ts2es_atomic_add64(&g_alloc_bytes, num * size);
+    return __real_calloc(num, size);
+}
+
+void *__wrap_realloc(void *p, size_t size)
+{
+    ts2es_atomic_add64(&g_alloc_calls, 1);
+    ts2es_atomic_add64(&g_alloc_bytes, size);
+    return __real_realloc(p, size);
+}
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+#define BENCH_SLICE_SIZE    (1 << 20)   // buffer mode: bytes per call
+#define BENCH_OUTPUT        "/tmp/ts2es_bench"
+#define BENCH_HANDLES       256         // many mode: handles demuxing the stream at once
+#define BENCH_TURN_SIZE     (16 * TS_PACKET_SIZE)   // ... bytes demuxed by each in turn
+#define BENCH_UDP_SIZE      (8 << 20)   // live input check: bytes sent on the loopback
+#define BENCH_UDP_PACKETS   7           // ... TS packets per datagram
+#define BENCH_READ_KEEP     (3 * TS_PACKET_SIZE)    // reader check: bytes kept from block to block
+
+// options of keep_run()
+#define KEEP_KEYFRAMES      0x1         // the key pictures only
+#define KEEP_AU             0x2         // access units, kept one per entry
+#define KEEP_INDEX          0x4         // write the seek index of each ES
+
+enum bench_mode_e {
+    MODE_PACKET = 0,    // ts2es_demux_ts_packet()
+    MODE_BUFFER,        // ts2es_demux_ts_buffer(), slices of BENCH_SLICE_SIZE
+    MODE_IOV,           // zero-copy output
+    MODE_PIPE,          // worker threads
+    MODE_CHUNKS,        // ts2es_demux_ts_chunks()
+    MODE_AU,            // access units
+    MODE_SINK,          // built-in output files, zero-copy
+    MODE_SINK_ES,       // built-in output files, from the ES buffers
+    NUM_MODES
+};
+
+static const char *g_mode_names[NUM_MODES] = {
+    "packet", "buffer", "iov", "pipe", "chunks", "au", "sink", "sink-es"
+};
+
+/* ES data received, per PID */
+typedef struct bench_out_t {
+    int      b_hash;                // hash the data, else only count it
+    uint64_t hash[TS_NUM_PIDS];     // FNV-1a
+    uint64_t bytes[TS_NUM_PIDS];
+} bench_out_t;
+
+/* ES data and PES starts of one PID, kept for the range check */
+typedef struct bench_es_t {
+    uint8_t *data;
+    size_t   len;
+    size_t   size;
+    size_t  *pes_pos;       // offset of each PES in data
+    int64_t *pes_pts;
+    int      n_pes;
+    int      max_pes;
+} bench_es_t;
+
+typedef struct bench_keep_t {
+    bench_es_t es[TS_NUM_PIDS];
+} bench_keep_t;
+
+/* counted on the stream, per PID */
+typedef struct bench_pid_count_t {
+    uint64_t packets;
+    uint64_t pes;           // packets starting a PES
+    uint64_t cc_errors;     // continuity_counter jumps
+} bench_pid_count_t;
+
+typedef struct bench_scenario_t {
+    const char    *name;
+    ts_gen_param_t gen;
+} bench_scenario_t;
+
+/* ---------------------------------------------------------------------------
+ */
+static void out_data(bench_out_t *p_out, int pid, const uint8_t *p, size_t len)
+{
+    pid &= TS_NUM_PIDS - 1;
+    p_out->bytes[pid] += len;
+    if (p_out->b_hash) {
+        uint64_t h = p_out->hash[pid];
+        size_t i;
+        for (i = 0; i < len; i++) {
+            h = (h ^ p[i]) * 0x100000001B3ULL;
+        }
+        p_out->hash[pid] = h;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void out_es(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque)
+{
+    size_t len;
+    const uint8_t *data = ts2es_es_take(h_ts, p_es, &len);
+
+    if (data != NULL) {
+        out_data((bench_out_t *)opque, p_es->pid, data, len);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void out_iov(ts2es_t *h_ts, int pid, int64_t pts, int64_t dts,
+                    const ts2es_iov_t *iov, int n_iov, void *opque)
+{
+    int i;
+
+    for (i = 0; i < n_iov && ts2es_atomic_load(&h_ts->b_output); i++) {
+        out_data((bench_out_t *)opque, pid, (const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void out_au(ts2es_t *h_ts, int pid, int64_t pts, int64_t dts, int b_key,
+                   const uint8_t *data, size_t len, void *opque)
+{
+    out_data((bench_out_t *)opque, pid, data, len);
+}
+
+/* ---------------------------------------------------------------------------
+ * PID of the i-th stream of the generator
+ */
+static int gen_pid(const ts_gen_param_t *p_gen, int i)
+{
+    return i < p_gen->num_video ? TS_GEN_VIDEO_PID + i : TS_GEN_AUDIO_PID + i - p_gen->num_video;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void select_pids(ts2es_t *h_ts, const ts_gen_param_t *p_gen)
+{
+    int i;
+    for (i = 0; i < p_gen->num_video + p_gen->num_audio; i++) {
+        ts2es_select_pid(h_ts, gen_pid(p_gen, i));
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * keep the ES data, a PES starts where the PTS changes
+ * returns 1 on success, or 0 if out of memory
+ */
+static int keep_data(bench_es_t *p_es, int64_t pts, const uint8_t *p, size_t len)
+{
+    if (p_es->n_pes == 0 || p_es->pes_pts[p_es->n_pes - 1] != pts) {
+        if (p_es->n_pes == p_es->max_pes) {
+            int max_pes = p_es->max_pes ? p_es->max_pes << 1 : 256;
+            size_t  *pes_pos = (size_t *)realloc(p_es->pes_pos, max_pes * sizeof(size_t));
+            int64_t *pes_pts = pes_pos ? (int64_t *)realloc(p_es->pes_pts, max_pes * sizeof(int64_t)) : NULL;
+            p_es->pes_pos = pes_pos ? pes_pos : p_es->pes_pos;
+            if (pes_pts == NULL) {
+                return 0;
+            }
+            p_es->pes_pts = pes_pts;
+            p_es->max_pes = max_pes;
+        }
+        p_es->pes_pos[p_es->n_pes] = p_es->len;
+        p_es->pes_pts[p_es->n_pes] = pts;
+        p_es->n_pes++;
+    }
+    if (p_es->len + len > p_es->size) {
+        size_t size = (p_es->len + len) << 1;
+        uint8_t *data = (uint8_t *)realloc(p_es->data, size);
+        if (data == NULL) {
+            return 0;
+        }
+        p_es->data = data;
+        p_es->size = size;
+    }
+    memcpy(p_es->data + p_es->len, p, len);
+    p_es->len += len;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void keep_es(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque)
+{
+    bench_keep_t *p_keep = (bench_keep_t *)opque;
+    size_t len;
+    const uint8_t *data = ts2es_es_take(h_ts, p_es, &len);
+
+    if (data != NULL && !keep_data(&p_keep->es[p_es->pid & (TS_NUM_PIDS - 1)], p_es->pts, data, len)) {
+        h_ts->Interrupted = 1;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void keep_au(ts2es_t *h_ts, int pid, int64_t pts, int64_t dts, int b_key,
+                    const uint8_t *data, size_t len, void *opque)
+{
+    bench_keep_t *p_keep = (bench_keep_t *)opque;
+    if (!keep_data(&p_keep->es[pid & (TS_NUM_PIDS - 1)], pts, data, len)) {
+        h_ts->Interrupted = 1;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void keep_free(bench_keep_t *p_keep)
+{
+    int i;
+    for (i = 0; i < TS_NUM_PIDS; i++) {
+        free(p_keep->es[i].data);
+        free(p_keep->es[i].pes_pos);
+        free(p_keep->es[i].pes_pts);
+    }
+    memset(p_keep, 0, sizeof(bench_keep_t));
+}
+
+/* ---------------------------------------------------------------------------
+ * hash the files written by the built-in output, if p_out, and remove them
+ */
+static void out_read_files(bench_out_t *p_out, const ts_gen_param_t *p_gen)
+{
+    uint8_t *buf = (uint8_t *)malloc(BENCH_SLICE_SIZE);
+    int i;
+
+    for (i = 0; i < p_gen->num_video + p_gen->num_audio && buf != NULL; i++) {
+        int pid = gen_pid(p_gen, i);
+        char s_path[64];
+        FILE *fp;
+        size_t len;
+
+        snprintf(s_path, sizeof(s_path), "%s_%d.es", BENCH_OUTPUT, pid);
+        if ((fp = fopen(s_path, "rb")) == NULL) {
+            continue;
+        }
+        while (p_out != NULL && (len = fread(buf, 1, BENCH_SLICE_SIZE, fp)) > 0) {
+            out_data(p_out, pid, buf, len);
+        }
+        fclose(fp);
+        remove(s_path);
+    }
+    free(buf);
+}
+
+/* ---------------------------------------------------------------------------
+ * demux a stream once in a mode
+ * returns the time taken in us, or -1 if the handle could not be created
+ */
+static int64_t bench_run(int mode, const ts_gen_param_t *p_gen, uint8_t *buf, size_t len,
+                         int n_threads, bench_out_t *p_out)
+{
+    ts2es_param_t param;
+    ts2es_t *h_ts;
+    int64_t t0;
+    size_t pos;
+
+    memset(&param, 0, sizeof(param));
+    param.i_log_level = TS2ES_ERROR;
+    param.i_threads   = mode == MODE_PIPE ? n_threads : 0;
+    snprintf(param.s_input, sizeof(param.s_input), "bench");
+    snprintf(param.s_output, sizeof(param.s_output), "%s", BENCH_OUTPUT);
+
+    t0 = ts2es_time_us();
+    h_ts = ts2es_create(&param, mode == MODE_SINK || mode == MODE_SINK_ES ? NULL : out_es, p_out);
+    if (h_ts == NULL) {
+        return -1;
+    }
+    if (mode == MODE_IOV) {
+        ts2es_set_output_iov(h_ts, out_iov, p_out);
+    } else if (mode == MODE_AU) {
+        ts2es_set_output_au(h_ts, out_au, p_out);
+    } else if (mode == MODE_SINK) {
+        ts2es_set_output_iov(h_ts, ts2es_sink_output_iov, NULL);
+    }
+    select_pids(h_ts, p_gen);
+
+    switch (mode) {
+    case MODE_PACKET:
+        for (pos = 0; pos + TS_PACKET_SIZE <= len; pos += TS_PACKET_SIZE) {
+            ts2es_demux_ts_packet(h_ts, buf + pos, TS_PACKET_SIZE);
+        }
+        break;
+    case MODE_BUFFER:
+        for (pos = 0; pos < len;) {
+            size_t n = len - pos < BENCH_SLICE_SIZE ? len - pos : BENCH_SLICE_SIZE;
+            size_t used = ts2es_demux_ts_buffer(h_ts, buf + pos, n);
+            if (used == 0) {
+                break;
+            }
+            pos += used;
+        }
+        break;
+    case MODE_CHUNKS:
+        ts2es_demux_ts_chunks(h_ts, buf, len, n_threads);
+        break;
+    default:
+        ts2es_demux_ts_buffer(h_ts, buf, len);
+        break;
+    }
+    ts2es_destroy(h_ts);
+    return ts2es_time_us() - t0;
+}
+
+/* ---------------------------------------------------------------------------
+ * demux the stream on BENCH_HANDLES handles at once with zero-copy output,
+ * taking turns of BENCH_TURN_SIZE bytes, as a server demuxing many inputs on
+ * one thread does: the state of each handle is out of the L1 and L2 caches
+ * when its turn comes
+ * returns the time taken in us
+ */
+static int64_t many_run(const ts_gen_param_t *p_gen, uint8_t *buf, size_t len, bench_out_t *p_out)
+{
+    ts2es_t *handles[BENCH_HANDLES];
+    ts2es_param_t param;
+    size_t pos[BENCH_HANDLES];
+    int64_t t0;
+    int h, n_active;
+
+    memset(&param, 0, sizeof(param));
+    param.i_log_level = TS2ES_ERROR;
+    snprintf(param.s_input, sizeof(param.s_input), "bench");
+
+    t0 = ts2es_time_us();
+    for (h = 0; h < BENCH_HANDLES; h++) {
+        handles[h] = ts2es_create(&param, out_es, p_out);
+        ts2es_set_output_iov(handles[h], out_iov, p_out);
+        select_pids(handles[h], p_gen);
+        pos[h] = 0;
+    }
+    do {
+        n_active = 0;
+        for (h = 0; h < BENCH_HANDLES; h++) {
+            size_t n = len - pos[h] < BENCH_TURN_SIZE ? len - pos[h] : BENCH_TURN_SIZE;
+            if (n > 0) {
+                size_t used = ts2es_demux_ts_buffer(handles[h], buf + pos[h], n);
+                pos[h] = used ? pos[h] + used : len;
+                n_active++;
+            }
+        }
+    } while (n_active > 0);
+    for (h = 0; h < BENCH_HANDLES; h++) {
+        ts2es_destroy(handles[h]);
+    }
+    return ts2es_time_us() - t0;
+}
+
+/* ---------------------------------------------------------------------------
+ * demux the whole stream, or the range [start, end] if start >= 0, keeping
+ * the ES data, with the KEEP_* options in "flags"
+ */
+static void keep_run(const ts_gen_param_t *p_gen, uint8_t *buf, size_t len, int64_t start, int64_t end,
+                     int n_threads, int flags, bench_keep_t *p_keep)
+{
+    ts2es_param_t param;
+    ts2es_t *h_ts;
+
+    memset(&param, 0, sizeof(param));
+    param.i_log_level = TS2ES_ERROR;
+    param.b_keyframes = !!(flags & KEEP_KEYFRAMES);
+    param.b_index     = !!(flags & KEEP_INDEX);
+    snprintf(param.s_input, sizeof(param.s_input), "bench");
+    snprintf(param.s_output, sizeof(param.s_output), "%s", BENCH_OUTPUT);
+
+    h_ts = ts2es_create(&param, keep_es, p_keep);
+    if (flags & KEEP_AU) {
+        ts2es_set_output_au(h_ts, keep_au, p_keep);
+    }
+    select_pids(h_ts, p_gen);
+    if (start >= 0) {
+        ts2es_demux_ts_range(h_ts, buf, len, start, end, n_threads);
+    } else if (n_threads > 1) {
+        ts2es_demux_ts_chunks(h_ts, buf, len, n_threads);
+    } else {
+        ts2es_demux_ts_buffer(h_ts, buf, len);
+    }
+    ts2es_destroy(h_ts);
+}
+
+/* ---------------------------------------------------------------------------
+ * check the ES of a range against those of the whole stream: each one is to
+ * be the data of the PES from its first one, up to and excluding the first
+ * PES presented after "end"
+ * returns 1 if all match
+ */
+static int range_check(const bench_keep_t *p_ref, const bench_keep_t *p_out, int64_t end)
+{
+    int b_match = 1;
+    int i, k;
+
+    for (i = 0; i < TS_NUM_PIDS; i++) {
+        const bench_es_t *p_ref_es = &p_ref->es[i];
+        const bench_es_t *p_es = &p_out->es[i];
+        size_t pos;
+
+        if (p_es->len == 0) {
+            continue;
+        }
+        for (k = 0; k < p_ref_es->n_pes && p_ref_es->pes_pts[k] != p_es->pes_pts[0]; k++) {
+        }
+        if (k == p_ref_es->n_pes || p_ref_es->pes_pos[k] + p_es->len > p_ref_es->len ||
+            memcmp(p_ref_es->data + p_ref_es->pes_pos[k], p_es->data, p_es->len)) {
+            printf("  PID %d: %llu bytes, not the data of the stream\n", i, (unsigned long long)p_es->len);
+            b_match = 0;
+            continue;
+        }
+
+        pos = p_ref_es->pes_pos[k] + p_es->len;
+        for (; k < p_ref_es->n_pes && p_ref_es->pes_pos[k] < pos; k++) {
+        }
+        if ((k < p_ref_es->n_pes && (p_ref_es->pes_pos[k] != pos || p_ref_es->pes_pts[k] <= end)) ||
+            p_ref_es->pes_pts[k - 1] > end) {
+            printf("  PID %d: %llu bytes, ends at PTS %lld\n", i, (unsigned long long)p_es->len,
+                   (long long)p_ref_es->pes_pts[k - 1]);
+            b_match = 0;
+        }
+    }
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * check the ES of the key pictures against those of the whole stream: the
+ * video is to be the PES of the I frames, one a second from the first, and
+ * the audio all of it
+ * returns 1 if all match
+ */
+static int keyframe_check(const bench_keep_t *p_ref, const bench_keep_t *p_out, const ts_gen_param_t *p_gen)
+{
+    int b_match = 1;
+    int i, k;
+
+    for (i = 0; i < TS_NUM_PIDS; i++) {
+        const bench_es_t *p_ref_es = &p_ref->es[i];
+        const bench_es_t *p_es = &p_out->es[i];
+        int b_video = i >= TS_GEN_VIDEO_PID && i < TS_GEN_VIDEO_PID + p_gen->num_video;
+        size_t pos = 0;
+
+        for (k = 0; k < p_ref_es->n_pes; k++) {
+            size_t end = k + 1 < p_ref_es->n_pes ? p_ref_es->pes_pos[k + 1] : p_ref_es->len;
+            size_t len = end - p_ref_es->pes_pos[k];
+
+            if (b_video && (p_ref_es->pes_pts[k] - p_ref_es->pes_pts[0]) % 90000 != 0) {
+                continue;
+            }
+            if (pos + len > p_es->len || memcmp(p_es->data + pos, p_ref_es->data + p_ref_es->pes_pos[k], len)) {
+                break;
+            }
+            pos += len;
+        }
+        if (k < p_ref_es->n_pes || pos != p_es->len) {
+            printf("  PID %d: %llu bytes, differs from the PES at PTS %lld\n", i, (unsigned long long)p_es->len,
+                   (long long)(k < p_ref_es->n_pes ? p_ref_es->pes_pts[k] : -1));
+            b_match = 0;
+        }
+    }
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * length of the k-th PES kept
+ */
+static size_t pes_len(const bench_es_t *p_es, int k)
+{
+    return (k + 1 < p_es->n_pes ? p_es->pes_pos[k + 1] : p_es->len) - p_es->pes_pos[k];
+}
+
+/* ---------------------------------------------------------------------------
+ * check the access units against the PES of the whole stream, each PES of
+ * the generator holding one frame: each access unit is to be the next PES of
+ * its PID. Only audio frames cut by a continuity error, which the framing
+ * drops, may be missing; they are shorter than the frames delivered
+ * returns 1 if all match, and sets *p_dropped to the frames missing
+ */
+static int au_check(const bench_keep_t *p_ref, const bench_keep_t *p_out, const ts_gen_param_t *p_gen,
+                    int *p_dropped)
+{
+    int b_match = 1;
+    int i, j, k;
+
+    *p_dropped = 0;
+    for (i = 0; i < p_gen->num_video + p_gen->num_audio; i++) {
+        int pid = gen_pid(p_gen, i);
+        const bench_es_t *p_ref_es = &p_ref->es[pid];
+        const bench_es_t *p_es = &p_out->es[pid];
+        size_t frame_len = 0;
+
+        for (j = 0; j < p_es->n_pes; j++) {
+            frame_len = pes_len(p_es, j) > frame_len ? pes_len(p_es, j) : frame_len;
+        }
+        for (j = 0, k = 0; k < p_ref_es->n_pes; k++) {
+            size_t len = pes_len(p_ref_es, k);
+            if (j < p_es->n_pes && p_es->pes_pts[j] == p_ref_es->pes_pts[k] && pes_len(p_es, j) == len &&
+                !memcmp(p_es->data + p_es->pes_pos[j], p_ref_es->data + p_ref_es->pes_pos[k], len)) {
+                j++;
+            } else if (i >= p_gen->num_video && len < frame_len) {
+                (*p_dropped)++;
+            } else {
+                break;
+            }
+        }
+        if (k < p_ref_es->n_pes || j < p_es->n_pes) {
+            printf("  PID %d: %d access units, differs from the PES at PTS %lld\n", pid, p_es->n_pes,
+                   (long long)(k < p_ref_es->n_pes ? p_ref_es->pes_pts[k] : -1));
+            b_match = 0;
+        }
+    }
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * print the row of a check, which is not timed
+ * returns b_match: 1 ok, 0 mismatch, -1 not available here
+ */
+static int check_row(const char *s_stream, const char *s_name, int b_match)
+{
+    printf("%-8s %-8s %12s %8s %10s %10s  %s\n", s_stream, s_name, "-", "-", "-", "-",
+           b_match > 0 ? "ok" : b_match < 0 ? "skipped" : "MISMATCH");
+    fflush(stdout);
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns 1 if the ES data of both are the same
+ */
+static int out_same(const bench_out_t *p_ref, const bench_out_t *p_out)
+{
+    int i;
+
+    for (i = 0; i < TS_NUM_PIDS; i++) {
+        if (p_ref->hash[i] != p_out->hash[i] || p_ref->bytes[i] != p_out->bytes[i]) {
+            printf("  PID %d: %llu bytes, %llu expected\n", i,
+                   (unsigned long long)p_out->bytes[i], (unsigned long long)p_ref->bytes[i]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * read a whole file, and remove it
+ * returns the data, to be freed, or NULL if it cannot be read
+ */
+static uint8_t *read_file(const char *s_path, size_t *p_len)
+{
+    FILE *fp = fopen(s_path, "rb");
+    uint8_t *data = NULL;
+    long size;
+
+    *p_len = 0;
+    if (fp == NULL) {
+        return NULL;
+    }
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 && fseek(fp, 0, SEEK_SET) == 0 &&
+        (data = (uint8_t *)malloc((size_t)size + 1)) != NULL) {
+        *p_len = fread(data, 1, (size_t)size, fp);
+        data[*p_len] = '\0';
+    }
+    fclose(fp);
+    remove(s_path);
+    return data;
+}
+
+/* ---------------------------------------------------------------------------
+ * count the packets, the PES starts and the continuity errors of each PID of
+ * the stream, every packet of the generator carrying a payload
+ */
+static void count_pids(const uint8_t *buf, size_t len, bench_pid_count_t *counts)
+{
+    uint8_t last_cc[TS_NUM_PIDS];
+    size_t pos;
+
+    memset(counts, 0, TS_NUM_PIDS * sizeof(bench_pid_count_t));
+    memset(last_cc, 0xFF, sizeof(last_cc));
+    for (pos = 0; pos + TS_PACKET_SIZE <= len; pos += TS_PACKET_SIZE) {
+        const uint8_t *p = buf + pos;
+        int pid = TS_PACKET_PID(p);
+
+        counts[pid].packets++;
+        counts[pid].pes += TS_PACKET_PAYLOAD_START(p);
+        if (pid != 0x1FFF && last_cc[pid] != 0xFF && TS_PACKET_CONT_COUNT(p) != ((last_cc[pid] + 1) & 0xF)) {
+            counts[pid].cc_errors++;
+        }
+        last_cc[pid] = (uint8_t)TS_PACKET_CONT_COUNT(p);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * check the seek index of each video PID, written serially or in chunks: an
+ * entry per PES output, in order, with its PTS, its ES offset and the offset
+ * of the TS packet starting it, the I frames flagged. A seek to the PTS of
+ * each entry is to give the last I frame decoded by then
+ * returns 1 if all match
+ */
+static int index_check(const ts_gen_param_t *p_gen, uint8_t *buf, size_t len, int n_threads,
+                       const bench_keep_t *p_ref)
+{
+    bench_keep_t *p_keep = (bench_keep_t *)calloc(1, sizeof(bench_keep_t));
+    int b_match = p_keep != NULL;
+    int i;
+
+    if (p_keep != NULL) {
+        keep_run(p_gen, buf, len, -1, -1, n_threads, KEEP_INDEX, p_keep);
+        keep_free(p_keep);
+        free(p_keep);
+    }
+
+    for (i = 0; i < p_gen->num_video; i++) {
+        const bench_es_t *p_es = &p_ref->es[TS_GEN_VIDEO_PID + i];
+        ts2es_index_entry_t ent;
+        char s_path[64];
+        size_t idx_len, n, j, m;
+        int64_t key;
+        uint8_t *idx;
+        int k = 0;
+
+        snprintf(s_path, sizeof(s_path), "%s_%d.idx", BENCH_OUTPUT, TS_GEN_VIDEO_PID + i);
+        idx = read_file(s_path, &idx_len);
+        n = idx_len >= TS2ES_INDEX_HEADER_SIZE ? (idx_len - TS2ES_INDEX_HEADER_SIZE) / TS2ES_INDEX_ENTRY_SIZE : 0;
+        if (idx == NULL || n != (size_t)p_es->n_pes) {
+            printf("  PID %d: %llu index entries, %d PES\n", TS_GEN_VIDEO_PID + i, (unsigned long long)n,
+                   p_es->n_pes);
+            b_match = 0;
+        }
+
+        for (j = 0; j < n && b_match; j++, k++) {
+            const uint8_t *p;
+            int b_key;
+            int64_t got;
+
+            ts2es_index_entry(idx, idx_len, j, &ent);
+            p = buf + ent.ts_offset;
+            b_key = (p_es->pes_pts[k] - p_es->pes_pts[0]) % 90000 == 0;
+            if (ent.pts != p_es->pes_pts[k] || ent.es_offset != p_es->pes_pos[k] ||
+                ent.ts_offset + TS_PACKET_SIZE > len || TS_PACKET_SYNC_BYTE(p) != 0x47 ||
+                TS_PACKET_PID(p) != TS_GEN_VIDEO_PID + i || !TS_PACKET_PAYLOAD_START(p) ||
+                !(ent.flags & TS2ES_INDEX_KEY) != !b_key) {
+                printf("  PID %d: index entry %llu differs from the PES at PTS %lld\n", TS_GEN_VIDEO_PID + i,
+                       (unsigned long long)j, (long long)p_es->pes_pts[k]);
+                b_match = 0;
+                break;
+            }
+
+            // the last I frame decoded by the PTS of the entry
+            got = ts2es_index_seek(idx, idx_len, p_es->pes_pts[k]);
+            for (m = 0, key = -1; m < n && ts2es_index_entry(idx, idx_len, m, &ent) &&
+                 ent.pts - ent.pts_minus_dts <= p_es->pes_pts[k]; m++) {
+                key = (ent.flags & TS2ES_INDEX_KEY) ? (int64_t)m : key;
+            }
+            if (got != key) {
+                printf("  PID %d: seek to PTS %lld gives entry %lld, %lld expected\n", TS_GEN_VIDEO_PID + i,
+                       (long long)p_es->pes_pts[k], (long long)got, (long long)key);
+                b_match = 0;
+            }
+        }
+        free(idx);
+    }
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * check the probe of the stream: its one program, and each ES with its
+ * stream_type and its first PTS, the audio with a sync point and the
+ * parameters of its frames. The video of the generator has no sequence
+ * header, so the probe is not complete
+ * returns 1 if all match
+ */
+static int probe_check(const ts_gen_param_t *p_gen, const uint8_t *buf, size_t len, const bench_keep_t *p_ref)
+{
+    ts2es_probe_t *p_probe = (ts2es_probe_t *)malloc(sizeof(ts2es_probe_t));
+    int b_match;
+    int i, k;
+
+    if (p_probe == NULL) {
+        return 0;
+    }
+    ts2es_probe_buffer(NULL, buf, len, p_probe);
+    b_match = p_probe->packet_size == TS_PACKET_SIZE && p_probe->bytes_scanned > 0 &&
+              p_probe->num_programs == 1 && p_probe->programs[0].program_number == 1 &&
+              p_probe->programs[0].pmt_pid == TS_GEN_PMT_PID && p_probe->programs[0].pcr_pid == gen_pid(p_gen, 0) &&
+              p_probe->num_es == p_gen->num_video + p_gen->num_audio;
+    if (!b_match) {
+        printf("  probe: %d byte packets, %d programs, %d ES\n", p_probe->packet_size, p_probe->num_programs,
+               p_probe->num_es);
+    }
+
+    for (k = 0; k < p_probe->num_es && b_match; k++) {
+        const ts2es_probe_es_t *p_es = &p_probe->es[k];
+        const bench_es_t *p_ref_es = &p_ref->es[p_es->pid & (TS_NUM_PIDS - 1)];
+
+        for (i = 0; i < p_gen->num_video + p_gen->num_audio && gen_pid(p_gen, i) != p_es->pid; i++) {
+        }
+        if (i < p_gen->num_video) {
+            b_match = p_es->stream_type == p_gen->video_stream_type && p_es->stream_id == 0xE0 + (i & 0xF);
+        } else {
+            b_match = i < p_gen->num_video + p_gen->num_audio && p_es->stream_type == 0x03 &&
+                      p_es->stream_id == 0xC0 + ((i - p_gen->num_video) & 0x1F) && p_es->b_synced && p_es->samplerate == 48000 &&
+                      p_es->bitrate == 192 && p_es->channels == 2;
+        }
+        // the ES is output from its first sync point
+        b_match = b_match && p_ref_es->n_pes > 0 && p_es->first_pts >= 0 && p_es->first_pts <= p_ref_es->pes_pts[0];
+        if (!b_match) {
+            printf("  probe: PID %d, stream_type 0x%x, stream id 0x%x, first PTS %lld\n", p_es->pid,
+                   p_es->stream_type, p_es->stream_id, (long long)p_es->first_pts);
+        }
+    }
+    free(p_probe);
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * check the live input: the start of the stream is sent on the loopback in
+ * datagrams, all to be received and demuxed as from memory
+ * returns 1 if all match, or -1 if there is no loopback
+ */
+static int udp_check(const ts_gen_param_t *p_gen, uint8_t *buf, size_t len)
+{
+    const size_t dgram_len = BENCH_UDP_PACKETS * TS_PACKET_SIZE;
+    size_t n = (len < BENCH_UDP_SIZE ? len : BENCH_UDP_SIZE) / dgram_len;
+    bench_out_t *p_ref = (bench_out_t *)calloc(1, sizeof(bench_out_t));
+    bench_out_t *p_out = (bench_out_t *)calloc(1, sizeof(bench_out_t));
+    int port = 20000 + (int)(getpid() % 20000);
+    ts2es_udp_stats_t stats;
+    ts2es_param_t param;
+    ts2es_udp_t *p_udp = NULL;
+    ts2es_t *h_ts;
+    struct sockaddr_in sa;
+    char s_addr[32];
+    int fd, b_match = -1;
+    size_t k;
+
+    if (p_ref == NULL || p_out == NULL) {
+        free(p_ref);
+        free(p_out);
+        return 0;
+    }
+    p_ref->b_hash = 1;
+    p_out->b_hash = 1;
+    bench_run(MODE_BUFFER, p_gen, buf, n * dgram_len, 1, p_ref);
+
+    memset(&param, 0, sizeof(param));
+    param.i_log_level = TS2ES_ERROR;
+    snprintf(param.s_input, sizeof(param.s_input), "bench");
+    h_ts = ts2es_create(&param, out_es, p_out);
+    select_pids(h_ts, p_gen);
+
+    snprintf(s_addr, sizeof(s_addr), "127.0.0.1:%d", port);
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd >= 0 && (p_udp = ts2es_udp_open(h_ts, s_addr, (int)n + 64)) != NULL) {
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family      = AF_INET;
+        sa.sin_port        = htons((uint16_t)port);
+        sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (k = 0; k < n; k++) {
+            sendto(fd, buf + k * dgram_len, dgram_len, 0, (struct sockaddr *)&sa, sizeof(sa));
+            if ((k & 15) == 15) {
+                usleep(200);    // paced, the socket buffer holds few datagrams
+            }
+        }
+        ts2es_udp_demux(p_udp, 200);
+        ts2es_udp_get_stats(p_udp, &stats);
+        b_match = stats.datagrams == n && stats.dropped == 0 && stats.lost == 0 &&
+                  stats.overflows == 0 && stats.truncated == 0;
+        if (!b_match) {
+            printf("  %llu datagrams of %llu received, %llu dropped, %llu overflows\n",
+                   (unsigned long long)stats.datagrams, (unsigned long long)n,
+                   (unsigned long long)stats.dropped, (unsigned long long)stats.overflows);
+        }
+    }
+    ts2es_udp_close(p_udp);
+    if (fd >= 0) {
+        close(fd);
+    }
+    ts2es_destroy(h_ts);
+
+    b_match = b_match > 0 ? out_same(p_ref, p_out) : b_match;
+    free(p_ref);
+    free(p_out);
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * check the asynchronous I/O on each backend: the stream written to a file
+ * is read back in blocks, the end of each block put in front of the next,
+ * then demuxed to the built-in output written asynchronously, whose files
+ * are to hold the ES of the other modes
+ * returns 1 if all match
+ */
+static int aio_check(const ts_gen_param_t *p_gen, const uint8_t *buf, size_t len, const bench_out_t *p_ref)
+{
+    bench_out_t *p_out = (bench_out_t *)malloc(sizeof(bench_out_t));
+    char s_path[64];
+    int b_threads, b_match;
+    FILE *fp;
+
+    snprintf(s_path, sizeof(s_path), "%s.ts", BENCH_OUTPUT);
+    fp = fopen(s_path, "wb");
+    b_match = p_out != NULL && fp != NULL && fwrite(buf, 1, len, fp) == len;
+    if (fp != NULL) {
+        b_match = !fclose(fp) && b_match;
+    }
+
+    for (b_threads = 0; b_threads < 2 && b_match; b_threads++) {
+        ts2es_aio_t *p_aio = ts2es_aio_create(b_threads);
+        ts2es_reader_t *p_rd = p_aio != NULL ? ts2es_reader_open(p_aio, s_path, 4, BENCH_SLICE_SIZE) : NULL;
+        const char *s_backend = p_aio != NULL ? ts2es_aio_backend(p_aio) : "none";
+        size_t pos = 0, keep = 0, n;
+        ts2es_param_t param;
+        ts2es_t *h_ts;
+        uint8_t *p;
+
+        while (p_rd != NULL && (p = ts2es_reader_next(p_rd, keep, &n)) != NULL) {
+            if (n < keep || pos + n - keep > len || memcmp(p, buf + pos - keep, n)) {
+                break;
+            }
+            pos += n - keep;
+            keep = BENCH_READ_KEEP;
+        }
+        if (pos != len) {
+            printf("  %s: %llu bytes read of %llu\n", s_backend, (unsigned long long)pos, (unsigned long long)len);
+            b_match = 0;
+        }
+        ts2es_reader_close(p_rd);
+        ts2es_aio_destroy(p_aio);
+
+        memset(&param, 0, sizeof(param));
+        param.i_log_level = TS2ES_ERROR;
+        param.b_async_io  = 1 + b_threads;
+        snprintf(param.s_input, sizeof(param.s_input), "bench");
+        snprintf(param.s_output, sizeof(param.s_output), "%s", BENCH_OUTPUT);
+        h_ts = ts2es_create(&param, NULL, NULL);
+        select_pids(h_ts, p_gen);
+        ts2es_demux_ts_buffer(h_ts, (uint8_t *)buf, len);
+        ts2es_destroy(h_ts);
+
+        memset(p_out, 0, sizeof(bench_out_t));
+        p_out->b_hash = 1;
+        out_read_files(p_out, p_gen);
+        b_match = out_same(p_ref, p_out) && b_match;
+    }
+    remove(s_path);
+    free(p_out);
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * check the statistics written as JSON at the end, with the built-in output:
+ * the packets, the output bytes, and the packets, PES and continuity errors
+ * of each PID as counted on the stream
+ * returns 1 if all match
+ */
+static int stats_check(const ts_gen_param_t *p_gen, uint8_t *buf, size_t len, const bench_out_t *p_ref)
+{
+    bench_pid_count_t *counts = (bench_pid_count_t *)malloc(TS_NUM_PIDS * sizeof(bench_pid_count_t));
+    unsigned long long packets = 0, output_bytes = 0, expected = 0;
+    ts2es_param_t param;
+    ts2es_t *h_ts;
+    size_t json_len;
+    char *json, *p;
+    int b_match, i;
+
+    if (counts == NULL) {
+        return 0;
+    }
+    count_pids(buf, len, counts);
+
+    memset(&param, 0, sizeof(param));
+    param.i_log_level = TS2ES_ERROR;
+    param.b_stats     = 1;
+    snprintf(param.s_input, sizeof(param.s_input), "bench");
+    snprintf(param.s_output, sizeof(param.s_output), "%s", BENCH_OUTPUT);
+    snprintf(param.s_stats, sizeof(param.s_stats), "%s.json", BENCH_OUTPUT);
+    remove(param.s_stats);
+    h_ts = ts2es_create(&param, NULL, NULL);
+    select_pids(h_ts, p_gen);
+    ts2es_demux_ts_buffer(h_ts, buf, len);
+    ts2es_destroy(h_ts);
+    out_read_files(NULL, p_gen);
+
+    json = (char *)read_file(param.s_stats, &json_len);
+    for (i = 0; i < TS_NUM_PIDS; i++) {
+        expected += p_ref->bytes[i];
+    }
+    b_match = json != NULL && (p = strstr(json, "\"packets\":")) != NULL &&
+              sscanf(p, "\"packets\":%llu", &packets) == 1 && packets == len / TS_PACKET_SIZE &&
+              (p = strstr(json, "\"output_bytes\":")) != NULL &&
+              sscanf(p, "\"output_bytes\":%llu", &output_bytes) == 1 && output_bytes == expected;
+    if (!b_match) {
+        printf("  %llu packets, %llu output bytes, %llu expected\n", packets, output_bytes, expected);
+    }
+
+    for (i = 0; i < p_gen->num_video + p_gen->num_audio && b_match; i++) {
+        const bench_pid_count_t *p_cnt = &counts[gen_pid(p_gen, i)];
+        unsigned long long pid_packets = 0, payload_bytes = 0, pes = 0, cc_errors = 0;
+        char s_key[32];
+
+        snprintf(s_key, sizeof(s_key), "{\"pid\":%d,", gen_pid(p_gen, i));
+        b_match = (p = strstr(json, s_key)) != NULL &&
+                  sscanf(p + strlen(s_key), "\"packets\":%llu,\"payload_bytes\":%llu,\"pes\":%llu,\"cc_errors\":%llu",
+                         &pid_packets, &payload_bytes, &pes, &cc_errors) == 4 &&
+                  pid_packets == p_cnt->packets && pes == p_cnt->pes && cc_errors == p_cnt->cc_errors;
+        if (!b_match) {
+            printf("  PID %d: %llu packets, %llu PES, %llu continuity errors, %llu, %llu, %llu expected\n",
+                   gen_pid(p_gen, i), pid_packets, pes, cc_errors, (unsigned long long)p_cnt->packets,
+                   (unsigned long long)p_cnt->pes, (unsigned long long)p_cnt->cc_errors);
+        }
+    }
+    free(json);
+    free(counts);
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * check the asynchronous reports: those of the stream, every level on, are
+ * to be written as the synchronous ones, in the same order
+ * returns 1 if all match
+ */
+static int log_check(const ts_gen_param_t *p_gen, uint8_t *buf, size_t len)
+{
+    bench_out_t *p_out = (bench_out_t *)calloc(1, sizeof(bench_out_t));
+    char *text[2] = { NULL, NULL };
+    size_t text_len[2];
+    char s_path[64];
+    int b_async, b_match;
+
+    snprintf(s_path, sizeof(s_path), "%s.log", BENCH_OUTPUT);
+    for (b_async = 0; b_async < 2 && p_out != NULL; b_async++) {
+        ts2es_param_t param;
+        ts2es_t *h_ts;
+        int fd_err, fd;
+
+        // the reports go to stderr
+        fflush(stderr);
+        if ((fd = open(s_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0 || (fd_err = dup(2)) < 0) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            break;
+        }
+        dup2(fd, 2);
+        close(fd);
+
+        memset(&param, 0, sizeof(param));
+        param.i_log_level = TS2ES_DEBUG;
+        param.b_log_async = b_async;
+        snprintf(param.s_input, sizeof(param.s_input), "bench");
+        h_ts = ts2es_create(&param, out_es, p_out);
+        select_pids(h_ts, p_gen);
+        ts2es_demux_ts_buffer(h_ts, buf, len);
+        ts2es_destroy(h_ts);
+
+        fflush(stderr);
+        dup2(fd_err, 2);
+        close(fd_err);
+        text[b_async] = (char *)read_file(s_path, &text_len[b_async]);
+    }
+
+    b_match = text[0] != NULL && text[1] != NULL && text_len[0] > 0 && text_len[0] == text_len[1] &&
+              !memcmp(text[0], text[1], text_len[0]);
+    if (!b_match) {
+        printf("  %llu bytes of reports, %llu synchronously\n", (unsigned long long)(text[1] ? text_len[1] : 0),
+               (unsigned long long)(text[0] ? text_len[0] : 0));
+    }
+    free(text[0]);
+    free(text[1]);
+    free(p_out);
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ * check the selection of a program, as with -P: all the ES of the program of
+ * the generator are those of the other modes, another program has none
+ * returns 1 if all match
+ */
+static int program_check(uint8_t *buf, size_t len, const bench_out_t *p_ref)
+{
+    bench_out_t *p_out = (bench_out_t *)malloc(sizeof(bench_out_t));
+    int b_match = p_out != NULL;
+    int r, i;
+
+    for (r = 0; r < 2 && b_match; r++) {
+        ts2es_param_t param;
+        ts2es_t *h_ts;
+
+        memset(p_out, 0, sizeof(bench_out_t));
+        p_out->b_hash = 1;
+        memset(&param, 0, sizeof(param));
+        param.i_log_level         = TS2ES_ERROR;
+        param.stream_type_2_catch = TS2ES_STREAM_TYPE_ANY;
+        param.program_number      = r ? 2 : 1;
+        snprintf(param.s_input, sizeof(param.s_input), "bench");
+        h_ts = ts2es_create(&param, out_es, p_out);
+        ts2es_demux_ts_buffer(h_ts, buf, len);
+        ts2es_destroy(h_ts);
+
+        if (r == 0) {
+            b_match = out_same(p_ref, p_out);
+        }
+        for (i = 0; i < TS_NUM_PIDS && r == 1 && b_match; i++) {
+            if (p_out->bytes[i]) {
+                printf("  program 2: PID %d, %llu bytes\n", i, (unsigned long long)p_out->bytes[i]);
+                b_match = 0;
+            }
+        }
+    }
+    free(p_out);
+    return b_match;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void usage(void)
+{
+    printf("usage: ts2es_bench [-s MB] [-r reps] [-j threads] [-o file.ts]\n"
+           "  -s  size of each synthetic stream in MB (default 64)\n"
+           "  -r  timed runs per mode, the best one is reported (default 3)\n"
+           "  -j  threads of the pipe and chunks modes (default: CPUs, at least 2)\n"
+           "  -o  write the stream of the first scenario to a file and exit\n");
+}
+
+/* ---------------------------------------------------------------------------
+ */
+int main(int argc, char **argv)
+{
+    bench_scenario_t scenarios[4];
+    bench_out_t *p_ref, *p_out;
+    bench_keep_t *p_keep_ref, *p_keep;
+    const char *s_dump = NULL;
+    size_t size = 64 << 20;
+    int reps = 3;
+    int n_threads = ts2es_cpu_count();
+    int s, mode, r, i;
+    uint8_t *buf;
+
+    n_threads = n_threads < 2 ? 2 : n_threads;
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            size = (size_t)atoi(argv[++i]) << 20;
+        } else if (!strcmp(argv[i], "-r") && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+            n_threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+            s_dump = argv[++i];
+        } else {
+            usage();
+            return argv[i][1] == 'h' ? 0 : -1;
+        }
+    }
+    if (size < (1 << 20) || reps < 1 || n_threads < 1) {
+        usage();
+        return -1;
+    }
+
+    // clean: one program as broadcast
+    scenarios[0].name = "clean";
+    ts_gen_default(&scenarios[0].gen);
+    // noisy: lost packets, stuffing and many null packets
+    scenarios[1].name = "noisy";
+    ts_gen_default(&scenarios[1].gen);
+    scenarios[1].gen.seed          = 2;
+    scenarios[1].gen.video_kbps    = 4000;
+    scenarios[1].gen.num_audio     = 2;
+    scenarios[1].gen.null_percent  = 20;
+    scenarios[1].gen.cc_error_rate = 1e-3;
+    scenarios[1].gen.stuffing_rate = 0.05;
+    // multi: many PIDs, AVC video
+    scenarios[2].name = "multi";
+    ts_gen_default(&scenarios[2].gen);
+    scenarios[2].gen.seed         = 3;
+    scenarios[2].gen.video_stream_type = 0x1B;
+    scenarios[2].gen.num_video    = 4;
+    scenarios[2].gen.num_audio    = 4;
+    scenarios[2].gen.video_kbps   = 6000;
+    scenarios[2].gen.null_percent = 2;
+    // wide: as many PIDs as ES states, mostly audio
+    scenarios[3].name = "wide";
+    ts_gen_default(&scenarios[3].gen);
+    scenarios[3].gen.seed         = 4;
+    scenarios[3].gen.num_video    = 8;
+    scenarios[3].gen.num_audio    = MAX_NUM_ES - 8;
+    scenarios[3].gen.video_kbps   = 1500;
+    scenarios[3].gen.null_percent = 2;
+
+    buf   = (uint8_t *)malloc(size);
+    p_ref = (bench_out_t *)malloc(sizeof(bench_out_t));
+    p_out = (bench_out_t *)malloc(sizeof(bench_out_t));
+    p_keep_ref = (bench_keep_t *)calloc(1, sizeof(bench_keep_t));
+    p_keep     = (bench_keep_t *)calloc(1, sizeof(bench_keep_t));
+    if (buf == NULL || p_ref == NULL || p_out == NULL || p_keep_ref == NULL || p_keep == NULL) {
+        fprintf(stderr, "Failed to allocate %lu MB\n", (unsigned long)(size >> 20));
+        return -3;
+    }
+
+    if (s_dump != NULL) {
+        FILE *fp = fopen(s_dump, "wb");
+        size_t len = ts_gen(&scenarios[0].gen, buf, size);
+        if (fp == NULL || fwrite(buf, 1, len, fp) != len) {
+            fprintf(stderr, "Failed to write %s\n", s_dump);
+            return -1;
+        }
+        fclose(fp);
+        return 0;
+    }
+
+    printf("%-8s %-8s %12s %8s %10s %10s  %s\n",
+           "stream", "mode", "packets/s", "GB/s", "allocs", "alloc MB", "check");
+    for (s = 0; s < (int)(sizeof(scenarios) / sizeof(scenarios[0])); s++) {
+        size_t len = ts_gen(&scenarios[s].gen, buf, size);
+
+        if (len == 0) {
+            fprintf(stderr, "Failed to generate stream %s\n", scenarios[s].name);
+            return -1;
+        }
+        keep_run(&scenarios[s].gen, buf, len, -1, -1, 1, 0, p_keep_ref);
+        for (mode = 0; mode < NUM_MODES; mode++) {
+            int64_t best_us = 0;
+            uint64_t calls, bytes;
+            int b_match, b_lossy, n_dropped = 0;
+            char s_check[64];
+
+            // checked run, the allocations are those of this run
+            memset(p_out, 0, sizeof(bench_out_t));
+            p_out->b_hash = 1;
+            g_alloc_calls = 0;
+            g_alloc_bytes = 0;
+            bench_run(mode, &scenarios[s].gen, buf, len, n_threads, p_out);
+            calls = g_alloc_calls;
+            bytes = g_alloc_bytes;
+            if (mode == MODE_SINK || mode == MODE_SINK_ES) {
+                out_read_files(p_out, &scenarios[s].gen);
+            }
+            if (mode == 0) {
+                memcpy(p_ref, p_out, sizeof(bench_out_t));
+            }
+            b_match = !memcmp(p_ref->hash, p_out->hash, sizeof(p_out->hash)) &&
+                      !memcmp(p_ref->bytes, p_out->bytes, sizeof(p_out->bytes));
+            // audio frames broken by continuity errors are dropped by the framing,
+            // the access units are then checked one by one
+            b_lossy = !b_match && mode == MODE_AU && scenarios[s].gen.cc_error_rate > 0;
+            if (b_lossy) {
+                keep_run(&scenarios[s].gen, buf, len, -1, -1, 1, KEEP_AU, p_keep);
+                b_match = au_check(p_keep_ref, p_keep, &scenarios[s].gen, &n_dropped);
+                keep_free(p_keep);
+            } else if (!b_match) {
+                for (i = 0; i < TS_NUM_PIDS; i++) {
+                    if (p_ref->hash[i] != p_out->hash[i] || p_ref->bytes[i] != p_out->bytes[i]) {
+                        printf("  PID %d: %llu bytes, %llu expected\n", i,
+                               (unsigned long long)p_out->bytes[i], (unsigned long long)p_ref->bytes[i]);
+                    }
+                }
+            }
+            snprintf(s_check, sizeof(s_check), !b_match ? "MISMATCH" : b_lossy ? "ok, %d broken frames dropped" : "ok",
+                     n_dropped);
+
+            for (r = 0; r < reps; r++) {
+                int64_t us;
+                p_out->b_hash = 0;
+                us = bench_run(mode, &scenarios[s].gen, buf, len, n_threads, p_out);
+                best_us = (r == 0 || us < best_us) ? us : best_us;
+            }
+            if (mode == MODE_SINK || mode == MODE_SINK_ES) {
+                out_read_files(NULL, &scenarios[s].gen);
+            }
+            best_us = best_us > 0 ? best_us : 1;
+
+            printf("%-8s %-8s %12.0f %8.3f %10llu %10.1f  %s\n", scenarios[s].name, g_mode_names[mode],
+                   (double)(len / TS_PACKET_SIZE) * 1e6 / best_us, (double)len / 1e3 / best_us,
+                   (unsigned long long)calls, bytes / 1048576.0, s_check);
+            fflush(stdout);
+            if (!b_match) {
+                return -1;
+            }
+        }
+
+        // many handles in turns, each one outputs the data of the other modes
+        memset(p_out, 0, sizeof(bench_out_t));
+        g_alloc_calls = 0;
+        g_alloc_bytes = 0;
+        many_run(&scenarios[s].gen, buf, len, p_out);
+        {
+            uint64_t calls = g_alloc_calls, bytes = g_alloc_bytes;
+            int64_t best_us = 0;
+            int b_match = 1;
+
+            for (i = 0; i < TS_NUM_PIDS; i++) {
+                if (p_out->bytes[i] != p_ref->bytes[i] * BENCH_HANDLES) {
+                    printf("  PID %d: %llu bytes, %llu expected\n", i, (unsigned long long)p_out->bytes[i],
+                           (unsigned long long)p_ref->bytes[i] * BENCH_HANDLES);
+                    b_match = 0;
+                }
+            }
+            for (r = 0; r < reps; r++) {
+                int64_t us = many_run(&scenarios[s].gen, buf, len, p_out);
+                best_us = (r == 0 || us < best_us) ? us : best_us;
+            }
+            best_us = best_us > 0 ? best_us : 1;
+            printf("%-8s %-8s %12.0f %8.3f %10llu %10.1f  %s\n", scenarios[s].name, "many",
+                   (double)(len / TS_PACKET_SIZE) * BENCH_HANDLES * 1e6 / best_us,
+                   (double)len * BENCH_HANDLES / 1e3 / best_us,
+                   (unsigned long long)calls, bytes / 1048576.0, b_match ? "ok" : "MISMATCH");
+            fflush(stdout);
+            if (!b_match) {
+                return -1;
+            }
+        }
+
+        // the middle third of the video PTS of the stream, serially and in chunks
+        for (r = 0; r < 2; r++) {
+            const bench_es_t *p_video = &p_keep_ref->es[TS_GEN_VIDEO_PID];
+            int64_t start = p_video->pes_pts[p_video->n_pes / 3];
+            int64_t end   = p_video->pes_pts[p_video->n_pes * 2 / 3];
+            int b_match;
+
+            keep_run(&scenarios[s].gen, buf, len, start, end, r ? n_threads : 1, 0, p_keep);
+            b_match = range_check(p_keep_ref, p_keep, end);
+            keep_free(p_keep);
+            if (!check_row(scenarios[s].name, r ? "range-c" : "range", b_match)) {
+                return -1;
+            }
+        }
+
+        // the key pictures, serially and in chunks
+        for (r = 0; r < 2; r++) {
+            int b_match;
+
+            keep_run(&scenarios[s].gen, buf, len, -1, -1, r ? n_threads : 1, KEEP_KEYFRAMES, p_keep);
+            b_match = keyframe_check(p_keep_ref, p_keep, &scenarios[s].gen);
+            keep_free(p_keep);
+            if (!check_row(scenarios[s].name, r ? "key-c" : "key", b_match)) {
+                return -1;
+            }
+        }
+
+        // the features around the demux
+        if (!check_row(scenarios[s].name, "index", index_check(&scenarios[s].gen, buf, len, 1, p_keep_ref)) ||
+            !check_row(scenarios[s].name, "index-c", index_check(&scenarios[s].gen, buf, len, n_threads, p_keep_ref)) ||
+            !check_row(scenarios[s].name, "probe", probe_check(&scenarios[s].gen, buf, len, p_keep_ref)) ||
+            !check_row(scenarios[s].name, "udp", udp_check(&scenarios[s].gen, buf, len)) ||
+            !check_row(scenarios[s].name, "aio", aio_check(&scenarios[s].gen, buf, len, p_ref)) ||
+            !check_row(scenarios[s].name, "stats", stats_check(&scenarios[s].gen, buf, len, p_ref)) ||
+            !check_row(scenarios[s].name, "log", log_check(&scenarios[s].gen, buf, len)) ||
+            !check_row(scenarios[s].name, "program", program_check(buf, len, p_ref))) {
+            return -1;
+        }
+        keep_free(p_keep_ref);
+    }
+
+    free(buf);
+    free(p_ref);
+    free(p_out);
+    free(p_keep_ref);
+    free(p_keep);
+    return 0;
+}
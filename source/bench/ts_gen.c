@@ -0,0 +1,456 @@
+/*
+    ts_gen.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Synthetic transport stream generator. The PIDs are multiplexed by
+ * packet rate: each packet slot goes to the stream with the most credit, null
+ * packets being one more stream; PAT, PMT and PCR are sent at their
+ * intervals of stream time.
+ */
+#include "ts_gen.h"
+#include "ts2es/ts2es.h"
+#include <string.h>
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define GEN_AUDIO_FRAME_SIZE    576     // 192 kbit/s at 48 kHz, Layer II
+#define GEN_AUDIO_FRAME_TICKS   2160    // 1152 samples in 90 kHz units
+#define GEN_PES_HEADER_SIZE     14      // with a PTS
+#define GEN_PTS_START           90000
+#define GEN_AVC_SEI_SIZE        400     // the slice starts in the third packet of a PES
+#define GEN_AVC_HEAD_SIZE       (6 + 4 + GEN_AVC_SEI_SIZE + 5)  // AUD, SEI, slice NAL header
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+typedef struct gen_stream_t {
+    int      pid;
+    int      stream_id;
+    int      b_video;
+    int      cc;
+    double   weight;    // packets per second
+    double   credit;
+    uint8_t *pes;       // PES being sent
+    size_t   pes_len;
+    size_t   pes_pos;
+    size_t   pes_cap;
+    uint32_t num_frames;
+} gen_stream_t;
+
+typedef struct gen_t {
+    const ts_gen_param_t *param;
+    uint32_t     rand;
+    int          num_streams;
+    gen_stream_t streams[TS_GEN_MAX_STREAMS + 1];   // the last one: null packets
+    double       packets_per_s;
+    int          cc_pat;
+    int          cc_pmt;
+} gen_t;
+
+/* ---------------------------------------------------------------------------
+ */
+static uint32_t gen_rand(gen_t *g)
+{
+    g->rand ^= g->rand << 13;
+    g->rand ^= g->rand >> 17;
+    g->rand ^= g->rand << 5;
+    return g->rand;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns 1 with probability p
+ */
+static int gen_chance(gen_t *g, double p)
+{
+    return p > 0 && gen_rand(g) < p * 4294967296.0;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+void ts_gen_default(ts_gen_param_t *p_param)
+{
+    memset(p_param, 0, sizeof(ts_gen_param_t));
+    p_param->seed              = 1;
+    p_param->num_video         = 1;
+    p_param->num_audio         = 1;
+    p_param->video_stream_type = 0x43;
+    p_param->video_kbps        = 8000;
+    p_param->fps               = 25;
+    p_param->null_percent      = 5;
+    p_param->psi_interval_ms   = 100;
+    p_param->pcr_interval_ms   = 40;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the packets per second a stream needs to keep up with its clock:
+ * each PES starts a packet, and stuffing takes room from the payload
+ */
+static double gen_packet_rate(const ts_gen_param_t *p_param, int b_video)
+{
+    double payload = TS_PACKET_SIZE - 4 - p_param->stuffing_rate * 17.5;    // 2 to 33 bytes of stuffing
+    double packets = 0;
+    int i;
+
+    if (!b_video) {
+        // frames of one size: a whole number of packets each
+        int n = (int)((GEN_PES_HEADER_SIZE + GEN_AUDIO_FRAME_SIZE + payload - 1) / payload);
+        return n * 48000.0 / 1152;
+    }
+
+    // the frames of one second, as sized by gen_next_pes(); frame sizes spread
+    // over many packets, the last one is half full on average
+    for (i = 0; i < p_param->fps; i++) {
+        double avg = p_param->video_kbps * 125.0 / p_param->fps;
+        double scale = i == 0 ? 3.0 : p_param->fps > 3 ? (p_param->fps - 3.0) / (p_param->fps - 1.0) : 1.0;
+        packets += (GEN_PES_HEADER_SIZE + avg * scale) / payload + 0.5;
+    }
+    return packets;
+}
+
+/* ---------------------------------------------------------------------------
+ * write a PSI section in one packet, with its CRC_32
+ */
+static void gen_psi_packet(uint8_t *p, int pid, int *p_cc, const uint8_t *section, int len)
+{
+    uint32_t crc = ts2es_crc32(section, len);
+
+    p[0] = 0x47;
+    p[1] = (uint8_t)(0x40 | (pid >> 8));
+    p[2] = (uint8_t)pid;
+    p[3] = (uint8_t)(0x10 | *p_cc);
+    p[4] = 0;   // pointer_field
+    memcpy(p + 5, section, len);
+    p[5 + len]     = (uint8_t)(crc >> 24);
+    p[5 + len + 1] = (uint8_t)(crc >> 16);
+    p[5 + len + 2] = (uint8_t)(crc >> 8);
+    p[5 + len + 3] = (uint8_t)crc;
+    memset(p + 9 + len, 0xFF, TS_PACKET_SIZE - 9 - len);
+    *p_cc = (*p_cc + 1) & 0xF;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void gen_pat(gen_t *g, uint8_t *p)
+{
+    uint8_t s[12];
+
+    s[0]  = TS_TABLE_ID_PAT;
+    s[1]  = 0xB0;
+    s[2]  = 13;         // section_length
+    s[3]  = 0x00;       // transport_stream_id
+    s[4]  = 0x01;
+    s[5]  = 0xC1;       // version 0, current
+    s[6]  = 0;
+    s[7]  = 0;
+    s[8]  = 0x00;       // program_number 1
+    s[9]  = 0x01;
+    s[10] = (uint8_t)(0xE0 | (TS_GEN_PMT_PID >> 8));
+    s[11] = (uint8_t)TS_GEN_PMT_PID;
+    gen_psi_packet(p, 0, &g->cc_pat, s, sizeof(s));
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void gen_pmt(gen_t *g, uint8_t *p)
+{
+    uint8_t s[12 + 5 * TS_GEN_MAX_STREAMS];
+    int len = 12;
+    int i;
+
+    s[0]  = TS_TABLE_ID_PMT;
+    s[3]  = 0x00;       // program_number 1
+    s[4]  = 0x01;
+    s[5]  = 0xC1;
+    s[6]  = 0;
+    s[7]  = 0;
+    s[8]  = (uint8_t)(0xE0 | (g->streams[0].pid >> 8));     // PCR_PID
+    s[9]  = (uint8_t)g->streams[0].pid;
+    s[10] = 0xF0;       // program_info_length 0
+    s[11] = 0x00;
+    for (i = 0; i < g->num_streams; i++) {
+        gen_stream_t *p_st = &g->streams[i];
+        s[len++] = (uint8_t)(p_st->b_video ? g->param->video_stream_type : 0x03);
+        s[len++] = (uint8_t)(0xE0 | (p_st->pid >> 8));
+        s[len++] = (uint8_t)p_st->pid;
+        s[len++] = 0xF0;
+        s[len++] = 0x00;
+    }
+    s[1] = (uint8_t)(0xB0 | ((len + 1) >> 8));
+    s[2] = (uint8_t)(len + 1);      // the rest and the CRC_32
+    gen_psi_packet(p, TS_GEN_PMT_PID, &g->cc_pmt, s, len);
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void gen_pts(uint8_t *p, uint64_t pts)
+{
+    p[0] = (uint8_t)(0x21 | ((pts >> 29) & 0x0E));
+    p[1] = (uint8_t)(pts >> 22);
+    p[2] = (uint8_t)(((pts >> 14) & 0xFE) | 1);
+    p[3] = (uint8_t)(pts >> 7);
+    p[4] = (uint8_t)(((pts << 1) & 0xFE) | 1);
+}
+
+/* ---------------------------------------------------------------------------
+ * build the PES of the next frame of a stream
+ * returns 1 on success, or 0 if out of memory
+ */
+static int gen_next_pes(gen_t *g, gen_stream_t *p_st)
+{
+    const ts_gen_param_t *param = g->param;
+    size_t frame_len;
+    uint64_t pts;
+    size_t i;
+
+    if (p_st->b_video) {
+        double avg = param->video_kbps * 125.0 / param->fps;
+        double scale = (p_st->num_frames % param->fps) == 0 ? 3.0 :
+                       param->fps > 3 ? (param->fps - 3.0) / (param->fps - 1.0) : 1.0;
+        frame_len = (size_t)(avg * scale * (0.75 + (gen_rand(g) & 0xFFFF) / 131072.0));
+        frame_len = frame_len < GEN_AVC_HEAD_SIZE ? GEN_AVC_HEAD_SIZE : frame_len;
+        pts = GEN_PTS_START + (uint64_t)p_st->num_frames * 90000 / param->fps;
+    } else {
+        frame_len = GEN_AUDIO_FRAME_SIZE;
+        pts = GEN_PTS_START + (uint64_t)p_st->num_frames * GEN_AUDIO_FRAME_TICKS;
+    }
+
+    p_st->pes_len = GEN_PES_HEADER_SIZE + frame_len;
+    if (p_st->pes_len > p_st->pes_cap) {
+        uint8_t *pes = (uint8_t *)realloc(p_st->pes, p_st->pes_len);
+        if (pes == NULL) {
+            return 0;
+        }
+        p_st->pes     = pes;
+        p_st->pes_cap = p_st->pes_len;
+    }
+
+    // PES header, the length is 0 (unbounded) for large video frames
+    p_st->pes[0] = 0x00;
+    p_st->pes[1] = 0x00;
+    p_st->pes[2] = 0x01;
+    p_st->pes[3] = (uint8_t)p_st->stream_id;
+    if (p_st->pes_len - 6 <= 0xFFFF) {
+        p_st->pes[4] = (uint8_t)((p_st->pes_len - 6) >> 8);
+        p_st->pes[5] = (uint8_t)(p_st->pes_len - 6);
+    } else {
+        p_st->pes[4] = 0;
+        p_st->pes[5] = 0;
+    }
+    p_st->pes[6] = 0x80;
+    p_st->pes[7] = 0x80;    // PTS only
+    p_st->pes[8] = 5;
+    gen_pts(p_st->pes + 9, pts);
+
+    // frame: a start code or an audio frame header, then noise
+    for (i = GEN_PES_HEADER_SIZE; i + 4 <= p_st->pes_len; i += 4) {
+        uint32_t r = gen_rand(g);
+        memcpy(p_st->pes + i, &r, 4);
+    }
+    for (; i < p_st->pes_len; i++) {
+        p_st->pes[i] = (uint8_t)gen_rand(g);
+    }
+    if (p_st->b_video && param->video_stream_type == 0x1B) {
+        // access unit delimiter, SEI, then an IDR or a non-IDR slice with
+        // first_mb_in_slice 0; the parameter sets are not repeated
+        uint8_t *p = p_st->pes + GEN_PES_HEADER_SIZE;
+        static const uint8_t aud[10] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xF0, 0x00, 0x00, 0x01, 0x06 };
+        memcpy(p, aud, sizeof(aud));
+        memset(p + sizeof(aud), 0xFF, GEN_AVC_SEI_SIZE);
+        p += sizeof(aud) + GEN_AVC_SEI_SIZE;
+        p[0] = 0x00;
+        p[1] = 0x00;
+        p[2] = 0x01;
+        p[3] = (p_st->num_frames % param->fps) == 0 ? 0x65 : 0x41;
+        p[4] = 0x88;
+    } else if (p_st->b_video) {
+        static const uint8_t sc[2] = { 0xB3, 0xB6 };    // I, P/B picture
+        p_st->pes[14] = 0x00;
+        p_st->pes[15] = 0x00;
+        p_st->pes[16] = 0x01;
+        p_st->pes[17] = sc[(p_st->num_frames % param->fps) != 0];
+    } else {
+        p_st->pes[14] = 0xFF;
+        p_st->pes[15] = 0xFD;   // MPEG-1 Layer II, no CRC
+        p_st->pes[16] = 0xA4;   // 192 kbit/s, 48 kHz
+        p_st->pes[17] = 0x00;
+    }
+
+    p_st->pes_pos = 0;
+    p_st->num_frames++;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * write the next packet of an ES, with a PCR if asked for
+ * returns 1 on success, or 0 if out of memory
+ */
+static int gen_es_packet(gen_t *g, gen_stream_t *p_st, uint8_t *p, int b_pcr, uint64_t pcr)
+{
+    int pusi, adapt, len;
+    size_t left;
+
+    if (p_st->pes_pos == p_st->pes_len && !gen_next_pes(g, p_st)) {
+        return 0;
+    }
+    pusi = p_st->pes_pos == 0;
+    left = p_st->pes_len - p_st->pes_pos;
+
+    // bytes of the adaptation field, with its length byte
+    adapt = b_pcr ? 8 : gen_chance(g, g->param->stuffing_rate) ? 2 + (gen_rand(g) & 0x1F) : 0;
+    len = (int)(left < (size_t)(TS_PACKET_SIZE - 4 - adapt) ? left : (size_t)(TS_PACKET_SIZE - 4 - adapt));
+    adapt = TS_PACKET_SIZE - 4 - len;
+
+    // a jump of the continuity_counter, as after a lost packet
+    if (gen_chance(g, g->param->cc_error_rate)) {
+        p_st->cc = (p_st->cc + 1 + (gen_rand(g) % 14)) & 0xF;
+    }
+
+    p[0] = 0x47;
+    p[1] = (uint8_t)((pusi << 6) | (p_st->pid >> 8));
+    p[2] = (uint8_t)p_st->pid;
+    p[3] = (uint8_t)((adapt ? 0x30 : 0x10) | p_st->cc);
+    if (adapt) {
+        p[4] = (uint8_t)(adapt - 1);
+        if (adapt > 1) {
+            uint64_t base = pcr / 300;
+            int ext = (int)(pcr % 300);
+            p[5] = 0x00;
+            if (b_pcr) {
+                p[5]  = 0x10;
+                p[6]  = (uint8_t)(base >> 25);
+                p[7]  = (uint8_t)(base >> 17);
+                p[8]  = (uint8_t)(base >> 9);
+                p[9]  = (uint8_t)(base >> 1);
+                p[10] = (uint8_t)(((base & 1) << 7) | 0x7E | (ext >> 8));
+                p[11] = (uint8_t)ext;
+                memset(p + 12, 0xFF, adapt - 8);
+            } else {
+                memset(p + 6, 0xFF, adapt - 2);
+            }
+        }
+    }
+    memcpy(p + 4 + adapt, p_st->pes + p_st->pes_pos, len);
+    p_st->pes_pos += len;
+    p_st->cc = (p_st->cc + 1) & 0xF;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void gen_null_packet(uint8_t *p)
+{
+    p[0] = 0x47;
+    p[1] = (uint8_t)(TS_NULL_PID >> 8);
+    p[2] = (uint8_t)TS_NULL_PID;
+    p[3] = 0x10;
+    memset(p + 4, 0xFF, TS_PACKET_SIZE - 4);
+}
+
+/* ---------------------------------------------------------------------------
+ * Fill a buffer with whole packets of the synthetic stream
+ * returns the number of bytes written, or 0 on failure
+ */
+size_t ts_gen(const ts_gen_param_t *p_param, uint8_t *buf, size_t buf_len)
+{
+    gen_t g;
+    double total = 0;
+    uint64_t num_packets = buf_len / TS_PACKET_SIZE;
+    uint64_t psi_period, pcr_period, tail, n;
+    int i, b_ok = 1;
+
+    if (p_param->num_video + p_param->num_audio <= 0 ||
+        p_param->num_video + p_param->num_audio > TS_GEN_MAX_STREAMS || p_param->fps <= 0 ||
+        p_param->null_percent < 0 || p_param->null_percent >= 100) {
+        return 0;
+    }
+
+    memset(&g, 0, sizeof(g));
+    g.param = p_param;
+    g.rand  = p_param->seed ? p_param->seed : 1;
+    for (i = 0; i < p_param->num_video + p_param->num_audio; i++) {
+        gen_stream_t *p_st = &g.streams[g.num_streams++];
+        p_st->b_video   = i < p_param->num_video;
+        p_st->pid       = p_st->b_video ? TS_GEN_VIDEO_PID + i : TS_GEN_AUDIO_PID + i - p_param->num_video;
+        p_st->stream_id = p_st->b_video ? 0xE0 + (i & 0xF) : 0xC0 + ((i - p_param->num_video) & 0x1F);
+        p_st->weight    = gen_packet_rate(p_param, p_st->b_video);
+        total += p_st->weight;
+    }
+    g.streams[g.num_streams].weight = total * p_param->null_percent / (100.0 - p_param->null_percent);
+    total += g.streams[g.num_streams].weight;
+
+    g.packets_per_s = total;
+    psi_period = (uint64_t)(g.packets_per_s * p_param->psi_interval_ms / 1000);
+    pcr_period = (uint64_t)(g.packets_per_s * p_param->pcr_interval_ms / 1000);
+    psi_period = psi_period < 3 ? 3 : psi_period;
+    pcr_period = pcr_period < 1 ? 1 : pcr_period;
+
+    // the PES in progress are completed in the tail of the stream, no new
+    // one is started there, so the stream ends on frame boundaries
+    tail = 0;
+    for (i = 0; i < g.num_streams; i++) {
+        double max_pes = g.streams[i].b_video ? p_param->video_kbps * 125.0 * 3.75 / p_param->fps :
+                         GEN_AUDIO_FRAME_SIZE;
+        tail += (uint64_t)((max_pes + GEN_PES_HEADER_SIZE) / (TS_PACKET_SIZE - 4 - 34)) + 2;
+    }
+    tail += 2 * tail / psi_period + 2;
+    tail = num_packets - (tail < num_packets / 2 ? tail : num_packets / 2);
+
+    for (n = 0; n < num_packets && b_ok; n++) {
+        uint8_t *p = buf + n * TS_PACKET_SIZE;
+        gen_stream_t *p_best = NULL;
+
+        if (n % psi_period == 0) {
+            gen_pat(&g, p);
+            continue;
+        } else if (n % psi_period == 1) {
+            gen_pmt(&g, p);
+            continue;
+        }
+
+        for (i = 0; i <= g.num_streams; i++) {
+            gen_stream_t *p_st = &g.streams[i];
+            p_st->credit += p_st->weight / total;
+            if (n >= tail && (i == g.num_streams || p_st->pes_pos == p_st->pes_len)) {
+                continue;
+            }
+            if (p_best == NULL || p_st->credit > p_best->credit) {
+                p_best = p_st;
+            }
+        }
+        p_best = p_best != NULL ? p_best : &g.streams[g.num_streams];
+        p_best->credit -= 1.0;
+
+        if (p_best == &g.streams[g.num_streams]) {
+            gen_null_packet(p);
+        } else {
+            // 27 MHz clock of this packet slot
+            uint64_t pcr = (uint64_t)(n * 27000000.0 / g.packets_per_s);
+            int b_pcr = p_best == &g.streams[0] && (n / pcr_period) != ((n - 1) / pcr_period);
+            b_ok = gen_es_packet(&g, p_best, p, b_pcr, pcr);
+        }
+    }
+
+    for (i = 0; i < g.num_streams; i++) {
+        free(g.streams[i].pes);
+    }
+    return b_ok ? (size_t)(num_packets * TS_PACKET_SIZE) : 0;
+}
@@ -0,0 +1,72 @@
+/*
+    ts_gen.h
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef _TS_GEN_H_
+#define _TS_GEN_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define TS_GEN_PMT_PID          0x1000
+#define TS_GEN_VIDEO_PID        0x100   // video PIDs are 0x100, 0x101, ...
+#define TS_GEN_AUDIO_PID        0x200   // audio PIDs are 0x200, 0x201, ...
+#define TS_GEN_MAX_STREAMS      32      // the PMT fits in one packet
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+
+/* Synthetic transport stream: one program with video and MPEG-1 Layer II
+ * audio (192 kbit/s, 48 kHz) PIDs, each PES holding one frame. A video frame
+ * begins with an AVS picture start code, or with an access unit delimiter
+ * and a large SEI before the slice for AVC. The same parameters always give
+ * the same stream */
+typedef struct ts_gen_param_t {
+    uint32_t seed;
+    int      num_video;         // number of video PIDs
+    int      num_audio;         // number of audio PIDs
+    int      video_stream_type; // stream_type of the video in the PMT, 0x43 (AVS2) or 0x1B (AVC)
+    int      video_kbps;        // bitrate of each video PID
+    int      fps;               // video frame rate, with an I frame every second
+    int      null_percent;      // share of null packets in the stream, below 100
+    int      psi_interval_ms;   // PAT and PMT repetition
+    int      pcr_interval_ms;   // PCR repetition on the first PID
+    double   cc_error_rate;     // chance of a continuity_counter jump, per ES packet
+    double   stuffing_rate;     // chance of an adaptation field with stuffing, per ES packet
+} ts_gen_param_t;
+
+/* ===========================================================================
+ * interface definitions
+ * ==========================================================================*/
+void     ts_gen_default(ts_gen_param_t *p_param);
+size_t   ts_gen(const ts_gen_param_t *p_param, uint8_t *buf, size_t buf_len);
+
+#ifdef __cplusplus
+};
+#endif
+#endif // _TS_GEN_H_
@@ -0,0 +1,102 @@
+/*
+    demux.cpp
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Example of the C++ interface: extract all the ES of a file of 188 byte
+ * packets to <outfile>_<pid>.es, as `ts2es -t all <infile> <outfile>` does.
+ * `make example` compares the two on a synthetic stream.
+ */
+#include "ts2es/ts2es.hpp"
+#include <stdio.h>
+#include <map>
+#include <string>
+
+/* ===========================================================================
+ * sink
+ * ==========================================================================*/
+
+/* writes each PID to its own file, opened at its first PES */
+class FileWriter {
+public:
+    explicit FileWriter(const std::string &prefix = std::string()) : prefix_(prefix) {}
+
+    FileWriter(const FileWriter &other) : prefix_(other.prefix_) {}   // files are not shared
+
+    ~FileWriter()
+    {
+        for (std::map<int, FILE *>::iterator it = files_.begin(); it != files_.end(); ++it) {
+            fclose(it->second);
+        }
+    }
+
+    void operator()(int pid, int64_t pts, int64_t dts, const uint8_t *data, size_t len)
+    {
+        FILE *&fp = files_[pid];
+
+        if (fp == NULL) {
+            std::string path = prefix_ + "_" + std::to_string(pid) + ".es";
+            if ((fp = fopen(path.c_str(), "wb")) == NULL) {
+                fprintf(stderr, "Failed to open %s\n", path.c_str());
+                files_.erase(pid);
+                return;
+            }
+        }
+        fwrite(data, 1, len, fp);
+    }
+
+private:
+    FileWriter &operator=(const FileWriter &);
+
+    std::string           prefix_;
+    std::map<int, FILE *> files_;
+};
+
+/* ---------------------------------------------------------------------------
+ */
+int main(int argc, char **argv)
+{
+    typedef ts2es::Demuxer<ts2es::TS, FileWriter> Demuxer;
+    static uint8_t buf[1 << 20];
+    size_t keep = 0, len;
+    FILE *fin;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: ts2es_demux_cpp <infile> <outfile>\n");
+        return -1;
+    }
+    if ((fin = fopen(argv[1], "rb")) == NULL) {
+        fprintf(stderr, "Failed to open %s\n", argv[1]);
+        return -1;
+    }
+
+    {
+        Demuxer demux(Demuxer::default_param(), FileWriter(argv[2]));
+
+        while ((len = fread(buf + keep, 1, sizeof(buf) - keep, fin)) > 0) {
+            size_t used = demux.demux(buf, keep + len);
+            keep = keep + len - used;
+            memmove(buf, buf + used, keep);     // the rest goes with the following data
+        }
+    }   // the last PES are written, then the files closed
+
+    fclose(fin);
+    return 0;
+}
@@ -20,45 +20,661 @@
     Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 */
 #include "ts2es/ts2es.h"
+#include "ts2es/ts_thread.h"
 #include <string.h>
+#include <signal.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <glob.h>
+#endif
+
+#ifdef _MSC_VER
+#define snprintf _snprintf
+#define strdup   _strdup
+#endif
+
+// size of the read buffer when the input is not mapped
+#define READ_BUF_SIZE           (TS_PACKET_SIZE << 14)
+// blocks read ahead with asynchronous I/O, and their size
+#define AIO_READ_BLOCKS         4
+#define AIO_READ_SIZE           (4 << 20)
+// open files allowed in batch mode if the system does not tell
+#define BATCH_MAX_OPEN_FILES    512
+
+// handle interrupted by Ctrl-C
+static ts2es_t *volatile g_h_ts = NULL;
+
+/* ---------------------------------------------------------------------------
+ * time range to extract, in 90 kHz units
+ */
+typedef struct time_range_t {
+    int64_t  start;         // -1: from the start of the input
+    int64_t  end;           // -1: to the end of the input
+    int      b_start_rel;   // counted from the first clock of the input, else a PTS
+    int      b_end_rel;
+} time_range_t;
+
+/* ---------------------------------------------------------------------------
+ * mapped input file
+ */
+typedef struct input_map_t {
+    uint8_t *p_data;
+    size_t   i_size;
+#ifdef _WIN32
+    HANDLE   h_file;
+    HANDLE   h_map;
+#endif
+} input_map_t;
+
+/* ---------------------------------------------------------------------------
+ * map the whole input file into memory
+ * returns 1 if mapped, or 0 if the file cannot be mapped
+ */
+static int input_map_open(input_map_t *p_map, const char *s_path)
+{
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    memset(p_map, 0, sizeof(input_map_t));
+    p_map->h_file = CreateFileA(s_path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (p_map->h_file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    if (!GetFileSizeEx(p_map->h_file, &size) || size.QuadPart == 0 ||
+        (uint64_t)size.QuadPart > (uint64_t)(SIZE_MAX)) {
+        CloseHandle(p_map->h_file);
+        return 0;
+    }
+    p_map->h_map = CreateFileMappingA(p_map->h_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (p_map->h_map == NULL) {
+        CloseHandle(p_map->h_file);
+        return 0;
+    }
+    p_map->p_data = (uint8_t *)MapViewOfFile(p_map->h_map, FILE_MAP_READ, 0, 0, 0);
+    if (p_map->p_data == NULL) {
+        CloseHandle(p_map->h_map);
+        CloseHandle(p_map->h_file);
+        return 0;
+    }
+    p_map->i_size = (size_t)size.QuadPart;
+    return 1;
+#else
+    struct stat st;
+    void *p_data;
+    int fd;
+
+    memset(p_map, 0, sizeof(input_map_t));
+    if ((fd = open(s_path, O_RDONLY)) < 0) {
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > (uint64_t)(SIZE_MAX)) {
+        close(fd);
+        return 0;
+    }
+    p_data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);              // the mapping keeps its own reference
+    if (p_data == MAP_FAILED) {
+        return 0;
+    }
+    madvise(p_data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    p_map->p_data = (uint8_t *)p_data;
+    p_map->i_size = (size_t)st.st_size;
+    return 1;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void input_map_close(input_map_t *p_map)
+{
+#ifdef _WIN32
+    UnmapViewOfFile(p_map->p_data);
+    CloseHandle(p_map->h_map);
+    CloseHandle(p_map->h_file);
+#else
+    munmap(p_map->p_data, p_map->i_size);
+#endif
+    memset(p_map, 0, sizeof(input_map_t));
+}
 
 /* ---------------------------------------------------------------------------
+ * demux the input file through a large read buffer
  */
-void ts2es_output_es(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque)
+static void demux_file_read(ts2es_t *h_ts, FILE *fin)
 {
-    if (h_ts->b_output && p_es->cur_len) {
-        char s_path[260];
-        int written = 0;
-        FILE *fp;
-        
-        sprintf_s(s_path, 260, "%s_%d.es", h_ts->param.s_output, p_es->pid);
-        fp = fopen(s_path, "ab+");
-        if (fp != NULL) {
-            written = fwrite(p_es->raw_data, 1, p_es->cur_len, fp);
-            fclose(fp);
+    uint8_t *buf = (uint8_t *)malloc(READ_BUF_SIZE);
+    size_t   buf_len = 0;
+
+    if (buf == NULL) {
+        perror("Failed to allocate read buffer");
+        exit(-3);
+    }
+
+    while (!h_ts->Interrupted) {
+        size_t count = fread(buf + buf_len, 1, READ_BUF_SIZE - buf_len, fin);
+        size_t used;
+        if (count == 0) {
+            break;
         }
+        buf_len += count;
 
-        p_es->cur_len = 0;
-        if (written <= 0) {
-            ts2es_report(h_ts, TS2ES_ERROR, "failed to write stream out");
-            exit(-2);
+        used = ts2es_demux_ts_buffer(h_ts, buf, buf_len);
+
+        // keep the unconsumed tail for the next read
+        buf_len -= used;
+        memmove(buf, buf + used, buf_len);
+    }
+
+    free(buf);
+}
+
+/* ---------------------------------------------------------------------------
+ * demux the input file with asynchronous reads, several blocks ahead
+ * returns 1 on success, or 0 if the file cannot be opened
+ */
+static int demux_file_aio(ts2es_t *h_ts)
+{
+    ts2es_reader_t *p_rd = ts2es_reader_open(h_ts->aio, h_ts->param.s_input, AIO_READ_BLOCKS, AIO_READ_SIZE);
+    uint8_t *buf;
+    size_t buf_len, keep = 0;
+
+    if (p_rd == NULL) {
+        return 0;
+    }
+    while (!h_ts->Interrupted && (buf = ts2es_reader_next(p_rd, keep, &buf_len)) != NULL) {
+        // the unconsumed tail comes again in front of the next block
+        keep = buf_len - ts2es_demux_ts_buffer(h_ts, buf, buf_len);
+    }
+    ts2es_reader_close(p_rd);
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * parse a time: [[hh:]mm:]ss[.frac] or <seconds>s from the start of the
+ * input, or else a PTS in 90 kHz units
+ * returns the time in 90 kHz units, or -1 if it is not valid
+ */
+static int64_t parse_time(const char *s, int *p_b_relative)
+{
+    double secs = 0;
+    char *end;
+
+    *p_b_relative = strchr(s, ':') != NULL || (*s != '\0' && s[strlen(s) - 1] == 's');
+    if (!*p_b_relative) {
+        int64_t pts = strtoll(s, &end, 0);
+        return *end == '\0' && pts >= 0 ? pts & TS_PTS_MASK : -1;
+    }
+    for (;;) {
+        double v = strtod(s, &end);
+        if (end == s || v < 0) {
+            return -1;
+        }
+        secs += v;
+        if (*end != ':') {
+            break;
+        }
+        secs *= 60;
+        s = end + 1;
+    }
+    return (*end == '\0' || strcmp(end, "s") == 0) ? (int64_t)(secs * 90000 + 0.5) : -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * demux the time range of a mapped input file
+ */
+static void demux_range(ts2es_t *h_ts, uint8_t *buf, size_t buf_len, const time_range_t *p_range,
+                        int n_chunk_threads)
+{
+    int64_t start = p_range->start, end = p_range->end;
+
+    if (p_range->b_start_rel || p_range->b_end_rel) {
+        int64_t t0 = ts2es_first_clock(h_ts, buf, buf_len);
+        t0 = t0 < 0 ? 0 : t0;
+        start = p_range->b_start_rel && start >= 0 ? (t0 + start) & TS_PTS_MASK : start;
+        end   = p_range->b_end_rel && end >= 0 ? (t0 + end) & TS_PTS_MASK : end;
+    }
+    ts2es_demux_ts_range(h_ts, buf, buf_len, start, end, n_chunk_threads);
+}
+
+/* ---------------------------------------------------------------------------
+ * demux one input file, mapped or read, in the time range if there is one
+ * returns 1 on success, or 0 if the file cannot be opened
+ */
+static int demux_file(ts2es_t *h_ts, int b_mmap, int n_chunk_threads, const time_range_t *p_range)
+{
+    input_map_t input;
+    FILE *fin;
+    int b_range = p_range->start >= 0 || p_range->end >= 0;
+
+    if ((b_mmap || b_range) && input_map_open(&input, h_ts->param.s_input)) {
+        if (b_range) {
+            demux_range(h_ts, input.p_data, input.i_size, p_range, n_chunk_threads);
+        } else if (n_chunk_threads > 1) {
+            ts2es_demux_ts_chunks(h_ts, input.p_data, input.i_size, n_chunk_threads);
         } else {
-            ts2es_report(h_ts, TS2ES_DEBUG, "writing TS packet, PID[%d], pts: %lld\n", p_es->pid, p_es->pts);
+            ts2es_demux_ts_buffer(h_ts, input.p_data, input.i_size);
         }
-        h_ts->total_bytes += written;
+        input_map_close(&input);
+        return 1;
+    }
+
+    if (b_range) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Failed to map input file, extracting all of it\n");
+    } else if (b_mmap) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Failed to map input file, reading it instead\n");
     }
+    if (h_ts->aio != NULL) {
+        return demux_file_aio(h_ts);
+    }
+    fin = fopen(h_ts->param.s_input, "rb");
+    if (fin == NULL) {
+        return 0;
+    }
+    demux_file_read(h_ts, fin);
+    fclose(fin);
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * probe the start of an input file and print the report as one JSON line
+ * returns the number of bytes scanned, or -1 if the file cannot be read
+ */
+static int64_t probe_input(const ts2es_param_t *p_param, const char *s_input, size_t max_bytes)
+{
+    ts2es_probe_t *p_probe = (ts2es_probe_t *)malloc(sizeof(ts2es_probe_t));
+    char line[16384], s_name[1024];
+    int n = 0, i, k = 0;
+    int64_t bytes;
+
+    if (p_probe == NULL) {
+        perror("Failed to allocate the probe report");
+        exit(-3);
+    }
+    if (ts2es_probe_file(p_param, s_input, max_bytes, p_probe) < 0) {
+        free(p_probe);
+        return -1;
+    }
+
+    // the name goes into a JSON string
+    for (i = 0; s_input[i] != '\0' && k < (int)sizeof(s_name) - 2; i++) {
+        if (s_input[i] == '"' || s_input[i] == '\\') {
+            s_name[k++] = '\\';
+        }
+        s_name[k++] = (unsigned char)s_input[i] < 0x20 ? '?' : s_input[i];
+    }
+    s_name[k] = '\0';
+
+    n += snprintf(line + n, sizeof(line) - n, "{\"input\":\"%s\",\"complete\":%s,\"bytes\":%llu,\"packet_size\":%d,\"programs\":[",
+        s_name, p_probe->b_complete ? "true" : "false", (unsigned long long)p_probe->bytes_scanned, p_probe->packet_size);
+    for (i = 0; i < p_probe->num_programs; i++) {
+        n += snprintf(line + n, sizeof(line) - n, "%s{\"program\":%d,\"pmt_pid\":%d,\"pcr_pid\":%d}", i ? "," : "",
+            p_probe->programs[i].program_number, p_probe->programs[i].pmt_pid, p_probe->programs[i].pcr_pid);
+    }
+    n += snprintf(line + n, sizeof(line) - n, "],\"streams\":[");
+    for (i = 0; i < p_probe->num_es; i++) {
+        const ts2es_probe_es_t *p_es = &p_probe->es[i];
+        n += snprintf(line + n, sizeof(line) - n,
+            "%s{\"program\":%d,\"pid\":%d,\"stream_type\":%d,\"stream_id\":%d,\"first_pts\":%lld,\"synced\":%s",
+            i ? "," : "", p_es->program_number, p_es->pid, p_es->stream_type, p_es->stream_id,
+            (long long)p_es->first_pts, p_es->b_synced ? "true" : "false");
+        if (p_es->width > 0) {
+            n += snprintf(line + n, sizeof(line) - n, ",\"width\":%d,\"height\":%d", p_es->width, p_es->height);
+        }
+        if (p_es->samplerate > 0) {
+            n += snprintf(line + n, sizeof(line) - n, ",\"bitrate\":%d,\"samplerate\":%d,\"channels\":%d",
+                p_es->bitrate, p_es->samplerate, p_es->channels);
+        }
+        n += snprintf(line + n, sizeof(line) - n, "}");
+    }
+    snprintf(line + n, sizeof(line) - n, "]}\n");
+    fputs(line, stdout);    // one call, lines of batch threads do not mix
+
+    bytes = (int64_t)p_probe->bytes_scanned;
+    free(p_probe);
+    return bytes;
+}
+
+/* ---------------------------------------------------------------------------
+ * stop the demux at Ctrl-C, the output files are closed as usual
+ */
+static void on_interrupt(int sig)
+{
+    (void)sig;
+    if (g_h_ts != NULL) {
+        g_h_ts->Interrupted = 1;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * demux a live input until Ctrl-C or, if idle_ms > 0, until it is idle
+ * returns 1 on success, or 0 if the input cannot be opened
+ */
+static int demux_live(ts2es_t *h_ts, const char *s_addr, int ring_slots, int idle_ms)
+{
+    ts2es_udp_t *p_udp = ts2es_udp_open(h_ts, s_addr, ring_slots);
+    ts2es_udp_stats_t st;
+
+    if (p_udp == NULL) {
+        return 0;
+    }
+    g_h_ts = h_ts;
+    signal(SIGINT, on_interrupt);
+    ts2es_udp_demux(p_udp, idle_ms);
+    signal(SIGINT, SIG_DFL);
+    g_h_ts = NULL;
+
+    ts2es_udp_get_stats(p_udp, &st);
+    ts2es_udp_close(p_udp);
+    ts2es_report(NULL, TS2ES_INFO, "Datagrams received: %llu (%llu bytes), dropped by the socket: %llu, "
+        "lost in RTP: %llu, ring overflows: %llu, truncated: %llu\n",
+        (unsigned long long)st.datagrams, (unsigned long long)st.bytes, (unsigned long long)st.dropped,
+        (unsigned long long)st.lost, (unsigned long long)st.overflows, (unsigned long long)st.truncated);
+    return 1;
+}
+
+/* ===========================================================================
+ * batch mode: one handle per input file, on a pool of threads
+ * ==========================================================================*/
+typedef struct batch_t {
+    ts2es_param_t param;            // shared options
+    int          *pids;
+    int           n_pids;
+    int           b_mmap;
+    int           b_zero_copy;
+    time_range_t  range;
+    int           b_probe;
+    size_t        probe_bytes;
+    char        **inputs;
+    int           n_inputs;
+    int           max_inputs;
+} batch_t;
+
+typedef struct batch_job_t {
+    batch_t      *p_batch;
+    const char   *s_input;
+    uint64_t      bytes_in;
+    uint64_t      bytes_out;
+    int           b_failed;
+} batch_job_t;
+
+/* ---------------------------------------------------------------------------
+ */
+static void batch_add_input(batch_t *p_batch, const char *s_input)
+{
+    if (p_batch->n_inputs == p_batch->max_inputs) {
+        int max_inputs = p_batch->max_inputs ? p_batch->max_inputs << 1 : 256;
+        char **inputs = (char **)realloc(p_batch->inputs, max_inputs * sizeof(char *));
+        if (inputs == NULL) {
+            perror("Failed to allocate the input list");
+            exit(-3);
+        }
+        p_batch->inputs     = inputs;
+        p_batch->max_inputs = max_inputs;
+    }
+    if ((p_batch->inputs[p_batch->n_inputs] = strdup(s_input)) == NULL) {
+        perror("Failed to allocate the input list");
+        exit(-3);
+    }
+    p_batch->n_inputs++;
+}
+
+/* ---------------------------------------------------------------------------
+ * add the files named in a list file, one per line, "-" reads stdin
+ */
+static void batch_add_list(batch_t *p_batch, const char *s_list)
+{
+    FILE *fp = strcmp(s_list, "-") == 0 ? stdin : fopen(s_list, "r");
+    char line[1024];
+
+    if (fp == NULL) {
+        perror("Failed to open the input list");
+        exit(-2);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = '\0';
+        }
+        if (len > 0) {
+            batch_add_input(p_batch, line);
+        }
+    }
+    if (fp != stdin) {
+        fclose(fp);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * add the files matching a wildcard pattern
+ */
+static void batch_add_glob(batch_t *p_batch, const char *s_pattern)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA fd;
+    HANDLE h_find = FindFirstFileA(s_pattern, &fd);
+    const char *s_name = s_pattern + strlen(s_pattern);
+    char s_path[MAX_PATH];
+
+    // FindFirstFile() returns bare names, keep the directory of the pattern
+    while (s_name > s_pattern && s_name[-1] != '\\' && s_name[-1] != '/' && s_name[-1] != ':') {
+        s_name--;
+    }
+    if (h_find == INVALID_HANDLE_VALUE) {
+        return;
+    }
+    do {
+        if (!(fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+            snprintf(s_path, sizeof(s_path), "%.*s%s", (int)(s_name - s_pattern), s_pattern, fd.cFileName);
+            batch_add_input(p_batch, s_path);
+        }
+    } while (FindNextFileA(h_find, &fd));
+    FindClose(h_find);
+#else
+    glob_t g;
+    size_t i;
+
+    if (glob(s_pattern, 0, NULL, &g) != 0) {
+        return;
+    }
+    for (i = 0; i < g.gl_pathc; i++) {
+        batch_add_input(p_batch, g.gl_pathv[i]);
+    }
+    globfree(&g);
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * Each PID of <input>.ts is written to <input>_<pid>.es
+ */
+static void batch_job_proc(void *arg)
+{
+    batch_job_t *p_job = (batch_job_t *)arg;
+    batch_t *p_batch = p_job->p_batch;
+    ts2es_param_t param = p_batch->param;
+    const char *s_ext = strrchr(p_job->s_input, '.');
+    ts2es_t *h_ts;
+    int len, i;
+
+    if (p_batch->b_probe) {
+        int64_t bytes = probe_input(&param, p_job->s_input, p_batch->probe_bytes);
+        if (bytes < 0) {
+            ts2es_report(NULL, TS2ES_ERROR, "Failed to open input file %s\n", p_job->s_input);
+            p_job->b_failed = 1;
+        } else {
+            p_job->bytes_in = (uint64_t)bytes;
+        }
+        return;
+    }
+
+    snprintf(param.s_input, sizeof(param.s_input), "%s", p_job->s_input);
+    len = s_ext != NULL && strpbrk(s_ext, "/\\") == NULL ? (int)(s_ext - p_job->s_input) : (int)strlen(p_job->s_input);
+    snprintf(param.s_output, sizeof(param.s_output), "%.*s", len, p_job->s_input);
+
+    if ((h_ts = ts2es_create(&param, NULL, NULL)) == NULL) {
+        p_job->b_failed = 1;
+        return;
+    }
+    for (i = 0; i < p_batch->n_pids; i++) {
+        ts2es_select_pid(h_ts, p_batch->pids[i]);
+    }
+    if (p_batch->b_zero_copy) {
+        ts2es_set_output_iov(h_ts, ts2es_sink_output_iov, NULL);
+    }
+
+    if (!demux_file(h_ts, p_batch->b_mmap, 0, &p_batch->range)) {
+        ts2es_report(h_ts, TS2ES_ERROR, "Failed to open input file %s\n", param.s_input);
+        p_job->b_failed = 1;
+    }
+
+    ts2es_flush(h_ts);
+    if (ts2es_sink_flush(h_ts, h_ts->sink) > 0) {
+        p_job->b_failed = 1;
+    }
+    p_job->bytes_in  = h_ts->stream_offset;
+    p_job->bytes_out = h_ts->total_bytes;
+    ts2es_destroy(h_ts);
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux all input files, at most one per thread at a time. Each file takes
+ * an input file, up to MAX_NUM_ES output files and their staging buffers,
+ * so the number of threads is also limited by the number of open files
+ */
+static int batch_run(batch_t *p_batch, int n_threads)
+{
+    batch_job_t *jobs;
+    ts2es_pool_t *p_pool;
+    uint64_t bytes_in = 0, bytes_out = 0;
+    int64_t t_start, t_used;
+    int max_threads = BATCH_MAX_OPEN_FILES / (MAX_NUM_ES + 1);
+    int n_failed = 0;
+    int i;
+
+#ifndef _WIN32
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY) {
+        max_threads = (int)((rl.rlim_cur - 16) / (MAX_NUM_ES + 1));
+    }
+#endif
+    if (n_threads <= 0) {
+        n_threads = ts2es_cpu_count();
+    }
+    n_threads = n_threads > max_threads ? max_threads : n_threads;
+    n_threads = n_threads > p_batch->n_inputs ? p_batch->n_inputs : n_threads;
+    n_threads = n_threads < 1 ? 1 : n_threads;
+
+    jobs = (batch_job_t *)calloc(p_batch->n_inputs, sizeof(batch_job_t));
+    if (jobs == NULL || (p_pool = ts2es_pool_create(n_threads)) == NULL) {
+        ts2es_report(NULL, TS2ES_ERROR, "Failed to start %d threads\n", n_threads);
+        exit(-3);
+    }
+
+    t_start = ts2es_time_us();
+    for (i = 0; i < p_batch->n_inputs; i++) {
+        jobs[i].p_batch = p_batch;
+        jobs[i].s_input = p_batch->inputs[i];
+        if (!ts2es_pool_submit(p_pool, batch_job_proc, &jobs[i])) {
+            batch_job_proc(&jobs[i]);
+        }
+    }
+    ts2es_pool_wait(p_pool);
+    t_used = ts2es_time_us() - t_start;
+    ts2es_pool_destroy(p_pool);
+
+    for (i = 0; i < p_batch->n_inputs; i++) {
+        bytes_in  += jobs[i].bytes_in;
+        bytes_out += jobs[i].bytes_out;
+        n_failed  += jobs[i].b_failed;
+    }
+    t_used = t_used > 0 ? t_used : 1;
+
+    ts2es_report(NULL, TS2ES_INFO, "Files processed: %d (%d failed) on %d threads\n",
+        p_batch->n_inputs, n_failed, n_threads);
+    ts2es_report(NULL, TS2ES_INFO, "Total read: %llu bytes, written: %llu bytes in %.3f s\n",
+        (unsigned long long)bytes_in, (unsigned long long)bytes_out, t_used / 1e6);
+    ts2es_report(NULL, TS2ES_INFO, "Throughput: %.1f MB/s, %.1f files/s\n",
+        bytes_in / (double)t_used, p_batch->n_inputs * 1e6 / t_used);
+
+    free(jobs);
+    return n_failed ? -2 : 0;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void show_usage(void)
+{
+    fprintf(stderr, "Usage: ts2es [options] [<infile> [<outfile>]]\n");
+    fprintf(stderr, "       ts2es [options] udp://[@][<address>]:<port> | rtp://... <outfile>\n");
+    fprintf(stderr, "       ts2es [options] -L <list> | -G <pattern>\n");
+    fprintf(stderr, "  -h             Help - this message.\n");
+    fprintf(stderr, "  -a             Write reports on a background thread.\n");
+    fprintf(stderr, "  --aio          Read the input and write the output with asynchronous I/O (io_uring).\n");
+    fprintf(stderr, "  --aio-threads  Same on I/O threads.\n");
+    fprintf(stderr, "  -b <size>      TS packet size: 188, 192 or 204 (default: detect).\n");
+    fprintf(stderr, "  -c <threads>   Demux the mapped input file in chunks on this many threads.\n");
+    fprintf(stderr, "  --end <time>   Stop extracting at this time, see --start.\n");
+    fprintf(stderr, "  -G <pattern>   Batch mode, extract all files matching the pattern.\n");
+    fprintf(stderr, "  --idle <ms>    Stop a live input when no datagram came for this long (default: Ctrl-C).\n");
+    fprintf(stderr, "  -i             Write a seek index of each ES to <outfile>_<pid>.idx.\n");
+    fprintf(stderr, "  -j <threads>   Reassemble and write the ES on this many worker threads.\n");
+    fprintf(stderr, "  -k             Keyframes only, leave out the video pictures coded with reference to others.\n");
+    fprintf(stderr, "  -L <list>      Batch mode, extract all files named in the list (- for stdin).\n");
+    fprintf(stderr, "  -m             Map the input file into memory instead of reading it.\n");
+    fprintf(stderr, "  -n <threads>   Number of files extracted at a time in batch mode (default: CPUs).\n");
+    fprintf(stderr, "  -p <pid>       Extract this PID, may be given several times.\n");
+    fprintf(stderr, "  -P <program>   Extract the streams of this program only (default: all programs).\n");
+    fprintf(stderr, "  --probe        Print the programs and streams found at the start of the input as JSON.\n");
+    fprintf(stderr, "  --probe-size <MB> Bytes read by --probe at most (default: 8).\n");
+    fprintf(stderr, "  --ring <n>     Datagrams buffered for a live input (default: 8192).\n");
+    fprintf(stderr, "  -s <file>      Append per-PID statistics and stage times as JSON lines (- for stderr).\n");
+    fprintf(stderr, "  --start <time> Start extracting at this time: [[hh:]mm:]ss[.frac] or <seconds>s from\n");
+    fprintf(stderr, "                 the start of the input, or a PTS in 90 kHz units. Found by bisection.\n");
+    fprintf(stderr, "  -S <ms>        Interval between two dumps of the statistics (default: at the end).\n");
+    fprintf(stderr, "  -t <type>      Extract the streams of this stream_type in the PMTs, or all of them with 'all'\n");
+    fprintf(stderr, "                 (default: 67).\n");
+    fprintf(stderr, "  -z             Zero-copy output, write ES data straight from the input buffer.\n");
+    fprintf(stderr, "In batch mode each <file>.ts is extracted to <file>_<pid>.es.\n");
 }
 
 /* ---------------------------------------------------------------------------
  */
 int main(int argc, char **argv)
 {
-    FILE *fin;
     ts2es_param_t param;
     ts2es_t *h_ts;
-    uint8_t buf[TS_PACKET_SIZE];
+    batch_t batch;
+    time_range_t range;
+    int pids[MAX_NUM_ES];
+    int n_pids = 0;
+    int b_mmap = 0;
+    int b_zero_copy = 0;
+    int b_batch = 0;
+    int b_probe = 0;
+    size_t probe_bytes = 0;
+    int n_chunk_threads = 0;
+    int n_batch_threads = 0;
+    int n_files = 0;
+    int ring_slots = 0;
+    int idle_ms = 0;
+    int b_failed;
+    uint64_t total_packets, total_bytes;
+    int i;
+
+    memset(&batch, 0, sizeof(batch));
+    range.start = range.end = -1;
+    range.b_start_rel = range.b_end_rel = 0;
 
     // Parse the command-line parameters
+    memset(&param, 0, sizeof(param));
     param.i_log_level = TS2ES_DEBUG;   // only report information whose level >= i_log_level
     param.stream_type_2_catch = 67;    // stream_type to catch, if >=0, would overwrite the pid_min and pid_max settings
                                        // 66, HEVC; 67, AVS2;
@@ -68,34 +684,143 @@ int main(int argc, char **argv)
     strcpy(param.s_input, "video.ts");
     strcpy(param.s_output, "output.es");
 
-    h_ts = ts2es_create(&param, &ts2es_output_es, NULL);
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-h") == 0) {
+            show_usage();
+            return 0;
+        } else if (strcmp(argv[i], "-a") == 0) {
+            param.b_log_async = 1;
+        } else if (strcmp(argv[i], "--aio") == 0) {
+            param.b_async_io = 1;
+        } else if (strcmp(argv[i], "--aio-threads") == 0) {
+            param.b_async_io = 2;
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            param.i_packet_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            n_chunk_threads = atoi(argv[++i]);
+            b_mmap = 1;
+        } else if (strcmp(argv[i], "--end") == 0 && i + 1 < argc) {
+            if ((range.end = parse_time(argv[++i], &range.b_end_rel)) < 0) {
+                show_usage();
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-G") == 0 && i + 1 < argc) {
+            batch_add_glob(&batch, argv[++i]);
+            b_batch = 1;
+        } else if (strcmp(argv[i], "-L") == 0 && i + 1 < argc) {
+            batch_add_list(&batch, argv[++i]);
+            b_batch = 1;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            n_batch_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--idle") == 0 && i + 1 < argc) {
+            idle_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-i") == 0) {
+            param.b_index = 1;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            param.i_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0) {
+            param.b_keyframes = 1;
+        } else if (strcmp(argv[i], "-m") == 0) {
+            b_mmap = 1;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc && n_pids < MAX_NUM_ES) {
+            pids[n_pids++] = (int)strtol(argv[++i], NULL, 0);
+            param.stream_type_2_catch = -1;
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+            param.program_number = (int)strtol(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--probe") == 0) {
+            b_probe = 1;
+        } else if (strcmp(argv[i], "--probe-size") == 0 && i + 1 < argc) {
+            probe_bytes = (size_t)(atof(argv[++i]) * (1 << 20));
+        } else if (strcmp(argv[i], "--ring") == 0 && i + 1 < argc) {
+            ring_slots = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            snprintf(param.s_stats, sizeof(param.s_stats), "%s", argv[++i]);
+            param.b_stats = 1;
+        } else if (strcmp(argv[i], "--start") == 0 && i + 1 < argc) {
+            if ((range.start = parse_time(argv[++i], &range.b_start_rel)) < 0) {
+                show_usage();
+                return -1;
+            }
+        } else if (strcmp(argv[i], "-S") == 0 && i + 1 < argc) {
+            param.i_stats_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            i++;
+            param.stream_type_2_catch = strcmp(argv[i], "all") == 0 ? TS2ES_STREAM_TYPE_ANY : (int)strtol(argv[i], NULL, 0);
+        } else if (strcmp(argv[i], "-z") == 0) {
+            b_zero_copy = 1;
+        } else if (argv[i][0] != '-' && n_files == 0) {
+            snprintf(param.s_input, sizeof(param.s_input), "%s", argv[i]);
+            n_files++;
+        } else if (argv[i][0] != '-' && n_files == 1) {
+            snprintf(param.s_output, sizeof(param.s_output), "%s", argv[i]);
+            n_files++;
+        } else {
+            show_usage();
+            return -1;
+        }
+    }
 
-    // Hard work happens here
-    fin = fopen(h_ts->param.s_input, "rb");
-    if (fin == NULL) {
-        perror("Failed to open input file");
-        exit(-2);
+    if (b_batch) {
+        int ret;
+        if (batch.n_inputs == 0) {
+            ts2es_report(NULL, TS2ES_ERROR, "No input files\n");
+            return -1;
+        }
+        batch.param       = param;
+        batch.pids        = pids;
+        batch.n_pids      = n_pids;
+        batch.b_mmap      = b_mmap;
+        batch.b_zero_copy = b_zero_copy;
+        batch.range       = range;
+        batch.b_probe     = b_probe;
+        batch.probe_bytes = probe_bytes;
+        ret = batch_run(&batch, n_batch_threads);
+        for (i = 0; i < batch.n_inputs; i++) {
+            free(batch.inputs[i]);
+        }
+        free(batch.inputs);
+        return ret;
     }
 
-    while (!h_ts->Interrupted) {
-        int count = fread(buf, 1, TS_PACKET_SIZE, fin);
-        if (count == 0) {
-            break;
+    if (b_probe) {
+        if (probe_input(&param, param.s_input, probe_bytes) < 0) {
+            perror("Failed to open input file");
+            exit(-2);
         }
+        return 0;
+    }
 
-        if (ts2es_demux_ts_packet(h_ts, buf, count) == 0) {
-            break;
+    h_ts = ts2es_create(&param, NULL, NULL);   // use the built-in output files
+    if (h_ts == NULL) {
+        exit(-3);
+    }
+    for (i = 0; i < n_pids; i++) {
+        ts2es_select_pid(h_ts, pids[i]);
+    }
+    if (b_zero_copy) {
+        ts2es_set_output_iov(h_ts, ts2es_sink_output_iov, NULL);
+    }
+
+    // Hard work happens here
+    if (strstr(param.s_input, "udp://") == param.s_input || strstr(param.s_input, "rtp://") == param.s_input) {
+        if (!demux_live(h_ts, param.s_input, ring_slots, idle_ms)) {
+            exit(-2);
         }
+    } else if (!demux_file(h_ts, b_mmap, n_chunk_threads, &range)) {
+        perror("Failed to open input file");
+        exit(-2);
     }
 
-    // Display statistics
-    ts2es_report(NULL, TS2ES_INFO, "TS packets processed: %lu\n", h_ts->total_packets);
-    ts2es_report(NULL, TS2ES_INFO, "Total written: %lu bytes\n", h_ts->total_bytes);
+    // Display statistics, once the last PES of each ES is written out
+    ts2es_flush(h_ts);
+    b_failed      = ts2es_sink_flush(h_ts, h_ts->sink) > 0;
+    total_packets = h_ts->total_packets;
+    total_bytes   = h_ts->total_bytes;
 
     ts2es_destroy(h_ts);
     h_ts = NULL;
 
-    // Success
-    return 0;
+    ts2es_report(NULL, TS2ES_INFO, "TS packets processed: %llu\n", (unsigned long long)total_packets);
+    ts2es_report(NULL, TS2ES_INFO, "Total written: %llu bytes\n", (unsigned long long)total_bytes);
+    return b_failed ? -2 : 0;
 }
-
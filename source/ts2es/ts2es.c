@@ -23,7 +23,10 @@
 
 #include "ts2es.h"
 #include "mpa_header.h"
+#include "ts_thread.h"
 #include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
 
 #ifdef _WIN32
 #include <windows.h>
@@ -35,46 +38,6 @@
 #pragma warning(disable:4189)
 #endif
 
-/* ---------------------------------------------------------------------------
- */
-void ts2es_report(ts2es_t *h_ts, int i_type, const char *format, ...)
-{
-    static const int color_1 = FOREGROUND_RED | FOREGROUND_GREEN;  // 
-    static const int color_2 = FOREGROUND_RED | FOREGROUND_BLUE;   // 
-    static const int color_3 = FOREGROUND_GREEN | FOREGROUND_BLUE; // ǳ
-
-    static const char s_type_info[][20] = {
-        "debug", "info", "warning", "error"
-    };
-    static char buff[1024];
-    int si_color[] = {
-        color_1, color_3, color_2, FOREGROUND_RED
-    };
-    int k;
-
-    va_list ap;
-
-    if (h_ts != NULL && i_type < h_ts->param.i_log_level) {
-        return;
-    }
-
-    va_start(ap, format);
-    vsnprintf(buff, sizeof(buff), format, ap);
-    va_end(ap);
-
-    if ((k = strlen(buff)) > 1 && buff[k - 1] == '\n') {
-        buff[k - 1] = '\0';
-    }
-
-#ifdef _WIN32
-    SetConsoleTextAttribute(GetStdHandle(STD_ERROR_HANDLE), FOREGROUND_INTENSITY | si_color[i_type]);
-    fprintf(stderr, "[ts2es] %s: %s\n", s_type_info[i_type], buff);
-    SetConsoleTextAttribute(GetStdHandle(STD_ERROR_HANDLE), FOREGROUND_INTENSITY | FOREGROUND_GREEN);
-#else
-    fprintf(stderr, "[ts2es] %s: %s\n", s_type_info[i_type], buff);
-#endif
-}
-
 /* ---------------------------------------------------------------------------
  * Parse AVS1/AVS2/AVC/HEVC video start-code
  * returns 1 if valid, or 0 if invalid
@@ -142,25 +105,364 @@ static int validate_pes_header(ts2es_t *h_ts, int pid, uint8_t *buf_ptr, int buf
     return 1;
 }
 
+/* ---------------------------------------------------------------------------
+ * Grow the ES buffer geometrically to hold at least "size" bytes
+ * returns 1 on success, or 0 if the buffer cannot grow
+ */
+static int es_buffer_grow(ts2es_es_t *p_es, size_t size)
+{
+    size_t new_size = p_es->buf_size ? (size_t)p_es->buf_size << 1 : ES_MIN_SIZE;
+    uint32_t capacity;
+    uint8_t *p_new;
+
+    while (new_size < size) {
+        new_size <<= 1;
+    }
+    if (new_size > ES_MAX_SIZE || (p_new = ts2es_mem_alloc(new_size, &capacity)) == NULL) {
+        return 0;
+    }
+
+    if (p_es->cur_len) {
+        memcpy(p_new, p_es->raw_data, p_es->cur_len);
+    }
+    ts2es_mem_free(p_es->raw_data);
+    p_es->raw_data = p_new;
+    p_es->buf_size = capacity;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Stage timing, only with the statistics on: add the ticks since *p_t0 to a
+ * stage and start counting the next one
+ */
+#define STATS_T0(h_ts)      ((h_ts)->stats != NULL ? ts2es_ticks() : 0)
+// the statistics are dumped at intervals checked every 4096 packets
+#define STATS_POLL_PACKETS  4095
+
+static void stats_stage(ts2es_t *h_ts, uint64_t *p_ticks, uint64_t *p_t0)
+{
+    if (h_ts->stats != NULL) {
+        uint64_t t1 = ts2es_ticks();
+        *p_ticks += t1 - *p_t0;
+        *p_t0 = t1;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Pull output: queue the collected data with its buffer for the caller, the
+ * ES goes on in a new buffer of the same size
+ */
+static void es_pull(ts2es_t *h_ts, ts2es_es_t *p_es)
+{
+    ts2es_pes_t *p_pes;
+    uint8_t *raw_data;
+    uint32_t capacity;
+
+    if (!ts2es_atomic_load(&h_ts->b_output) || p_es->cur_len == 0) {
+        return;
+    }
+
+    if (h_ts->n_pulled == h_ts->max_pulled) {
+        int max_pulled = h_ts->max_pulled ? h_ts->max_pulled << 1 : 16;
+        ts2es_pes_t *pulled = (ts2es_pes_t *)realloc(h_ts->pulled, max_pulled * sizeof(ts2es_pes_t));
+        if (pulled == NULL) {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to queue a PES, dropping %u bytes (pid: %d).\n",
+                p_es->cur_len, p_es->pid);
+            p_es->cur_len = 0;
+            return;
+        }
+        h_ts->pulled     = pulled;
+        h_ts->max_pulled = max_pulled;
+    }
+
+    if ((raw_data = ts2es_mem_alloc(p_es->buf_size, &capacity)) == NULL) {
+        ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate ES buffer, dropping %u bytes (pid: %d).\n",
+            p_es->cur_len, p_es->pid);
+        p_es->cur_len = 0;
+        return;
+    }
+
+    p_pes = &h_ts->pulled[h_ts->n_pulled++];
+    p_pes->pid  = (int)p_es->pid;
+    p_pes->pts  = p_es->pts;
+    p_pes->dts  = p_es->dts;
+    p_pes->data = p_es->raw_data;
+    p_pes->len  = p_es->cur_len;
+
+    p_es->raw_data = raw_data;
+    p_es->buf_size = capacity;
+    p_es->cur_len  = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Send the collected ES data to the output. Every ES_SHRINK_PERIOD outputs,
+ * a buffer which has used less than a quarter of its size is made smaller
+ */
+static void output_es(ts2es_t *h_ts, ts2es_es_t *p_es)
+{
+#define ES_SHRINK_PERIOD    64
+    uint64_t t0 = STATS_T0(h_ts);
+
+    if (h_ts->b_pull) {
+        es_pull(h_ts, p_es);
+        stats_stage(h_ts, &p_es->stage_ticks[TS2ES_STAGE_OUTPUT], &t0);
+        return;
+    }
+
+    if (h_ts->f_output_iov != NULL) {
+        h_ts->f_output_iov(h_ts, p_es->pid, p_es->pts, p_es->dts, p_es->iov, p_es->n_iov, h_ts->opque_output_iov);
+        p_es->n_iov   = 0;
+        p_es->cur_len = 0;
+        stats_stage(h_ts, &p_es->stage_ticks[TS2ES_STAGE_OUTPUT], &t0);
+        return;
+    }
+
+    if (p_es->cur_len > p_es->peak_len) {
+        p_es->peak_len = p_es->cur_len;
+    }
+
+    h_ts->f_output(h_ts, p_es, h_ts->opque_output);
+    stats_stage(h_ts, &p_es->stage_ticks[TS2ES_STAGE_OUTPUT], &t0);
+
+    if (++p_es->num_outputs >= ES_SHRINK_PERIOD) {
+        if (p_es->cur_len == 0 && p_es->buf_size > ES_MIN_SIZE && p_es->peak_len < p_es->buf_size / 4) {
+            ts2es_mem_free(p_es->raw_data);
+            p_es->raw_data = NULL;
+            p_es->buf_size = 0;
+            es_buffer_grow(p_es, (size_t)p_es->peak_len << 1);
+        }
+        p_es->peak_len    = 0;
+        p_es->num_outputs = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Zero-copy output: keep a reference to ES data inside the input buffer
+ * returns 1 on success, or 0 if out of memory
+ */
+static int es_iov_append(ts2es_t *h_ts, ts2es_es_t *p_es, uint8_t *es_ptr, size_t es_len)
+{
+    if (p_es->n_iov == p_es->max_iov) {
+        int max_iov = p_es->max_iov ? p_es->max_iov << 1 : 64;
+        ts2es_iov_t *iov = (ts2es_iov_t *)realloc(p_es->iov, max_iov * sizeof(ts2es_iov_t));
+        if (iov == NULL) {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate ES slices (pid: %d).\n", p_es->pid);
+            return 0;
+        }
+        p_es->iov     = iov;
+        p_es->max_iov = max_iov;
+    }
+
+    p_es->iov[p_es->n_iov].iov_base = es_ptr;
+    p_es->iov[p_es->n_iov].iov_len  = es_len;
+    p_es->n_iov++;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Zero-copy output: deliver the pending slices of all ES before the input
+ * buffer they point into goes away
+ */
+static void es_iov_flush(ts2es_t *h_ts)
+{
+    int i;
+    for (i = 0; i < h_ts->num_es; i++) {
+        if (h_ts->es[i].n_iov) {
+            output_es(h_ts, &h_ts->es[i]);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Make room for "len" more bytes in the ES buffer. If the buffer is already
+ * at its maximum size, the collected data is sent to the output first
+ * returns 1 on success, or 0 if there is no room
+ */
+static int es_buffer_reserve(ts2es_t *h_ts, ts2es_es_t *p_es, size_t len)
+{
+    if (p_es->cur_len + len <= p_es->buf_size || es_buffer_grow(p_es, p_es->cur_len + len)) {
+        return 1;
+    }
+
+    if (p_es->cur_len) {
+        output_es(h_ts, p_es);
+        if (p_es->cur_len) {
+            ts2es_report(h_ts, TS2ES_WARNING, "ES buffer overflow, dropping %u bytes (pid: %d).\n",
+                p_es->cur_len, p_es->pid);
+            p_es->es_bytes -= p_es->cur_len;
+            p_es->cur_len = 0;
+        }
+    }
+
+    if (len <= p_es->buf_size || es_buffer_grow(p_es, len)) {
+        return 1;
+    }
+
+    ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate ES buffer (pid: %d, size: %u).\n",
+        p_es->pid, (uint32_t)len);
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Collect ES data of the current PES for output, once the ES is in sync.
+ * "b_index": the data begins the PES, "b_output": the PES ends with it
+ */
+static void es_collect(ts2es_t *h_ts, ts2es_es_t *p_es, uint8_t *es_ptr, size_t es_len, int b_index, int b_output)
+{
+    ts2es_es_state_t *p_st = ts2es_es_state(h_ts, p_es);
+    size_t unsynced_len = p_st->synced ? 0 : es_len;
+    uint64_t t0 = STATS_T0(h_ts);
+
+    // Scan through Elementary Stream (ES)
+    // and try and find MPEG audio stream header
+    while (!p_st->synced && es_len >= 4) {
+        mpa_header_t mpah;
+        // Skip to the next position that may start a header
+        size_t skip = ts2es_es_sync_scan(es_ptr, es_len);
+        es_ptr += skip;
+        es_len -= skip;
+        if (es_len < 4) {
+            break;
+        }
+        // Valid header?
+        if (mpa_header_parse(h_ts, es_ptr, &mpah)) {
+            // Looks good, we have gained sync.
+            if (ts2es_atomic_load(&h_ts->never_synced)) {
+                ts2es_report(h_ts, TS2ES_INFO, " ");
+                mpa_header_print(h_ts, &mpah);
+                ts2es_report(h_ts, TS2ES_INFO, "MPEG Audio Framesize: %d bytes\n", mpah.framesize);
+            } else {
+                ts2es_report(h_ts, TS2ES_INFO, "Regained sync at 0x % lx\n", 
+                    (unsigned long)p_st->pkt_offset);
+            }
+            p_st->synced = 1;
+            p_es->resyncs++;
+            ts2es_atomic_store(&h_ts->never_synced, 0);   // shared by the workers
+        } else if (is_valid_video_pes(h_ts, es_ptr)) {
+            /* video ES start-code */
+            if (ts2es_atomic_load(&h_ts->never_synced)) {
+                ts2es_report(h_ts, TS2ES_INFO, "AVS Video StartCode Found\n");
+            } else {
+                ts2es_report(h_ts, TS2ES_INFO, "Regained sync at 0x % lx\n", 
+                    (unsigned long)p_st->pkt_offset);
+            }
+            p_st->synced = 1;
+            p_es->resyncs++;
+            ts2es_atomic_store(&h_ts->never_synced, 0);
+        } else {
+            // Skip byte
+            es_len--;
+            es_ptr++;
+        }
+    }
+
+    if (unsynced_len) {
+        p_es->skipped_bytes += p_st->synced ? unsynced_len - es_len : unsynced_len;
+        stats_stage(h_ts, &p_es->stage_ticks[TS2ES_STAGE_SYNC], &t0);
+    }
+
+    // If stream is synced then write the data out
+    if (p_st->synced && es_len > 0) {
+        if (h_ts->f_output_iov != NULL) {
+            if (!es_iov_append(h_ts, p_es, es_ptr, es_len)) {
+                return;
+            }
+        } else {
+            if (!es_buffer_reserve(h_ts, p_es, es_len)) {
+                return;
+            }
+            memcpy(p_es->raw_data + p_es->cur_len, es_ptr, es_len);
+        }
+        if (b_index) {
+            ts2es_index_add(h_ts, p_es, es_ptr, es_len);
+        }
+        p_es->cur_len  += es_len;
+        p_es->es_bytes += es_len;
+        stats_stage(h_ts, &p_es->stage_ticks[TS2ES_STAGE_COPY], &t0);
+
+        // Write out the data
+        if (b_output) {
+            output_es(h_ts, p_es);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Hold the data of a video PES until its first picture is found, which tells
+ * if the PES is left out in keyframe mode, and flags its index entry. "b_end":
+ * the PES ends with this data. A PES in which no picture is found is kept
+ * returns 1 once the PES is classified, with the held data in *pp_data and
+ * *p_len (none if the PES is left out), or 0 while the data is held
+ */
+static int es_hold(ts2es_t *h_ts, ts2es_es_t *p_es, uint8_t **pp_data, size_t *p_len, int b_end)
+{
+    ts2es_es_state_t *p_st = ts2es_es_state(h_ts, p_es);
+    size_t from = p_es->held_len > 5 ? p_es->held_len - 5 : 0;     // a start code may span two packets
+    int b_key;
+
+    if (p_es->held == NULL && (p_es->held = (uint8_t *)malloc(ES_HOLD_SIZE + TS_PACKET_SIZE)) == NULL) {
+        ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate the PES head (pid: %d).\n", p_es->pid);
+        p_st->b_held = 0;
+        return 1;   // kept, as nothing was held yet
+    }
+    memcpy(p_es->held + p_es->held_len, *pp_data, *p_len);
+    p_es->held_len += (uint32_t)*p_len;
+
+    b_key = ts2es_au_keyframe(p_es, p_es->held + from, p_es->held_len - from);
+    if (b_key < 0 && !b_end && p_es->held_len < ES_HOLD_SIZE) {
+        return 0;
+    }
+
+    p_st->b_held = 0;
+    *pp_data = p_es->held;
+    *p_len   = p_es->held_len;
+    p_es->held_len = 0;
+    if (b_key == 0 && h_ts->param.b_keyframes) {
+        p_st->b_skip_pes = 1;
+        p_es->skipped_pes++;
+        *p_len = 0;
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * End the PES held by es_hold(), e.g. at the next PES header
+ */
+static void es_hold_end(ts2es_t *h_ts, ts2es_es_t *p_es)
+{
+    uint8_t *es_ptr = p_es->held;
+    size_t es_len = 0;
+
+    if (ts2es_es_state(h_ts, p_es)->b_held && es_hold(h_ts, p_es, &es_ptr, &es_len, 1) && es_len) {
+        es_collect(h_ts, p_es, es_ptr, es_len, h_ts->param.b_index, 0);
+    }
+}
+
 /* ---------------------------------------------------------------------------
  * Extract the PES payload and send it to the output file
  */
 static void extract_pes_payload(ts2es_t *h_ts, ts2es_es_t *p_es, int cur_pid, uint8_t *pes_ptr, size_t pes_len, int start_of_pes)
 {
+    ts2es_es_state_t *p_st = ts2es_es_state(h_ts, p_es);
     uint8_t *es_ptr = NULL;
     size_t es_len = 0;
+    int b_index = 0;
+    uint64_t t0;
 
     // Start of a PES header?
     if (start_of_pes) {
         uint32_t pes_total_len = PES_PACKET_LEN(pes_ptr);
         size_t pes_header_len  = PES_PACKET_HEAD_LEN(pes_ptr);
         uint8_t stream_id      = PES_PACKET_STREAM_ID(pes_ptr);
-        int64_t pts            = PES_PACKET_PTS(pes_ptr);
-        int64_t dts            = PES_PACKET_DTS(pes_ptr);
+        int     pts_dts_flags  = PES_PACKET_PTS_DTS(pes_ptr);
+        int64_t pts            = (pts_dts_flags & 2) ? (int64_t)PES_PACKET_PTS(pes_ptr) : -1;
+        int64_t dts            = pts_dts_flags == 3 ? (int64_t)PES_PACKET_DTS(pes_ptr) : pts;
 
+        es_hold_end(h_ts, p_es);
         if (p_es->cur_len) {
-            h_ts->f_output(h_ts, p_es, h_ts->opque_output); // output the last ES stream
+            output_es(h_ts, p_es); // output the last ES stream
         }
+        t0 = STATS_T0(h_ts);
 
         // Check that it has a valid header
         if (!validate_pes_header(h_ts, cur_pid, pes_ptr, pes_len)) {
@@ -173,79 +475,65 @@ static void extract_pes_payload(ts2es_t *h_ts, ts2es_es_t *p_es, int cur_pid, ui
                 // keep the first stream we see
                 p_es->pes_stream_id = stream_id;
                 ts2es_report(h_ts, TS2ES_INFO, "Found valid PES packet (offset: 0x%lx, pid: %d, stream id: 0x%x, length: %u)\n",
-                    ((unsigned long)h_ts->total_packets - 1)*TS_PACKET_SIZE, cur_pid, stream_id, pes_total_len);
+                    (unsigned long)p_st->pkt_offset, cur_pid, stream_id, pes_total_len);
             } else {
                 ts2es_report(h_ts, TS2ES_INFO, "Ignoring additional stream ID 0x%x (pid: %d).\n", stream_id, cur_pid);
                 return;
             }
         }
         // Store the length of the PES packet payload
-        p_es->pes_remaining = pes_total_len - (2 + pes_header_len);
+        p_st->pes_remaining = pes_total_len - (2 + pes_header_len);
         p_es->pts           = pts;
         p_es->dts           = dts;
+        p_es->pes_count++;
+        p_es->pes_offset    = p_st->pkt_offset;
+        b_index = h_ts->param.b_index;
 
         // Keep pointer to ES data in this packet
         es_ptr = pes_ptr + (9 + pes_header_len);
         es_len = pes_len - (9 + pes_header_len);
+
+        // The ES ends at the first PES presented after the time range
+        if (h_ts->range_end >= 0 && pts >= 0) {
+            int64_t after = (pts - h_ts->range_end) & TS_PTS_MASK;
+            p_es->b_range_end |= after > 0 && after <= (TS_PTS_MASK >> 1);
+        }
+
+        // In keyframe mode, or for the index, a video PES is held until its first picture
+        p_st->b_skip_pes   = p_es->b_range_end;
+        p_st->b_held       = !p_es->b_range_end && (h_ts->param.b_keyframes || b_index) && ts2es_au_video(p_es);
+        p_es->skipped_pes += p_st->b_skip_pes;
+        stats_stage(h_ts, &p_es->stage_ticks[TS2ES_STAGE_PES], &t0);
     } else if (p_es->pes_stream_id) {
         // Only output data once we have seen a PES header
         es_ptr = pes_ptr;
         es_len = pes_len;
 
         // Are we are the end of the PES packet?
-        if (es_len > p_es->pes_remaining) {
-            es_len = p_es->pes_remaining;
+        if (es_len > p_st->pes_remaining) {
+            es_len = p_st->pes_remaining;
         }
     }
 
+    // Left out PES: the data is not looked at
+    if (es_ptr && p_st->b_skip_pes) {
+        p_st->pes_remaining -= es_len;
+        return;
+    }
+
     // Got some data to write out?
     if (es_ptr) {
         // Subtract the amount remaining in current PES packet
-        p_es->pes_remaining -= es_len;
-
-        // Scan through Elementary Stream (ES)
-        // and try and find MPEG audio stream header
-        while (!p_es->synced && es_len >= 4) {
-            mpa_header_t mpah;
-            // Valid header?
-            if (mpa_header_parse(h_ts, es_ptr, &mpah)) {
-                // Looks good, we have gained sync.
-                if (h_ts->never_synced) {
-                    ts2es_report(h_ts, TS2ES_INFO, " ");
-                    mpa_header_print(h_ts, &mpah);
-                    ts2es_report(h_ts, TS2ES_INFO, "MPEG Audio Framesize: %d bytes\n", mpah.framesize);
-                } else {
-                    ts2es_report(h_ts, TS2ES_INFO, "Regained sync at 0x % lx\n", 
-                        ((unsigned long)h_ts->total_packets - 1) * TS_PACKET_SIZE);
-                }
-                p_es->synced = 1;
-                h_ts->never_synced = 0;
-            } else if (is_valid_video_pes(h_ts, es_ptr)) {
-                /* video ES start-code */
-                if (h_ts->never_synced) {
-                    ts2es_report(h_ts, TS2ES_INFO, "AVS Video StartCode Found\n");
-                } else {
-                    ts2es_report(h_ts, TS2ES_INFO, "Regained sync at 0x % lx\n", 
-                        ((unsigned long)h_ts->total_packets - 1) * TS_PACKET_SIZE);
-                }
-                p_es->synced = 1;
-                h_ts->never_synced = 0;
-            } else {
-                // Skip byte
-                es_len--;
-                es_ptr++;
-            }
-        }
-
-        // If stream is synced then write the data out
-        if (p_es->synced && es_len > 0) {
-            memcpy(p_es->raw_data + p_es->cur_len, es_ptr, es_len);
-            p_es->cur_len += es_len;
+        p_st->pes_remaining -= es_len;
 
-            // Write out the data
-            if (p_es->pes_remaining + pes_len < TS_PACKET_SIZE - 5) {
-                h_ts->f_output(h_ts, p_es, h_ts->opque_output);
+        if (p_st->b_held) {
+            if (!es_hold(h_ts, p_es, &es_ptr, &es_len, p_st->pes_remaining == 0)) {
+                return;
             }
+            b_index = h_ts->param.b_index;  // the held data begins the PES
+        }
+        if (es_len > 0) {
+            es_collect(h_ts, p_es, es_ptr, es_len, b_index, p_st->pes_remaining + pes_len < TS_PACKET_SIZE - 5);
         }
     }
 }
@@ -254,200 +542,1400 @@ static void extract_pes_payload(ts2es_t *h_ts, ts2es_es_t *p_es, int cur_pid, ui
  */
 static void ts_continuity_check(ts2es_t *h_ts, ts2es_es_t *p_es, int ts_cc)
 {
-    if (p_es->continuity_count != ts_cc) {
+    ts2es_es_state_t *p_st = ts2es_es_state(h_ts, p_es);
+
+    if (p_st->continuity_count != ts_cc) {
         // Only display an error after we gain sync
-        if (p_es->synced) {
+        if (p_st->synced) {
             ts2es_report(h_ts, TS2ES_WARNING, "TS continuity error at 0x%lx, pid[%d]: (%d, %d)\n",
-                ((unsigned long)h_ts->total_packets - 1) * TS_PACKET_SIZE, 
-                p_es->pid, p_es->continuity_count, ts_cc);
-            p_es->synced = 0;
+                (unsigned long)p_st->pkt_offset, 
+                p_es->pid, p_st->continuity_count, ts_cc);
+            p_st->synced = 0;
+        }
+        p_st->continuity_count = ts_cc;
+    }
+
+    p_st->continuity_count++;
+    if (p_st->continuity_count == 16) {
+        p_st->continuity_count = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the stream_type of a PID in the PMTs, or 0 if it is in none
+ */
+static int pmt_stream_type(ts2es_t *h_ts, int pid)
+{
+    int i, k;
+
+    for (k = 0; k < h_ts->num_programs; k++) {
+        const ts2es_program_t *p_prog = &h_ts->programs[k];
+        for (i = 0; i < p_prog->num_streams; i++) {
+            if (p_prog->streams[i].pid == pid) {
+                return p_prog->streams[i].stream_type;
+            }
         }
-        p_es->continuity_count = ts_cc;
     }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Take the stream_type in the PMTs of the ES attached before, e.g. selected
+ * by PID before the PMT arrived
+ */
+static void es_set_stream_types(ts2es_t *h_ts)
+{
+    int i;
+
+    for (i = 0; i < h_ts->num_es; i++) {
+        ts2es_es_t *p_es = &h_ts->es[i];
+        int stream_type = pmt_stream_type(h_ts, p_es->pid);
 
-    p_es->continuity_count++;
-    if (p_es->continuity_count == 16) {
-        p_es->continuity_count = 0;
+        if (p_es->b_valid && stream_type != 0 && stream_type != p_es->stream_type) {
+            ts2es_wait_workers(h_ts);   // the ES may be demuxed on a worker
+            ts2es_report(h_ts, TS2ES_DEBUG, "PID %d has stream_type 0x%x\n", p_es->pid, stream_type);
+            p_es->stream_type = stream_type;
+            ts2es_au_retype(h_ts, p_es);
+        }
     }
 }
 
 /* ---------------------------------------------------------------------------
+ * Attach an ES state to a selected PID
+ * returns the ES, or NULL if all ES states are in use
  */
-ts2es_es_t *ts2es_find_es(ts2es_t *h_ts, int pid)
+static ts2es_es_t *es_attach(ts2es_t *h_ts, int pid)
 {
+    ts2es_es_t *p_es;
     int i;
+
     for (i = 0; i < h_ts->num_es; i++) {
         if (h_ts->es[i].b_valid && h_ts->es[i].pid == pid) {
-            return &h_ts->es[i];
+            break;  // PID was selected before
         }
     }
+    if (i == MAX_NUM_ES) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Too many ES, ignoring PID %d.\n", pid);
+        h_ts->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_IGNORE, 0);
+        return NULL;
+    }
 
-    h_ts->num_es++;
-    h_ts->es[i].b_valid = 1;
-    h_ts->es[i].pid     = pid;
-    h_ts->es[i].cur_len = 0;
-    h_ts->es[i].synced  = 1;
-    h_ts->es[i].continuity_count = -1;
+    p_es = &h_ts->es[i];
+    if (i == h_ts->num_es) {
+        h_ts->num_es++;
+        p_es->b_valid = 1;
+        p_es->pid     = pid;
+        p_es->cur_len = 0;
+        h_ts->es_state[i].synced           = 1;
+        h_ts->es_state[i].continuity_count = -1;
+        p_es->stream_type = pmt_stream_type(h_ts, pid);
+    }
 
-    return &h_ts->es[i];
+    h_ts->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_ES, i);
+    return p_es;
 }
 
 /* ---------------------------------------------------------------------------
+ * Select a PID to be extracted, any number of PIDs may be selected
  */
-int ts2es_demux_ts_packet(ts2es_t *h_ts, uint8_t *buf, size_t buf_len)
+void ts2es_select_pid(ts2es_t *h_ts, int pid)
 {
-    uint8_t *pes_ptr = NULL;
-    size_t pes_len;
-    int cur_pid;
-    ts2es_es_t *p_es = NULL;
-
-    h_ts->total_packets++;
+    int type;
 
-    // Check the sync-byte
-    if (TS_PACKET_SYNC_BYTE(buf) != 0x47) {
-        ts2es_report(h_ts, TS2ES_WARNING, "Lost Transport Stream syncronisation - aborting (offset: 0x%lx).\n",
-            ((unsigned long)h_ts->total_packets - 1)*TS_PACKET_SIZE);
-        // FIXME: try and re-gain synchronisation
-        return 0;
+    if (pid <= 0 || pid >= 0x1FFF) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Invalid Transport Stream PID: %d\n", pid);
+        return;
+    }
+    type = TS2ES_PID_TYPE(h_ts->pid_map[pid]);
+    if (type == TS2ES_PID_PAT || type == TS2ES_PID_PMT) {
+        ts2es_report(h_ts, TS2ES_WARNING, "PID %d carries PSI, not selected.\n", pid);
+        return;
     }
+    if (type != TS2ES_PID_ES) {
+        h_ts->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_SELECT, 0);
+    }
+}
 
-    cur_pid = TS_PACKET_PID(buf);
+/* ---------------------------------------------------------------------------
+ * Point the dispatch table at the PMTs found in the PAT, a PMT PID shared by
+ * several programs points at the first one
+ */
+static void pid_map_set_pmt(ts2es_t *h_ts)
+{
+    int pid, i;
 
-    if (cur_pid == 0) {
-        ts2es_report(h_ts, TS2ES_DEBUG, "pid: 0, PAT\n");
-        ts2es_decode_pat(h_ts, buf + 5, buf_len - 5);
-    } else if (cur_pid == h_ts->pmt_pid) {
-        int i = 0;
-        ts2es_report(h_ts, TS2ES_DEBUG, "pid: %d, PMT\n", cur_pid);
-        ts2es_decode_pmt(h_ts, buf + 5, buf_len - 5);
-        h_ts->b_output = 1;
-
-        if (h_ts->param.stream_type_2_catch >= 0) {
-            h_ts->param.pid_max = 1;
-            h_ts->param.pid_min = 0x1FFE;
-            for (i = 0; i < MAX_NUM_ES; i++) {
-                int pmt_pid = h_ts->pmt[i].pid;
-                if (pmt_pid == 0) {  // 'PID = 0' is used for PAT
-                    break;
-                }
-                if (h_ts->pmt[i].stream_type == h_ts->param.stream_type_2_catch) {
-                    if (h_ts->param.pid_max < pmt_pid) {
-                        h_ts->param.pid_max = pmt_pid;
-                    }
-                    if (h_ts->param.pid_min > pmt_pid) {
-                        h_ts->param.pid_min = pmt_pid;
-                    }
-                }
-            }
+    for (pid = 1; pid < 0x1FFF; pid++) {
+        if (TS2ES_PID_TYPE(h_ts->pid_map[pid]) == TS2ES_PID_PMT) {
+            h_ts->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_IGNORE, 0);
         }
     }
+    for (i = h_ts->num_programs - 1; i >= 0; i--) {
+        pid = h_ts->programs[i].pmt_pid;
+        if (pid > 0 && pid < 0x1FFF) {
+            h_ts->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_PMT, i);
+        }
+    }
+}
 
-    // Check packet validity
-    if ((cur_pid >= h_ts->param.pid_min && cur_pid <= h_ts->param.pid_max) || (h_ts->param.pid_max == -1)) {
-        // Scrambled?
-        if (TS_PACKET_SCRAMBLING(buf)) {
-            ts2es_report(h_ts, TS2ES_WARNING, "PID %d is scrambled.", cur_pid);
-            return 1;
+/* ---------------------------------------------------------------------------
+ * Select the ES whose stream_type is stream_type_2_catch in the PMTs of all
+ * programs, or of param.program_number only
+ */
+static void pid_map_select_streams(ts2es_t *h_ts)
+{
+    int pid, i, k;
+
+    // drop the selection of the previous PMT, ES states are kept
+    for (pid = 1; pid < 0x1FFF; pid++) {
+        int type = TS2ES_PID_TYPE(h_ts->pid_map[pid]);
+        if (type == TS2ES_PID_ES || type == TS2ES_PID_SELECT || type == TS2ES_PID_PROBE) {
+            h_ts->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_IGNORE, 0);
         }
+    }
 
-        // Transport error?
-        if (TS_PACKET_TRANS_ERROR(buf)) {
-            ts2es_report(h_ts, TS2ES_WARNING, "transport error at 0x%lx\n",
-                ((unsigned long)h_ts->total_packets - 1)*TS_PACKET_SIZE);
-            p_es->synced = 0;
-            return 1;
+    for (k = 0; k < h_ts->num_programs; k++) {
+        ts2es_program_t *p_prog = &h_ts->programs[k];
+        if (h_ts->param.program_number > 0 && p_prog->program_number != h_ts->param.program_number) {
+            continue;
+        }
+        for (i = 0; i < p_prog->num_streams; i++) {
+            if (p_prog->streams[i].stream_type == h_ts->param.stream_type_2_catch ||
+                h_ts->param.stream_type_2_catch == TS2ES_STREAM_TYPE_ANY) {
+                ts2es_select_pid(h_ts, p_prog->streams[i].pid);
+            }
         }
     }
+}
 
+/* ---------------------------------------------------------------------------
+ * Locate the payload of a TS packet
+ * returns 1 if the packet has a payload, or 0 if it has none
+ */
+static int ts_packet_payload(uint8_t *buf, uint8_t **pp_payload, size_t *p_len)
+{
     // Location of and size of PES payload
-    pes_ptr = &buf[4];
-    pes_len = TS_PACKET_SIZE - 4;
+    *pp_payload = &buf[4];
+    *p_len      = TS_PACKET_SIZE - 4;
 
     // Check for adaptation field?
     if (TS_PACKET_ADAPTATION(buf) == 0x1) {
         // Payload only, no adaptation field
     } else if (TS_PACKET_ADAPTATION(buf) == 0x2) {
         // Adaptation field only, no payload
-        return 1;
+        return 0;
     } else if (TS_PACKET_ADAPTATION(buf) == 0x3) {
         // Adaptation field AND payload
-        pes_ptr += (TS_PACKET_ADAPT_LEN(buf) + 1);
-        pes_len -= (TS_PACKET_ADAPT_LEN(buf) + 1);
+        *pp_payload += (TS_PACKET_ADAPT_LEN(buf) + 1);
+        *p_len      -= (TS_PACKET_ADAPT_LEN(buf) + 1);
     }
+    return 1;
+}
 
-    // fprintf(stdout, "pid[%4d]: %5u\n", cur_pid, pes_len);
-    // Check we know about the payload
-    if (cur_pid == 0x1FFF) {
-        // Ignore NULL package
-        return 1;
+/* ---------------------------------------------------------------------------
+ * Reassemble the ES of one packet, on the thread owning the ES
+ */
+static void demux_es_packet(ts2es_t *h_ts, ts2es_es_t *p_es, uint8_t *buf)
+{
+    ts2es_es_state_t *p_st = ts2es_es_state(h_ts, p_es);
+    uint8_t *pes_ptr;
+    size_t pes_len;
+
+    // Scrambled?
+    if (TS_PACKET_SCRAMBLING(buf)) {
+        ts2es_report(h_ts, TS2ES_WARNING, "PID %d is scrambled.", p_es->pid);
+        return;
     }
 
-    // No chosen PID yet?
-    if (h_ts->param.pid_max == -1 && TS_PACKET_PAYLOAD_START(buf)) {
-        // Does this one look good ?
-        if (TS_PACKET_PAYLOAD_START(buf) &&
-            validate_pes_header(h_ts, cur_pid, pes_ptr, pes_len)) {
-            // Looks good, use this one
-            h_ts->param.pid_min = h_ts->param.pid_max = cur_pid;
-        }
+    // Transport error?
+    if (TS_PACKET_TRANS_ERROR(buf)) {
+        ts2es_report(h_ts, TS2ES_WARNING, "transport error at 0x%lx\n", (unsigned long)p_st->pkt_offset);
+        p_st->synced = 0;
+        return;
     }
 
-    // Process the packet, if it is the PID we are interested in
-    if (cur_pid >= h_ts->param.pid_min && cur_pid <= h_ts->param.pid_max) {
-        p_es = ts2es_find_es(h_ts, cur_pid);
-        // Continuity check
-        ts_continuity_check(h_ts, p_es, TS_PACKET_CONT_COUNT(buf));
-        // Extract PES payload and write it to output
-        extract_pes_payload(h_ts, p_es, cur_pid, pes_ptr, pes_len, TS_PACKET_PAYLOAD_START(buf));
+    if (!ts_packet_payload(buf, &pes_ptr, &pes_len)) {
+        return;
     }
 
+    // Continuity check
+    ts_continuity_check(h_ts, p_es, TS_PACKET_CONT_COUNT(buf));
+    // Extract PES payload and write it to output
+    extract_pes_payload(h_ts, p_es, p_es->pid, pes_ptr, pes_len, TS_PACKET_PAYLOAD_START(buf));
+}
+
+/* ===========================================================================
+ * pipelined demux: the caller's thread classifies the packets by PID and
+ * passes the packets of each ES over a ring to the worker owning the ES
+ * ==========================================================================*/
+#define PIPE_RING_SLOTS         4096
+
+typedef struct pipe_slot_t {
+    uint64_t offset;        // stream offset of the packet
+    uint32_t es_idx;        // index of the ES in ts2es_t::es[]
+    uint8_t  packet[TS_PACKET_SIZE];
+} pipe_slot_t;
+
+typedef struct pipe_worker_t {
+    ts2es_ring_t    ring;
+    ts2es_t        *h_ts;
+    ts2es_thread_t  thread;
+    int             b_started;
+} pipe_worker_t;
+
+struct ts2es_pipe_t {
+    int             num_workers;
+    uint32_t        b_stop;
+    pipe_worker_t  *workers;
+};
+
+/* ---------------------------------------------------------------------------
+ */
+static void *pipe_worker_proc(void *arg)
+{
+    pipe_worker_t *p_worker = (pipe_worker_t *)arg;
+    ts2es_t *h_ts = p_worker->h_ts;
+    int n_idle = 0;
+
+    for (;;) {
+        pipe_slot_t *p_slot = (pipe_slot_t *)ts2es_ring_read_slot(&p_worker->ring);
+
+        if (p_slot == NULL) {
+            if (ts2es_atomic_load(&h_ts->pipe->b_stop)) {
+                // all packets were published before the stop flag
+                if ((p_slot = (pipe_slot_t *)ts2es_ring_read_slot(&p_worker->ring)) == NULL) {
+                    break;
+                }
+            } else {
+                if (++n_idle < 64) {
+                    ts2es_thread_yield();
+                } else {
+                    ts2es_sleep_ms(1);
+                }
+                continue;
+            }
+        }
+
+        n_idle = 0;
+        h_ts->es_state[p_slot->es_idx].pkt_offset = p_slot->offset;
+        demux_es_packet(h_ts, &h_ts->es[p_slot->es_idx], p_slot->packet);
+        ts2es_ring_release(&p_worker->ring);
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Pass a packet to the worker owning its ES
+ */
+static void pipe_push(ts2es_t *h_ts, int es_idx, uint64_t offset, const uint8_t *buf)
+{
+    pipe_worker_t *p_worker = &h_ts->pipe->workers[es_idx % h_ts->pipe->num_workers];
+    pipe_slot_t *p_slot;
+
+    while ((p_slot = (pipe_slot_t *)ts2es_ring_write_slot(&p_worker->ring)) == NULL) {
+        ts2es_thread_yield();   // worker is behind
+    }
+    p_slot->offset = offset;
+    p_slot->es_idx = es_idx;
+    memcpy(p_slot->packet, buf, TS_PACKET_SIZE);
+    ts2es_ring_commit(&p_worker->ring);
+}
+
+/* ---------------------------------------------------------------------------
+ * Hand all pushed packets over to the workers
+ */
+static void pipe_publish(ts2es_t *h_ts)
+{
+    int i;
+    for (i = 0; i < h_ts->pipe->num_workers; i++) {
+        ts2es_ring_publish(&h_ts->pipe->workers[i].ring);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Wait until the workers have demuxed all packets passed so far and their
+ * reports are written, e.g. before reading statistics. ES data of unfinished
+ * PES is still pending
+ */
+void ts2es_wait_workers(ts2es_t *h_ts)
+{
+    int i;
+
+    if (h_ts->pipe != NULL) {
+        pipe_publish(h_ts);
+        for (i = 0; i < h_ts->pipe->num_workers; i++) {
+            ts2es_ring_t *p_ring = &h_ts->pipe->workers[i].ring;
+            while (ts2es_atomic_load(&p_ring->tail) != p_ring->head) {
+                ts2es_sleep_ms(1);
+            }
+        }
+    }
+    ts2es_log_flush(h_ts->log);
+}
+
+/* ---------------------------------------------------------------------------
+ * Let the workers finish all pushed packets and stop them
+ */
+static void pipe_destroy(ts2es_t *h_ts)
+{
+    ts2es_pipe_t *p_pipe = h_ts->pipe;
+    int i;
+
+    if (p_pipe == NULL) {
+        return;
+    }
+    pipe_publish(h_ts);
+    ts2es_atomic_store(&p_pipe->b_stop, 1);
+    for (i = 0; i < p_pipe->num_workers; i++) {
+        if (p_pipe->workers[i].b_started) {
+            ts2es_thread_join(p_pipe->workers[i].thread);
+        }
+        ts2es_ring_destroy(&p_pipe->workers[i].ring);
+    }
+    free(p_pipe->workers);
+    free(p_pipe);
+    h_ts->pipe = NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the pipeline, or NULL on failure
+ */
+static ts2es_pipe_t *pipe_create(ts2es_t *h_ts, int num_workers)
+{
+    ts2es_pipe_t *p_pipe = (ts2es_pipe_t *)malloc(sizeof(ts2es_pipe_t));
+    int i;
+
+    if (p_pipe == NULL) {
+        return NULL;
+    }
+    if (num_workers > MAX_NUM_ES) {
+        num_workers = MAX_NUM_ES;   // an ES is never split between workers
+    }
+    p_pipe->num_workers = num_workers;
+    p_pipe->b_stop      = 0;
+    p_pipe->workers     = (pipe_worker_t *)calloc(num_workers, sizeof(pipe_worker_t));
+    if (p_pipe->workers == NULL) {
+        free(p_pipe);
+        return NULL;
+    }
+    h_ts->pipe = p_pipe;
+
+    for (i = 0; i < num_workers; i++) {
+        pipe_worker_t *p_worker = &p_pipe->workers[i];
+        p_worker->h_ts = h_ts;
+        if (!ts2es_ring_init(&p_worker->ring, PIPE_RING_SLOTS, sizeof(pipe_slot_t)) ||
+            !ts2es_thread_create(&p_worker->thread, pipe_worker_proc, p_worker)) {
+            pipe_destroy(h_ts);     // stops the workers started so far
+            return NULL;
+        }
+        p_worker->b_started = 1;
+    }
+    return p_pipe;
+}
+
+/* ===========================================================================
+ * chunked demux: each chunk of a large buffer is demuxed on its own handle,
+ * starting every ES at its first PES header in the chunk. The packets before
+ * are deferred, and the ES output is captured to be passed on at the join
+ * ==========================================================================*/
+#define CHUNK_MIN_PACKETS       2048
+#define CHUNK_MAX_PACKETS       (1 << 18)
+#define CHUNK_PREFIX_SIZE       (1 << 20)
+
+typedef struct chunk_rec_t {
+    uint32_t len;
+    int64_t  pts;
+    int64_t  dts;
+} chunk_rec_t;
+
+typedef struct chunk_es_t {
+    int          b_started;         // first PES header seen
+    uint32_t     start_idx;         // index of its packet in the chunk
+    int          start_cc;
+    int          start_stream_id;
+    uint8_t     *data;              // captured ES data
+    size_t       len;
+    size_t       cap;
+    chunk_rec_t *recs;              // one per call of the output function
+    int          n_recs;
+    int          max_recs;
+} chunk_es_t;
+
+struct ts2es_chunk_t {
+    ts2es_t        *h_ts;           // handle demuxing the chunk
+    uint8_t        *buf;            // first packet of the chunk
+    uint32_t        num_packets;
+    uint64_t        first_packet;   // number of packets before the chunk
+    int             b_invalid;      // chunk has to be demuxed serially
+    const uint16_t *pid_map_ref;    // dispatch table the chunk was started with
+    uint32_t       *deferred;       // packets before the first PES header of their ES
+    int             n_deferred;
+    int             max_deferred;
+    chunk_es_t      es[MAX_NUM_ES];
+    ts2es_thread_t  thread;
+    int             b_thread;
+};
+
+/* ---------------------------------------------------------------------------
+ * Compare the selection of two dispatch tables, ES indices aside
+ * returns 1 if the same PIDs are demuxed the same way, or 0 if not
+ */
+static int pid_map_same(const uint16_t *map1, const uint16_t *map2)
+{
+    int pid;
+    for (pid = 0; pid < TS_NUM_PIDS; pid++) {
+        int type1 = TS2ES_PID_TYPE(map1[pid]);
+        int type2 = TS2ES_PID_TYPE(map2[pid]);
+        if (type1 != type2 && !((type1 == TS2ES_PID_ES || type1 == TS2ES_PID_SELECT) &&
+                                (type2 == TS2ES_PID_ES || type2 == TS2ES_PID_SELECT))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Start an ES at the first packet of the chunk carrying a valid PES header,
+ * the state before it is only known at the join
+ * returns 1 if the packet is demuxed in the chunk, or 0 if it is deferred
+ */
+static int chunk_admit(ts2es_t *h_ts, ts2es_es_t *p_es, uint8_t *buf)
+{
+    ts2es_chunk_t *p_chunk = h_ts->chunk;
+    chunk_es_t *p_ces = &p_chunk->es[p_es - h_ts->es];
+    ts2es_es_state_t *p_st = ts2es_es_state(h_ts, p_es);
+    uint32_t idx = (uint32_t)(h_ts->total_packets - 1 - p_chunk->first_packet);
+    uint8_t *pes_ptr;
+    size_t pes_len;
+
+    if (p_ces->b_started) {
+        return 1;
+    }
+
+    if (!TS_PACKET_SCRAMBLING(buf) && !TS_PACKET_TRANS_ERROR(buf) && TS_PACKET_PAYLOAD_START(buf) &&
+        ts_packet_payload(buf, &pes_ptr, &pes_len) && pes_len >= 9 &&
+        pes_ptr[0] == 0x00 && pes_ptr[1] == 0x00 && pes_ptr[2] == 0x01 &&
+        PES_PACKET_SYNC_CODE(pes_ptr) == 0x2 && !PES_PACKET_SCRAMBLED(pes_ptr)) {
+        p_ces->b_started       = 1;
+        p_ces->start_idx       = idx;
+        p_ces->start_cc        = TS_PACKET_CONT_COUNT(buf);
+        p_ces->start_stream_id = PES_PACKET_STREAM_ID(pes_ptr);
+        // assume the serial state continues without a break, checked at the join
+        p_st->continuity_count = p_ces->start_cc;
+        p_st->synced           = 1;
+        p_es->pes_stream_id    = p_ces->start_stream_id;
+        return 1;
+    }
+
+    if (p_chunk->n_deferred == p_chunk->max_deferred) {
+        int max_deferred = p_chunk->max_deferred ? p_chunk->max_deferred << 1 : 256;
+        uint32_t *deferred = (uint32_t *)realloc(p_chunk->deferred, max_deferred * sizeof(uint32_t));
+        if (deferred == NULL) {
+            p_chunk->b_invalid = 1;
+            return 0;
+        }
+        p_chunk->deferred     = deferred;
+        p_chunk->max_deferred = max_deferred;
+    }
+    p_chunk->deferred[p_chunk->n_deferred++] = idx;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * A chunk whose PSI changes the selection is demuxed serially
+ */
+static void chunk_check_psi(ts2es_t *h_ts)
+{
+    if (!pid_map_same(h_ts->pid_map, h_ts->chunk->pid_map_ref)) {
+        h_ts->chunk->b_invalid = 1;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the number of tables decoded, see ts2es_demux_psi()
+ */
+static int demux_psi(ts2es_t *h_ts, ts2es_psi_t *p_psi, uint8_t *buf, int table_id)
+{
+    // a section begun before the chunk is only seen by the serial demux
+    if (h_ts->chunk != NULL && p_psi->continuity_count < 0 && !TS_PACKET_PAYLOAD_START(buf)) {
+        h_ts->chunk->b_invalid = 1;
+    }
+    return ts2es_demux_psi(h_ts, p_psi, buf, table_id);
+}
+
+/* ---------------------------------------------------------------------------
+ * Count a packet in the statistics of its PID, once per packet of the stream
+ */
+static void stats_packet(ts2es_t *h_ts, uint8_t *buf)
+{
+    ts2es_stats_t *p_stats = h_ts->stats;
+    int pid = TS_PACKET_PID(buf);
+    ts2es_pid_stats_t *p_pid = &p_stats->pids[pid];
+    int cc = TS_PACKET_CONT_COUNT(buf);
+    int last_cc = p_stats->last_cc[pid];
+    int b_payload = TS_PACKET_ADAPTATION(buf) & 0x1;
+    int adapt_len = TS_PACKET_ADAPTATION(buf) & 0x2 ? TS_PACKET_ADAPT_LEN(buf) + 1 : 0;
+
+    p_stats->packets++;
+    p_pid->packets++;
+    if (TS_PACKET_TRANS_ERROR(buf)) {
+        p_pid->te_errors++;
+        return;
+    }
+    if (TS_PACKET_SCRAMBLING(buf)) {
+        p_pid->scrambled++;
+    }
+    if (b_payload && adapt_len < TS_PACKET_SIZE - 4) {
+        p_pid->payload_bytes += TS_PACKET_SIZE - 4 - adapt_len;
+    }
+
+    // the counter goes up with each payload, a packet may be sent twice
+    if (last_cc != 0xFF && pid != TS_NULL_PID && !(adapt_len > 1 && TS_PACKET_DISCONTINUITY(buf)) &&
+        cc != (b_payload ? (last_cc + 1) & 0xF : last_cc) && !(b_payload && cc == last_cc)) {
+        p_pid->cc_errors++;
+    }
+    p_stats->last_cc[pid] = (uint8_t)cc;
+}
+
+/* ---------------------------------------------------------------------------
+ * Classify a packet by its PID, PSI is decoded here
+ * returns the ES of the packet, or NULL if there is no ES data to demux
+ */
+static ts2es_es_t *classify_packet(ts2es_t *h_ts, uint8_t *buf, uint64_t offset)
+{
+    uint8_t *pes_ptr = NULL;
+    size_t pes_len;
+    int cur_pid;
+    int entry;
+    ts2es_es_t *p_es = NULL;
+
+    cur_pid = TS_PACKET_PID(buf);
+    entry   = h_ts->pid_map[cur_pid];
+
+    switch (TS2ES_PID_TYPE(entry)) {
+    case TS2ES_PID_IGNORE:
+        return NULL;
+    case TS2ES_PID_PAT:
+        if (!demux_psi(h_ts, h_ts->psi_pat, buf, TS_TABLE_ID_PAT)) {
+            return NULL;    // no new version
+        }
+        ts2es_report(h_ts, TS2ES_DEBUG, "pid: 0, PAT version %d, %d programs\n", h_ts->psi_pat->version,
+            h_ts->num_programs);
+        pid_map_set_pmt(h_ts);
+        if (h_ts->chunk != NULL) {
+            chunk_check_psi(h_ts);
+        }
+        return NULL;
+    case TS2ES_PID_PMT:
+        if (!demux_psi(h_ts, &h_ts->programs[TS2ES_PID_INDEX(entry)].psi, buf, TS_TABLE_ID_PMT)) {
+            return NULL;
+        }
+        ts2es_report(h_ts, TS2ES_DEBUG, "pid: %d, PMT decoded\n", cur_pid);
+        if (!h_ts->b_output) {
+            ts2es_atomic_store(&h_ts->b_output, 1);     // read by the workers
+        }
+        if (h_ts->param.stream_type_2_catch > 0) {
+            pid_map_select_streams(h_ts);
+        }
+        es_set_stream_types(h_ts);
+        if (h_ts->chunk != NULL) {
+            chunk_check_psi(h_ts);
+        }
+        return NULL;
+    case TS2ES_PID_ES:
+        p_es = &h_ts->es[TS2ES_PID_INDEX(entry)];
+        break;
+    default:    // PID selected or probed, but no ES state yet
+        break;
+    }
+
+    if (p_es == NULL) {
+        // Scrambled?
+        if (TS_PACKET_SCRAMBLING(buf)) {
+            ts2es_report(h_ts, TS2ES_WARNING, "PID %d is scrambled.", cur_pid);
+            return NULL;
+        }
+
+        // Transport error?
+        if (TS_PACKET_TRANS_ERROR(buf)) {
+            ts2es_report(h_ts, TS2ES_WARNING, "transport error at 0x%lx\n", (unsigned long)offset);
+            return NULL;
+        }
+
+        if (!ts_packet_payload(buf, &pes_ptr, &pes_len)) {
+            return NULL;
+        }
+
+        // No chosen PID yet?
+        if (TS2ES_PID_TYPE(entry) == TS2ES_PID_PROBE) {
+            int pid;
+            // Does this one look good ?
+            if (!TS_PACKET_PAYLOAD_START(buf) ||
+                !validate_pes_header(h_ts, cur_pid, pes_ptr, pes_len)) {
+                return NULL;
+            }
+            // Looks good, use this one
+            for (pid = 0; pid < TS_NUM_PIDS; pid++) {
+                if (TS2ES_PID_TYPE(h_ts->pid_map[pid]) == TS2ES_PID_PROBE) {
+                    h_ts->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_IGNORE, 0);
+                }
+            }
+        }
+        p_es = es_attach(h_ts, cur_pid);
+    }
+    return p_es;
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux a packet: after the classification, ES packets are demuxed directly
+ * or passed to the worker owning the ES
+ * returns 1 on success, or 0 if the packet is not synchronised
+ */
+static int demux_packet(ts2es_t *h_ts, uint8_t *buf, size_t buf_len)
+{
+    uint64_t t0 = STATS_T0(h_ts);
+    uint64_t offset;
+    ts2es_es_t *p_es;
+
+    h_ts->total_packets++;
+    offset = h_ts->packet_offset;
+
+    // Check the sync-byte
+    if (TS_PACKET_SYNC_BYTE(buf) != 0x47) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Lost Transport Stream syncronisation - aborting (offset: 0x%lx).\n",
+            (unsigned long)offset);
+        // ts2es_demux_ts_buffer() regains synchronisation
+        return 0;
+    }
+
+    p_es = classify_packet(h_ts, buf, offset);
+    if (h_ts->stats != NULL) {
+        stats_stage(h_ts, &h_ts->stats->stage_ticks[TS2ES_STAGE_CLASSIFY], &t0);
+    }
+    if (p_es == NULL) {
+        return 1;
+    }
+
+    if (h_ts->chunk != NULL && !chunk_admit(h_ts, p_es, buf)) {
+        return 1;   // demuxed at the join of the chunk
+    }
+
+    if (h_ts->pipe != NULL) {
+        pipe_push(h_ts, (int)(p_es - h_ts->es), offset, buf);
+    } else {
+        ts2es_es_state(h_ts, p_es)->pkt_offset = offset;
+        demux_es_packet(h_ts, p_es, buf);
+    }
     return 1;
 }
 
+// packets filtered at a time by demux_run()
+#define DEMUX_RUN_PACKETS   64
+
+/* ---------------------------------------------------------------------------
+ * Demux a run of packets from p, which is in sync. Their headers are
+ * filtered first, so packets of PIDs not demuxed are only counted, their
+ * payload is not read
+ * returns the position after the packets demuxed, where the sync is lost, or
+ * after a packet that may have changed the dispatch table
+ */
+static uint8_t *demux_run(ts2es_t *h_ts, uint8_t *buf, uint8_t *p, uint8_t *buf_end)
+{
+    uint32_t idx[DEMUX_RUN_PACKETS];
+    int stride = h_ts->packet_size;
+    uint64_t first_packet = h_ts->total_packets;
+    size_t n = (size_t)(buf_end - p - TS_PACKET_SIZE) / stride + 1;
+    size_t n_idx, k;
+
+    n     = n < DEMUX_RUN_PACKETS ? n : DEMUX_RUN_PACKETS;
+    n_idx = ts2es_pid_filter(p, n, stride, h_ts->pid_map, idx);
+
+    for (k = 0; k < n_idx; k++) {
+        uint8_t *pkt = p + (size_t)idx[k] * stride;
+        int type = TS2ES_PID_TYPE(h_ts->pid_map[TS_PACKET_PID(pkt)]);
+
+        h_ts->total_packets = first_packet + idx[k];
+        if (TS_PACKET_SYNC_BYTE(pkt) != 0x47) {
+            return pkt;
+        }
+        h_ts->packet_offset = h_ts->stream_offset + (pkt - buf);
+        demux_packet(h_ts, pkt, TS_PACKET_SIZE);
+        if (type != TS2ES_PID_ES) {
+            return pkt + stride;    // PSI, or a PID selected or probed
+        }
+    }
+    h_ts->total_packets = first_packet + n;
+    return p + n * stride;
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux one TS packet
+ * returns 1 on success, or 0 if the packet is not synchronised
+ */
+int ts2es_demux_ts_packet(ts2es_t *h_ts, uint8_t *buf, size_t buf_len)
+{
+    int ret;
+
+    if (h_ts->stats != NULL && TS_PACKET_SYNC_BYTE(buf) == 0x47) {
+        stats_packet(h_ts, buf);
+    }
+    h_ts->packet_offset  = h_ts->stream_offset;
+    h_ts->stream_offset += buf_len;
+    ret = demux_packet(h_ts, buf, buf_len);
+
+    if (h_ts->pipe != NULL) {
+        pipe_publish(h_ts);
+    } else if (h_ts->f_output_iov != NULL) {
+        es_iov_flush(h_ts);
+    }
+    return ret;
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux the TS packet in sync at "buf", packet "packet_index" of the stream
+ * at "offset", for a caller stepping through the packets of a run
+ */
+void ts2es_demux_ts_unit(ts2es_t *h_ts, uint8_t *buf, uint64_t packet_index, uint64_t offset)
+{
+    h_ts->total_packets = packet_index;
+    if (h_ts->stats != NULL) {
+        stats_packet(h_ts, buf);
+        if ((packet_index & STATS_POLL_PACKETS) == 0) {
+            ts2es_stats_poll(h_ts);
+        }
+    }
+    h_ts->packet_offset = offset;
+    demux_packet(h_ts, buf, TS_PACKET_SIZE);
+}
+
+/* ---------------------------------------------------------------------------
+ * End a run of packets passed to ts2es_demux_ts_unit(): "total_packets" were
+ * seen up to its end, "len" bytes of the stream consumed
+ */
+void ts2es_demux_ts_run_end(ts2es_t *h_ts, uint64_t total_packets, size_t len)
+{
+    h_ts->total_packets  = total_packets;
+    h_ts->stream_offset += len;
+}
+
+/* ---------------------------------------------------------------------------
+ * Select the pull output, see ts2es_demux_ts_unit(): instead of the output
+ * function given to ts2es_create(), the PES are queued in h_ts->pulled[]
+ */
+void ts2es_set_output_pull(ts2es_t *h_ts)
+{
+    if (h_ts->pipe != NULL) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Pull output is not available with worker threads.\n");
+        return;
+    }
+    h_ts->b_pull = 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Release the data of the PES taken from h_ts->pulled[], and empty it
+ */
+void ts2es_pull_release(ts2es_t *h_ts)
+{
+    int i;
+    for (i = 0; i < h_ts->n_pulled; i++) {
+        ts2es_mem_free(h_ts->pulled[i].data);
+    }
+    h_ts->n_pulled = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Take the ES data collected for output, from the output function given to
+ * ts2es_create(). The data is valid until the output function returns
+ * returns the data and sets *p_len, or NULL if there is none to output
+ */
+const uint8_t *ts2es_es_take(ts2es_t *h_ts, ts2es_es_t *p_es, size_t *p_len)
+{
+    *p_len = 0;
+    if (!ts2es_atomic_load(&h_ts->b_output) || p_es->cur_len == 0) {
+        return NULL;
+    }
+    *p_len = p_es->cur_len;
+    p_es->cur_len = 0;
+    return p_es->raw_data;
+}
+
+/* ---------------------------------------------------------------------------
+ * Select zero-copy output: instead of the output function given to
+ * ts2es_create(), ES data is delivered as slices of the input buffer. A PES
+ * is delivered in several calls if it spans several input buffers.
+ * Not available with worker threads, which demux copies of the packets
+ */
+void ts2es_set_output_iov(ts2es_t *h_ts, f_ts2es_output_iov p_fun_out, void *opque)
+{
+    if (h_ts->pipe != NULL) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Zero-copy output is not available with worker threads.\n");
+        return;
+    }
+    h_ts->f_output_iov     = p_fun_out;
+    h_ts->opque_output_iov = opque;
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux a run of contiguous TS packets, e.g. a large read() or a mapped file.
+ * The packet size is detected on the first call, and synchronisation is
+ * regained at the next run of sync bytes whenever it is lost.
+ * returns the number of bytes consumed, the rest (less than a few packets)
+ * is left to the caller to be passed again with the following data
+ */
+size_t ts2es_demux_ts_buffer(ts2es_t *h_ts, uint8_t *buf, size_t buf_len)
+{
+    uint8_t *buf_end = buf + buf_len;
+    uint8_t *p = buf;
+
+    // skip the end of the last packet of the previous buffer
+    if (h_ts->skip_bytes >= buf_len) {
+        h_ts->skip_bytes    -= (uint32_t)buf_len;
+        h_ts->stream_offset += buf_len;
+        return buf_len;
+    }
+    p += h_ts->skip_bytes;
+    h_ts->skip_bytes = 0;
+
+    while (p + TS_PACKET_SIZE <= buf_end && !h_ts->Interrupted) {
+        if (h_ts->packet_size == 0 || TS_PACKET_SYNC_BYTE(p) != 0x47) {
+            int b_detect = h_ts->packet_size == 0;
+            int64_t offset = ts2es_sync_find(p, buf_end - p, &h_ts->packet_size);
+            uint64_t lost_at = h_ts->stream_offset + (p - buf);
+
+            if (offset < 0) {
+                const size_t keep = (TS_SYNC_CHECK - 1) * TS_PACKET_SIZE_RS + TS_PACKET_SIZE;
+                if (b_detect && (size_t)(buf_end - p) < keep && TS_PACKET_SYNC_BYTE(p) == 0x47) {
+                    h_ts->packet_size = TS_PACKET_SIZE;     // too short to detect
+                    continue;
+                }
+                // no sync, keep the tail as it may begin a run of sync bytes
+                if ((size_t)(buf_end - p) > keep) {
+                    if (h_ts->stats != NULL) {
+                        h_ts->stats->ts_skipped_bytes += (buf_end - keep) - p;
+                    }
+                    p = buf_end - keep;
+                }
+                break;
+            }
+
+            p += offset;
+            if (h_ts->stats != NULL) {
+                h_ts->stats->ts_skipped_bytes += offset;
+                h_ts->stats->ts_resyncs += !b_detect;
+            }
+            if (b_detect) {
+                ts2es_report(h_ts, TS2ES_INFO, "Detected %d byte TS packets (offset: 0x%llx).\n",
+                    h_ts->packet_size, (unsigned long long)(lost_at + offset));
+            } else {
+                ts2es_report(h_ts, TS2ES_WARNING, "Lost Transport Stream syncronisation at 0x%llx, "
+                    "regained at 0x%llx.\n", (unsigned long long)lost_at, (unsigned long long)(lost_at + offset));
+            }
+            continue;
+        }
+
+        // statistics count every packet, they are not filtered
+        if (h_ts->stats == NULL) {
+            p = demux_run(h_ts, buf, p, buf_end);
+            continue;
+        }
+        stats_packet(h_ts, p);
+        if ((h_ts->total_packets & STATS_POLL_PACKETS) == 0) {
+            ts2es_stats_poll(h_ts);
+        }
+        h_ts->packet_offset = h_ts->stream_offset + (p - buf);
+        demux_packet(h_ts, p, TS_PACKET_SIZE);
+        p += h_ts->packet_size;
+    }
+
+    if (h_ts->pipe != NULL) {
+        pipe_publish(h_ts);
+    } else if (h_ts->f_output_iov != NULL) {
+        es_iov_flush(h_ts);
+    }
+
+    // the stride of the last packet may run past the buffer
+    if (p > buf_end) {
+        h_ts->skip_bytes = (uint32_t)(p - buf_end);
+        p = buf_end;
+    }
+
+    h_ts->stream_offset += p - buf;
+    return (size_t)(p - buf);
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static ts2es_es_t *es_find(ts2es_t *h_ts, uint32_t pid)
+{
+    int i;
+    for (i = 0; i < h_ts->num_es; i++) {
+        if (h_ts->es[i].b_valid && h_ts->es[i].pid == pid) {
+            return &h_ts->es[i];
+        }
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Output function of the chunk handles: capture the ES data
+ */
+static void chunk_output_es(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque)
+{
+    ts2es_chunk_t *p_chunk = (ts2es_chunk_t *)opque;
+    chunk_es_t *p_ces = &p_chunk->es[p_es - h_ts->es];
+    chunk_rec_t *p_rec;
+
+    if (p_ces->len + p_es->cur_len > p_ces->cap) {
+        size_t cap = p_ces->cap ? p_ces->cap : ES_MIN_SIZE;
+        uint8_t *data;
+        while (cap < p_ces->len + p_es->cur_len) {
+            cap <<= 1;
+        }
+        if ((data = (uint8_t *)realloc(p_ces->data, cap)) == NULL) {
+            p_chunk->b_invalid = 1;
+            p_es->cur_len = 0;
+            return;
+        }
+        p_ces->data = data;
+        p_ces->cap  = cap;
+    }
+    if (p_ces->n_recs == p_ces->max_recs) {
+        int max_recs = p_ces->max_recs ? p_ces->max_recs << 1 : 64;
+        chunk_rec_t *recs = (chunk_rec_t *)realloc(p_ces->recs, max_recs * sizeof(chunk_rec_t));
+        if (recs == NULL) {
+            p_chunk->b_invalid = 1;
+            p_es->cur_len = 0;
+            return;
+        }
+        p_ces->recs     = recs;
+        p_ces->max_recs = max_recs;
+    }
+
+    memcpy(p_ces->data + p_ces->len, p_es->raw_data, p_es->cur_len);
+    p_ces->len += p_es->cur_len;
+    p_rec = &p_ces->recs[p_ces->n_recs++];
+    p_rec->len = p_es->cur_len;
+    p_rec->pts = p_es->pts;
+    p_rec->dts = p_es->dts;
+    p_es->cur_len = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Set up a handle for one chunk, with the PSI state of h_ts
+ * returns the chunk, or NULL if out of memory
+ */
+static ts2es_chunk_t *chunk_create(ts2es_t *h_ts, uint8_t *buf, uint32_t num_packets, uint64_t first_packet,
+                                   const uint16_t *pid_map_ref)
+{
+    ts2es_chunk_t *p_chunk = (ts2es_chunk_t *)calloc(1, sizeof(ts2es_chunk_t));
+    ts2es_t *h_chunk = ts2es_handle_alloc();
+    int i;
+
+    if (p_chunk == NULL || h_chunk == NULL) {
+        free(p_chunk);
+        ts2es_handle_free(h_chunk);
+        return NULL;
+    }
+
+    memcpy(&h_chunk->param, &h_ts->param, sizeof(ts2es_param_t));
+    h_chunk->param.i_threads = 0;
+    h_chunk->packet_size     = h_ts->packet_size;
+    h_chunk->never_synced    = h_ts->never_synced;
+    h_chunk->total_packets   = first_packet;
+    h_chunk->b_output        = h_ts->b_output;
+    h_chunk->range_end       = h_ts->range_end;
+    h_chunk->f_output        = chunk_output_es;
+    h_chunk->opque_output    = p_chunk;
+    h_chunk->chunk           = p_chunk;
+    h_chunk->log             = h_ts->log;
+    if (h_ts->stats != NULL) {
+        if ((h_chunk->stats = (ts2es_stats_t *)calloc(1, sizeof(ts2es_stats_t))) == NULL) {
+            free(p_chunk);
+            ts2es_handle_free(h_chunk);
+            return NULL;
+        }
+        memset(h_chunk->stats->last_cc, 0xFF, sizeof(h_chunk->stats->last_cc));
+    }
+    h_chunk->pat             = h_ts->pat;
+    h_chunk->num_programs    = h_ts->num_programs;
+    memcpy(h_chunk->pid_map, h_ts->pid_map, sizeof(h_ts->pid_map));
+    ts2es_psi_reset(h_chunk->psi_pat);
+    h_chunk->psi_pat->version = h_ts->psi_pat->version;
+    h_chunk->psi_pat->crc     = h_ts->psi_pat->crc;
+    for (i = 0; i < h_ts->num_programs; i++) {
+        ts2es_program_t *p_prog = &h_chunk->programs[i];
+        memcpy(p_prog, &h_ts->programs[i], offsetof(ts2es_program_t, psi));
+        ts2es_psi_reset(&p_prog->psi);
+        p_prog->psi.version = h_ts->programs[i].psi.version;
+        p_prog->psi.crc     = h_ts->programs[i].psi.crc;
+    }
+
+    // same ES indices as h_ts, the states are set up by chunk_admit()
+    h_chunk->num_es = h_ts->num_es;
+    for (i = 0; i < MAX_NUM_ES; i++) {
+        h_chunk->es[i].b_valid          = h_ts->es[i].b_valid;
+        h_chunk->es[i].pid              = h_ts->es[i].pid;
+        h_chunk->es[i].stream_type      = h_ts->es[i].stream_type;
+        h_chunk->es[i].pes_stream_id    = -1;
+        h_chunk->es[i].b_range_end      = h_ts->es[i].b_range_end;
+        h_chunk->es_state[i].continuity_count = -1;
+    }
+
+    p_chunk->h_ts         = h_chunk;
+    p_chunk->buf          = buf;
+    p_chunk->num_packets  = num_packets;
+    p_chunk->first_packet = first_packet;
+    p_chunk->pid_map_ref  = pid_map_ref;
+    return p_chunk;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void chunk_destroy(ts2es_chunk_t *p_chunk)
+{
+    int i;
+    for (i = 0; i < MAX_NUM_ES; i++) {
+        ts2es_index_close(p_chunk->h_ts, &p_chunk->h_ts->es[i]);
+        ts2es_mem_free(p_chunk->h_ts->es[i].raw_data);
+        free(p_chunk->h_ts->es[i].iov);
+        free(p_chunk->h_ts->es[i].held);
+        free(p_chunk->es[i].data);
+        free(p_chunk->es[i].recs);
+    }
+    free(p_chunk->deferred);
+    free(p_chunk->h_ts->stats);
+    ts2es_handle_free(p_chunk->h_ts);
+    free(p_chunk);
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void *chunk_proc(void *arg)
+{
+    ts2es_chunk_t *p_chunk = (ts2es_chunk_t *)arg;
+    ts2es_t *h_chunk = p_chunk->h_ts;
+    uint32_t i;
+
+    for (i = 0; i < p_chunk->num_packets && !p_chunk->b_invalid; i++) {
+        uint8_t *p = p_chunk->buf + (size_t)i * h_chunk->packet_size;
+        if (TS_PACKET_SYNC_BYTE(p) != 0x47) {
+            p_chunk->b_invalid = 1;     // resynchronised serially
+            break;
+        }
+        if (h_chunk->stats != NULL) {
+            stats_packet(h_chunk, p);
+        }
+        h_chunk->packet_offset = h_chunk->stream_offset + (uint64_t)i * h_chunk->packet_size;
+        demux_packet(h_chunk, p, TS_PACKET_SIZE);
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Add the packet counters and times of a joined chunk
+ */
+static void stats_merge(ts2es_t *h_ts, ts2es_t *h_chunk)
+{
+    ts2es_stats_t *p_dst = h_ts->stats;
+    ts2es_stats_t *p_src = h_chunk->stats;
+    int pid, k;
+
+    p_dst->packets += p_src->packets;
+    for (k = 0; k < TS2ES_NUM_STAGES; k++) {
+        p_dst->stage_ticks[k] += p_src->stage_ticks[k];
+    }
+    for (pid = 0; pid < TS_NUM_PIDS; pid++) {
+        ts2es_pid_stats_t *p_pid = &p_src->pids[pid];
+        if (p_pid->packets) {
+            p_dst->pids[pid].packets       += p_pid->packets;
+            p_dst->pids[pid].payload_bytes += p_pid->payload_bytes;
+            p_dst->pids[pid].cc_errors     += p_pid->cc_errors;
+            p_dst->pids[pid].te_errors     += p_pid->te_errors;
+            p_dst->pids[pid].scrambled     += p_pid->scrambled;
+            p_dst->last_cc[pid] = p_src->last_cc[pid];
+        }
+    }
+    for (k = 0; k < h_chunk->num_es; k++) {
+        ts2es_es_t *p_es = es_find(h_ts, h_chunk->es[k].pid);
+        int i;
+        for (i = 0; p_es != NULL && i < TS2ES_NUM_STAGES; i++) {
+            p_es->stage_ticks[i] += h_chunk->es[k].stage_ticks[i];
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Join a chunk which starts where h_ts stopped: demux the deferred packets,
+ * then for each ES started in the chunk, either the serial state matches the
+ * assumed one and the captured output is passed on, or the rest of the ES is
+ * demuxed again serially
+ */
+static void chunk_merge(ts2es_t *h_ts, ts2es_chunk_t *p_chunk)
+{
+    ts2es_t *h_chunk = p_chunk->h_ts;
+    int packet_size = h_ts->packet_size;
+    uint32_t i;
+    int k;
+
+    for (i = 0; i < (uint32_t)p_chunk->n_deferred; i++) {
+        h_ts->total_packets = p_chunk->first_packet + p_chunk->deferred[i];
+        h_ts->packet_offset = h_ts->stream_offset + (uint64_t)p_chunk->deferred[i] * packet_size;
+        demux_packet(h_ts, p_chunk->buf + (size_t)p_chunk->deferred[i] * packet_size, TS_PACKET_SIZE);
+    }
+
+    for (k = 0; k < h_chunk->num_es; k++) {
+        chunk_es_t *p_ces = &p_chunk->es[k];
+        ts2es_es_t *p_src = &h_chunk->es[k];
+        ts2es_es_state_t *p_src_st = &h_chunk->es_state[k];
+        ts2es_es_state_t *p_st;
+        ts2es_es_t *p_es;
+
+        if (!p_ces->b_started) {
+            continue;
+        }
+
+        p_es = es_find(h_ts, p_src->pid);
+        p_st = p_es != NULL ? ts2es_es_state(h_ts, p_es) : NULL;
+        if (p_st != NULL && p_st->synced && p_st->continuity_count == p_ces->start_cc &&
+            (p_es->pes_stream_id == -1 || p_es->pes_stream_id == p_ces->start_stream_id)) {
+            uint8_t *raw_data = p_es->raw_data;
+            uint8_t *held;
+            size_t offset = 0;
+            int r;
+
+            // the PES carried over ends at the first PES header of the chunk
+            es_hold_end(h_ts, p_es);
+            if (p_es->cur_len) {
+                output_es(h_ts, p_es);
+            }
+            for (r = 0; r < p_ces->n_recs; r++) {
+                p_es->raw_data = p_ces->data + offset;
+                p_es->cur_len  = p_ces->recs[r].len;
+                p_es->pts      = p_ces->recs[r].pts;
+                p_es->dts      = p_ces->recs[r].dts;
+                h_ts->f_output(h_ts, p_es, h_ts->opque_output);
+                offset += p_ces->recs[r].len;
+            }
+
+            // continue from the state at the end of the chunk
+            ts2es_mem_free(raw_data);
+            p_es->raw_data         = p_src->raw_data;
+            p_es->buf_size         = p_src->buf_size;
+            p_es->cur_len          = p_src->cur_len;
+            p_es->pts              = p_src->pts;
+            p_es->dts              = p_src->dts;
+            p_st->synced           = p_src_st->synced;
+            p_st->continuity_count = p_src_st->continuity_count;
+            p_st->pes_remaining    = p_src_st->pes_remaining;
+            p_es->pes_stream_id    = p_src->pes_stream_id;
+            p_es->peak_len         = 0;
+            p_es->num_outputs      = 0;
+            p_es->pes_count       += p_src->pes_count;
+            p_es->resyncs         += p_src->resyncs;
+            p_es->skipped_bytes   += p_src->skipped_bytes;
+            p_es->skipped_pes     += p_src->skipped_pes;
+            p_st->b_skip_pes       = p_src_st->b_skip_pes;
+            p_es->b_range_end     |= p_src->b_range_end;
+            p_st->b_held           = p_src_st->b_held;
+            p_es->held_len         = p_src->held_len;
+            p_es->pes_offset       = p_src->pes_offset;
+            held                   = p_es->held;    // the held data moves with its buffer
+            p_es->held             = p_src->held;
+            p_src->held            = held;
+            ts2es_index_merge(h_ts, p_es, p_src);
+            p_es->es_bytes        += p_src->es_bytes;
+            p_src->raw_data = NULL;
+            p_src->buf_size = 0;
+        } else {
+            for (i = p_ces->start_idx; i < p_chunk->num_packets; i++) {
+                uint8_t *p = p_chunk->buf + (size_t)i * packet_size;
+                if ((uint32_t)TS_PACKET_PID(p) == p_src->pid) {
+                    h_ts->total_packets = p_chunk->first_packet + i;
+                    h_ts->packet_offset = h_ts->stream_offset + (uint64_t)i * packet_size;
+                    demux_packet(h_ts, p, TS_PACKET_SIZE);
+                }
+            }
+        }
+    }
+
+    if (h_ts->stats != NULL) {
+        stats_merge(h_ts, h_chunk);
+    }
+    if (!h_chunk->never_synced) {
+        h_ts->never_synced = 0;
+    }
+    h_ts->total_packets  = p_chunk->first_packet + p_chunk->num_packets;
+    h_ts->stream_offset += (uint64_t)p_chunk->num_packets * packet_size;
+}
+
+/* ---------------------------------------------------------------------------
+ * Chunks may be demuxed once the packet size is known, the PMT has been seen
+ * and no PID is being probed any more
+ */
+static int chunk_ready(ts2es_t *h_ts)
+{
+    return h_ts->packet_size != 0 && h_ts->skip_bytes == 0 && h_ts->b_output && !h_ts->b_pull &&
+           (h_ts->param.pid_max != -1 || h_ts->num_es > 0) &&
+           h_ts->f_output_iov == NULL && h_ts->pipe == NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux a large buffer, e.g. a mapped file, in packet-aligned chunks on
+ * several threads. A PES running over the end of a chunk is carried over to
+ * the next one, and the continuity of each ES is checked across chunks, so
+ * each ES is output exactly as by ts2es_demux_ts_buffer() (only the order of
+ * the output calls of different ES differs). Chunks are demuxed in waves of
+ * "num_threads" chunks, to bound the memory holding the output
+ * returns the number of bytes consumed, see ts2es_demux_ts_buffer()
+ */
+size_t ts2es_demux_ts_chunks(ts2es_t *h_ts, uint8_t *buf, size_t buf_len, int num_threads)
+{
+    ts2es_chunk_t *chunks[MAX_NUM_ES];
+    uint16_t *pid_map_ref = NULL;
+    size_t pos = 0;
+
+    if (num_threads > MAX_NUM_ES) {
+        num_threads = MAX_NUM_ES;
+    }
+
+    // serially, until the streams are selected
+    while (pos < buf_len && !h_ts->Interrupted && !chunk_ready(h_ts)) {
+        size_t len = buf_len - pos < CHUNK_PREFIX_SIZE ? buf_len - pos : CHUNK_PREFIX_SIZE;
+        size_t consumed = ts2es_demux_ts_buffer(h_ts, buf + pos, len);
+        if (consumed == 0) {
+            break;
+        }
+        pos += consumed;
+    }
+
+    if (num_threads > 1 && chunk_ready(h_ts)) {
+        pid_map_ref = (uint16_t *)malloc(sizeof(h_ts->pid_map));
+    }
+
+    while (pid_map_ref != NULL && !h_ts->Interrupted && chunk_ready(h_ts)) {
+        size_t left = (buf_len - pos) / h_ts->packet_size;
+        size_t num_packets = left / num_threads;
+        size_t wave_pos = pos;
+        int b_stale = 0;
+        int n, k;
+
+        if (left < 2 * CHUNK_MIN_PACKETS) {
+            break;
+        }
+        num_packets = num_packets < CHUNK_MIN_PACKETS ? CHUNK_MIN_PACKETS : num_packets;
+        num_packets = num_packets > CHUNK_MAX_PACKETS ? CHUNK_MAX_PACKETS : num_packets;
+        n = (int)(left / num_packets < (size_t)num_threads ? left / num_packets : (size_t)num_threads);
+
+        memcpy(pid_map_ref, h_ts->pid_map, sizeof(h_ts->pid_map));
+        for (k = 0; k < n; k++) {
+            chunks[k] = chunk_create(h_ts, buf + wave_pos + k * num_packets * h_ts->packet_size, (uint32_t)num_packets,
+                                     h_ts->total_packets + k * num_packets, pid_map_ref);
+            if (chunks[k] != NULL) {
+                chunks[k]->h_ts->stream_offset = h_ts->stream_offset + (uint64_t)k * num_packets * h_ts->packet_size;
+                chunks[k]->b_thread = ts2es_thread_create(&chunks[k]->thread, chunk_proc, chunks[k]);
+            }
+        }
+
+        for (k = 0; k < n; k++) {
+            ts2es_chunk_t *p_chunk = chunks[k];
+            uint8_t *chunk_end = buf + wave_pos + (k + 1) * num_packets * h_ts->packet_size;
+
+            if (p_chunk != NULL) {
+                if (p_chunk->b_thread) {
+                    ts2es_thread_join(p_chunk->thread);
+                } else {
+                    chunk_proc(p_chunk);
+                }
+            }
+
+            if (p_chunk != NULL && !p_chunk->b_invalid && !b_stale &&
+                p_chunk->buf == buf + pos && h_ts->skip_bytes == 0) {
+                chunk_merge(h_ts, p_chunk);
+                pos = chunk_end - buf;
+                ts2es_stats_poll(h_ts);
+            } else {
+                pos += ts2es_demux_ts_buffer(h_ts, buf + pos, chunk_end - (buf + pos));
+            }
+            // later chunks of the wave assume the selection did not change
+            b_stale = b_stale || !pid_map_same(h_ts->pid_map, pid_map_ref);
+
+            if (p_chunk != NULL) {
+                chunk_destroy(p_chunk);
+            }
+        }
+    }
+    free(pid_map_ref);
+
+    // the rest, or all of it with a single thread
+    if (pos < buf_len) {
+        pos += ts2es_demux_ts_buffer(h_ts, buf + pos, buf_len - pos);
+    }
+    return pos;
+}
+
 /* ---------------------------------------------------------------------------
  */
 ts2es_t *ts2es_create(ts2es_param_t *p_param, f_ts2es_output_es p_fun_out, void *opque)
 {
-#  define CACHE_LINE_SIZE   32     /* align size */
-#  define ALIGN_POINTER(p)  (p) = (uint8_t *)((intptr_t)((p) + (CACHE_LINE_SIZE - 1)) & (~(intptr_t)(CACHE_LINE_SIZE - 1)))
-    uint8_t *mem_base;
-    uint32_t mem_size;
     ts2es_t *h_ts;
     int i;
 
-    if ((p_param->pid_min <= 0 || p_param->pid_max < p_param->pid_min) && p_param->stream_type_2_catch <= 0) {
+    if (p_param->pid_max > 0 && (p_param->pid_min <= 0 || p_param->pid_max < p_param->pid_min ||
+                                 p_param->pid_max >= 0x1FFF)) {
         ts2es_report(NULL, TS2ES_WARNING, "Invalid Transport Stream PID: [%d, %d]\n", p_param->pid_min, p_param->pid_max);
         exit(-1);
     }
 
-    mem_size = sizeof(ts2es_t) + CACHE_LINE_SIZE
-        + MAX_NUM_ES * (ES_MAX_SIZE + CACHE_LINE_SIZE);
+    if (p_param->i_packet_size != 0 && p_param->i_packet_size != TS_PACKET_SIZE &&
+        p_param->i_packet_size != TS_PACKET_SIZE_M2TS && p_param->i_packet_size != TS_PACKET_SIZE_RS) {
+        ts2es_report(NULL, TS2ES_WARNING, "Invalid Transport Stream packet size: %d\n", p_param->i_packet_size);
+        exit(-1);
+    }
 
-    mem_base = (uint8_t *)malloc(mem_size);
-    h_ts = (ts2es_t *)mem_base;
+    h_ts = ts2es_handle_alloc();
 
     if (h_ts == NULL) {
         perror("Failed to allocate memory for ts2es_t");
         exit(-3);
     }
 
-    // Zero the memory
-    memset(h_ts, 0, sizeof(ts2es_t));
     memcpy(&h_ts->param, p_param, sizeof(ts2es_param_t));
+    h_ts->packet_size = h_ts->param.i_packet_size;
+    h_ts->range_end   = -1;
 
-    mem_base += sizeof(ts2es_t);
-    ALIGN_POINTER(mem_base);
+    if (h_ts->param.b_log_async && (h_ts->log = ts2es_log_open()) == NULL) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Failed to start the log thread, reporting synchronously\n");
+    }
+    if (h_ts->param.b_stats && (h_ts->stats = ts2es_stats_create(h_ts)) == NULL) {
+        perror("Failed to allocate memory for ts2es_stats_t");
+        exit(-3);
+    }
 
-    /* init ES data */
+    /* init ES data, buffers are allocated when the first data arrives */
     for (i = 0; i < MAX_NUM_ES; i++) {
         ts2es_es_t *p_es = &h_ts->es[i];
+        ts2es_es_state_t *p_st = &h_ts->es_state[i];
         p_es->pes_stream_id    = -1;
-        p_es->pes_remaining    = 0;
-        p_es->continuity_count = -1;
-        p_es->synced           = 0;
-        p_es->raw_data         = mem_base;
-        mem_base              += ES_MAX_SIZE;
-        ALIGN_POINTER(mem_base);
+        p_st->pes_remaining    = 0;
+        p_st->continuity_count = -1;
+        p_st->synced           = 0;
+        p_es->raw_data         = NULL;
+        p_es->buf_size         = 0;
+    }
+
+    /* init PID dispatch table, ES are selected by stream_type when the PMT
+     * arrives, by the PID range, or else the first valid PES is taken */
+    h_ts->pid_map[0] = TS2ES_PID_ENTRY(TS2ES_PID_PAT, 0);
+    ts2es_psi_reset(h_ts->psi_pat);
+    if (h_ts->param.stream_type_2_catch <= 0) {
+        if (h_ts->param.pid_max > 0) {
+            for (i = h_ts->param.pid_min; i <= h_ts->param.pid_max; i++) {
+                h_ts->pid_map[i] = TS2ES_PID_ENTRY(TS2ES_PID_SELECT, 0);
+            }
+        } else if (h_ts->param.pid_max == -1) {
+            for (i = 1; i < 0x1FFF; i++) {
+                h_ts->pid_map[i] = TS2ES_PID_ENTRY(TS2ES_PID_PROBE, 0);
+            }
+        }
     }
 
     // Initialize defaults
@@ -458,14 +1946,71 @@ ts2es_t *ts2es_create(ts2es_param_t *p_param, f_ts2es_output_es p_fun_out, void
     h_ts->f_output      = p_fun_out;
     h_ts->opque_output  = opque;
 
+    if (h_ts->param.b_async_io) {
+        if ((h_ts->aio = ts2es_aio_create(h_ts->param.b_async_io == 2)) == NULL) {
+            perror("Failed to allocate memory for ts2es_aio_t");
+            exit(-3);
+        }
+        ts2es_report(h_ts, TS2ES_INFO, "Asynchronous I/O on %s\n", ts2es_aio_backend(h_ts->aio));
+    }
+
+    if (p_fun_out == NULL) {
+        h_ts->sink      = ts2es_sink_create();
+        h_ts->f_output  = ts2es_sink_output_es;
+    }
+
+    if (h_ts->param.i_threads > 0 && pipe_create(h_ts, h_ts->param.i_threads) == NULL) {
+        ts2es_report(NULL, TS2ES_ERROR, "Failed to start %d worker threads\n", h_ts->param.i_threads);
+        ts2es_destroy(h_ts);
+        return NULL;
+    }
+
     return h_ts;
 }
 
+/* ---------------------------------------------------------------------------
+ * Output the data of the last PES of each ES, at the end of the input. The
+ * workers are stopped first. Done by ts2es_destroy(), to be called before it
+ * with the pull output, so that the last PES can be taken
+ */
+void ts2es_flush(ts2es_t *h_ts)
+{
+    int i;
+
+    pipe_destroy(h_ts);
+
+    for (i = 0; i < h_ts->num_es; i++) {
+        es_hold_end(h_ts, &h_ts->es[i]);
+        // zero-copy slices are delivered after each buffer, but those of a held PES
+        if (h_ts->es[i].cur_len && (h_ts->f_output_iov == NULL || h_ts->es[i].n_iov)) {
+            output_es(h_ts, &h_ts->es[i]);
+        }
+        ts2es_au_flush(h_ts, &h_ts->es[i]);
+    }
+}
+
 /* ---------------------------------------------------------------------------
  */
 void ts2es_destroy(ts2es_t *h_ts)
 {
+    int i;
+
     if (h_ts) {
-        free(h_ts);
+        ts2es_flush(h_ts);
+        for (i = 0; i < h_ts->num_es; i++) {
+            ts2es_index_close(h_ts, &h_ts->es[i]);
+        }
+        ts2es_pull_release(h_ts);
+        free(h_ts->pulled);
+        ts2es_stats_destroy(h_ts);
+        ts2es_sink_destroy(h_ts, h_ts->sink);
+        ts2es_aio_destroy(h_ts->aio);
+        for (i = 0; i < MAX_NUM_ES; i++) {
+            ts2es_mem_free(h_ts->es[i].raw_data);
+            free(h_ts->es[i].iov);
+            free(h_ts->es[i].held);
+        }
+        ts2es_log_close(h_ts->log);
+        ts2es_handle_free(h_ts);
     }
 }
\ No newline at end of file
@@ -40,9 +40,25 @@ extern "C" {
  * ==========================================================================*/
 // The size of MPEG2 TS packets
 #define TS_PACKET_SIZE          188
-// maximum size of an ES streams
-#define ES_MAX_SIZE             (4 << 20)
+#define TS_PACKET_SIZE_M2TS     192     /* 4 byte timestamp + TS packet */
+#define TS_PACKET_SIZE_RS       204     /* TS packet + 16 byte Reed-Solomon code */
+// number of sync bytes in a row to regain synchronisation
+#define TS_SYNC_CHECK           5
+// initial and maximum size of the buffer of an ES, buffers grow geometrically
+#define ES_MIN_SIZE             (64 << 10)
+#define ES_MAX_SIZE             (64 << 20)
+#define ES_HOLD_SIZE            (64 << 10)      // video PES data held until its first picture is found
 #define MAX_NUM_ES              32
+// cache line size the layout of ts2es_t is made for
+#define TS2ES_CACHE_LINE        64
+// programs of the PAT that are followed
+#define MAX_NUM_PROGRAMS        32
+// number of PIDs, 13 bit
+#define TS_NUM_PIDS             8192
+// largest PAT or PMT section, section_length is at most 1021
+#define TS_PSI_MAX_SIZE         1024
+#define TS_TABLE_ID_PAT         0x00
+#define TS_TABLE_ID_PMT         0x02
 
 /* Macros for accessing MPEG-2 TS packet headers */
 #define TS_PACKET_SYNC_BYTE(b)      (b[0])
@@ -55,6 +71,11 @@ extern "C" {
 #define TS_PACKET_ADAPTATION(b)     ((b[3]&0x30)>>4)
 #define TS_PACKET_CONT_COUNT(b)     ((b[3]&0x0F)>>0)
 #define TS_PACKET_ADAPT_LEN(b)      (b[4])
+#define TS_PACKET_DISCONTINUITY(b)  ((b[5]&0x80)>>7)    /* if TS_PACKET_ADAPT_LEN(b) > 0 */
+#define TS_PACKET_PCR_FLAG(b)       ((b[5]&0x10)>>4)    /* if TS_PACKET_ADAPT_LEN(b) > 0 */
+#define TS_PACKET_PCR_BASE(b)       (((uint64_t)b[6] << 25) | ((uint64_t)b[7] << 17) | \
+                                     ((uint64_t)b[8] << 9) | ((uint64_t)b[9] << 1) | (b[10] >> 7))
+#define TS_NULL_PID                 0x1FFF
 
 /* Macros for accessing MPEG-2 PES packet headers */
 #define PES_PACKET_SYNC_BYTE1(b)    (b[0])
@@ -79,17 +100,21 @@ extern "C" {
 #define PES_PACKET_EXTEN(b)         ((b[7] & 0x1) >> 0)
 #define PES_PACKET_HEAD_LEN(b)      (b[8])
 
-#define PES_PACKET_PTS(b)       ((uint32_t)((b[9] & 0x0E) << 29) | \
-                     (uint32_t)(b[10] << 22) | \
-                     (uint32_t)((b[11] & 0xFE) << 14) | \
-                     (uint32_t)(b[12] << 7) | \
-                     (uint32_t)(b[13] >> 1))
+#define PES_PACKET_PTS(b)       (((uint64_t)(b[9] & 0x0E) << 29) | \
+                     ((uint64_t)b[10] << 22) | \
+                     ((uint64_t)(b[11] & 0xFE) << 14) | \
+                     ((uint64_t)b[12] << 7) | \
+                     ((uint64_t)b[13] >> 1))
 
-#define PES_PACKET_DTS(b)       ((uint32_t)((b[14] & 0x0E) << 29) | \
-                     (uint32_t)(b[15] << 22) | \
-                     (uint32_t)((b[16] & 0xFE) << 14) | \
-                     (uint32_t)(b[17] << 7) | \
-                     (uint32_t)(b[18] >> 1))
+#define PES_PACKET_DTS(b)       (((uint64_t)(b[14] & 0x0E) << 29) | \
+                     ((uint64_t)b[15] << 22) | \
+                     ((uint64_t)(b[16] & 0xFE) << 14) | \
+                     ((uint64_t)b[17] << 7) | \
+                     ((uint64_t)b[18] >> 1))
+
+/* PTS, DTS and the PCR base are 33 bit counters of a 90 kHz clock, which
+ * wrap around every 26.5 hours */
+#define TS_PTS_MASK                 ((((int64_t)1) << 33) - 1)
 
 enum ts2es_report_e {
     TS2ES_DEBUG   = 0,
@@ -99,39 +124,171 @@ enum ts2es_report_e {
     TS2ES_INFO_TYPE_MASK = 0xff,
 };
 
+/* reports below this level are compiled out, e.g. -DTS2ES_LOG_MIN_LEVEL=1
+ * removes all debug reports */
+#ifndef TS2ES_LOG_MIN_LEVEL
+#define TS2ES_LOG_MIN_LEVEL     TS2ES_DEBUG
+#endif
+
+/* PID dispatch table: handler type in the high byte, ES index in the low byte */
+enum ts2es_pid_type_e {
+    TS2ES_PID_IGNORE = 0,   // not demuxed
+    TS2ES_PID_PAT    = 1,   // program association table
+    TS2ES_PID_PMT    = 2,   // program map table, with the index of its program in ts2es_t::programs[]
+    TS2ES_PID_ES     = 3,   // selected ES, with its index in ts2es_t::es[]
+    TS2ES_PID_SELECT = 4,   // selected ES, no data seen yet
+    TS2ES_PID_PROBE  = 5,   // candidate, while no PID is chosen
+};
+
+/* stages timed by the statistics, see ts2es_get_stats() */
+enum ts2es_stage_e {
+    TS2ES_STAGE_CLASSIFY = 0,   // dispatch by PID and PSI decoding
+    TS2ES_STAGE_PES      = 1,   // PES header parsing
+    TS2ES_STAGE_SYNC     = 2,   // ES sync search
+    TS2ES_STAGE_COPY     = 3,   // copy of ES data, or slice collection
+    TS2ES_STAGE_OUTPUT   = 4,   // output function
+    TS2ES_NUM_STAGES     = 5,
+};
+
+// stream_type_2_catch selecting every ES of the programs
+#define TS2ES_STREAM_TYPE_ANY       0x100
+
+#define TS2ES_PID_ENTRY(type, idx)  ((uint16_t)(((type) << 8) | (idx)))
+#define TS2ES_PID_TYPE(entry)       ((entry) >> 8)
+#define TS2ES_PID_INDEX(entry)      ((entry) & 0xFF)
+
+#ifdef _MSC_VER
+#define TS2ES_ALIGNED(n)            __declspec(align(n))
+#else
+#define TS2ES_ALIGNED(n)            __attribute__((aligned(n)))
+#endif
+
 /* ===========================================================================
  * type definitions
  * ==========================================================================*/
 
 typedef struct ts2es_es_t ts2es_es_t;
 typedef struct ts2es_t    ts2es_t;
+typedef struct ts2es_sink_t ts2es_sink_t;
+typedef struct ts2es_pipe_t ts2es_pipe_t;
+typedef struct ts2es_chunk_t ts2es_chunk_t;
+typedef struct ts2es_log_t  ts2es_log_t;
+typedef struct ts2es_stats_t ts2es_stats_t;
+typedef struct ts2es_framer_t ts2es_framer_t;
+typedef struct ts2es_index_t  ts2es_index_t;
+typedef struct ts2es_udp_t    ts2es_udp_t;
+typedef struct ts2es_aio_t    ts2es_aio_t;
+typedef struct ts2es_reader_t ts2es_reader_t;
 
 typedef void(*f_ts2es_output_es)(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque);
 
+/* slice of ES data inside the input buffer, same layout as struct iovec */
+typedef struct ts2es_iov_t {
+    void    *iov_base;
+    size_t   iov_len;
+} ts2es_iov_t;
+
+typedef void(*f_ts2es_output_iov)(ts2es_t *h_ts, int pid, int64_t pts, int64_t dts,
+                                  const ts2es_iov_t *iov, int n_iov, void *opque);
+
+/* PES queued for the caller by the pull output, see ts2es_set_output_pull().
+ * The data is a buffer of the pool, released by ts2es_pull_release() */
+typedef struct ts2es_pes_t {
+    int      pid;
+    int64_t  pts;
+    int64_t  dts;
+    uint8_t *data;
+    size_t   len;
+} ts2es_pes_t;
+
+/* one access unit: a coded picture or an audio frame. pts/dts are -1 if the
+ * PES carried none, b_key is set for pictures coded without reference to
+ * other pictures and for audio frames */
+typedef void(*f_ts2es_output_au)(ts2es_t *h_ts, int pid, int64_t pts, int64_t dts, int b_key,
+                                 const uint8_t *data, size_t len, void *opque);
+
 typedef struct ts2es_param_t {
     char s_input[256];
     char s_output[256];
 
     int  i_log_level;
-    int  stream_type_2_catch;
-    int  pid_min;
-    int  pid_max;
+    int  stream_type_2_catch;   // if > 0, select the ES of this stream_type in the PMTs, TS2ES_STREAM_TYPE_ANY: all
+    int  program_number;        // if > 0, select in the PMT of this program only, else in all programs
+    int  pid_min;               // else select PIDs [pid_min, pid_max], see also ts2es_select_pid()
+    int  pid_max;               // -1: select the first PID carrying a valid PES
+    int  i_packet_size;         // 188, 192 or 204, 0: detect
+    int  i_threads;             // worker threads for ES reassembly and output, 0: none
+    int  b_log_async;           // format and write reports on a background thread
+    int  b_stats;               // count per-PID statistics and time the stages, see ts2es_get_stats()
+    int  i_stats_interval;      // ms between two dumps of the statistics to s_stats, 0: at the end only
+    char s_stats[256];          // file the statistics are appended to as JSON lines, "-": stderr
+    int  b_index;               // write a seek index of each ES to <s_output>_<pid>.idx
+    int  b_async_io;            // asynchronous I/O for the built-in output: 1 io_uring if available, 2 I/O threads
+    int  b_keyframes;           // leave out the video PES and access units not starting with a key picture
 } ts2es_param_t;
 
-typedef struct ts2es_es_t {
+/* state of an ES read and written on every packet of its PID, 16 bytes: the
+ * states of all the ES of a handle fill MAX_NUM_ES / 4 cache lines at the
+ * head of ts2es_t, see ts2es_es_state() */
+typedef struct ts2es_es_state_t {
+    uint64_t pkt_offset;        // stream offset of the packet being demuxed, for reports
+    int32_t  pes_remaining;     // payload bytes of the current PES still to come
+    int8_t   continuity_count;  // expected in the next packet, -1: none yet
+    uint8_t  synced;
+    uint8_t  b_skip_pes;        // the current PES is left out
+    uint8_t  b_held;            // the data of the current PES is held until its first picture
+} ts2es_es_state_t;
+
+/* ES data and counters, a cache line aligned record: the fields used while
+ * collecting data fill its first line */
+typedef struct TS2ES_ALIGNED(TS2ES_CACHE_LINE) ts2es_es_t {
     uint32_t b_valid;   // ݶǷЧ
     uint32_t pid;       // ESPID
     int64_t  pts;       // PESpts
     int64_t  dts;       // PESdts
-    int      synced;
-    int      continuity_count;
-    int      pes_remaining;
+    uint8_t *raw_data;  // bufferָ
+    uint32_t cur_len;   // ǰѾȡbuffer
+    uint32_t buf_size;  // capacity of raw_data, 0 until the first data arrives
+    ts2es_iov_t *iov;   // pending slices, for zero-copy output
+    int      n_iov;
+    int      max_iov;
+    uint64_t es_bytes;      // ES data collected for output so far
     int      pes_stream_id;
     uint32_t total_len; // ܵES
-    uint32_t cur_len;   // ǰѾȡbuffer
-    uint8_t *raw_data;  // bufferָ
+    uint32_t peak_len;  // largest cur_len output since the last shrink check
+    int      num_outputs;
+    int      stream_type;   // in the PMT when the PID was attached, 0: unknown
+    uint64_t pes_count;     // PES headers accepted
+    uint64_t resyncs;       // times the ES sync was regained
+    uint64_t skipped_bytes; // ES bytes dropped while not synced
+    uint64_t skipped_pes;   // PES left out by param.b_keyframes or after a time range
+    int      b_range_end;   // a PES after ts2es_t::range_end was seen, the rest is left out
+    uint8_t *held;          // data of the current PES held until its first picture
+    uint32_t held_len;
+    uint64_t pes_offset;    // stream offset of the packet starting the current PES
+    uint64_t stage_ticks[TS2ES_NUM_STAGES];     // if param.b_stats, ES stages only
+    ts2es_framer_t *framer; // access-unit framing, see ts2es_set_output_au()
+    ts2es_index_t *index;   // seek index, if param.b_index
 } ts2es_es_t;
 
+/* Seek index file: a header of TS2ES_INDEX_HEADER_SIZE bytes (magic, version,
+ * entry size, PID, stream_type, TS packet size as 32 bit words), then one
+ * entry of TS2ES_INDEX_ENTRY_SIZE bytes per PES: TS offset, ES offset, PTS
+ * (64 bit), PTS - DTS, flags (32 bit). All little-endian */
+#define TS2ES_INDEX_MAGIC           "TS2ESIDX"
+#define TS2ES_INDEX_VERSION         1
+#define TS2ES_INDEX_HEADER_SIZE     32
+#define TS2ES_INDEX_ENTRY_SIZE      32
+#define TS2ES_INDEX_KEY             0x1     // the PES starts a key access unit
+
+typedef struct ts2es_index_entry_t {
+    uint64_t ts_offset;     // input offset of the TS packet holding the PES header
+    uint64_t es_offset;     // output offset of the first ES byte of the PES
+    int64_t  pts;           // -1: none
+    int32_t  pts_minus_dts;
+    uint32_t flags;
+} ts2es_index_entry_t;
+
 typedef struct ts2es_pmt_t {
     uint8_t    stream_type;        /* 8 bit, ָʾضPIDĽĿԪذ͡ôPIDelementary PIDָ */
     uint16_t   pid;                /* 13 bit, ָʾTSPIDֵЩTSصĽĿԪ */
@@ -139,29 +296,165 @@ typedef struct ts2es_pmt_t {
     uint32_t   descriptor;
 } ts2es_pmt_t;
 
+/* reassembly of the sections of one PSI PID */
+typedef struct ts2es_psi_t {
+    int      len;               // bytes of the current section collected, 0: none
+    int      continuity_count;  // of the last packet, -1: none yet
+    int      version;           // version_number of the table in use, -1: none
+    uint32_t crc;               // CRC_32 of the table in use
+    uint8_t  buf[TS_PSI_MAX_SIZE];
+} ts2es_psi_t;
+
+/* a program of the PAT, with the streams of its PMT */
+typedef struct ts2es_program_t {
+    int         program_number;
+    int         pmt_pid;
+    int         pcr_pid;            // -1: PMT not decoded yet
+    int         num_streams;
+    ts2es_pmt_t streams[MAX_NUM_ES];
+    ts2es_psi_t psi;                // sections of its PMT, and the version in use
+} ts2es_program_t;
+
+/* counters of one PID */
+typedef struct ts2es_pid_stats_t {
+    uint64_t packets;
+    uint64_t payload_bytes;
+    uint64_t pes_count;
+    uint64_t cc_errors;     // continuity errors, duplicate packets aside
+    uint64_t te_errors;     // packets with transport_error_indicator set
+    uint64_t scrambled;
+    uint64_t resyncs;       // times the ES sync was regained
+    uint64_t skipped_bytes; // ES bytes dropped while not synced
+    uint64_t skipped_pes;   // PES left out by param.b_keyframes
+} ts2es_pid_stats_t;
+
+struct ts2es_stats_t {
+    int64_t  elapsed_us;        // since ts2es_create()
+    double   ticks_per_us;
+    uint64_t packets;
+    uint64_t ts_resyncs;        // times the TS sync was lost and regained
+    uint64_t ts_skipped_bytes;  // bytes skipped to find the TS sync
+    uint64_t output_bytes;      // ES bytes written, filled in by the snapshot
+    uint64_t stage_ticks[TS2ES_NUM_STAGES];
+    ts2es_pid_stats_t pids[TS_NUM_PIDS];
+
+    // state of the counting
+    int64_t  start_us;
+    uint64_t start_ticks;
+    int64_t  dump_us;           // time of the last dump
+    FILE    *fp;                // of param.s_stats
+    uint8_t  last_cc[TS_NUM_PIDS];  // continuity_counter, 0xFF: none yet
+};
+
+/* counters of a live input, see ts2es_udp_open() */
+typedef struct ts2es_udp_stats_t {
+    uint64_t datagrams;     // received into the ring
+    uint64_t bytes;
+    uint64_t dropped;       // dropped by the socket, its buffer being full (Linux only)
+    uint64_t lost;          // missing from the RTP sequence
+    uint64_t overflows;     // received while the ring was full, discarded
+    uint64_t truncated;     // larger than a slot of the ring, discarded
+} ts2es_udp_stats_t;
+
+/* stream found by ts2es_probe_buffer() */
+typedef struct ts2es_probe_es_t {
+    int      program_number;    // of the first program listing the PID
+    int      pid;
+    int      stream_type;
+    int      stream_id;         // of the first PES, -1: no PES seen
+    int64_t  first_pts;         // -1: none seen
+    int      b_synced;          // the sequence header or an audio frame header was found
+    int      width;             // video, from the sequence header, 0: unknown
+    int      height;
+    int      bitrate;           // audio, kbit/s, 0: unknown or variable
+    int      samplerate;        // audio, Hz
+    int      channels;          // audio, LFE included
+} ts2es_probe_es_t;
+
+typedef struct ts2es_probe_program_t {
+    int      program_number;
+    int      pmt_pid;
+    int      pcr_pid;           // -1: PMT not found
+} ts2es_probe_program_t;
+
+#define TS2ES_PROBE_MAX_ES      64
+// bytes read by ts2es_probe_file() at most, unless told otherwise
+#define TS2ES_PROBE_BYTES       (8 << 20)
+
+typedef struct ts2es_probe_t {
+    int      packet_size;       // 0: no TS sync found
+    int      b_complete;        // the PAT, every PMT and a sync point of each ES were found
+    uint64_t bytes_scanned;     // from the start of the input
+    int      num_programs;
+    ts2es_probe_program_t programs[MAX_NUM_PROGRAMS];
+    int      num_es;
+    ts2es_probe_es_t es[TS2ES_PROBE_MAX_ES];
+} ts2es_probe_t;
+
+/* read or write queued with ts2es_aio_submit() */
+typedef struct ts2es_aio_op_t {
+    int      fd;
+    int      b_write;
+    uint8_t *buf;
+    size_t   len;
+    int64_t  offset;        // -1: at the file position
+    uint32_t b_done;
+    int64_t  result;        // bytes transferred, or -errno
+    struct ts2es_aio_op_t *next;    // queue of the I/O threads
+} ts2es_aio_op_t;
+
+// bytes of the previous block ts2es_reader_next() can put in front of the next one
+#define TS2ES_READER_KEEP   4096
+
 typedef struct ts2es_pat_t {
     /* PID: 0x0000 */
     uint16_t   program_id;         /* 16 bit, Ƶ */
     uint16_t   program_map_pid;    /* 13 bit, PID of PMT */
 } ts2es_pat_t;
 
+/* The per-packet state comes first, aligned to a cache line: the ES states,
+ * then the fields of the handle used on every packet. The ES records and the
+ * dispatch table follow, the parameters and the PSI last; the section buffers
+ * of the PAT and the programs are allocated apart, see ts2es_handle_alloc() */
 typedef struct ts2es_t {
-    ts2es_param_t       param;
+    TS2ES_ALIGNED(TS2ES_CACHE_LINE) ts2es_es_state_t es_state[MAX_NUM_ES];
 
-    int                 Interrupted;
-    int                 never_synced;
-    uint32_t            total_bytes;
-    uint32_t            total_packets;
+    int                 packet_size;    // stride of the packets, 0 if not detected yet
     int                 num_es;
+    uint64_t            packet_offset;  // stream offset of the packet being demuxed
+    uint64_t            stream_offset;  // offset of the next buffer in the stream
+    uint32_t            skip_bytes;     // bytes of the last packet beyond the last buffer
+    uint64_t            total_bytes;
+    uint64_t            total_packets;
     int                 b_output;
+    int64_t             range_end;      // PES with a later PTS are left out, -1: none, see ts2es_demux_ts_range()
+    ts2es_pipe_t       *pipe;           // worker threads, if param.i_threads > 0
+    ts2es_chunk_t      *chunk;          // chunk demuxed by this handle, see ts2es_demux_ts_chunks()
+    ts2es_stats_t      *stats;          // if param.b_stats
     f_ts2es_output_es   f_output;
     void               *opque_output;
-
-    ts2es_pat_t         pat;
-    int                 pmt_pid;
-    ts2es_pmt_t         pmt[MAX_NUM_ES];
+    f_ts2es_output_iov  f_output_iov;   // zero-copy output, replaces f_output if set
+    void               *opque_output_iov;
+    ts2es_pes_t        *pulled;         // pull output: PES taken from the ES, see ts2es_set_output_pull()
+    int                 n_pulled;
+    int                 max_pulled;
+    int                 b_pull;
+    f_ts2es_output_au   f_output_au;    // access-unit output, see ts2es_set_output_au()
+    void               *opque_output_au;
+    ts2es_sink_t       *sink;           // built-in output, if no output function is given
+    ts2es_log_t        *log;            // ring of pending reports, if param.b_log_async
+    ts2es_aio_t        *aio;            // if param.b_async_io
+    int                 Interrupted;
+    int                 never_synced;
 
     ts2es_es_t          es[MAX_NUM_ES];
+    uint16_t            pid_map[TS_NUM_PIDS];   // PID dispatch table
+
+    ts2es_param_t       param;
+    ts2es_pat_t         pat;
+    ts2es_psi_t        *psi_pat;        // sections of the PAT, and the version in use
+    int                 num_programs;
+    ts2es_program_t    *programs;       // MAX_NUM_PROGRAMS, PMT PIDs point here in pid_map
 } ts2es_t;
 
 
@@ -169,14 +462,143 @@ typedef struct ts2es_t {
  * interface definitions
  * ==========================================================================*/
 
+/* With param.i_threads > 0, the calling thread only classifies packets by PID;
+ * each ES is reassembled and output on one of the worker threads, so the
+ * output function is called from these threads, one ES at a time. The output
+ * function gets the ES data with ts2es_es_take(). ts2es_create() returns
+ * NULL if the workers cannot be started */
 ts2es_t *ts2es_create(ts2es_param_t *p_param, f_ts2es_output_es p_fun_out, void *opque);
+#define  ts2es_es_state(h_ts, p_es)     (&(h_ts)->es_state[(p_es) - (h_ts)->es])
+const uint8_t *ts2es_es_take(ts2es_t *h_ts, ts2es_es_t *p_es, size_t *p_len);
 int      ts2es_demux_ts_packet(ts2es_t *h_ts, uint8_t *buf, size_t buf_len);
+size_t   ts2es_demux_ts_buffer(ts2es_t *h_ts, uint8_t *buf, size_t buf_len);
+size_t   ts2es_demux_ts_chunks(ts2es_t *h_ts, uint8_t *buf, size_t buf_len, int num_threads);
 void     ts2es_destroy(ts2es_t *h_ts);
-
+void     ts2es_select_pid(ts2es_t *h_ts, int pid);
+void     ts2es_set_output_iov(ts2es_t *h_ts, f_ts2es_output_iov p_fun_out, void *opque);
+void     ts2es_wait_workers(ts2es_t *h_ts);
+void     ts2es_flush(ts2es_t *h_ts);
+
+/* pull output, for callers stepping through the packets themselves, e.g.
+ * ts2es::Demuxer (ts2es.hpp): each PES is queued in h_ts->pulled[] with its
+ * buffer, to be taken after the packet that ended it. The units of a run
+ * are passed one at a time: the TS packet in sync at "buf", its index and
+ * its stream offset. Packets of PIDs not demuxed may be skipped, the run is
+ * accounted for at its end. Not available with worker threads or chunks */
+void     ts2es_set_output_pull(ts2es_t *h_ts);
+void     ts2es_pull_release(ts2es_t *h_ts);
+void     ts2es_demux_ts_unit(ts2es_t *h_ts, uint8_t *buf, uint64_t packet_index, uint64_t offset);
+void     ts2es_demux_ts_run_end(ts2es_t *h_ts, uint64_t total_packets, size_t len);
+
+/* access-unit output (ts_au.c): instead of the output function given to
+ * ts2es_create(), each ES is cut into pictures (AVS/AVS2, AVC, HEVC) or MPEG
+ * audio frames, delivered one per call with their PTS/DTS. Other stream types
+ * are delivered as collected. Works with worker threads and chunks, and
+ * replaces zero-copy output */
+void     ts2es_set_output_au(ts2es_t *h_ts, f_ts2es_output_au p_fun_out, void *opque);
+void     ts2es_au_output_es(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque);
+void     ts2es_au_flush(ts2es_t *h_ts, ts2es_es_t *p_es);
+int      ts2es_au_video(ts2es_es_t *p_es);
+void     ts2es_au_retype(ts2es_t *h_ts, ts2es_es_t *p_es);
+int      ts2es_au_keyframe(ts2es_es_t *p_es, const uint8_t *buf, size_t len);
+
+/* seek index (ts_index.c). An index file may be mapped and searched with
+ * ts2es_index_seek(), which returns the entry to start decoding at */
+void     ts2es_index_add(ts2es_t *h_ts, ts2es_es_t *p_es, const uint8_t *es_ptr, size_t es_len);
+void     ts2es_index_merge(ts2es_t *h_ts, ts2es_es_t *p_dst, ts2es_es_t *p_src);
+void     ts2es_index_close(ts2es_t *h_ts, ts2es_es_t *p_es);
+int      ts2es_index_entry(const uint8_t *idx, size_t idx_len, size_t i, ts2es_index_entry_t *p_ent);
+int64_t  ts2es_index_seek(const uint8_t *idx, size_t idx_len, int64_t pts);
+
+/* time ranges (ts_range.c): the packets of a mapped input between two PTS
+ * are found by bisection on the PCR, or on the PTS of one PID if there is
+ * no PCR, and demuxed after the PAT and PMT from the start of the input */
+int64_t  ts2es_first_clock(ts2es_t *h_ts, const uint8_t *buf, size_t buf_len);
+size_t   ts2es_demux_ts_range(ts2es_t *h_ts, uint8_t *buf, size_t buf_len, int64_t start, int64_t end,
+                              int num_threads);
+
+/* live input (ts_udp.c): datagrams of TS packets, optionally in RTP, are
+ * received into a ring by a thread of their own and demuxed by the caller of
+ * ts2es_udp_demux() */
+ts2es_udp_t *ts2es_udp_open(ts2es_t *h_ts, const char *s_addr, int ring_slots);
+void     ts2es_udp_demux(ts2es_udp_t *p_udp, int idle_ms);
+void     ts2es_udp_get_stats(ts2es_udp_t *p_udp, ts2es_udp_stats_t *p_stats);
+void     ts2es_udp_close(ts2es_udp_t *p_udp);
+
+/* stream discovery (ts_probe.c): the start of an input is scanned until the
+ * PAT, every PMT, and the first PES and a sync point of each ES are seen.
+ * p_param only sets the reports, it may be NULL. Both return 1 if all was
+ * found, 0 if the data ran out first; ts2es_probe_file() -1 if the file
+ * cannot be read */
+int      ts2es_probe_buffer(const ts2es_param_t *p_param, const uint8_t *buf, size_t buf_len,
+                            ts2es_probe_t *p_probe);
+int      ts2es_probe_file(const ts2es_param_t *p_param, const char *s_path, size_t max_bytes,
+                          ts2es_probe_t *p_probe);
+
+/* asynchronous I/O (ts_aio.c), on an io_uring or else on I/O threads */
+ts2es_aio_t *ts2es_aio_create(int b_threads);
+const char *ts2es_aio_backend(ts2es_aio_t *p_aio);
+void     ts2es_aio_submit(ts2es_aio_t *p_aio, ts2es_aio_op_t *p_op);
+int64_t  ts2es_aio_wait(ts2es_aio_t *p_aio, ts2es_aio_op_t *p_op);
+void     ts2es_aio_destroy(ts2es_aio_t *p_aio);
+ts2es_reader_t *ts2es_reader_open(ts2es_aio_t *p_aio, const char *s_path, int num_blocks, size_t block_size);
+uint8_t *ts2es_reader_next(ts2es_reader_t *p_rd, size_t keep, size_t *p_len);
+void     ts2es_reader_close(ts2es_reader_t *p_rd);
+
+/* built-in output (ts_sink.c), used when ts2es_create() gets no output function.
+ * The ES of an output file that cannot be opened or written is dropped,
+ * ts2es_sink_flush() tells how many failed */
+ts2es_sink_t *ts2es_sink_create(void);
+void     ts2es_sink_destroy(ts2es_t *h_ts, ts2es_sink_t *p_sink);
+int      ts2es_sink_flush(ts2es_t *h_ts, ts2es_sink_t *p_sink);
+void     ts2es_sink_output_es(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque);
+void     ts2es_sink_output_iov(ts2es_t *h_ts, int pid, int64_t pts, int64_t dts,
+                               const ts2es_iov_t *iov, int n_iov, void *opque);
+
+/* TS synchronisation (ts_sync.c) */
+int64_t  ts2es_sync_find(const uint8_t *buf, size_t len, int *p_packet_size);
+int      ts2es_cpu_has_avx2(void);
+size_t   ts2es_es_sync_scan(const uint8_t *buf, size_t len);
+size_t   ts2es_pid_filter(const uint8_t *buf, size_t n, int stride, const uint16_t *pid_map, uint32_t *idx);
+
+/* ES buffer pool and handles (ts_mem.c) */
+uint8_t *ts2es_mem_alloc(size_t size, uint32_t *p_capacity);
+void     ts2es_mem_free(uint8_t *p);
+ts2es_t *ts2es_handle_alloc(void);
+void     ts2es_handle_free(ts2es_t *h_ts);
+
+/* PSI tables (ts_table.c) */
+int      ts2es_demux_psi(ts2es_t *h_ts, ts2es_psi_t *p_psi, const uint8_t *buf, int table_id);
+void     ts2es_psi_reset(ts2es_psi_t *p_psi);
+uint32_t ts2es_crc32(const uint8_t *buf, size_t len);
 void     ts2es_decode_pat(ts2es_t *h_ts, uint8_t *buf, int buf_len);
 void     ts2es_decode_pmt(ts2es_t *h_ts, uint8_t *buf, int buf_len);
-
-void     ts2es_report(ts2es_t *h_ts, int i_type, const char *format, ...);
+ts2es_program_t *ts2es_find_program(ts2es_t *h_ts, int program_number);
+
+/* statistics (ts_stats.c). ts2es_get_stats() waits for the workers, the
+ * periodic dumps do not; only the ES counters are kept unless param.b_stats
+ * is set */
+void     ts2es_get_stats(ts2es_t *h_ts, ts2es_stats_t *p_stats);
+int      ts2es_stats_json(ts2es_t *h_ts, FILE *fp);
+ts2es_stats_t *ts2es_stats_create(ts2es_t *h_ts);
+void     ts2es_stats_destroy(ts2es_t *h_ts);
+void     ts2es_stats_poll(ts2es_t *h_ts);
+uint64_t ts2es_ticks(void);
+
+/* reports (ts_log.c). ts2es_report() costs nothing below TS2ES_LOG_MIN_LEVEL,
+ * and only a compare below the level of the handle; h_ts may be NULL */
+#define ts2es_report(h_ts, i_type, ...) \
+    do { \
+        if ((i_type) >= TS2ES_LOG_MIN_LEVEL && \
+            ((ts2es_t *)(h_ts) == NULL || (i_type) >= ((ts2es_t *)(h_ts))->param.i_log_level)) { \
+            ts2es_log(h_ts, i_type, __VA_ARGS__); \
+        } \
+    } while (0)
+
+void     ts2es_log(ts2es_t *h_ts, int i_type, const char *format, ...);
+ts2es_log_t *ts2es_log_open(void);
+void     ts2es_log_flush(ts2es_log_t *p_log);
+void     ts2es_log_close(ts2es_log_t *p_log);
 
 #ifdef __cplusplus
 };
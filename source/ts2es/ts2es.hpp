@@ -0,0 +1,200 @@
+/*
+    ts2es.hpp
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * C++ interface (C++11, header only): ts2es::Demuxer<PacketFormat, Sink>
+ * steps through the packets itself, inline. The packet format fixes the
+ * stride and the offset of the TS packet in each unit at compile time, the
+ * PID dispatch table of the handle is looked up in the loop, and packets of
+ * PIDs not demuxed are only counted. The others are demuxed one at a time by
+ * the C library with ts2es_demux_ts_unit(), in pull output: the PES it ends
+ * are passed to the sink, a direct call, before the next packet. Where the
+ * sync is lost, and with the statistics on, the rest of the buffer goes
+ * through ts2es_demux_ts_buffer(), the loop of the C interface, which regains
+ * the sync. The Demuxer runs on the calling thread, param.i_threads is not
+ * used. Handles are independent, a Demuxer per stream may run on each
+ * thread. See source/examples/demux.cpp.
+ *
+ *     struct Writer {
+ *         void operator()(int pid, int64_t pts, int64_t dts, const uint8_t *data, size_t len);
+ *     };
+ *     ts2es::Demuxer<ts2es::M2TS, Writer> demux(param);
+ *     while ((len = read_more(buf + keep)) > 0) {
+ *         keep = keep + len - demux.demux(buf, keep + len);    // move the rest to the front
+ *     }
+ */
+#ifndef _TS2ES_HPP_
+#define _TS2ES_HPP_
+
+#include "ts2es.h"
+#include <string.h>
+
+namespace ts2es {
+
+/* ===========================================================================
+ * packet formats
+ * ==========================================================================*/
+enum PacketFormat {
+    TS   = TS_PACKET_SIZE,          // 188 byte TS packets
+    M2TS = TS_PACKET_SIZE_M2TS,     // 4 byte timestamp + TS packet
+    RS   = TS_PACKET_SIZE_RS,       // TS packet + 16 byte Reed-Solomon code
+};
+
+/* layout of the packets of a format: "size" byte units, the sync byte of
+ * the TS packet at "ts_offset" in each */
+template <int Format> struct packet_traits;
+
+template <> struct packet_traits<TS> {
+    static const int size      = TS_PACKET_SIZE;
+    static const int ts_offset = 0;
+};
+
+template <> struct packet_traits<M2TS> {
+    static const int size      = TS_PACKET_SIZE_M2TS;
+    static const int ts_offset = 4;     // after the timestamp
+};
+
+template <> struct packet_traits<RS> {
+    static const int size      = TS_PACKET_SIZE_RS;
+    static const int ts_offset = 0;     // the code follows the TS packet
+};
+
+/* ===========================================================================
+ * demuxer
+ * ==========================================================================*/
+template <int Format, class Sink>
+class Demuxer {
+public:
+    typedef packet_traits<Format> traits;
+
+    /* "param" selects the streams and the options as for ts2es_create(), its
+     * packet size is replaced by the format */
+    explicit Demuxer(const ts2es_param_t &param = default_param(), const Sink &sink = Sink())
+        : sink_(sink)
+    {
+        ts2es_param_t p = param;
+        p.i_packet_size = traits::size;
+        p.i_threads     = 0;
+        h_ts_ = ts2es_create(&p, NULL, NULL);
+        ts2es_set_output_pull(h_ts_);
+    }
+
+    ~Demuxer()
+    {
+        ts2es_flush(h_ts_);     // the last PES are sent to the sink
+        take();
+        ts2es_destroy(h_ts_);
+    }
+
+    Demuxer(const Demuxer &) = delete;
+    Demuxer &operator=(const Demuxer &) = delete;
+
+    /* all streams of all programs, warnings and errors reported */
+    static ts2es_param_t default_param()
+    {
+        ts2es_param_t param;
+        memset(&param, 0, sizeof(param));
+        param.i_log_level         = TS2ES_WARNING;
+        param.stream_type_2_catch = TS2ES_STREAM_TYPE_ANY;
+        return param;
+    }
+
+    /* Demux a run of packets, as ts2es_demux_ts_buffer()
+     * returns the number of bytes consumed, the rest is to be passed again
+     * with the following data */
+    size_t demux(uint8_t *buf, size_t len)
+    {
+        ts2es_t *h_ts = h_ts_;
+        uint8_t *end  = buf + len;
+        uint8_t *p    = buf;
+        uint64_t first = h_ts->total_packets;
+        uint64_t n = 0;
+
+        if (h_ts->stats != NULL || h_ts->skip_bytes != 0) {
+            return resync(buf, buf, end);
+        }
+
+        // the first unit of the stream, whose TS packet follows a prefix
+        if (h_ts->stream_offset == 0 && len > (size_t)traits::ts_offset && p[0] != 0x47 && p[traits::ts_offset] == 0x47) {
+            p += traits::ts_offset;
+        }
+
+        // up to the TS packet of the next unit, as the C library: the prefix
+        // or the code of a unit is consumed with the packet before it
+        for (; p + traits::size <= end && p[0] == 0x47 && !h_ts->Interrupted; p += traits::size, n++) {
+            if (TS2ES_PID_TYPE(h_ts->pid_map[TS_PACKET_PID(p)]) == TS2ES_PID_IGNORE) {
+                continue;
+            }
+            ts2es_demux_ts_unit(h_ts, p, first + n, h_ts->stream_offset + (p - buf));
+            if (h_ts->n_pulled) {
+                take();
+            }
+        }
+        ts2es_demux_ts_run_end(h_ts, first + n, p - buf);
+
+        if (p + traits::size <= end && p[0] != 0x47 && !h_ts->Interrupted) {
+            return resync(buf, p, end);
+        }
+        return (size_t)(p - buf);
+    }
+
+    void select_pid(int pid)
+    {
+        ts2es_select_pid(h_ts_, pid);
+    }
+
+    /* PID of the packet in the unit at "p", e.g. to route the units of a
+     * file before they are demuxed */
+    static int pid(const uint8_t *p)
+    {
+        return TS_PACKET_PID((p + traits::ts_offset));
+    }
+
+    Sink    &sink()   { return sink_; }
+    ts2es_t *handle() { return h_ts_; }
+
+private:
+    /* the rest of the buffer from "p" through the loop of the C library
+     * returns the bytes consumed from "buf" */
+    size_t resync(uint8_t *buf, uint8_t *p, uint8_t *end)
+    {
+        size_t used = (size_t)(p - buf) + ts2es_demux_ts_buffer(h_ts_, p, (size_t)(end - p));
+        take();
+        return used;
+    }
+
+    /* pass the PES queued by the pull output to the sink */
+    void take()
+    {
+        const ts2es_pes_t *pes = h_ts_->pulled;
+        for (int i = 0; i < h_ts_->n_pulled; i++) {
+            sink_(pes[i].pid, pes[i].pts, pes[i].dts, pes[i].data, pes[i].len);
+        }
+        ts2es_pull_release(h_ts_);
+    }
+
+    Sink     sink_;
+    ts2es_t *h_ts_;
+};
+
+} // namespace ts2es
+
+#endif // _TS2ES_HPP_
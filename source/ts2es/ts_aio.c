@@ -0,0 +1,626 @@
+/*
+    ts_aio.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * Asynchronous file I/O: reads and writes are queued and complete in the
+ * background while the caller goes on demuxing. On Linux they go through an
+ * io_uring, set up with raw system calls; where it is not available (old
+ * kernels, seccomp) a few I/O threads do them with pread()/pwrite(). Any
+ * thread may submit and wait. The reader built on it keeps several large
+ * blocks of a file in flight ahead of the demuxer.
+ */
+#include "ts2es.h"
+#include "ts_thread.h"
+#include <string.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define close       _close
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#ifdef IO_URING_OP_SUPPORTED    // Linux 5.6 headers: read and write operations, opcode probe
+#define HAVE_IO_URING   1
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+#endif
+#endif
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define AIO_ENTRIES         64      // operations in flight, power of 2
+#define AIO_THREADS         2       // I/O threads without io_uring
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+#ifdef HAVE_IO_URING
+typedef struct aio_uring_t {
+    int                  fd;
+    uint32_t            *sq_head;
+    uint32_t            *sq_tail;
+    uint32_t            *sq_mask;
+    uint32_t            *sq_array;
+    uint32_t            *cq_head;
+    uint32_t            *cq_tail;
+    uint32_t            *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring;
+    void                *cq_ring;
+    size_t               sq_ring_size;
+    size_t               cq_ring_size;
+    uint32_t             sq_entries;
+} aio_uring_t;
+#endif
+
+struct ts2es_aio_t {
+    int                 b_uring;
+    ts2es_mutex_t       submit_lock;    // submission queue, or queue of the I/O threads
+    ts2es_mutex_t       reap_lock;      // completion queue
+    ts2es_cond_t        cond_queued;
+    ts2es_cond_t        cond_done;
+    int                 in_flight;      // submitted, not reaped yet
+    int                 b_stop;
+#ifdef HAVE_IO_URING
+    aio_uring_t         ring;
+#endif
+    ts2es_aio_op_t     *queue_head;     // queue of the I/O threads
+    ts2es_aio_op_t     *queue_tail;
+    ts2es_thread_t      threads[AIO_THREADS];
+    int                 num_threads;
+};
+
+struct ts2es_reader_t {
+    ts2es_aio_t        *p_aio;
+    int                 fd;
+    int                 num_blocks;
+    size_t              block_size;
+    uint8_t            *mem;
+    ts2es_aio_op_t     *ops;            // one per block, each reads block_size bytes
+    int                 next;           // block returned next
+    int                 prev;           // block returned last, -1: none
+    int64_t             read_offset;    // of the next read submitted
+    int                 b_eof;          // a read returned 0 or failed, no more are submitted
+};
+
+/* ---------------------------------------------------------------------------
+ * do one operation synchronously
+ * returns the number of bytes transferred, or -errno
+ */
+static int64_t aio_do_op(ts2es_aio_op_t *p_op)
+{
+#ifdef _WIN32
+    int64_t n;
+    if (p_op->offset >= 0 && _lseeki64(p_op->fd, p_op->offset, SEEK_SET) < 0) {
+        return -1;
+    }
+    n = p_op->b_write ? _write(p_op->fd, p_op->buf, (unsigned int)p_op->len)
+                      : _read(p_op->fd, p_op->buf, (unsigned int)p_op->len);
+    return n;
+#else
+    ssize_t n;
+    if (p_op->b_write) {
+        n = p_op->offset >= 0 ? pwrite(p_op->fd, p_op->buf, p_op->len, (off_t)p_op->offset)
+                              : write(p_op->fd, p_op->buf, p_op->len);
+    } else {
+        n = p_op->offset >= 0 ? pread(p_op->fd, p_op->buf, p_op->len, (off_t)p_op->offset)
+                              : read(p_op->fd, p_op->buf, p_op->len);
+    }
+    return n < 0 ? -(int64_t)errno : (int64_t)n;
+#endif
+}
+
+#ifdef HAVE_IO_URING
+/* ---------------------------------------------------------------------------
+ * returns 1 if the kernel supports the read and write operations, or 0 if not
+ */
+static int uring_probe(int fd)
+{
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p_probe = (struct io_uring_probe *)calloc(1, size);
+    int b_ok;
+
+    if (p_probe == NULL) {
+        return 0;
+    }
+    b_ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p_probe, 256) >= 0 &&
+           p_probe->last_op >= IORING_OP_WRITE &&
+           (p_probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+           (p_probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(p_probe);
+    return b_ok;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns 1 if the io_uring is set up, or 0 if it is not available
+ */
+static int uring_open(aio_uring_t *p_ring, uint32_t entries)
+{
+    struct io_uring_params p;
+    uint8_t *sq, *cq;
+
+    memset(p_ring, 0, sizeof(aio_uring_t));
+    memset(&p, 0, sizeof(p));
+    if ((p_ring->fd = (int)syscall(__NR_io_uring_setup, entries, &p)) < 0) {
+        return 0;
+    }
+    // reads and writes at the file position (offset -1) need IORING_FEAT_RW_CUR_POS;
+    // the operations themselves are probed, a kernel may have the feature bits
+    // of a release without all its opcodes (backports, seccomp filters)
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS) ||
+        !uring_probe(p_ring->fd)) {
+        close(p_ring->fd);
+        return 0;
+    }
+
+    p_ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+    p_ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p_ring->cq_ring_size > p_ring->sq_ring_size) {
+        p_ring->sq_ring_size = p_ring->cq_ring_size;
+    }
+    p_ring->sq_ring = mmap(NULL, p_ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           p_ring->fd, IORING_OFF_SQ_RING);
+    if (p_ring->sq_ring == MAP_FAILED) {
+        close(p_ring->fd);
+        return 0;
+    }
+    p_ring->cq_ring = p_ring->sq_ring;
+    p_ring->sqes = (struct io_uring_sqe *)mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, p_ring->fd, IORING_OFF_SQES);
+    if (p_ring->sqes == MAP_FAILED) {
+        munmap(p_ring->sq_ring, p_ring->sq_ring_size);
+        close(p_ring->fd);
+        return 0;
+    }
+
+    sq = (uint8_t *)p_ring->sq_ring;
+    cq = (uint8_t *)p_ring->cq_ring;
+    p_ring->sq_head    = (uint32_t *)(sq + p.sq_off.head);
+    p_ring->sq_tail    = (uint32_t *)(sq + p.sq_off.tail);
+    p_ring->sq_mask    = (uint32_t *)(sq + p.sq_off.ring_mask);
+    p_ring->sq_array   = (uint32_t *)(sq + p.sq_off.array);
+    p_ring->cq_head    = (uint32_t *)(cq + p.cq_off.head);
+    p_ring->cq_tail    = (uint32_t *)(cq + p.cq_off.tail);
+    p_ring->cq_mask    = (uint32_t *)(cq + p.cq_off.ring_mask);
+    p_ring->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    p_ring->sq_entries = p.sq_entries;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void uring_close(aio_uring_t *p_ring)
+{
+    munmap(p_ring->sqes, p_ring->sq_entries * sizeof(struct io_uring_sqe));
+    munmap(p_ring->sq_ring, p_ring->sq_ring_size);
+    close(p_ring->fd);
+}
+
+/* ---------------------------------------------------------------------------
+ * queue an operation and tell the kernel, with the submission lock held
+ * returns 0 on success, or -errno if the kernel refused it
+ */
+static int uring_submit(aio_uring_t *p_ring, ts2es_aio_op_t *p_op)
+{
+    uint32_t tail = *p_ring->sq_tail;
+    uint32_t idx = tail & *p_ring->sq_mask;
+    struct io_uring_sqe *sqe = &p_ring->sqes[idx];
+
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode    = p_op->b_write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd        = p_op->fd;
+    sqe->addr      = (uint64_t)(uintptr_t)p_op->buf;
+    sqe->len       = (uint32_t)p_op->len;
+    sqe->off       = p_op->offset >= 0 ? (uint64_t)p_op->offset : (uint64_t)-1;   // -1: file position
+    sqe->user_data = (uint64_t)(uintptr_t)p_op;
+    p_ring->sq_array[idx] = idx;
+    ts2es_atomic_store(p_ring->sq_tail, tail + 1);
+
+    for (;;) {
+        long ret = syscall(__NR_io_uring_enter, p_ring->fd, 1, 0, 0, NULL, 0);
+        if (ret == 1) {
+            return 0;
+        }
+        if (ret < 0 && errno != EAGAIN && errno != EBUSY && errno != EINTR) {
+            return -errno;
+        }
+        ts2es_thread_yield();
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * mark the completed operations done, with the completion lock held
+ * returns the number of operations completed
+ */
+static int uring_reap(aio_uring_t *p_ring)
+{
+    uint32_t head = *p_ring->cq_head;
+    uint32_t tail = ts2es_atomic_load(p_ring->cq_tail);
+    int n = 0;
+
+    for (; head != tail; head++, n++) {
+        struct io_uring_cqe *cqe = &p_ring->cqes[head & *p_ring->cq_mask];
+        ts2es_aio_op_t *p_op = (ts2es_aio_op_t *)(uintptr_t)cqe->user_data;
+        p_op->result = cqe->res;
+        ts2es_atomic_store(&p_op->b_done, 1);
+    }
+    ts2es_atomic_store(p_ring->cq_head, head);
+    return n;
+}
+#endif // HAVE_IO_URING
+
+/* ---------------------------------------------------------------------------
+ * I/O thread: do the queued operations in order
+ */
+static void *aio_thread_proc(void *arg)
+{
+    ts2es_aio_t *p_aio = (ts2es_aio_t *)arg;
+
+    ts2es_mutex_lock(&p_aio->submit_lock);
+    for (;;) {
+        ts2es_aio_op_t *p_op;
+
+        while (p_aio->queue_head == NULL && !p_aio->b_stop) {
+            ts2es_cond_wait(&p_aio->cond_queued, &p_aio->submit_lock);
+        }
+        if ((p_op = p_aio->queue_head) == NULL) {
+            break;
+        }
+        p_aio->queue_head = p_op->next;
+        if (p_aio->queue_head == NULL) {
+            p_aio->queue_tail = NULL;
+        }
+        ts2es_mutex_unlock(&p_aio->submit_lock);
+
+        p_op->result = aio_do_op(p_op);
+
+        ts2es_mutex_lock(&p_aio->reap_lock);
+        ts2es_atomic_store(&p_op->b_done, 1);
+        ts2es_cond_broadcast(&p_aio->cond_done);
+        ts2es_mutex_unlock(&p_aio->reap_lock);
+
+        ts2es_mutex_lock(&p_aio->submit_lock);
+    }
+    ts2es_mutex_unlock(&p_aio->submit_lock);
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Create an I/O engine, on an io_uring unless b_threads is set or it is not
+ * available
+ * returns the engine, or NULL on failure
+ */
+ts2es_aio_t *ts2es_aio_create(int b_threads)
+{
+    ts2es_aio_t *p_aio = (ts2es_aio_t *)calloc(1, sizeof(ts2es_aio_t));
+    int i;
+
+    if (p_aio == NULL) {
+        return NULL;
+    }
+    ts2es_mutex_init(&p_aio->submit_lock);
+    ts2es_mutex_init(&p_aio->reap_lock);
+    ts2es_cond_init(&p_aio->cond_queued);
+    ts2es_cond_init(&p_aio->cond_done);
+
+#ifdef HAVE_IO_URING
+    if (!b_threads && uring_open(&p_aio->ring, AIO_ENTRIES)) {
+        p_aio->b_uring = 1;
+        return p_aio;
+    }
+#else
+    (void)b_threads;
+#endif
+#ifndef _WIN32
+    for (i = 0; i < AIO_THREADS; i++) {
+        if (!ts2es_thread_create(&p_aio->threads[i], aio_thread_proc, p_aio)) {
+            break;
+        }
+        p_aio->num_threads++;
+    }
+#else
+    (void)i;    // operations are done at submission
+#endif
+    return p_aio;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the name of the backend of an engine
+ */
+const char *ts2es_aio_backend(ts2es_aio_t *p_aio)
+{
+    return p_aio->b_uring ? "io_uring" : p_aio->num_threads ? "threads" : "synchronous";
+}
+
+/* ---------------------------------------------------------------------------
+ * Queue a read or write of p_op->len bytes at p_op->offset (-1: at the file
+ * position). p_op and its buffer must stay valid until ts2es_aio_wait()
+ */
+void ts2es_aio_submit(ts2es_aio_t *p_aio, ts2es_aio_op_t *p_op)
+{
+    p_op->b_done = 0;
+    p_op->result = 0;
+    p_op->next   = NULL;
+
+#ifdef HAVE_IO_URING
+    if (p_aio->b_uring) {
+        int ret;
+
+        ts2es_mutex_lock(&p_aio->submit_lock);
+        // the completion queue holds twice the entries, keep within them
+        while (ts2es_atomic_load(&p_aio->in_flight) >= (int)p_aio->ring.sq_entries) {
+            ts2es_mutex_lock(&p_aio->reap_lock);
+            ts2es_atomic_add(&p_aio->in_flight, -uring_reap(&p_aio->ring));
+            ts2es_mutex_unlock(&p_aio->reap_lock);
+            ts2es_thread_yield();
+        }
+        if ((ret = uring_submit(&p_aio->ring, p_op)) == 0) {
+            ts2es_atomic_add(&p_aio->in_flight, 1);
+        } else {
+            p_op->result = ret;
+            ts2es_atomic_store(&p_op->b_done, 1);
+        }
+        ts2es_mutex_unlock(&p_aio->submit_lock);
+        return;
+    }
+#endif
+
+    if (p_aio->num_threads == 0) {
+        p_op->result = aio_do_op(p_op);
+        p_op->b_done = 1;
+        return;
+    }
+    ts2es_mutex_lock(&p_aio->submit_lock);
+    if (p_aio->queue_tail != NULL) {
+        p_aio->queue_tail->next = p_op;
+    } else {
+        p_aio->queue_head = p_op;
+    }
+    p_aio->queue_tail = p_op;
+    ts2es_cond_signal(&p_aio->cond_queued);
+    ts2es_mutex_unlock(&p_aio->submit_lock);
+}
+
+/* ---------------------------------------------------------------------------
+ * Wait for an operation. A write is completed synchronously if it was short
+ * returns the number of bytes transferred, or -errno on failure
+ */
+int64_t ts2es_aio_wait(ts2es_aio_t *p_aio, ts2es_aio_op_t *p_op)
+{
+    ts2es_mutex_lock(&p_aio->reap_lock);
+    while (!ts2es_atomic_load(&p_op->b_done)) {
+#ifdef HAVE_IO_URING
+        if (p_aio->b_uring) {
+            // one waiter at a time sleeps in the kernel, the others on the lock
+            int n = uring_reap(&p_aio->ring);
+            if (n > 0) {
+                ts2es_atomic_add(&p_aio->in_flight, -n);
+            } else {
+                syscall(__NR_io_uring_enter, p_aio->ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            }
+            continue;
+        }
+#endif
+        ts2es_cond_wait(&p_aio->cond_done, &p_aio->reap_lock);
+    }
+    ts2es_mutex_unlock(&p_aio->reap_lock);
+
+    if (p_op->b_write && p_op->result >= 0 && (size_t)p_op->result < p_op->len) {
+        ts2es_aio_op_t op = *p_op;
+        size_t done = (size_t)p_op->result;
+        while (done < p_op->len) {
+            op.buf    = p_op->buf + done;
+            op.len    = p_op->len - done;
+            op.offset = p_op->offset >= 0 ? p_op->offset + (int64_t)done : -1;
+            if ((op.result = aio_do_op(&op)) <= 0) {
+                return op.result < 0 ? op.result : -1;
+            }
+            done += (size_t)op.result;
+        }
+        p_op->result = (int64_t)done;
+    }
+    return p_op->result;
+}
+
+/* ---------------------------------------------------------------------------
+ * Destroy an engine, all its operations must have been waited for
+ */
+void ts2es_aio_destroy(ts2es_aio_t *p_aio)
+{
+    int i;
+
+    if (p_aio == NULL) {
+        return;
+    }
+#ifdef HAVE_IO_URING
+    if (p_aio->b_uring) {
+        uring_close(&p_aio->ring);
+    }
+#endif
+    ts2es_mutex_lock(&p_aio->submit_lock);
+    p_aio->b_stop = 1;
+    ts2es_cond_broadcast(&p_aio->cond_queued);
+    ts2es_mutex_unlock(&p_aio->submit_lock);
+    for (i = 0; i < p_aio->num_threads; i++) {
+        ts2es_thread_join(p_aio->threads[i]);
+    }
+    ts2es_cond_destroy(&p_aio->cond_done);
+    ts2es_cond_destroy(&p_aio->cond_queued);
+    ts2es_mutex_destroy(&p_aio->reap_lock);
+    ts2es_mutex_destroy(&p_aio->submit_lock);
+    free(p_aio);
+}
+
+/* ---------------------------------------------------------------------------
+ * submit the read of the next block of the file into a block
+ */
+static void reader_submit(ts2es_reader_t *p_rd, int k)
+{
+    ts2es_aio_op_t *p_op = &p_rd->ops[k];
+
+    if (p_rd->b_eof) {
+        p_op->b_done = 1;
+        p_op->result = 0;
+        return;
+    }
+    p_op->fd      = p_rd->fd;
+    p_op->b_write = 0;
+    p_op->buf     = p_rd->mem + (size_t)k * (TS2ES_READER_KEEP + p_rd->block_size) + TS2ES_READER_KEEP;
+    p_op->len     = p_rd->block_size;
+    p_op->offset  = p_rd->read_offset;
+    p_rd->read_offset += p_rd->block_size;
+    ts2es_aio_submit(p_rd->p_aio, p_op);
+}
+
+/* ---------------------------------------------------------------------------
+ * Open a file and start reading its first num_blocks blocks of block_size
+ * bytes
+ * returns the reader, or NULL on failure
+ */
+ts2es_reader_t *ts2es_reader_open(ts2es_aio_t *p_aio, const char *s_path, int num_blocks, size_t block_size)
+{
+    ts2es_reader_t *p_rd = (ts2es_reader_t *)calloc(1, sizeof(ts2es_reader_t));
+    int k;
+
+    if (p_rd == NULL) {
+        return NULL;
+    }
+#ifdef _WIN32
+    p_rd->fd = _open(s_path, _O_RDONLY | _O_BINARY);
+#else
+    p_rd->fd = open(s_path, O_RDONLY);
+#endif
+    p_rd->ops = (ts2es_aio_op_t *)calloc(num_blocks, sizeof(ts2es_aio_op_t));
+    p_rd->mem = (uint8_t *)malloc((size_t)num_blocks * (TS2ES_READER_KEEP + block_size));
+    if (p_rd->fd < 0 || p_rd->ops == NULL || p_rd->mem == NULL) {
+        if (p_rd->fd >= 0) {
+            close(p_rd->fd);
+        }
+        free(p_rd->ops);
+        free(p_rd->mem);
+        free(p_rd);
+        return NULL;
+    }
+#if defined(POSIX_FADV_SEQUENTIAL) && !defined(_WIN32)
+    posix_fadvise(p_rd->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    p_rd->p_aio      = p_aio;
+    p_rd->num_blocks = num_blocks;
+    p_rd->block_size = block_size;
+    p_rd->prev       = -1;
+    for (k = 0; k < num_blocks; k++) {
+        reader_submit(p_rd, k);
+    }
+    return p_rd;
+}
+
+/* ---------------------------------------------------------------------------
+ * wait for the read of a block, and read the rest of it if it came short
+ * returns the number of bytes in the block, or -errno on failure
+ */
+static int64_t reader_wait(ts2es_reader_t *p_rd, ts2es_aio_op_t *p_op)
+{
+    int64_t got = ts2es_aio_wait(p_rd->p_aio, p_op);
+    uint8_t *buf = p_op->buf;
+    int64_t offset = p_op->offset;
+
+    while (got > 0 && (size_t)got < p_rd->block_size) {
+        int64_t n;
+        p_op->buf    = buf + got;
+        p_op->len    = p_rd->block_size - (size_t)got;
+        p_op->offset = offset + got;
+        ts2es_aio_submit(p_rd->p_aio, p_op);
+        if ((n = ts2es_aio_wait(p_rd->p_aio, p_op)) <= 0) {
+            p_rd->b_eof = 1;    // end of the file, the block is kept as it is
+            break;
+        }
+        got += n;
+    }
+    p_op->buf    = buf;
+    p_op->len    = p_rd->block_size;
+    p_op->offset = offset;
+    p_op->result = got;
+    return got;
+}
+
+/* ---------------------------------------------------------------------------
+ * Get the next block of the file, with the last "keep" bytes (at most
+ * TS2ES_READER_KEEP) of the previous block in front of it, e.g. the bytes
+ * the demuxer left. The previous block is read again, further in the file
+ * returns the data, or NULL at the end of the file or on failure
+ */
+uint8_t *ts2es_reader_next(ts2es_reader_t *p_rd, size_t keep, size_t *p_len)
+{
+    ts2es_aio_op_t *p_op = &p_rd->ops[p_rd->next];
+    int64_t got = reader_wait(p_rd, p_op);
+    uint8_t *data = p_op->buf;
+
+    keep = keep < TS2ES_READER_KEEP ? keep : TS2ES_READER_KEEP;
+    if (p_rd->prev >= 0) {
+        ts2es_aio_op_t *p_prev = &p_rd->ops[p_rd->prev];
+        keep = keep < (size_t)p_prev->result ? keep : (size_t)p_prev->result;
+        memcpy(data - keep, p_prev->buf + p_prev->result - keep, keep);
+        reader_submit(p_rd, p_rd->prev);
+    } else {
+        keep = 0;
+    }
+
+    if (got <= 0) {
+        p_rd->b_eof  = 1;
+        p_op->result = 0;
+        p_rd->prev   = -1;
+        *p_len = 0;
+        return NULL;
+    }
+    p_rd->prev = p_rd->next;
+    p_rd->next = (p_rd->next + 1) % p_rd->num_blocks;
+    *p_len = keep + (size_t)got;
+    return data - keep;
+}
+
+/* ---------------------------------------------------------------------------
+ * Stop reading and close the file
+ */
+void ts2es_reader_close(ts2es_reader_t *p_rd)
+{
+    int k;
+
+    if (p_rd == NULL) {
+        return;
+    }
+    for (k = 0; k < p_rd->num_blocks; k++) {
+        ts2es_aio_wait(p_rd->p_aio, &p_rd->ops[k]);
+    }
+    close(p_rd->fd);
+    free(p_rd->ops);
+    free(p_rd->mem);
+    free(p_rd);
+}
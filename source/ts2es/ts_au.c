@@ -0,0 +1,483 @@
+/*
+    ts_au.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Access-unit output: the ES data of each output is appended to a framer per
+ * ES, which cuts it into coded pictures at the start codes of AVS/AVS2, AVC
+ * and HEVC, or into MPEG audio frames by their header. A picture ends where
+ * the next one starts, so it is delivered once the start of the next one has
+ * arrived; an audio frame once the header of the next frame is seen, frames
+ * followed by garbage (data lost inside them) are dropped.
+ *
+ * The PTS/DTS of a PES belong to the first access unit starting in the PES,
+ * so each change of timestamps is kept as a mark at the stream offset of the
+ * data, and taken by the first access unit starting at or after it.
+ */
+#include "ts2es.h"
+#include "ts_thread.h"
+#include "mpa_header.h"
+#include <string.h>
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define AU_MAX_MARKS        16      // pending PES timestamps
+#define AU_MIN_SIZE         (64 << 10)
+
+enum au_codec_e {
+    AU_CODEC_PES  = 0,  // no framing known, one access unit per output
+    AU_CODEC_MPA  = 1,  // MPEG audio
+    AU_CODEC_AVS  = 2,  // AVS, AVS+ and AVS2
+    AU_CODEC_AVC  = 3,
+    AU_CODEC_HEVC = 4,
+};
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+typedef struct au_mark_t {
+    uint64_t offset;    // stream offset of the first byte of the PES data
+    int64_t  pts;
+    int64_t  dts;
+} au_mark_t;
+
+struct ts2es_framer_t {
+    int      codec;
+    uint8_t *buf;
+    size_t   cap;
+    size_t   start;     // first byte of the current access unit
+    size_t   len;
+    size_t   scan;      // next byte to look for a start code at
+    uint64_t base;      // stream offset of buf[0]
+    int      b_pic;     // the current access unit holds a picture
+    int      b_key;     // ... coded without reference to other pictures
+    int      frame_len; // MPEG audio: size of the current frame, 0: not known
+    int64_t  frame_ticks;   // MPEG audio: duration of a frame, in 90 kHz units
+    int64_t  last_pts;
+    int64_t  last_dts;
+    int64_t  mark_pts;  // timestamps of the last output
+    int64_t  mark_dts;
+    int      n_marks;
+    au_mark_t marks[AU_MAX_MARKS];
+};
+
+/* ---------------------------------------------------------------------------
+ * choose the framing of an ES from its stream_type, or else its stream_id
+ */
+static int au_codec(ts2es_es_t *p_es)
+{
+    switch (p_es->stream_type) {
+    case 0x03:
+    case 0x04:
+        return AU_CODEC_MPA;
+    case 0x1B:
+        return AU_CODEC_AVC;
+    case 0x24:
+        return AU_CODEC_HEVC;
+    case 0x42:
+    case 0x43:
+    case 0xD2:
+        return AU_CODEC_AVS;
+    case 0:
+        if (p_es->pes_stream_id >= 0xC0 && p_es->pes_stream_id <= 0xDF) {
+            return AU_CODEC_MPA;
+        }
+        if (p_es->pes_stream_id >= 0xE0 && p_es->pes_stream_id <= 0xEF) {
+            return AU_CODEC_AVS;
+        }
+        return AU_CODEC_PES;
+    default:
+        return AU_CODEC_PES;
+    }
+}
+
+static const char *s_codecs[] = { "PES", "MPEG audio", "AVS", "AVC", "HEVC" };
+
+/* ---------------------------------------------------------------------------
+ * returns the framer of an ES, or NULL if out of memory
+ */
+static ts2es_framer_t *au_framer(ts2es_t *h_ts, ts2es_es_t *p_es)
+{
+    ts2es_framer_t *p_fr = p_es->framer;
+
+    if (p_fr == NULL) {
+        if ((p_fr = (ts2es_framer_t *)calloc(1, sizeof(ts2es_framer_t))) == NULL) {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate the framer (pid: %d).\n", p_es->pid);
+            return NULL;
+        }
+        p_fr->codec    = au_codec(p_es);
+        p_fr->last_pts = -1;
+        p_fr->last_dts = -1;
+        p_fr->mark_pts = -2;    // no output yet
+        p_es->framer   = p_fr;
+        ts2es_report(h_ts, TS2ES_DEBUG, "Access units of PID %d framed as %s\n", p_es->pid, s_codecs[p_fr->codec]);
+    }
+    return p_fr;
+}
+
+/* ---------------------------------------------------------------------------
+ * Deliver the access unit [start, end) of the buffer, with the timestamps of
+ * the last mark at or before its start
+ */
+static void au_emit(ts2es_t *h_ts, ts2es_es_t *p_es, ts2es_framer_t *p_fr, size_t end, int b_key)
+{
+    uint64_t offset = p_fr->base + p_fr->start;
+    int64_t pts = -1, dts = -1;
+    int i, n = 0;
+
+    while (n < p_fr->n_marks && p_fr->marks[n].offset <= offset) {
+        n++;
+    }
+    if (n > 0) {
+        pts = p_fr->marks[n - 1].pts;
+        dts = p_fr->marks[n - 1].dts;
+        for (i = n; i < p_fr->n_marks; i++) {
+            p_fr->marks[i - n] = p_fr->marks[i];
+        }
+        p_fr->n_marks -= n;
+    } else if (p_fr->codec == AU_CODEC_MPA && p_fr->last_pts >= 0) {
+        pts = (p_fr->last_pts + p_fr->frame_ticks) & TS_PTS_MASK;   // audio frames are back to back
+        dts = (p_fr->last_dts + p_fr->frame_ticks) & TS_PTS_MASK;
+    }
+    p_fr->last_pts = pts;
+    p_fr->last_dts = dts;
+
+    // in keyframe mode, the pictures in between are left out
+    if (end > p_fr->start && (b_key || !h_ts->param.b_keyframes || !ts2es_au_video(p_es))) {
+        h_ts->f_output_au(h_ts, p_es->pid, pts, dts, b_key, p_fr->buf + p_fr->start, end - p_fr->start,
+                          h_ts->opque_output_au);
+    }
+    p_fr->start = end;
+}
+
+/* ---------------------------------------------------------------------------
+ * Look at the start code at p[0..3] of a video ES
+ * returns 1 if it may start an access unit, and sets *p_vcl if it starts a
+ * picture (or its first slice), *p_key if the picture is coded without
+ * reference to other pictures. 0 if it is part of the current access unit
+ */
+static int au_start_code(int codec, const uint8_t *p, int *p_vcl, int *p_key)
+{
+    int type;
+
+    *p_vcl = 0;
+    *p_key = 0;
+    switch (codec) {
+    case AU_CODEC_AVS:
+        // sequence header, I and P/B picture headers, video edit
+        *p_vcl = p[3] == 0xB3 || p[3] == 0xB6;
+        *p_key = p[3] == 0xB3;
+        return p[3] == 0xB0 || p[3] == 0xB3 || p[3] == 0xB6 || p[3] == 0xB7;
+    case AU_CODEC_AVC:
+        type = p[3] & 0x1F;
+        if (type >= 1 && type <= 5) {
+            *p_vcl = 1;
+            *p_key = type == 5;
+            return (p[4] & 0x80) != 0;  // first_mb_in_slice == 0
+        }
+        // SEI, SPS, PPS, access unit delimiter, 14..18
+        return (type >= 6 && type <= 9) || (type >= 14 && type <= 18);
+    case AU_CODEC_HEVC:
+        type = (p[3] >> 1) & 0x3F;
+        if (type < 32) {
+            *p_vcl = 1;
+            *p_key = type >= 16 && type <= 23;  // IRAP
+            return (p[5] & 0x80) != 0;  // first_slice_segment_in_pic_flag
+        }
+        // VPS, SPS, PPS, access unit delimiter, prefix SEI, 41..44, 48..55
+        return (type >= 32 && type <= 35) || type == 39 || (type >= 41 && type <= 44) ||
+               (type >= 48 && type <= 55);
+    default:
+        return 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Tell if the pictures of an ES are told apart by ts2es_au_keyframe(), that
+ * is if its stream_type is AVS/AVS2, AVC or HEVC video. Video known by its
+ * stream_id only is framed as AVS, but its pictures are not told apart
+ */
+int ts2es_au_video(ts2es_es_t *p_es)
+{
+    return p_es->stream_type != 0 && au_codec(p_es) >= AU_CODEC_AVS;
+}
+
+/* ---------------------------------------------------------------------------
+ * Frame an ES by its stream_type once it is known, e.g. for a PID selected
+ * before its PMT arrived
+ */
+void ts2es_au_retype(ts2es_t *h_ts, ts2es_es_t *p_es)
+{
+    ts2es_framer_t *p_fr = p_es->framer;
+    int codec = au_codec(p_es);
+
+    if (p_fr != NULL && p_fr->codec != codec) {
+        p_fr->codec     = codec;
+        p_fr->scan      = p_fr->start;
+        p_fr->b_pic     = 0;
+        p_fr->b_key     = 0;
+        p_fr->frame_len = 0;
+        ts2es_report(h_ts, TS2ES_DEBUG, "Access units of PID %d framed as %s\n", p_es->pid, s_codecs[codec]);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Tell if ES data, e.g. the start of a PES, begins a key access unit: the
+ * first picture found is coded without reference to other pictures
+ * returns 1 if so, 0 if not, or -1 if no picture starts in the data
+ */
+int ts2es_au_keyframe(ts2es_es_t *p_es, const uint8_t *buf, size_t len)
+{
+    int codec = au_codec(p_es);
+    size_t i = 0;
+
+    if (codec == AU_CODEC_MPA) {
+        return 1;
+    } else if (codec == AU_CODEC_PES) {
+        return p_es->pes_stream_id < 0xE0 || p_es->pes_stream_id > 0xEF;    // not video
+    }
+
+    while (i + 6 <= len) {
+        const uint8_t *p;
+        int b_vcl, b_key;
+
+        i += ts2es_es_sync_scan(buf + i, len - i);
+        if (i + 6 > len) {
+            break;
+        }
+        p = buf + i;
+        if (p[0] == 0x00 && p[1] == 0x00 && p[2] == 0x01) {
+            au_start_code(codec, p, &b_vcl, &b_key);
+            if (b_vcl) {
+                return b_key;
+            }
+        }
+        i++;
+    }
+    return -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * cut the buffered data of a video ES at the access unit boundaries
+ */
+static void au_frame_video(ts2es_t *h_ts, ts2es_es_t *p_es, ts2es_framer_t *p_fr)
+{
+    size_t i = p_fr->scan;
+
+    // 6 bytes: start code, NAL header and the first bit of a slice header
+    while (i + 6 <= p_fr->len) {
+        const uint8_t *p;
+        int b_vcl, b_key;
+
+        i += ts2es_es_sync_scan(p_fr->buf + i, p_fr->len - i);
+        if (i + 6 > p_fr->len) {
+            break;
+        }
+        p = p_fr->buf + i;
+        if (p[0] != 0x00 || p[1] != 0x00 || p[2] != 0x01) {
+            i++;
+            continue;
+        }
+        if (au_start_code(p_fr->codec, p, &b_vcl, &b_key) && p_fr->b_pic && i > p_fr->start) {
+            au_emit(h_ts, p_es, p_fr, i, p_fr->b_key);
+            p_fr->b_pic = 0;
+            p_fr->b_key = 0;
+        }
+        p_fr->b_pic |= b_vcl;
+        p_fr->b_key |= b_key;
+        i += 3;
+    }
+    p_fr->scan = i;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the size of the MPEG audio frame at p, or 0 if there is no valid
+ * header
+ */
+static int au_mpa_frame(ts2es_t *h_ts, ts2es_framer_t *p_fr, const uint8_t *p)
+{
+    mpa_header_t mpah;
+
+    if (!mpa_header_parse(h_ts, p, &mpah) || mpah.framesize < 4) {
+        return 0;
+    }
+    p_fr->frame_ticks = (int64_t)mpah.samples * 90000 / mpah.samplerate;
+    return (int)mpah.framesize;
+}
+
+/* ---------------------------------------------------------------------------
+ * cut the buffered data of an MPEG audio ES into frames
+ */
+static void au_frame_mpa(ts2es_t *h_ts, ts2es_es_t *p_es, ts2es_framer_t *p_fr)
+{
+    while (p_fr->len - p_fr->start >= 4) {
+        size_t next;
+
+        if (p_fr->frame_len == 0 && (p_fr->frame_len = au_mpa_frame(h_ts, p_fr, p_fr->buf + p_fr->start)) == 0) {
+            // lost sync, skip to the next header
+            size_t skip = 1 + ts2es_es_sync_scan(p_fr->buf + p_fr->start + 1, p_fr->len - p_fr->start - 1);
+            ts2es_report(h_ts, TS2ES_DEBUG, "Dropping %u bytes of MPEG audio (pid: %d).\n",
+                         (uint32_t)skip, p_es->pid);
+            p_fr->start += skip;
+            continue;
+        }
+
+        next = p_fr->start + p_fr->frame_len;
+        if (next + 4 > p_fr->len) {
+            break;  // the header of the next frame is not there yet
+        }
+        if (au_mpa_frame(h_ts, p_fr, p_fr->buf + next)) {
+            au_emit(h_ts, p_es, p_fr, next, 1);
+        } else {
+            ts2es_report(h_ts, TS2ES_DEBUG, "Dropping a broken MPEG audio frame (pid: %d).\n", p_es->pid);
+            p_fr->start++;
+        }
+        p_fr->frame_len = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Append data to the framer, the access units already delivered are dropped
+ * returns 1 on success, or 0 if out of memory
+ */
+static int au_append(ts2es_t *h_ts, ts2es_es_t *p_es, ts2es_framer_t *p_fr, const uint8_t *data, size_t len)
+{
+    size_t keep = p_fr->len - p_fr->start;
+
+    if (p_fr->start > 0) {
+        memmove(p_fr->buf, p_fr->buf + p_fr->start, keep);
+        p_fr->base += p_fr->start;
+        p_fr->scan -= p_fr->scan > p_fr->start ? p_fr->start : p_fr->scan;
+        p_fr->len   = keep;
+        p_fr->start = 0;
+    }
+
+    // an access unit larger than an ES buffer is cut
+    if (keep + len > ES_MAX_SIZE && keep > 0) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Access unit too large, cut at %u bytes (pid: %d).\n",
+                     (uint32_t)keep, p_es->pid);
+        au_emit(h_ts, p_es, p_fr, keep, p_fr->b_key);
+        p_fr->base += keep;
+        p_fr->len   = 0;
+        p_fr->start = 0;
+        p_fr->scan  = 0;
+        p_fr->b_pic = 0;
+        p_fr->b_key = 0;
+        p_fr->frame_len = 0;
+    }
+
+    if (p_fr->len + len > p_fr->cap) {
+        size_t cap = p_fr->cap ? p_fr->cap << 1 : AU_MIN_SIZE;
+        uint8_t *buf;
+        while (cap < p_fr->len + len) {
+            cap <<= 1;
+        }
+        if ((buf = (uint8_t *)realloc(p_fr->buf, cap)) == NULL) {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate the framer buffer (pid: %d).\n", p_es->pid);
+            return 0;
+        }
+        p_fr->buf = buf;
+        p_fr->cap = cap;
+    }
+    memcpy(p_fr->buf + p_fr->len, data, len);
+    p_fr->len += len;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Output function set by ts2es_set_output_au(): frame the collected ES data
+ */
+void ts2es_au_output_es(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque)
+{
+    ts2es_framer_t *p_fr;
+
+    if (!ts2es_atomic_load(&h_ts->b_output) || p_es->cur_len == 0 || (p_fr = au_framer(h_ts, p_es)) == NULL) {
+        return;
+    }
+    ts2es_atomic_add64(&h_ts->total_bytes, p_es->cur_len);
+
+    if (p_fr->codec == AU_CODEC_PES) {
+        h_ts->f_output_au(h_ts, p_es->pid, p_es->pts, p_es->dts, 1, p_es->raw_data, p_es->cur_len,
+                          h_ts->opque_output_au);
+        p_es->cur_len = 0;
+        return;
+    }
+
+    // new timestamps: data of another PES
+    if (p_es->pts != p_fr->mark_pts || p_es->dts != p_fr->mark_dts) {
+        au_mark_t *p_mark;
+        if (p_fr->n_marks == AU_MAX_MARKS) {
+            memmove(p_fr->marks, p_fr->marks + 1, (AU_MAX_MARKS - 1) * sizeof(au_mark_t));
+            p_fr->n_marks--;
+        }
+        p_mark = &p_fr->marks[p_fr->n_marks++];
+        p_mark->offset = p_fr->base + p_fr->len;
+        p_mark->pts    = p_es->pts;
+        p_mark->dts    = p_es->dts;
+        p_fr->mark_pts = p_es->pts;
+        p_fr->mark_dts = p_es->dts;
+    }
+
+    if (au_append(h_ts, p_es, p_fr, p_es->raw_data, p_es->cur_len)) {
+        if (p_fr->codec == AU_CODEC_MPA) {
+            au_frame_mpa(h_ts, p_es, p_fr);
+        } else {
+            au_frame_video(h_ts, p_es, p_fr);
+        }
+    }
+    p_es->cur_len = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * At the end of the stream: deliver the last access unit and free the framer
+ */
+void ts2es_au_flush(ts2es_t *h_ts, ts2es_es_t *p_es)
+{
+    ts2es_framer_t *p_fr = p_es->framer;
+
+    if (p_fr == NULL) {
+        return;
+    }
+    if (p_fr->codec == AU_CODEC_MPA) {
+        // the last frame is complete if its header says so
+        if (p_fr->len - p_fr->start >= 4 && au_mpa_frame(h_ts, p_fr, p_fr->buf + p_fr->start) == (int)(p_fr->len - p_fr->start)) {
+            au_emit(h_ts, p_es, p_fr, p_fr->len, 1);
+        }
+    } else if (p_fr->len > p_fr->start) {
+        au_emit(h_ts, p_es, p_fr, p_fr->len, p_fr->b_key);
+    }
+    free(p_fr->buf);
+    free(p_fr);
+    p_es->framer = NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Select access-unit output, to be called before the first packet
+ */
+void ts2es_set_output_au(ts2es_t *h_ts, f_ts2es_output_au p_fun_out, void *opque)
+{
+    h_ts->f_output_au      = p_fun_out;
+    h_ts->opque_output_au  = opque;
+    h_ts->f_output         = ts2es_au_output_es;
+    h_ts->opque_output     = NULL;
+    h_ts->f_output_iov     = NULL;
+    h_ts->opque_output_iov = NULL;
+}
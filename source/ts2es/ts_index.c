@@ -0,0 +1,298 @@
+/*
+    ts_index.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Seek index: with param.b_index, one entry per PES holding ES data is
+ * written to <s_output>_<pid>.idx, in stream order. The entry is added with
+ * the first data of the PES collected: a video PES is held until its first
+ * picture is found (up to ES_HOLD_SIZE), which tells if the entry is a key
+ * picture; other PES are added at their first packet with ES data. Entries are
+ * collected per ES by the thread owning the ES and written in batches; the
+ * entries of a chunk are kept until the chunk is joined, as their ES offsets
+ * are only known then. The layout is described in ts2es.h.
+ */
+#include "ts2es.h"
+#include <string.h>
+
+#ifdef _WIN32
+#define snprintf    _snprintf
+#endif
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define INDEX_BATCH         1024    // entries written at a time
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+struct ts2es_index_t {
+    FILE               *fp;         // NULL until the first batch is written
+    int                 b_failed;
+    ts2es_index_entry_t *entries;   // not written yet, in host byte order
+    int                 n_entries;
+    int                 max_entries;
+};
+
+/* ---------------------------------------------------------------------------
+ */
+static void put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void put_le64(uint8_t *p, uint64_t v)
+{
+    put_le32(p, (uint32_t)v);
+    put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const uint8_t *p)
+{
+    return (uint64_t)get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+/* ---------------------------------------------------------------------------
+ * write the pending entries of an ES, opening its index file first
+ * returns 1 on success, or 0 on failure
+ */
+static int index_write(ts2es_t *h_ts, ts2es_es_t *p_es, ts2es_index_t *p_idx)
+{
+    uint8_t buf[INDEX_BATCH * TS2ES_INDEX_ENTRY_SIZE];
+    int i, n;
+
+    if (p_idx->b_failed) {
+        p_idx->n_entries = 0;
+        return 0;
+    }
+
+    if (p_idx->fp == NULL) {
+        char s_path[sizeof(h_ts->param.s_output) + 16];
+
+        snprintf(s_path, sizeof(s_path), "%s_%d.idx", h_ts->param.s_output, p_es->pid);
+        if ((p_idx->fp = fopen(s_path, "wb")) == NULL) {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to open index file %s\n", s_path);
+            p_idx->b_failed  = 1;
+            p_idx->n_entries = 0;
+            return 0;
+        }
+        memset(buf, 0, TS2ES_INDEX_HEADER_SIZE);
+        memcpy(buf, TS2ES_INDEX_MAGIC, 8);
+        put_le32(buf + 8, TS2ES_INDEX_VERSION);
+        put_le32(buf + 12, TS2ES_INDEX_ENTRY_SIZE);
+        put_le32(buf + 16, p_es->pid);
+        put_le32(buf + 20, p_es->stream_type);
+        put_le32(buf + 24, h_ts->packet_size);
+        fwrite(buf, 1, TS2ES_INDEX_HEADER_SIZE, p_idx->fp);
+        ts2es_report(h_ts, TS2ES_INFO, "writing the index of PID[%d] to %s\n", p_es->pid, s_path);
+    }
+
+    for (i = 0; i < p_idx->n_entries; i += n) {
+        uint8_t *p = buf;
+        int k;
+
+        n = p_idx->n_entries - i < INDEX_BATCH ? p_idx->n_entries - i : INDEX_BATCH;
+        for (k = 0; k < n; k++, p += TS2ES_INDEX_ENTRY_SIZE) {
+            const ts2es_index_entry_t *p_ent = &p_idx->entries[i + k];
+            put_le64(p, p_ent->ts_offset);
+            put_le64(p + 8, p_ent->es_offset);
+            put_le64(p + 16, (uint64_t)p_ent->pts);
+            put_le32(p + 24, (uint32_t)p_ent->pts_minus_dts);
+            put_le32(p + 28, p_ent->flags);
+        }
+        if (fwrite(buf, TS2ES_INDEX_ENTRY_SIZE, n, p_idx->fp) != (size_t)n) {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to write the index (pid: %d).\n", p_es->pid);
+            p_idx->b_failed = 1;
+            break;
+        }
+    }
+    p_idx->n_entries = 0;
+    return !p_idx->b_failed;
+}
+
+/* ---------------------------------------------------------------------------
+ * Append an entry to the index of an ES; the entries of a chunk handle are
+ * kept for ts2es_index_merge()
+ */
+static void index_append(ts2es_t *h_ts, ts2es_es_t *p_es, const ts2es_index_entry_t *p_ent)
+{
+    ts2es_index_t *p_idx = p_es->index;
+
+    if (p_idx == NULL) {
+        if ((p_idx = (ts2es_index_t *)calloc(1, sizeof(ts2es_index_t))) == NULL) {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate the index (pid: %d).\n", p_es->pid);
+            return;
+        }
+        p_es->index = p_idx;
+    }
+
+    if (p_idx->n_entries == p_idx->max_entries) {
+        int max_entries = p_idx->max_entries ? p_idx->max_entries << 1 : INDEX_BATCH;
+        ts2es_index_entry_t *entries;
+        if (h_ts->chunk == NULL && p_idx->n_entries >= INDEX_BATCH) {
+            index_write(h_ts, p_es, p_idx);
+        } else if ((entries = (ts2es_index_entry_t *)realloc(p_idx->entries,
+                    max_entries * sizeof(ts2es_index_entry_t))) != NULL) {
+            p_idx->entries     = entries;
+            p_idx->max_entries = max_entries;
+        } else {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate the index (pid: %d).\n", p_es->pid);
+            return;
+        }
+    }
+    p_idx->entries[p_idx->n_entries++] = *p_ent;
+}
+
+/* ---------------------------------------------------------------------------
+ * Add the entry of a PES, when its first ES data is collected: es_ptr is that
+ * data, p_es->es_bytes its offset in the ES
+ */
+void ts2es_index_add(ts2es_t *h_ts, ts2es_es_t *p_es, const uint8_t *es_ptr, size_t es_len)
+{
+    ts2es_index_entry_t ent;
+
+    ent.ts_offset     = p_es->pes_offset;
+    ent.es_offset     = p_es->es_bytes;
+    ent.pts           = p_es->pts;
+    ent.pts_minus_dts = p_es->pts >= 0 && p_es->dts >= 0 ? (int32_t)((p_es->pts - p_es->dts) & TS_PTS_MASK) : 0;
+    ent.flags         = ts2es_au_keyframe(p_es, es_ptr, es_len) > 0 ? TS2ES_INDEX_KEY : 0;
+    index_append(h_ts, p_es, &ent);
+}
+
+/* ---------------------------------------------------------------------------
+ * Take over the entries of the same ES demuxed in a chunk, which follow the
+ * ES data collected so far
+ */
+void ts2es_index_merge(ts2es_t *h_ts, ts2es_es_t *p_dst, ts2es_es_t *p_src)
+{
+    ts2es_index_t *p_idx = p_src->index;
+    int i;
+
+    if (p_idx == NULL) {
+        return;
+    }
+    for (i = 0; i < p_idx->n_entries; i++) {
+        ts2es_index_entry_t ent = p_idx->entries[i];
+        ent.es_offset += p_dst->es_bytes;
+        index_append(h_ts, p_dst, &ent);
+    }
+    p_idx->n_entries = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Write the last entries of an ES and free its index; the entries of a chunk
+ * handle are dropped
+ */
+void ts2es_index_close(ts2es_t *h_ts, ts2es_es_t *p_es)
+{
+    ts2es_index_t *p_idx = p_es->index;
+
+    if (p_idx == NULL) {
+        return;
+    }
+    if (h_ts->chunk == NULL && p_idx->n_entries > 0) {
+        index_write(h_ts, p_es, p_idx);
+    }
+    if (p_idx->fp != NULL) {
+        fclose(p_idx->fp);
+    }
+    free(p_idx->entries);
+    free(p_idx);
+    p_es->index = NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Read an entry of an index file (mapped or read into memory)
+ * returns 1 on success, or 0 if "i" is beyond the entries
+ */
+int ts2es_index_entry(const uint8_t *idx, size_t idx_len, size_t i, ts2es_index_entry_t *p_ent)
+{
+    const uint8_t *p;
+
+    if (idx_len < TS2ES_INDEX_HEADER_SIZE || memcmp(idx, TS2ES_INDEX_MAGIC, 8) != 0 ||
+        i >= (idx_len - TS2ES_INDEX_HEADER_SIZE) / TS2ES_INDEX_ENTRY_SIZE) {
+        return 0;
+    }
+    p = idx + TS2ES_INDEX_HEADER_SIZE + i * TS2ES_INDEX_ENTRY_SIZE;
+    p_ent->ts_offset     = get_le64(p);
+    p_ent->es_offset     = get_le64(p + 8);
+    p_ent->pts           = (int64_t)get_le64(p + 16);
+    p_ent->pts_minus_dts = (int32_t)get_le32(p + 24);
+    p_ent->flags         = get_le32(p + 28);
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Find where to start decoding to present "pts": the last key entry whose
+ * DTS is not after it. DTS increase along the file once counted from the
+ * first one, across a wraparound, so they are bisected
+ * returns the number of the entry, or -1 if there is none
+ */
+int64_t ts2es_index_seek(const uint8_t *idx, size_t idx_len, int64_t pts)
+{
+    ts2es_index_entry_t ent;
+    size_t lo = 0, hi, k;
+    int64_t t0 = -1;
+
+    if (idx_len < TS2ES_INDEX_HEADER_SIZE || memcmp(idx, TS2ES_INDEX_MAGIC, 8) != 0) {
+        return -1;
+    }
+    hi = (idx_len - TS2ES_INDEX_HEADER_SIZE) / TS2ES_INDEX_ENTRY_SIZE;
+
+    for (k = 0; k < hi && t0 < 0; k++) {
+        ts2es_index_entry(idx, idx_len, k, &ent);
+        t0 = ent.pts >= 0 ? (ent.pts - ent.pts_minus_dts) & TS_PTS_MASK : -1;
+    }
+    if (t0 < 0 || ((pts - t0) & TS_PTS_MASK) > (TS_PTS_MASK >> 1)) {
+        return -1;      // no timestamps, or "pts" is before the first DTS
+    }
+    pts = (pts - t0) & TS_PTS_MASK;
+
+    // first entry with a DTS after "pts", entries without timestamps are skipped
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        k = mid;
+        while (k < hi && ts2es_index_entry(idx, idx_len, k, &ent) && ent.pts < 0) {
+            k++;
+        }
+        if (k < hi && ((ent.pts - ent.pts_minus_dts - t0) & TS_PTS_MASK) <= pts) {
+            lo = k + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    while (lo-- > 0) {
+        ts2es_index_entry(idx, idx_len, lo, &ent);
+        if (ent.flags & TS2ES_INDEX_KEY) {
+            return (int64_t)lo;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,527 @@
+/*
+    ts_log.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Reports. Without param.b_log_async a report is formatted and written by the
+ * calling thread. With it, the caller only copies the format pointer and the
+ * arguments into a record of the handle's ring, which any number of threads
+ * fill without locks; one background thread, shared by all handles, formats
+ * and writes the records. Errors are written at once, after the records
+ * before them, as the caller may exit right after.
+ * The format of a report must be a string literal, it is read later.
+ */
+#include "ts2es.h"
+#include "ts_thread.h"
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define snprintf    _snprintf
+#endif
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define LOG_RING_SLOTS          1024    // records per handle, power of 2
+#define LOG_MAX_ARGS            8       // more arguments are formatted at once
+#define LOG_DATA_SIZE           192     // copied strings of a record
+#define LOG_LINE_SIZE           1024
+
+enum log_arg_e {
+    LOG_ARG_NONE = 0,   // "%%"
+    LOG_ARG_INT,        // also char and short, promoted to int
+    LOG_ARG_LONG,
+    LOG_ARG_LLONG,
+    LOG_ARG_SIZE,
+    LOG_ARG_INTMAX,
+    LOG_ARG_PTRDIFF,
+    LOG_ARG_DOUBLE,
+    LOG_ARG_LDOUBLE,
+    LOG_ARG_PTR,
+    LOG_ARG_STR,
+};
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+typedef union log_arg_t {
+    int          i;
+    long         l;
+    long long    ll;
+    size_t       z;
+    intmax_t     j;
+    ptrdiff_t    t;
+    double       d;
+    long double  ld;
+    const void  *p;
+    int          s;         // offset of the string in log_rec_t::data
+} log_arg_t;
+
+typedef struct log_rec_t {
+    uint32_t     seq;       // == position + 1 once the record is written
+    int          i_type;
+    const char  *format;    // NULL: data holds the formatted text
+    log_arg_t    args[LOG_MAX_ARGS];
+    char         data[LOG_DATA_SIZE];
+} log_rec_t;
+
+struct ts2es_log_t {
+    ts2es_log_t *next;      // in the list of the background thread
+    uint8_t      pad0[56];
+    uint32_t     head;      // next position to write, taken by producers
+    uint8_t      pad1[60];
+    uint32_t     tail;      // next position to read, owned by the consumer
+    uint32_t     num_dropped;
+    log_rec_t    recs[LOG_RING_SLOTS];
+};
+
+typedef struct log_thread_t {
+    int          state;     // 0: not set up, 1: being set up, 2: ready
+    ts2es_mutex_t lock;     // held while draining, so there is one consumer
+    ts2es_log_t *rings;
+    int         *p_stop;    // stop flag of the running thread, NULL if none
+    ts2es_thread_t thread;
+} log_thread_t;
+
+static log_thread_t g_log;
+
+/* ---------------------------------------------------------------------------
+ * write one line to stderr
+ */
+static void log_write(int i_type, const char *text)
+{
+#ifdef _WIN32
+    static const int color_1 = FOREGROUND_RED | FOREGROUND_GREEN;  // 
+    static const int color_2 = FOREGROUND_RED | FOREGROUND_BLUE;   // 
+    static const int color_3 = FOREGROUND_GREEN | FOREGROUND_BLUE; // ǳ
+    int si_color[] = {
+        color_1, color_3, color_2, FOREGROUND_RED
+    };
+#endif
+
+    static const char s_type_info[][20] = {
+        "debug", "info", "warning", "error"
+    };
+    int k = (int)strlen(text);
+
+    if (k > 1 && text[k - 1] == '\n') {
+        k--;
+    }
+
+#ifdef _WIN32
+    SetConsoleTextAttribute(GetStdHandle(STD_ERROR_HANDLE), FOREGROUND_INTENSITY | si_color[i_type]);
+    fprintf(stderr, "[ts2es] %s: %.*s\n", s_type_info[i_type], k, text);
+    SetConsoleTextAttribute(GetStdHandle(STD_ERROR_HANDLE), FOREGROUND_INTENSITY | FOREGROUND_GREEN);
+#else
+    fprintf(stderr, "[ts2es] %s: %.*s\n", s_type_info[i_type], k, text);
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * parse the conversion specification at p, just after '%'
+ * returns the end of the specification, with its argument type in *p_type
+ * and the number of '*' fields in *p_stars
+ */
+static const char *log_parse_spec(const char *p, int *p_type, int *p_stars)
+{
+    int n_l = 0;
+    int len_mod = 0;
+
+    *p_stars = 0;
+    while (*p && strchr("-+ #0", *p)) {
+        p++;
+    }
+    for (; *p == '*' || (*p >= '0' && *p <= '9') || *p == '.'; p++) {
+        *p_stars += (*p == '*');
+    }
+    for (; *p && strchr("hlzjtL", *p); p++) {
+        n_l += (*p == 'l');
+        len_mod = *p;
+    }
+
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o':
+        *p_type = n_l >= 2 ? LOG_ARG_LLONG : n_l == 1 ? LOG_ARG_LONG :
+                  len_mod == 'z' ? LOG_ARG_SIZE : len_mod == 'j' ? LOG_ARG_INTMAX :
+                  len_mod == 't' ? LOG_ARG_PTRDIFF : LOG_ARG_INT;
+        break;
+    case 'c':
+        *p_type = LOG_ARG_INT;
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+        *p_type = len_mod == 'L' ? LOG_ARG_LDOUBLE : LOG_ARG_DOUBLE;
+        break;
+    case 'p':
+        *p_type = LOG_ARG_PTR;
+        break;
+    case 's':
+        *p_type = LOG_ARG_STR;
+        break;
+    case '%':
+        *p_type = LOG_ARG_NONE;
+        break;
+    default:
+        *p_type = -1;       // "%n" or unknown
+        return p;
+    }
+    return p + 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * copy the arguments of a report into a record
+ * returns 1 on success, or 0 if the record cannot hold them
+ */
+static int log_capture(log_rec_t *p_rec, const char *format, va_list ap)
+{
+    const char *p = format;
+    int n_args = 0;
+    int n_data = 0;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        int i_type, n_stars;
+
+        p = log_parse_spec(p + 1, &i_type, &n_stars);
+        if (i_type < 0 || n_args + n_stars + (i_type != LOG_ARG_NONE) > LOG_MAX_ARGS) {
+            return 0;
+        }
+        for (; n_stars > 0; n_stars--) {
+            p_rec->args[n_args++].i = va_arg(ap, int);
+        }
+
+        switch (i_type) {
+        case LOG_ARG_INT:     p_rec->args[n_args++].i  = va_arg(ap, int);           break;
+        case LOG_ARG_LONG:    p_rec->args[n_args++].l  = va_arg(ap, long);          break;
+        case LOG_ARG_LLONG:   p_rec->args[n_args++].ll = va_arg(ap, long long);     break;
+        case LOG_ARG_SIZE:    p_rec->args[n_args++].z  = va_arg(ap, size_t);        break;
+        case LOG_ARG_INTMAX:  p_rec->args[n_args++].j  = va_arg(ap, intmax_t);      break;
+        case LOG_ARG_PTRDIFF: p_rec->args[n_args++].t  = va_arg(ap, ptrdiff_t);     break;
+        case LOG_ARG_DOUBLE:  p_rec->args[n_args++].d  = va_arg(ap, double);        break;
+        case LOG_ARG_LDOUBLE: p_rec->args[n_args++].ld = va_arg(ap, long double);   break;
+        case LOG_ARG_PTR:     p_rec->args[n_args++].p  = va_arg(ap, void *);        break;
+        case LOG_ARG_STR: {
+            const char *s = va_arg(ap, const char *);
+            int len = (int)strlen(s != NULL ? s : "(null)");
+            if (n_data + len + 1 > LOG_DATA_SIZE) {
+                return 0;
+            }
+            memcpy(p_rec->data + n_data, s != NULL ? s : "(null)", len + 1);
+            p_rec->args[n_args++].s = n_data;
+            n_data += len + 1;
+            break;
+        }
+        default:
+            break;
+        }
+    }
+
+    p_rec->format = format;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * format a record, one conversion at a time
+ */
+static void log_format(const log_rec_t *p_rec, char *buff, int size)
+{
+    const char *p = p_rec->format;
+    int n_args = 0;
+    int n = 0;
+
+    if (p == NULL) {
+        snprintf(buff, size, "%s", p_rec->data);
+        buff[size - 1] = '\0';
+        return;
+    }
+
+    while (*p && n < size - 1) {
+        char spec[64];
+        const char *q;
+        int i_type, n_stars, len, k;
+
+        if (*p != '%') {
+            buff[n++] = *p++;
+            continue;
+        }
+
+        // copy the specification, with the '*' fields replaced by their values
+        q = log_parse_spec(p + 1, &i_type, &n_stars);
+        for (len = 0, k = 0; p < q && len < (int)sizeof(spec) - 12; p++) {
+            if (*p == '*') {
+                len += sprintf(spec + len, "%d", p_rec->args[n_args + k++].i);
+            } else {
+                spec[len++] = *p;
+            }
+        }
+        spec[len] = '\0';
+        n_args += n_stars;
+
+        switch (i_type) {
+        case LOG_ARG_NONE:    len = snprintf(buff + n, size - n, "%%");                                break;
+        case LOG_ARG_INT:     len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].i);      break;
+        case LOG_ARG_LONG:    len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].l);      break;
+        case LOG_ARG_LLONG:   len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].ll);     break;
+        case LOG_ARG_SIZE:    len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].z);      break;
+        case LOG_ARG_INTMAX:  len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].j);      break;
+        case LOG_ARG_PTRDIFF: len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].t);      break;
+        case LOG_ARG_DOUBLE:  len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].d);      break;
+        case LOG_ARG_LDOUBLE: len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].ld);     break;
+        case LOG_ARG_PTR:     len = snprintf(buff + n, size - n, spec, p_rec->args[n_args++].p);      break;
+        case LOG_ARG_STR:     len = snprintf(buff + n, size - n, spec, p_rec->data + p_rec->args[n_args++].s); break;
+        default:              len = 0;                                                                break;
+        }
+        if (len < 0 || len >= size - n) {
+            n = size - 1;   // truncated
+            break;
+        }
+        n += len;
+    }
+    buff[n] = '\0';
+}
+
+/* ---------------------------------------------------------------------------
+ * format and write the records of a ring written so far, with g_log.lock held
+ * returns the number of records
+ */
+static int log_drain(ts2es_log_t *p_log)
+{
+    char buff[LOG_LINE_SIZE];
+    uint32_t num_dropped;
+    int n = 0;
+
+    for (;;) {
+        log_rec_t *p_rec = &p_log->recs[p_log->tail & (LOG_RING_SLOTS - 1)];
+        if (ts2es_atomic_load(&p_rec->seq) != p_log->tail + 1) {
+            break;
+        }
+        log_format(p_rec, buff, sizeof(buff));
+        log_write(p_rec->i_type, buff);
+        ts2es_atomic_store(&p_rec->seq, p_log->tail + LOG_RING_SLOTS);
+        p_log->tail++;
+        n++;
+    }
+
+    if ((num_dropped = ts2es_atomic_load(&p_log->num_dropped)) != 0) {
+        ts2es_atomic_add(&p_log->num_dropped, (uint32_t)0 - num_dropped);
+        snprintf(buff, sizeof(buff), "%u reports dropped, the log ring was full", num_dropped);
+        buff[sizeof(buff) - 1] = '\0';
+        log_write(TS2ES_WARNING, buff);
+    }
+    return n;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void *log_thread_proc(void *arg)
+{
+    int *p_stop = (int *)arg;
+
+    for (;;) {
+        ts2es_log_t *p_log;
+        int n = 0;
+        int b_stop;
+
+        ts2es_mutex_lock(&g_log.lock);
+        for (p_log = g_log.rings; p_log != NULL; p_log = p_log->next) {
+            n += log_drain(p_log);
+        }
+        b_stop = *p_stop;
+        ts2es_mutex_unlock(&g_log.lock);
+
+        if (b_stop) {
+            break;
+        }
+        if (n == 0) {
+            fflush(stderr);
+            ts2es_sleep_ms(1);
+        }
+    }
+    free(p_stop);
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * set up the lock of the background thread once
+ */
+static void log_init(void)
+{
+    if (ts2es_atomic_load(&g_log.state) == 2) {
+        return;
+    }
+    if (ts2es_atomic_cas(&g_log.state, 0, 1)) {
+        ts2es_mutex_init(&g_log.lock);
+        ts2es_atomic_store(&g_log.state, 2);
+    }
+    while (ts2es_atomic_load(&g_log.state) != 2) {
+        ts2es_thread_yield();
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * report, see ts2es_report()
+ */
+void ts2es_log(ts2es_t *h_ts, int i_type, const char *format, ...)
+{
+    ts2es_log_t *p_log = h_ts != NULL ? h_ts->log : NULL;
+    va_list ap;
+
+    i_type &= TS2ES_INFO_TYPE_MASK;
+    va_start(ap, format);
+
+    if (p_log != NULL && i_type < TS2ES_ERROR) {
+        uint32_t pos = ts2es_atomic_load(&p_log->head);
+        log_rec_t *p_rec;
+
+        // take a free record, or drop the report if the ring is full
+        for (;;) {
+            int32_t dif;
+            p_rec = &p_log->recs[pos & (LOG_RING_SLOTS - 1)];
+            dif = (int32_t)(ts2es_atomic_load(&p_rec->seq) - pos);
+            if (dif == 0 && ts2es_atomic_cas(&p_log->head, pos, pos + 1)) {
+                break;
+            } else if (dif < 0) {
+                ts2es_atomic_add(&p_log->num_dropped, 1);
+                va_end(ap);
+                return;
+            }
+            pos = ts2es_atomic_load(&p_log->head);
+        }
+
+        p_rec->i_type = i_type;
+        {
+            va_list aq;
+            int ok;
+            va_copy(aq, ap);
+            ok = log_capture(p_rec, format, aq);
+            va_end(aq);
+            if (!ok) {
+                vsnprintf(p_rec->data, sizeof(p_rec->data), format, ap);
+                p_rec->data[sizeof(p_rec->data) - 1] = '\0';
+                p_rec->format = NULL;
+            }
+        }
+        ts2es_atomic_store(&p_rec->seq, pos + 1);
+    } else {
+        char buff[LOG_LINE_SIZE];
+
+        vsnprintf(buff, sizeof(buff), format, ap);
+        buff[sizeof(buff) - 1] = '\0';
+        if (p_log != NULL) {
+            // keep the order of the reports of the handle
+            ts2es_mutex_lock(&g_log.lock);
+            log_drain(p_log);
+            log_write(i_type, buff);
+            fflush(stderr);
+            ts2es_mutex_unlock(&g_log.lock);
+        } else {
+            log_write(i_type, buff);
+        }
+    }
+
+    va_end(ap);
+}
+
+/* ---------------------------------------------------------------------------
+ * set up the log ring of a handle, and the background thread if not running
+ * returns the ring, or NULL on failure
+ */
+ts2es_log_t *ts2es_log_open(void)
+{
+    ts2es_log_t *p_log = (ts2es_log_t *)calloc(1, sizeof(ts2es_log_t));
+    uint32_t i;
+
+    if (p_log == NULL) {
+        return NULL;
+    }
+    for (i = 0; i < LOG_RING_SLOTS; i++) {
+        p_log->recs[i].seq = i;
+    }
+
+    log_init();
+    ts2es_mutex_lock(&g_log.lock);
+    if (g_log.p_stop == NULL) {
+        int *p_stop = (int *)calloc(1, sizeof(int));
+        if (p_stop == NULL || !ts2es_thread_create(&g_log.thread, log_thread_proc, p_stop)) {
+            ts2es_mutex_unlock(&g_log.lock);
+            free(p_stop);
+            free(p_log);
+            return NULL;
+        }
+        g_log.p_stop = p_stop;
+    }
+    p_log->next = g_log.rings;
+    g_log.rings = p_log;
+    ts2es_mutex_unlock(&g_log.lock);
+
+    return p_log;
+}
+
+/* ---------------------------------------------------------------------------
+ * write out the records of a ring written so far
+ */
+void ts2es_log_flush(ts2es_log_t *p_log)
+{
+    if (p_log != NULL) {
+        ts2es_mutex_lock(&g_log.lock);
+        log_drain(p_log);
+        fflush(stderr);
+        ts2es_mutex_unlock(&g_log.lock);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * write out the pending records of a ring and free it, the background thread
+ * stops with the last ring
+ */
+void ts2es_log_close(ts2es_log_t *p_log)
+{
+    ts2es_log_t **pp;
+    ts2es_thread_t thread;
+    int b_join = 0;
+
+    if (p_log == NULL) {
+        return;
+    }
+
+    ts2es_mutex_lock(&g_log.lock);
+    log_drain(p_log);
+    fflush(stderr);
+    for (pp = &g_log.rings; *pp != NULL; pp = &(*pp)->next) {
+        if (*pp == p_log) {
+            *pp = p_log->next;
+            break;
+        }
+    }
+    if (g_log.rings == NULL && g_log.p_stop != NULL) {
+        // a new thread may be started before this one is joined
+        *g_log.p_stop = 1;
+        g_log.p_stop  = NULL;
+        thread = g_log.thread;
+        b_join = 1;
+    }
+    ts2es_mutex_unlock(&g_log.lock);
+
+    if (b_join) {
+        ts2es_thread_join(thread);
+    }
+    free(p_log);
+}
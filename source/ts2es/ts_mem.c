@@ -0,0 +1,228 @@
+/*
+    ts_mem.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Slab pool for ES buffers, shared by all ts2es_t instances of the process.
+ * Buffers come in power-of-two size classes from ES_MIN_SIZE to ES_MAX_SIZE;
+ * freed buffers are kept on a free list per class, up to MEM_POOL_MAX_CACHED
+ * bytes in total, and handed out again before new memory is allocated.
+ * Handles are allocated here too, aligned to a cache line; the free lists are
+ * emptied when the last handle is freed, so that an idle process keeps no
+ * ES memory.
+ */
+#include "ts2es.h"
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#define MEM_LOCK(l)     while (InterlockedExchange(&(l), 1)) { Sleep(0); }
+#define MEM_UNLOCK(l)   InterlockedExchange(&(l), 0)
+typedef volatile LONG mem_lock_t;
+#else
+#include <sched.h>
+#define MEM_LOCK(l)     while (__sync_lock_test_and_set(&(l), 1)) { sched_yield(); }
+#define MEM_UNLOCK(l)   __sync_lock_release(&(l))
+typedef volatile int mem_lock_t;
+#endif
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define MEM_NUM_CLASSES         11                  /* ES_MIN_SIZE << 10 == ES_MAX_SIZE */
+#define MEM_ALIGN               32                  /* alignment of the buffers */
+#define MEM_POOL_MAX_CACHED     (256 << 20)         /* bytes kept on the free lists */
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+typedef struct mem_block_t mem_block_t;
+struct mem_block_t {
+    mem_block_t *next;      // next free block of the same class
+    int          i_class;   // size class
+};
+
+typedef struct mem_pool_t {
+    mem_lock_t   lock;
+    mem_block_t *free_list[MEM_NUM_CLASSES];
+    size_t       cached;    // bytes on the free lists
+    int          handles;   // handles allocated and not freed yet
+} mem_pool_t;
+
+static mem_pool_t g_pool;
+
+/* ---------------------------------------------------------------------------
+ */
+static int mem_size_class(size_t size)
+{
+    int i_class = 0;
+    while (i_class < MEM_NUM_CLASSES - 1 && ((size_t)ES_MIN_SIZE << i_class) < size) {
+        i_class++;
+    }
+    return i_class;
+}
+
+/* ---------------------------------------------------------------------------
+ * buffer data follows the block header at the next aligned address
+ */
+static uint8_t *mem_block_data(mem_block_t *p_block)
+{
+    uint8_t *p = (uint8_t *)(p_block + 1) + sizeof(mem_block_t *);
+    p = (uint8_t *)((intptr_t)(p + MEM_ALIGN - 1) & (~(intptr_t)(MEM_ALIGN - 1)));
+    ((mem_block_t **)p)[-1] = p_block;
+    return p;
+}
+
+/* ---------------------------------------------------------------------------
+ * get a buffer of at least "size" bytes, size is limited to ES_MAX_SIZE
+ * returns the buffer and its capacity, or NULL if out of memory
+ */
+uint8_t *ts2es_mem_alloc(size_t size, uint32_t *p_capacity)
+{
+    int i_class = mem_size_class(size);
+    size_t capacity = (size_t)ES_MIN_SIZE << i_class;
+    mem_block_t *p_block;
+
+    if (size > ES_MAX_SIZE) {
+        return NULL;
+    }
+
+    MEM_LOCK(g_pool.lock);
+    p_block = g_pool.free_list[i_class];
+    if (p_block != NULL) {
+        g_pool.free_list[i_class] = p_block->next;
+        g_pool.cached -= capacity;
+    }
+    MEM_UNLOCK(g_pool.lock);
+
+    if (p_block == NULL) {
+        p_block = (mem_block_t *)malloc(sizeof(mem_block_t) + sizeof(mem_block_t *) + MEM_ALIGN + capacity);
+        if (p_block == NULL) {
+            return NULL;
+        }
+        p_block->i_class = i_class;
+    }
+
+    p_block->next = NULL;
+    *p_capacity   = (uint32_t)capacity;
+    return mem_block_data(p_block);
+}
+
+/* ---------------------------------------------------------------------------
+ * return a buffer to the pool
+ */
+void ts2es_mem_free(uint8_t *p)
+{
+    mem_block_t *p_block;
+    size_t capacity;
+
+    if (p == NULL) {
+        return;
+    }
+
+    p_block  = ((mem_block_t **)p)[-1];
+    capacity = (size_t)ES_MIN_SIZE << p_block->i_class;
+
+    MEM_LOCK(g_pool.lock);
+    if (g_pool.handles > 0 && g_pool.cached + capacity <= MEM_POOL_MAX_CACHED) {
+        p_block->next = g_pool.free_list[p_block->i_class];
+        g_pool.free_list[p_block->i_class] = p_block;
+        g_pool.cached += capacity;
+        p_block = NULL;
+    }
+    MEM_UNLOCK(g_pool.lock);
+
+    free(p_block);      // pool is full, or no handle is left
+}
+
+/* ---------------------------------------------------------------------------
+ * free the buffers on the free lists
+ */
+static void mem_pool_trim(void)
+{
+    mem_block_t *free_list[MEM_NUM_CLASSES];
+    int i;
+
+    MEM_LOCK(g_pool.lock);
+    memcpy(free_list, g_pool.free_list, sizeof(free_list));
+    memset(g_pool.free_list, 0, sizeof(g_pool.free_list));
+    g_pool.cached = 0;
+    MEM_UNLOCK(g_pool.lock);
+
+    for (i = 0; i < MEM_NUM_CLASSES; i++) {
+        while (free_list[i] != NULL) {
+            mem_block_t *p_block = free_list[i];
+            free_list[i] = p_block->next;
+            free(p_block);
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * free a handle, and the cached buffers with the last one
+ */
+void ts2es_handle_free(ts2es_t *h_ts)
+{
+    int handles;
+
+    if (h_ts != NULL) {
+        free(h_ts->psi_pat);
+        free(h_ts->programs);
+        free(((uint8_t **)h_ts)[-1]);
+
+        MEM_LOCK(g_pool.lock);
+        handles = --g_pool.handles;
+        MEM_UNLOCK(g_pool.lock);
+        if (handles == 0) {
+            mem_pool_trim();
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * get a zeroed handle, aligned to TS2ES_CACHE_LINE, with the section buffers
+ * of its PSI allocated apart
+ * returns the handle, to be freed with ts2es_handle_free(), or NULL if out of
+ * memory
+ */
+ts2es_t *ts2es_handle_alloc(void)
+{
+    uint8_t *mem = (uint8_t *)calloc(1, sizeof(ts2es_t) + TS2ES_CACHE_LINE);
+    ts2es_t *h_ts;
+
+    if (mem == NULL) {
+        return NULL;
+    }
+    // the pointer to free is kept in front of the handle, as for the buffers
+    h_ts = (ts2es_t *)((intptr_t)(mem + TS2ES_CACHE_LINE) & (~(intptr_t)(TS2ES_CACHE_LINE - 1)));
+    ((uint8_t **)h_ts)[-1] = mem;
+
+    MEM_LOCK(g_pool.lock);
+    g_pool.handles++;
+    MEM_UNLOCK(g_pool.lock);
+
+    h_ts->psi_pat  = (ts2es_psi_t *)calloc(1, sizeof(ts2es_psi_t));
+    h_ts->programs = (ts2es_program_t *)calloc(MAX_NUM_PROGRAMS, sizeof(ts2es_program_t));
+    if (h_ts->psi_pat == NULL || h_ts->programs == NULL) {
+        ts2es_handle_free(h_ts);
+        return NULL;
+    }
+    return h_ts;
+}
@@ -0,0 +1,778 @@
+/*
+    ts_probe.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * Probe: the PSI is decoded on a handle of its own, and the streams of the
+ * PMTs are followed from their first PES. The ES data of a PES is kept until
+ * the sequence header of a video stream (MPEG-1/2, AVC, HEVC, AVS, AVS2) or
+ * an audio frame header (MPEG audio, ADTS AAC, AC-3) is found in it; nothing
+ * is output. Other streams are done at their first PES, streams of sections
+ * at once. Scanning stops as soon as all streams are done.
+ */
+#include "ts2es.h"
+#include "mpa_header.h"
+#include <string.h>
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define PROBE_BLOCK_SIZE    (1 << 20)   // read at a time by ts2es_probe_file()
+#define PROBE_ES_SIZE       (64 << 10)  // ES data kept from the start of a PES
+#define PROBE_HEADER_SIZE   256         // ES data parsed from a start code at most
+// bytes kept for the next block if the TS sync is not found
+#define PROBE_SYNC_KEEP     (TS_PACKET_SIZE_RS * (TS_SYNC_CHECK + 1))
+
+enum probe_codec_e {
+    PROBE_CODEC_NONE = 0,   // sections, no PES to wait for
+    PROBE_CODEC_PES  = 1,   // done at the first PES
+    PROBE_CODEC_MPA  = 2,   // MPEG audio
+    PROBE_CODEC_ADTS = 3,   // AAC in ADTS
+    PROBE_CODEC_AC3  = 4,
+    PROBE_CODEC_MPV  = 5,   // MPEG-1/2 video
+    PROBE_CODEC_AVC  = 6,
+    PROBE_CODEC_HEVC = 7,
+    PROBE_CODEC_AVS  = 8,
+    PROBE_CODEC_AVS2 = 9,
+};
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+typedef struct probe_es_t {
+    int      codec;
+    int      b_pes;         // collecting the ES data of a PES
+    int      b_done;
+    uint8_t *buf;           // PROBE_ES_SIZE bytes, allocated at the first PES
+    size_t   len;
+    size_t   scan;          // next byte to look for a header at
+} probe_es_t;
+
+typedef struct probe_ctx_t {
+    ts2es_t       *h_ts;    // PSI decoding only
+    ts2es_probe_t *p_probe;
+    uint16_t       pid_map[TS_NUM_PIDS];    // entries of ts2es_t::pid_map, ES index in p_probe->es[]
+    probe_es_t     es[TS2ES_PROBE_MAX_ES];
+} probe_ctx_t;
+
+typedef struct probe_bits_t {
+    const uint8_t *p;
+    size_t   len;           // in bytes
+    size_t   pos;           // in bits
+} probe_bits_t;
+
+/* ---------------------------------------------------------------------------
+ * bit reader, reads beyond the end return zeros
+ */
+static uint32_t bits_read(probe_bits_t *p_bits, int n)
+{
+    uint32_t v = 0;
+    while (n-- > 0) {
+        size_t byte = p_bits->pos >> 3;
+        int bit = byte < p_bits->len ? (p_bits->p[byte] >> (7 - (p_bits->pos & 7))) & 1 : 0;
+        v = (v << 1) | bit;
+        p_bits->pos++;
+    }
+    return v;
+}
+
+static uint32_t bits_ue(probe_bits_t *p_bits)
+{
+    int zeros = 0;
+    while (bits_read(p_bits, 1) == 0 && zeros < 32) {
+        if (p_bits->pos >= p_bits->len << 3) {
+            return 0;
+        }
+        zeros++;
+    }
+    return zeros ? ((1u << zeros) - 1) + bits_read(p_bits, zeros) : 0;
+}
+
+static int32_t bits_se(probe_bits_t *p_bits)
+{
+    uint32_t v = bits_ue(p_bits);
+    return v & 1 ? (int32_t)((v + 1) >> 1) : -(int32_t)(v >> 1);
+}
+
+static int bits_ok(probe_bits_t *p_bits)
+{
+    return p_bits->pos <= p_bits->len << 3;
+}
+
+/* ---------------------------------------------------------------------------
+ * copy the payload of a NAL unit without its emulation prevention bytes
+ * returns the length of the copy
+ */
+static size_t nal_to_rbsp(const uint8_t *p, size_t len, uint8_t *rbsp, size_t max_len)
+{
+    size_t i, n = 0, zeros = 0;
+
+    for (i = 0; i < len && n < max_len; i++) {
+        if (zeros >= 2 && p[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = p[i] == 0 ? zeros + 1 : 0;
+        rbsp[n++] = p[i];
+    }
+    return n;
+}
+
+/* ---------------------------------------------------------------------------
+ * picture size in an AVC sequence parameter set, p follows the NAL header
+ */
+static int parse_avc_sps(const uint8_t *p, size_t len, ts2es_probe_es_t *p_info)
+{
+    uint8_t rbsp[PROBE_HEADER_SIZE];
+    probe_bits_t bits;
+    int profile_idc, chroma_format_idc = 1, b_separate = 0, frame_mbs_only;
+    int width_mbs, height_units, crop_x = 0, crop_y = 0;
+    int i, j;
+
+    bits.p   = rbsp;
+    bits.len = nal_to_rbsp(p, len, rbsp, sizeof(rbsp));
+    bits.pos = 0;
+
+    profile_idc = bits_read(&bits, 8);
+    bits_read(&bits, 16);               // constraint flags, level_idc
+    bits_ue(&bits);                     // seq_parameter_set_id
+    if (profile_idc == 100 || profile_idc == 110 || profile_idc == 122 || profile_idc == 244 ||
+        profile_idc == 44 || profile_idc == 83 || profile_idc == 86 || profile_idc == 118 ||
+        profile_idc == 128 || profile_idc == 138 || profile_idc == 139 || profile_idc == 134 ||
+        profile_idc == 135) {
+        chroma_format_idc = bits_ue(&bits);
+        if (chroma_format_idc == 3) {
+            b_separate = bits_read(&bits, 1);
+        }
+        bits_ue(&bits);                 // bit_depth_luma_minus8
+        bits_ue(&bits);                 // bit_depth_chroma_minus8
+        bits_read(&bits, 1);            // qpprime_y_zero_transform_bypass_flag
+        if (bits_read(&bits, 1)) {      // seq_scaling_matrix_present_flag
+            for (i = 0; i < (chroma_format_idc != 3 ? 8 : 12); i++) {
+                if (bits_read(&bits, 1)) {
+                    int last = 8, next = 8;
+                    for (j = 0; j < (i < 6 ? 16 : 64) && next != 0; j++) {
+                        next = (last + bits_se(&bits) + 256) % 256;
+                        last = next == 0 ? last : next;
+                    }
+                }
+            }
+        }
+    }
+    bits_ue(&bits);                     // log2_max_frame_num_minus4
+    switch (bits_ue(&bits)) {           // pic_order_cnt_type
+    case 0:
+        bits_ue(&bits);
+        break;
+    case 1: {
+        uint32_t n;
+        bits_read(&bits, 1);
+        bits_se(&bits);
+        bits_se(&bits);
+        n = bits_ue(&bits);
+        for (i = 0; i < (int)n && i < 256; i++) {
+            bits_se(&bits);
+        }
+        break;
+    }
+    default:
+        break;
+    }
+    bits_ue(&bits);                     // max_num_ref_frames
+    bits_read(&bits, 1);                // gaps_in_frame_num_value_allowed_flag
+    width_mbs      = bits_ue(&bits) + 1;
+    height_units   = bits_ue(&bits) + 1;
+    frame_mbs_only = bits_read(&bits, 1);
+    if (!frame_mbs_only) {
+        bits_read(&bits, 1);            // mb_adaptive_frame_field_flag
+    }
+    bits_read(&bits, 1);                // direct_8x8_inference_flag
+    if (bits_read(&bits, 1)) {          // frame_cropping_flag
+        int left = bits_ue(&bits), right = bits_ue(&bits);
+        int top = bits_ue(&bits), bottom = bits_ue(&bits);
+        int unit_x = 1, unit_y = 2 - frame_mbs_only;
+        if (!b_separate && chroma_format_idc != 0) {
+            unit_x  = chroma_format_idc == 3 ? 1 : 2;
+            unit_y *= chroma_format_idc == 1 ? 2 : 1;
+        }
+        crop_x = unit_x * (left + right);
+        crop_y = unit_y * (top + bottom);
+    }
+    if (!bits_ok(&bits)) {
+        return 0;
+    }
+    p_info->width  = width_mbs * 16 - crop_x;
+    p_info->height = (2 - frame_mbs_only) * height_units * 16 - crop_y;
+    return p_info->width > 0 && p_info->height > 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * picture size in an HEVC sequence parameter set, p follows the NAL header
+ */
+static int parse_hevc_sps(const uint8_t *p, size_t len, ts2es_probe_es_t *p_info)
+{
+    uint8_t rbsp[PROBE_HEADER_SIZE];
+    probe_bits_t bits;
+    int max_sub_layers, chroma_format_idc, width, height;
+    int b_profile[8], b_level[8];
+    int i;
+
+    bits.p   = rbsp;
+    bits.len = nal_to_rbsp(p, len, rbsp, sizeof(rbsp));
+    bits.pos = 0;
+
+    bits_read(&bits, 4);                // sps_video_parameter_set_id
+    max_sub_layers = bits_read(&bits, 3);
+    bits_read(&bits, 1);                // sps_temporal_id_nesting_flag
+
+    // profile_tier_level(): general profile and level, then the sub-layers
+    bits.pos += 88 + 8;
+    for (i = 0; i < max_sub_layers; i++) {
+        b_profile[i] = bits_read(&bits, 1);
+        b_level[i]   = bits_read(&bits, 1);
+    }
+    if (max_sub_layers > 0) {
+        bits.pos += 2 * (8 - max_sub_layers);
+    }
+    for (i = 0; i < max_sub_layers; i++) {
+        bits.pos += (b_profile[i] ? 88 : 0) + (b_level[i] ? 8 : 0);
+    }
+
+    bits_ue(&bits);                     // sps_seq_parameter_set_id
+    chroma_format_idc = bits_ue(&bits);
+    if (chroma_format_idc == 3) {
+        bits_read(&bits, 1);            // separate_colour_plane_flag
+    }
+    width  = bits_ue(&bits);
+    height = bits_ue(&bits);
+    if (bits_read(&bits, 1)) {          // conformance_window_flag
+        int left = bits_ue(&bits), right = bits_ue(&bits);
+        int top = bits_ue(&bits), bottom = bits_ue(&bits);
+        width  -= (chroma_format_idc == 1 || chroma_format_idc == 2 ? 2 : 1) * (left + right);
+        height -= (chroma_format_idc == 1 ? 2 : 1) * (top + bottom);
+    }
+    if (!bits_ok(&bits)) {
+        return 0;
+    }
+    p_info->width  = width;
+    p_info->height = height;
+    return width > 0 && height > 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * picture size in the sequence header of MPEG-1/2 video, AVS or AVS2, p
+ * follows the start code
+ */
+static int parse_sequence_header(int codec, const uint8_t *p, size_t len, ts2es_probe_es_t *p_info)
+{
+    probe_bits_t bits;
+
+    bits.p   = p;
+    bits.len = len;
+    bits.pos = 0;
+
+    if (codec == PROBE_CODEC_MPV) {
+        p_info->width  = bits_read(&bits, 12);
+        p_info->height = bits_read(&bits, 12);
+    } else {
+        bits_read(&bits, 16);           // profile_id, level_id
+        bits_read(&bits, codec == PROBE_CODEC_AVS2 ? 2 : 1);    // progressive_sequence, field_coded_sequence
+        p_info->width  = bits_read(&bits, 14);
+        p_info->height = bits_read(&bits, 14);
+    }
+    return bits_ok(&bits) && p_info->width > 0 && p_info->height > 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * audio parameters of a frame header, p has at least 8 bytes
+ */
+static int parse_audio_header(probe_ctx_t *ctx, int codec, const uint8_t *p, ts2es_probe_es_t *p_info)
+{
+    static const int adts_rates[13] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+    };
+    static const int ac3_rates[3] = { 48000, 44100, 32000 };
+    static const int ac3_bitrates[19] = {
+        32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512, 576, 640
+    };
+    static const int ac3_channels[8] = { 2, 1, 2, 3, 3, 4, 4, 5 };
+
+    if (codec == PROBE_CODEC_MPA) {
+        mpa_header_t mh;
+        if (!mpa_header_parse(ctx->h_ts, p, &mh)) {
+            return 0;
+        }
+        p_info->bitrate    = mh.bitrate;
+        p_info->samplerate = mh.samplerate;
+        p_info->channels   = mh.channels;
+        return 1;
+    }
+    if (codec == PROBE_CODEC_ADTS) {
+        int rate_index = (p[2] >> 2) & 0x0F;
+        if (p[0] != 0xFF || (p[1] & 0xF6) != 0xF0 || rate_index >= 13) {
+            return 0;
+        }
+        p_info->bitrate    = 0;     // variable
+        p_info->samplerate = adts_rates[rate_index];
+        p_info->channels   = ((p[2] & 0x01) << 2) | (p[3] >> 6);
+        return 1;
+    }
+    if (codec == PROBE_CODEC_AC3) {
+        probe_bits_t bits;
+        int fscod = p[4] >> 6, frmsizecod = p[4] & 0x3F, acmod;
+        if (p[0] != 0x0B || p[1] != 0x77 || fscod == 3 || frmsizecod >= 38 || (p[5] >> 3) > 8) {
+            return 0;
+        }
+        bits.p   = p + 6;
+        bits.len = 2;
+        bits.pos = 0;
+        acmod = bits_read(&bits, 3);
+        if ((acmod & 0x1) && acmod != 0x1) {
+            bits_read(&bits, 2);        // cmixlev
+        }
+        if (acmod & 0x4) {
+            bits_read(&bits, 2);        // surmixlev
+        }
+        if (acmod == 0x2) {
+            bits_read(&bits, 2);        // dsurmod
+        }
+        p_info->bitrate    = ac3_bitrates[frmsizecod >> 1];
+        p_info->samplerate = ac3_rates[fscod];
+        p_info->channels   = ac3_channels[acmod] + bits_read(&bits, 1);    // lfeon
+        return 1;
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * choose what to look for in a stream from its stream_type
+ */
+static int probe_codec(int stream_type)
+{
+    switch (stream_type) {
+    case 0x01:
+    case 0x02:
+        return PROBE_CODEC_MPV;
+    case 0x03:
+    case 0x04:
+        return PROBE_CODEC_MPA;
+    case 0x0F:
+        return PROBE_CODEC_ADTS;
+    case 0x1B:
+        return PROBE_CODEC_AVC;
+    case 0x24:
+        return PROBE_CODEC_HEVC;
+    case 0x42:
+        return PROBE_CODEC_AVS;
+    case 0x43:
+    case 0xD2:
+        return PROBE_CODEC_AVS2;
+    case 0x81:
+        return PROBE_CODEC_AC3;
+    case 0x05:
+    case 0x0A:
+    case 0x0B:
+    case 0x0C:
+    case 0x0D:
+    case 0x86:
+        return PROBE_CODEC_NONE;
+    default:
+        return PROBE_CODEC_PES;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Look for the header of an ES in the data collected from the start of its
+ * PES; b_end is set when no more data follows
+ * returns 1 if found
+ */
+static int probe_es_parse(probe_ctx_t *ctx, int idx, int b_end)
+{
+    probe_es_t *p_es = &ctx->es[idx];
+    ts2es_probe_es_t *p_info = &ctx->p_probe->es[idx];
+    const uint8_t *b = p_es->buf;
+    size_t i = p_es->scan;
+
+    if (p_es->codec == PROBE_CODEC_MPA || p_es->codec == PROBE_CODEC_ADTS || p_es->codec == PROBE_CODEC_AC3) {
+        for (; i + 8 <= p_es->len; i++) {
+            if ((b[i] == 0xFF || b[i] == 0x0B) && parse_audio_header(ctx, p_es->codec, b + i, p_info)) {
+                return 1;
+            }
+        }
+        p_es->scan = i;
+        return 0;
+    }
+
+    for (; i + 4 <= p_es->len; i++) {
+        int code, b_header;
+        if (b[i] != 0 || b[i + 1] != 0 || b[i + 2] != 1) {
+            continue;
+        }
+        code = b[i + 3];
+        switch (p_es->codec) {
+        case PROBE_CODEC_MPV:
+            b_header = code == 0xB3;
+            break;
+        case PROBE_CODEC_AVC:
+            b_header = (code & 0x1F) == 7;
+            break;
+        case PROBE_CODEC_HEVC:
+            b_header = ((code >> 1) & 0x3F) == 33;
+            break;
+        default:
+            b_header = code == 0xB0;
+            break;
+        }
+        if (!b_header) {
+            continue;
+        }
+        if (p_es->len - i < PROBE_HEADER_SIZE && !b_end) {
+            break;      // wait for the rest of the header
+        }
+        if (p_es->codec == PROBE_CODEC_AVC) {
+            b_header = parse_avc_sps(b + i + 4, p_es->len - i - 4, p_info);
+        } else if (p_es->codec == PROBE_CODEC_HEVC) {
+            b_header = parse_hevc_sps(b + i + 5, p_es->len - i - 5, p_info);
+        } else {
+            b_header = parse_sequence_header(p_es->codec, b + i + 4, p_es->len - i - 4, p_info);
+        }
+        if (b_header) {
+            return 1;
+        }
+    }
+    p_es->scan = i;
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns 1 once the PAT, every PMT and all streams are done
+ */
+static int probe_check_complete(probe_ctx_t *ctx)
+{
+    ts2es_t *h_ts = ctx->h_ts;
+    int i;
+
+    if (h_ts->num_programs == 0) {
+        return 0;
+    }
+    for (i = 0; i < h_ts->num_programs; i++) {
+        if (h_ts->programs[i].psi.version < 0) {
+            return 0;
+        }
+    }
+    for (i = 0; i < ctx->p_probe->num_es; i++) {
+        if (!ctx->es[i].b_done) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Take the programs and streams of the PSI decoded so far
+ */
+static void probe_update_psi(probe_ctx_t *ctx)
+{
+    ts2es_t *h_ts = ctx->h_ts;
+    ts2es_probe_t *p_probe = ctx->p_probe;
+    int pid, i, k;
+
+    for (pid = 1; pid < 0x1FFF; pid++) {
+        if (TS2ES_PID_TYPE(ctx->pid_map[pid]) == TS2ES_PID_PMT) {
+            ctx->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_IGNORE, 0);
+        }
+    }
+
+    p_probe->num_programs = h_ts->num_programs;
+    for (k = h_ts->num_programs - 1; k >= 0; k--) {
+        ts2es_program_t *p_prog = &h_ts->programs[k];
+        p_probe->programs[k].program_number = p_prog->program_number;
+        p_probe->programs[k].pmt_pid        = p_prog->pmt_pid;
+        p_probe->programs[k].pcr_pid        = p_prog->pcr_pid;
+        if (p_prog->pmt_pid > 0 && p_prog->pmt_pid < 0x1FFF) {
+            ctx->pid_map[p_prog->pmt_pid] = TS2ES_PID_ENTRY(TS2ES_PID_PMT, k);
+        }
+    }
+
+    for (k = 0; k < h_ts->num_programs; k++) {
+        ts2es_program_t *p_prog = &h_ts->programs[k];
+        for (i = 0; i < p_prog->num_streams; i++) {
+            ts2es_probe_es_t *p_info;
+            probe_es_t *p_es;
+            pid = p_prog->streams[i].pid;
+            if (pid <= 0 || pid >= 0x1FFF || TS2ES_PID_TYPE(ctx->pid_map[pid]) != TS2ES_PID_IGNORE) {
+                continue;   // listed before, or PSI
+            }
+            if (p_probe->num_es == TS2ES_PROBE_MAX_ES) {
+                ts2es_report(h_ts, TS2ES_WARNING, "Too many ES, ignoring PID %d.\n", pid);
+                continue;
+            }
+            p_info = &p_probe->es[p_probe->num_es];
+            p_es   = &ctx->es[p_probe->num_es];
+            memset(p_info, 0, sizeof(ts2es_probe_es_t));
+            p_info->program_number = p_prog->program_number;
+            p_info->pid            = pid;
+            p_info->stream_type    = p_prog->streams[i].stream_type;
+            p_info->stream_id      = -1;
+            p_info->first_pts      = -1;
+            p_es->codec            = probe_codec(p_info->stream_type);
+            p_es->b_done           = p_es->codec == PROBE_CODEC_NONE;
+            ctx->pid_map[pid] = TS2ES_PID_ENTRY(TS2ES_PID_ES, p_probe->num_es);
+            p_probe->num_es++;
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Follow a packet of a stream until its header is found
+ */
+static void probe_es_packet(probe_ctx_t *ctx, int idx, const uint8_t *buf)
+{
+    probe_es_t *p_es = &ctx->es[idx];
+    ts2es_probe_es_t *p_info = &ctx->p_probe->es[idx];
+    const uint8_t *p = buf + 4;
+    size_t n = TS_PACKET_SIZE - 4;
+
+    if (p_es->b_done || TS_PACKET_TRANS_ERROR(buf) || !(TS_PACKET_ADAPTATION(buf) & 0x1)) {
+        return;
+    }
+    if (TS_PACKET_ADAPTATION(buf) == 0x3) {
+        if (TS_PACKET_ADAPT_LEN(buf) + 1 >= (int)n) {
+            return;
+        }
+        n -= TS_PACKET_ADAPT_LEN(buf) + 1;
+        p += TS_PACKET_ADAPT_LEN(buf) + 1;
+    }
+
+    if (TS_PACKET_PAYLOAD_START(buf)) {
+        int header_len = 0;
+        if (p_es->b_pes && probe_es_parse(ctx, idx, 1)) {
+            p_es->b_done = p_info->b_synced = 1;
+            return;
+        }
+        p_es->b_pes = 0;
+        if (n < 9 || p[0] != 0 || p[1] != 0 || p[2] != 1) {
+            return;
+        }
+        if (p_info->stream_id < 0) {
+            p_info->stream_id = PES_PACKET_STREAM_ID(p);
+        }
+        if (PES_PACKET_SYNC_CODE(p) == 0x2) {   // optional PES header
+            header_len = 3 + PES_PACKET_HEAD_LEN(p);
+            if ((PES_PACKET_PTS_DTS(p) & 0x2) && n >= 14 && p_info->first_pts < 0) {
+                p_info->first_pts = (int64_t)PES_PACKET_PTS(p);
+            }
+        }
+        if (p_es->codec == PROBE_CODEC_PES) {
+            p_es->b_done = 1;
+            return;
+        }
+        if (6 + (size_t)header_len >= n) {
+            return;
+        }
+        if (p_es->buf == NULL && (p_es->buf = (uint8_t *)malloc(PROBE_ES_SIZE)) == NULL) {
+            ts2es_report(ctx->h_ts, TS2ES_ERROR, "Failed to allocate the probe buffer (pid: %d).\n", p_info->pid);
+            p_es->b_done = 1;
+            return;
+        }
+        p      += 6 + header_len;
+        n      -= 6 + header_len;
+        p_es->len   = 0;
+        p_es->scan  = 0;
+        p_es->b_pes = 1;
+    } else if (!p_es->b_pes) {
+        return;
+    }
+
+    if (n > PROBE_ES_SIZE - p_es->len) {
+        n = PROBE_ES_SIZE - p_es->len;
+    }
+    memcpy(p_es->buf + p_es->len, p, n);
+    p_es->len += n;
+    if (probe_es_parse(ctx, idx, p_es->len == PROBE_ES_SIZE)) {
+        p_es->b_done = p_info->b_synced = 1;
+    } else if (p_es->len == PROBE_ES_SIZE) {
+        p_es->b_pes = 0;    // wait for the next PES
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Scan packets until all is found
+ * returns the number of bytes used, a packet may be cut at the end
+ */
+static size_t probe_packets(probe_ctx_t *ctx, const uint8_t *buf, size_t len)
+{
+    ts2es_probe_t *p_probe = ctx->p_probe;
+    ts2es_t *h_ts = ctx->h_ts;
+    size_t pos = 0;
+
+    while (pos + (p_probe->packet_size ? p_probe->packet_size : TS_PACKET_SIZE) <= len && !p_probe->b_complete) {
+        const uint8_t *p = buf + pos;
+        int entry;
+
+        if (p_probe->packet_size == 0 || TS_PACKET_SYNC_BYTE(p) != 0x47) {
+            int64_t offset = ts2es_sync_find(p, len - pos, &p_probe->packet_size);
+            if (offset < 0) {
+                return len - pos > PROBE_SYNC_KEEP ? len - PROBE_SYNC_KEEP : pos;
+            }
+            pos += (size_t)offset;
+            continue;
+        }
+
+        entry = ctx->pid_map[TS_PACKET_PID(p)];
+        switch (TS2ES_PID_TYPE(entry)) {
+        case TS2ES_PID_PAT:
+            if (ts2es_demux_psi(h_ts, h_ts->psi_pat, p, TS_TABLE_ID_PAT)) {
+                probe_update_psi(ctx);
+                p_probe->b_complete = probe_check_complete(ctx);
+            }
+            break;
+        case TS2ES_PID_PMT:
+            if (ts2es_demux_psi(h_ts, &h_ts->programs[TS2ES_PID_INDEX(entry)].psi, p, TS_TABLE_ID_PMT)) {
+                probe_update_psi(ctx);
+                p_probe->b_complete = probe_check_complete(ctx);
+            }
+            break;
+        case TS2ES_PID_ES:
+            if (!ctx->es[TS2ES_PID_INDEX(entry)].b_done) {
+                probe_es_packet(ctx, TS2ES_PID_INDEX(entry), p);
+                if (ctx->es[TS2ES_PID_INDEX(entry)].b_done) {
+                    p_probe->b_complete = probe_check_complete(ctx);
+                }
+            }
+            break;
+        default:
+            break;
+        }
+        pos += p_probe->packet_size;
+    }
+    return pos;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the context of a probe, or NULL if out of memory
+ */
+static probe_ctx_t *probe_open(const ts2es_param_t *p_param, ts2es_probe_t *p_probe)
+{
+    probe_ctx_t *ctx = (probe_ctx_t *)calloc(1, sizeof(probe_ctx_t));
+
+    if (ctx == NULL || (ctx->h_ts = ts2es_handle_alloc()) == NULL) {
+        free(ctx);
+        return NULL;
+    }
+    if (p_param != NULL) {
+        ctx->h_ts->param = *p_param;
+    } else {
+        ctx->h_ts->param.i_log_level = TS2ES_WARNING;
+    }
+    ts2es_psi_reset(ctx->h_ts->psi_pat);
+    ctx->pid_map[0] = TS2ES_PID_ENTRY(TS2ES_PID_PAT, 0);
+    ctx->p_probe    = p_probe;
+    memset(p_probe, 0, sizeof(ts2es_probe_t));
+    return ctx;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void probe_close(probe_ctx_t *ctx)
+{
+    int i;
+
+    // headers cut by the end of the data
+    for (i = 0; i < ctx->p_probe->num_es; i++) {
+        probe_es_t *p_es = &ctx->es[i];
+        if (!p_es->b_done && p_es->b_pes && probe_es_parse(ctx, i, 1)) {
+            p_es->b_done = ctx->p_probe->es[i].b_synced = 1;
+        }
+        free(p_es->buf);
+    }
+    ctx->p_probe->b_complete = probe_check_complete(ctx);
+    ts2es_handle_free(ctx->h_ts);
+    free(ctx);
+}
+
+/* ---------------------------------------------------------------------------
+ * Probe the start of a buffer
+ */
+int ts2es_probe_buffer(const ts2es_param_t *p_param, const uint8_t *buf, size_t buf_len,
+                       ts2es_probe_t *p_probe)
+{
+    probe_ctx_t *ctx = probe_open(p_param, p_probe);
+
+    if (ctx == NULL) {
+        ts2es_report(NULL, TS2ES_ERROR, "Failed to allocate the probe.\n");
+        return 0;
+    }
+    p_probe->bytes_scanned = probe_packets(ctx, buf, buf_len);
+    if (!p_probe->b_complete) {
+        p_probe->bytes_scanned = buf_len;
+    }
+    probe_close(ctx);
+    return p_probe->b_complete;
+}
+
+/* ---------------------------------------------------------------------------
+ * Probe the first max_bytes of a file at most, 0: TS2ES_PROBE_BYTES
+ */
+int ts2es_probe_file(const ts2es_param_t *p_param, const char *s_path, size_t max_bytes,
+                     ts2es_probe_t *p_probe)
+{
+    FILE *fp = fopen(s_path, "rb");
+    probe_ctx_t *ctx;
+    uint8_t *buf;
+    size_t len = 0, total = 0, n;
+
+    if (fp == NULL) {
+        return -1;
+    }
+    if (max_bytes == 0) {
+        max_bytes = TS2ES_PROBE_BYTES;
+    }
+    buf = (uint8_t *)malloc(PROBE_BLOCK_SIZE + PROBE_SYNC_KEEP);
+    if (buf == NULL || (ctx = probe_open(p_param, p_probe)) == NULL) {
+        ts2es_report(NULL, TS2ES_ERROR, "Failed to allocate the probe.\n");
+        free(buf);
+        fclose(fp);
+        return 0;
+    }
+
+    // the bytes of a packet cut at the end of a block are kept for the next one
+    while (total < max_bytes && !p_probe->b_complete) {
+        size_t want = max_bytes - total < PROBE_BLOCK_SIZE ? max_bytes - total : PROBE_BLOCK_SIZE;
+        size_t used;
+        if ((n = fread(buf + len, 1, want, fp)) == 0) {
+            break;
+        }
+        total += n;
+        len   += n;
+        used   = probe_packets(ctx, buf, len);
+        p_probe->bytes_scanned = total - (len - used);
+        memmove(buf, buf + used, len - used);
+        len -= used;
+    }
+    if (!p_probe->b_complete) {
+        p_probe->bytes_scanned = total;
+    }
+    fclose(fp);
+    free(buf);
+    probe_close(ctx);
+    return p_probe->b_complete;
+}
@@ -0,0 +1,370 @@
+/*
+    ts_range.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * Time ranges: the first and last packets of a range of a mapped input are
+ * found by bisection on a clock carried along the stream, so only a few
+ * megabytes are read around each probe whatever the size of the input. The
+ * clock is the PCR of the first PID carrying one, or else the PTS of the
+ * first PID carrying one. It is counted from its first value in the input,
+ * which keeps it increasing across a wraparound of the 33 bit counter.
+ * The end of a range is also checked on the PTS of each PES, so that every
+ * ES ends on its last whole PES presented in the range.
+ */
+#include "ts2es.h"
+#include <string.h>
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define RANGE_PROBE_BYTES   (4 << 20)   // searched for the clock from a position
+#define RANGE_PCR_PREROLL   90000       // ES data is sent ahead of its PTS, 1 s
+#define RANGE_END_SLACK     900000      // demuxed past the end for the last PES to finish, 10 s
+#define RANGE_FINISH_BYTES  (256 << 10) // demuxed at a time past the end
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+typedef struct range_clock_t {
+    const uint8_t *buf;
+    size_t   len;
+    size_t   first;         // offset of the first packet
+    int      stride;        // packet size
+    int      pid;           // PID carrying the clock
+    int      b_pcr;         // PCR, else PES PTS
+    int64_t  t0;            // first value of the clock
+} range_clock_t;
+
+/* ---------------------------------------------------------------------------
+ * returns the PCR base of a packet, or -1 if it carries none
+ */
+static int64_t packet_pcr(const uint8_t *p)
+{
+    if ((TS_PACKET_ADAPTATION(p) & 2) && TS_PACKET_ADAPT_LEN(p) >= 7 && TS_PACKET_PCR_FLAG(p)) {
+        return (int64_t)TS_PACKET_PCR_BASE(p);
+    }
+    return -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the PTS of the PES starting in a packet, or -1 if there is none
+ */
+static int64_t packet_pts(const uint8_t *p)
+{
+    const uint8_t *pes = p + 4;
+
+    if (!TS_PACKET_PAYLOAD_START(p) || !(TS_PACKET_ADAPTATION(p) & 1)) {
+        return -1;
+    }
+    if (TS_PACKET_ADAPTATION(p) & 2) {
+        pes += 1 + TS_PACKET_ADAPT_LEN(p);
+    }
+    if (pes + 14 > p + TS_PACKET_SIZE || pes[0] != 0x00 || pes[1] != 0x00 || pes[2] != 0x01) {
+        return -1;
+    }
+    // audio, video and private streams have the optional PES header
+    if (PES_PACKET_STREAM_ID(pes) != 0xBD && PES_PACKET_STREAM_ID(pes) != 0xFD &&
+        (PES_PACKET_STREAM_ID(pes) < 0xC0 || PES_PACKET_STREAM_ID(pes) > 0xEF)) {
+        return -1;
+    }
+    return (PES_PACKET_PTS_DTS(pes) & 2) ? (int64_t)PES_PACKET_PTS(pes) : -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * find the next packet carrying the clock, from *p_pos on (moved back to a
+ * packet boundary), and store its offset in *p_pos
+ * returns the clock counted from its first value, or -1 if none is found
+ */
+static int64_t clock_next(const range_clock_t *p_clk, size_t *p_pos)
+{
+    size_t pos = p_clk->first + (*p_pos - p_clk->first) / p_clk->stride * p_clk->stride;
+    size_t end = pos + RANGE_PROBE_BYTES < p_clk->len ? pos + RANGE_PROBE_BYTES : p_clk->len;
+    int stride = p_clk->stride;
+
+    while (pos + TS_PACKET_SIZE <= end) {
+        const uint8_t *p = p_clk->buf + pos;
+        int64_t t;
+
+        if (TS_PACKET_SYNC_BYTE(p) != 0x47) {
+            int64_t offset = ts2es_sync_find(p, end - pos, &stride);
+            if (offset < 0) {
+                break;
+            }
+            pos += (size_t)offset;
+            continue;
+        }
+        if ((int)TS_PACKET_PID(p) == p_clk->pid) {
+            t = p_clk->b_pcr ? packet_pcr(p) : packet_pts(p);
+            if (t >= 0) {
+                *p_pos = pos;
+                return (t - p_clk->t0) & TS_PTS_MASK;
+            }
+        }
+        pos += stride;
+    }
+    return -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * find the first packet and the clock of an input
+ * returns 1 on success, or 0 if no clock is found at its start
+ */
+static int clock_open(ts2es_t *h_ts, range_clock_t *p_clk, const uint8_t *buf, size_t buf_len)
+{
+    int64_t first;
+    size_t end, pos;
+
+    memset(p_clk, 0, sizeof(range_clock_t));
+    p_clk->stride = h_ts->packet_size ? h_ts->packet_size : h_ts->param.i_packet_size;
+    if ((first = ts2es_sync_find(buf, buf_len, &p_clk->stride)) < 0) {
+        return 0;
+    }
+    p_clk->buf   = buf;
+    p_clk->len   = buf_len;
+    p_clk->first = (size_t)first;
+    end = p_clk->first + RANGE_PROBE_BYTES < buf_len ? p_clk->first + RANGE_PROBE_BYTES : buf_len;
+
+    // the PCR if any, it increases steadily
+    for (pos = p_clk->first; pos + TS_PACKET_SIZE <= end; pos += p_clk->stride) {
+        const uint8_t *p = buf + pos;
+        if (TS_PACKET_SYNC_BYTE(p) == 0x47 && TS_PACKET_PID(p) != TS_NULL_PID &&
+            (p_clk->t0 = packet_pcr(p)) >= 0) {
+            p_clk->pid   = TS_PACKET_PID(p);
+            p_clk->b_pcr = 1;
+            return 1;
+        }
+    }
+    for (pos = p_clk->first; pos + TS_PACKET_SIZE <= end; pos += p_clk->stride) {
+        const uint8_t *p = buf + pos;
+        if (TS_PACKET_SYNC_BYTE(p) == 0x47 && (p_clk->t0 = packet_pts(p)) >= 0) {
+            p_clk->pid = TS_PACKET_PID(p);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns a PTS counted from the first clock, or -1 if it comes before it
+ */
+static int64_t clock_relative(const range_clock_t *p_clk, int64_t pts)
+{
+    int64_t t = (pts - p_clk->t0) & TS_PTS_MASK;
+    return t > (TS_PTS_MASK >> 1) ? -1 : t;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the offset of the first packet whose clock is not before "t"
+ */
+static size_t clock_bisect(const range_clock_t *p_clk, int64_t t)
+{
+    uint64_t lo = 0;
+    uint64_t hi = (p_clk->len - p_clk->first) / p_clk->stride;
+    size_t pos;
+
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        int64_t t_mid;
+
+        pos   = p_clk->first + (size_t)mid * p_clk->stride;
+        t_mid = clock_next(p_clk, &pos);
+        if (t_mid >= 0 && t_mid < t) {
+            mid = (pos - p_clk->first) / p_clk->stride;
+            lo  = mid + 1 < hi ? mid + 1 : hi;
+        } else {
+            hi = mid;
+        }
+    }
+    pos = p_clk->first + (size_t)lo * p_clk->stride;
+    return pos < p_clk->len ? pos : p_clk->len;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns 1 once the PAT and the PMTs of the programs extracted are decoded
+ */
+static int range_psi_done(ts2es_t *h_ts)
+{
+    int i;
+
+    if (h_ts->num_programs == 0) {
+        return 0;
+    }
+    for (i = 0; i < h_ts->num_programs; i++) {
+        const ts2es_program_t *p_prog = &h_ts->programs[i];
+        if (p_prog->psi.version < 0 &&
+            (h_ts->param.program_number <= 0 || p_prog->program_number == h_ts->param.program_number)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * demux the PAT and the PMTs from the start of the input up to "end", so that
+ * the streams are selected when the range begins
+ */
+static void range_prime_psi(ts2es_t *h_ts, const range_clock_t *p_clk, uint8_t *buf, size_t end)
+{
+    uint64_t stream_offset = h_ts->stream_offset;
+    int stride = p_clk->stride;
+    size_t pos = p_clk->first;
+
+    while (pos + TS_PACKET_SIZE <= end && !range_psi_done(h_ts) && !h_ts->Interrupted) {
+        uint8_t *p = buf + pos;
+        int type;
+
+        if (TS_PACKET_SYNC_BYTE(p) != 0x47) {
+            int64_t offset = ts2es_sync_find(p, end - pos, &stride);
+            if (offset < 0) {
+                break;
+            }
+            pos += (size_t)offset;
+            continue;
+        }
+        type = h_ts->pid_map[TS_PACKET_PID(p)] >> 8;
+        if (type == TS2ES_PID_PAT || type == TS2ES_PID_PMT) {
+            h_ts->stream_offset = stream_offset + pos;
+            ts2es_demux_ts_packet(h_ts, p, TS_PACKET_SIZE);
+        }
+        pos += stride;
+    }
+    h_ts->stream_offset = stream_offset;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns 1 if every ES has got to a PES after the end of the range, i.e. its
+ * last PES in the range is finished
+ */
+static int range_finished(ts2es_t *h_ts)
+{
+    int i;
+
+    ts2es_wait_workers(h_ts);
+    for (i = 0; i < h_ts->num_es; i++) {
+        ts2es_es_t *p_es = &h_ts->es[i];
+        if (p_es->b_valid && p_es->pes_stream_id != -1 && !p_es->b_range_end) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux the packets after the end of a range until each ES finishes its last
+ * PES in the range. The unfinished PES of the ES that get to no PES header in
+ * "buf" are dropped.
+ * returns the number of bytes demuxed
+ */
+static size_t range_finish(ts2es_t *h_ts, uint8_t *buf, size_t buf_len)
+{
+    size_t pos = 0;
+    int i;
+
+    while (pos < buf_len && !h_ts->Interrupted && !range_finished(h_ts)) {
+        size_t n = buf_len - pos < RANGE_FINISH_BYTES ? buf_len - pos : RANGE_FINISH_BYTES;
+        size_t used = ts2es_demux_ts_buffer(h_ts, buf + pos, n);
+        if (used == 0) {
+            break;
+        }
+        pos += used;
+    }
+
+    for (i = 0; i < h_ts->num_es; i++) {
+        ts2es_es_t *p_es = &h_ts->es[i];
+        ts2es_es_state_t *p_st = &h_ts->es_state[i];
+        if (p_es->b_valid && !p_es->b_range_end && p_st->pes_remaining != 0 && (p_es->cur_len || p_st->b_held)) {
+            ts2es_report(h_ts, TS2ES_INFO, "Dropping %u bytes of an unfinished PES at the end of the range (pid: %d).\n",
+                p_es->cur_len + p_es->held_len, p_es->pid);
+            p_es->es_bytes -= p_es->cur_len;
+            p_es->cur_len   = 0;
+            p_st->b_held    = 0;
+            p_es->held_len  = 0;
+        }
+    }
+    return pos;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the first value of the clock of a mapped input (see
+ * ts2es_demux_ts_range()), or -1 if there is none
+ */
+int64_t ts2es_first_clock(ts2es_t *h_ts, const uint8_t *buf, size_t buf_len)
+{
+    range_clock_t clk;
+    return clock_open(h_ts, &clk, buf, buf_len) ? clk.t0 : -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux the packets of a mapped input whose clock is in [start, end], on
+ * num_threads chunks if more than one. Times are PTS in 90 kHz units, -1 for
+ * the start or the end of the input. With the PCR as clock, the range begins
+ * RANGE_PCR_PREROLL early, as the ES data is sent ahead of its PTS. Each ES
+ * ends before its first PES with a PTS after "end": the packets after the
+ * range are demuxed, up to RANGE_END_SLACK, until every ES gets to that PES.
+ * returns the number of bytes demuxed
+ */
+size_t ts2es_demux_ts_range(ts2es_t *h_ts, uint8_t *buf, size_t buf_len, int64_t start, int64_t end,
+                            int num_threads)
+{
+    range_clock_t clk;
+    size_t begin = 0, stop = buf_len, limit = buf_len;
+    size_t used;
+
+    if (!clock_open(h_ts, &clk, buf, buf_len)) {
+        ts2es_report(h_ts, TS2ES_WARNING, "No PCR or PTS found, demuxing the whole input.\n");
+        start = end = -1;
+    }
+
+    if (start >= 0) {
+        int64_t t = clock_relative(&clk, start);
+        if (clk.b_pcr && t >= 0) {
+            t = t > RANGE_PCR_PREROLL ? t - RANGE_PCR_PREROLL : 0;
+        }
+        begin = t > 0 ? clock_bisect(&clk, t) : 0;
+    }
+    if (end >= 0) {
+        int64_t t = clock_relative(&clk, end);
+        stop  = t >= 0 ? clock_bisect(&clk, t + 1) : 0;
+        limit = t >= 0 ? clock_bisect(&clk, t + 1 + RANGE_END_SLACK) : 0;
+        h_ts->range_end = end;
+    }
+    if (stop <= begin) {
+        ts2es_report(h_ts, TS2ES_WARNING, "The time range is not in the input.\n");
+        return 0;
+    }
+    ts2es_report(h_ts, TS2ES_INFO, "Time range: bytes 0x%llx to 0x%llx, clock on %s of PID[%d].\n",
+        (unsigned long long)begin, (unsigned long long)stop, clk.b_pcr ? "PCR" : "PTS", clk.pid);
+
+    if (begin > 0) {
+        range_prime_psi(h_ts, &clk, buf, begin);
+    }
+    h_ts->stream_offset += begin;
+    if (num_threads > 1) {
+        used = ts2es_demux_ts_chunks(h_ts, buf + begin, stop - begin, num_threads);
+    } else {
+        used = ts2es_demux_ts_buffer(h_ts, buf + begin, stop - begin);
+    }
+    if (end >= 0) {
+        used += range_finish(h_ts, buf + begin + used, limit - (begin + used));
+    }
+    return used;
+}
@@ -0,0 +1,456 @@
+/*
+    ts_sink.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+#include "ts2es.h"
+#include "ts_thread.h"
+#include <string.h>
+#include <fcntl.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define open        _open
+#define write       _write
+#define close       _close
+#define snprintf    _snprintf
+#define SINK_OPEN_FLAGS     (_O_WRONLY | _O_CREAT | _O_APPEND | _O_BINARY)
+#define SINK_OPEN_MODE      (_S_IREAD | _S_IWRITE)
+#else
+#include <unistd.h>
+#include <sys/uio.h>
+#define SINK_OPEN_FLAGS     (O_WRONLY | O_CREAT | O_APPEND)
+#define SINK_OPEN_MODE      0644
+#endif
+
+#ifdef _MSC_VER
+#pragma warning(disable:4100)
+#endif
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+// size of the staging buffer of each output file
+#define SINK_BUF_SIZE           (1 << 20)
+// writes are issued in multiples of this size whenever possible
+#define SINK_ALIGN              4096
+// maximum number of buffers written in one system call
+#define SINK_MAX_IOV            64
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+typedef struct sink_file_t {
+    int      fd;        // -1 if not opened yet
+    int      b_failed;  // open or write failed, the data of the ES is dropped
+    size_t   len;       // number of bytes staged in buf
+    uint8_t *buf;       // aligned staging buffer
+    uint8_t *mem;       // memory block of buf
+    ts2es_aio_t   *aio; // asynchronous writes, if h_ts->aio
+    uint8_t       *buf_io;  // second staging buffer, written out in the background
+    ts2es_aio_op_t op;      // write of buf_io, pending if op.buf is set
+} sink_file_t;
+
+struct ts2es_sink_t {
+    sink_file_t files[MAX_NUM_ES];
+};
+
+/* ---------------------------------------------------------------------------
+ * write a list of buffers out, with as few system calls as possible
+ * returns 1 on success, or 0 on failure
+ */
+static int sink_write_iov(int fd, const ts2es_iov_t *iov, int n_iov)
+{
+#ifdef _WIN32
+    int i;
+    for (i = 0; i < n_iov; i++) {
+        const uint8_t *p = (const uint8_t *)iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            int written = write(fd, p, (unsigned int)len);
+            if (written <= 0) {
+                return 0;
+            }
+            p   += written;
+            len -= written;
+        }
+    }
+    return 1;
+#else
+    struct iovec vec[SINK_MAX_IOV];
+    int n_vec = 0;
+    int i = 0;
+
+    while (i < n_iov || n_vec > 0) {
+        ssize_t written;
+        int k;
+
+        // fill up the system call's list
+        for (; i < n_iov && n_vec < SINK_MAX_IOV; i++) {
+            if (iov[i].iov_len > 0) {
+                vec[n_vec].iov_base = iov[i].iov_base;
+                vec[n_vec].iov_len  = iov[i].iov_len;
+                n_vec++;
+            }
+        }
+        if (n_vec == 0) {
+            break;
+        }
+
+        if ((written = writev(fd, vec, n_vec)) <= 0) {
+            return 0;
+        }
+
+        // skip what has been written and retry the remainder
+        for (k = 0; k < n_vec && (size_t)written >= vec[k].iov_len; k++) {
+            written -= vec[k].iov_len;
+        }
+        if (k < n_vec) {
+            vec[k].iov_base = (uint8_t *)vec[k].iov_base + written;
+            vec[k].iov_len -= written;
+        }
+        memmove(vec, vec + k, (n_vec - k) * sizeof(struct iovec));
+        n_vec -= k;
+    }
+    return 1;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * write two buffers out in one system call if possible
+ * returns 1 on success, or 0 on failure
+ */
+static int sink_writev(int fd, const uint8_t *p1, size_t len1, const uint8_t *p2, size_t len2)
+{
+    ts2es_iov_t iov[2];
+
+    iov[0].iov_base = (void *)p1;
+    iov[0].iov_len  = len1;
+    iov[1].iov_base = (void *)p2;
+    iov[1].iov_len  = len2;
+    return sink_write_iov(fd, iov, 2);
+}
+
+/* ---------------------------------------------------------------------------
+ * open the output file of one ES
+ * returns 1 on success, or 0 on failure
+ */
+static int sink_file_open(ts2es_t *h_ts, sink_file_t *p_file, int pid)
+{
+    char s_path[sizeof(h_ts->param.s_output) + 16];
+    int num_bufs = h_ts->aio != NULL ? 2 : 1;
+
+    p_file->mem = (uint8_t *)malloc(num_bufs * SINK_BUF_SIZE + SINK_ALIGN);
+    if (p_file->mem == NULL) {
+        ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate the output buffer of PID[%d]\n", pid);
+        return 0;
+    }
+    p_file->buf = (uint8_t *)((intptr_t)(p_file->mem + SINK_ALIGN - 1) & (~(intptr_t)(SINK_ALIGN - 1)));
+    p_file->len = 0;
+    if (h_ts->aio != NULL) {
+        p_file->aio    = h_ts->aio;
+        p_file->buf_io = p_file->buf + SINK_BUF_SIZE;
+    }
+
+    snprintf(s_path, sizeof(s_path), "%s_%d.es", h_ts->param.s_output, pid);
+    p_file->fd = open(s_path, SINK_OPEN_FLAGS, SINK_OPEN_MODE);
+    if (p_file->fd < 0) {
+        ts2es_report(h_ts, TS2ES_ERROR, "failed to open output file %s\n", s_path);
+        return 0;
+    }
+
+    ts2es_report(h_ts, TS2ES_INFO, "writing PID[%d] to %s\n", pid, s_path);
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * wait for the background write of one output file, if any
+ * returns 1 on success, or 0 on failure
+ */
+static int sink_file_wait(sink_file_t *p_file)
+{
+    int64_t ret;
+
+    if (p_file->op.buf == NULL) {
+        return 1;
+    }
+    ret = ts2es_aio_wait(p_file->aio, &p_file->op);
+    p_file->op.buf = NULL;
+    return ret == (int64_t)p_file->op.len;
+}
+
+/* ---------------------------------------------------------------------------
+ * write the full staging buffer out in the background, and stage into the
+ * other one once its own write is done
+ * returns 1 on success, or 0 on failure
+ */
+static int sink_file_submit(sink_file_t *p_file)
+{
+    uint8_t *buf = p_file->buf;
+
+    if (!sink_file_wait(p_file)) {
+        return 0;
+    }
+    p_file->op.fd      = p_file->fd;
+    p_file->op.b_write = 1;
+    p_file->op.buf     = buf;
+    p_file->op.len     = p_file->len;
+    p_file->op.offset  = -1;    // appended
+    ts2es_aio_submit(p_file->aio, &p_file->op);
+
+    p_file->buf    = p_file->buf_io;
+    p_file->buf_io = buf;
+    p_file->len    = 0;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * stage data for one output file, large chunks are gathered with the staged
+ * data into aligned writes. With asynchronous writes all data is staged, as
+ * it is written after the caller reuses it
+ * returns 1 on success, or 0 on failure
+ */
+static int sink_file_write(sink_file_t *p_file, const uint8_t *data, size_t len)
+{
+    size_t total = p_file->len + len;
+    size_t aligned;
+
+    while (p_file->aio != NULL && len > 0) {
+        size_t n = SINK_BUF_SIZE - p_file->len < len ? SINK_BUF_SIZE - p_file->len : len;
+        memcpy(p_file->buf + p_file->len, data, n);
+        p_file->len += n;
+        data        += n;
+        len         -= n;
+        if (p_file->len == SINK_BUF_SIZE && !sink_file_submit(p_file)) {
+            return 0;
+        }
+    }
+    if (p_file->aio != NULL) {
+        return 1;
+    }
+
+    if (total < SINK_BUF_SIZE) {
+        memcpy(p_file->buf + p_file->len, data, len);
+        p_file->len = total;
+        return 1;
+    }
+
+    // write the staged data and the aligned head of the new chunk at once
+    aligned = total & ~(size_t)(SINK_ALIGN - 1);
+    if (!sink_writev(p_file->fd, p_file->buf, p_file->len, data, aligned - p_file->len)) {
+        return 0;
+    }
+
+    // keep the unaligned tail for the next write
+    data += aligned - p_file->len;
+    p_file->len = total - aligned;
+    memcpy(p_file->buf, data, p_file->len);
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * write out all staged data of one output file
+ * returns 1 on success, or 0 on failure
+ */
+static int sink_file_flush(sink_file_t *p_file)
+{
+    if (p_file->aio != NULL && !sink_file_wait(p_file)) {
+        return 0;
+    }
+    if (p_file->fd >= 0 && p_file->len > 0) {
+        if (!sink_writev(p_file->fd, p_file->buf, p_file->len, NULL, 0)) {
+            return 0;
+        }
+        p_file->len = 0;
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the index of the ES of a PID, or -1 if there is none
+ */
+static int sink_es_index(ts2es_t *h_ts, int pid)
+{
+    uint16_t entry = h_ts->pid_map[pid & (TS_NUM_PIDS - 1)];
+    int i = TS2ES_PID_INDEX(entry);
+
+    if (TS2ES_PID_TYPE(entry) == TS2ES_PID_ES && h_ts->es[i].pid == (uint32_t)pid) {
+        return i;
+    }
+    // a new PMT may have dropped the PID while data of its ES is still held
+    for (i = 0; i < h_ts->num_es; i++) {
+        if (h_ts->es[i].pid == (uint32_t)pid) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the output file of an ES, opened if needed, or NULL if it failed
+ */
+static sink_file_t *sink_file_get(ts2es_t *h_ts, int es_idx, int pid)
+{
+    sink_file_t *p_file = &h_ts->sink->files[es_idx];
+
+    if (p_file->b_failed) {
+        return NULL;
+    }
+    if (p_file->fd < 0 && !sink_file_open(h_ts, p_file, pid)) {
+        p_file->b_failed = 1;
+        return NULL;
+    }
+    return p_file;
+}
+
+/* ---------------------------------------------------------------------------
+ * give up an output file after a failed write, the ES is no longer written
+ */
+static void sink_file_fail(ts2es_t *h_ts, sink_file_t *p_file, int pid)
+{
+    ts2es_report(h_ts, TS2ES_ERROR, "failed to write stream out, dropping PID[%d]\n", pid);
+    p_file->b_failed = 1;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+ts2es_sink_t *ts2es_sink_create(void)
+{
+    ts2es_sink_t *p_sink = (ts2es_sink_t *)malloc(sizeof(ts2es_sink_t));
+    int i;
+
+    if (p_sink == NULL) {
+        perror("Failed to allocate memory for ts2es_sink_t");
+        exit(-3);
+    }
+
+    memset(p_sink, 0, sizeof(ts2es_sink_t));
+    for (i = 0; i < MAX_NUM_ES; i++) {
+        p_sink->files[i].fd = -1;
+    }
+
+    return p_sink;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+void ts2es_sink_destroy(ts2es_t *h_ts, ts2es_sink_t *p_sink)
+{
+    int i;
+
+    if (p_sink == NULL) {
+        return;
+    }
+
+    ts2es_sink_flush(h_ts, p_sink);
+    for (i = 0; i < MAX_NUM_ES; i++) {
+        sink_file_t *p_file = &p_sink->files[i];
+        if (p_file->fd >= 0) {
+            close(p_file->fd);
+        }
+        free(p_file->mem);
+    }
+
+    free(p_sink);
+}
+
+/* ---------------------------------------------------------------------------
+ * Write out all staged data, e.g. once the input is demuxed and before the
+ * caller checks the outcome
+ * returns the number of output files that failed, their ES are dropped
+ */
+int ts2es_sink_flush(ts2es_t *h_ts, ts2es_sink_t *p_sink)
+{
+    int n_failed = 0;
+    int i;
+
+    if (p_sink == NULL) {
+        return 0;
+    }
+    for (i = 0; i < MAX_NUM_ES; i++) {
+        sink_file_t *p_file = &p_sink->files[i];
+        if (!p_file->b_failed && p_file->fd >= 0 && !sink_file_flush(p_file)) {
+            sink_file_fail(h_ts, p_file, h_ts->es[i].pid);
+        }
+        n_failed += p_file->b_failed;
+    }
+    return n_failed;
+}
+
+/* ---------------------------------------------------------------------------
+ * Built-in output: append each ES to the file <output>_<pid>.es, which is
+ * opened once and written in large chunks
+ */
+void ts2es_sink_output_es(ts2es_t *h_ts, ts2es_es_t *p_es, void *opque)
+{
+    if (ts2es_atomic_load(&h_ts->b_output) && p_es->cur_len) {
+        sink_file_t *p_file = sink_file_get(h_ts, (int)(p_es - h_ts->es), p_es->pid);
+
+        if (p_file != NULL && !sink_file_write(p_file, p_es->raw_data, p_es->cur_len)) {
+            sink_file_fail(h_ts, p_file, p_es->pid);
+        } else if (p_file != NULL) {
+            ts2es_report(h_ts, TS2ES_DEBUG, "writing TS packet, PID[%d], pts: %lld\n", p_es->pid, p_es->pts);
+            ts2es_atomic_add64(&h_ts->total_bytes, p_es->cur_len);
+        }
+        p_es->cur_len = 0;
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Built-in zero-copy output: slices are written out directly, together with
+ * the staged data, unless they are small enough to be staged
+ */
+void ts2es_sink_output_iov(ts2es_t *h_ts, int pid, int64_t pts, int64_t dts,
+                           const ts2es_iov_t *iov, int n_iov, void *opque)
+{
+    sink_file_t *p_file;
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < n_iov; i++) {
+        total += iov[i].iov_len;
+    }
+    if (!ts2es_atomic_load(&h_ts->b_output) || total == 0) {
+        return;
+    }
+
+    if ((i = sink_es_index(h_ts, pid)) < 0 || (p_file = sink_file_get(h_ts, i, pid)) == NULL) {
+        return;
+    }
+
+    if (p_file->aio != NULL) {
+        // staged, the slices are written out after they are reused
+        for (i = 0; i < n_iov; i++) {
+            if (!sink_file_write(p_file, (const uint8_t *)iov[i].iov_base, iov[i].iov_len)) {
+                sink_file_fail(h_ts, p_file, pid);
+                return;
+            }
+        }
+    } else if (p_file->len + total < SINK_BUF_SIZE) {
+        for (i = 0; i < n_iov; i++) {
+            memcpy(p_file->buf + p_file->len, iov[i].iov_base, iov[i].iov_len);
+            p_file->len += iov[i].iov_len;
+        }
+    } else if (!sink_file_flush(p_file) || !sink_write_iov(p_file->fd, iov, n_iov)) {
+        sink_file_fail(h_ts, p_file, pid);
+        return;
+    }
+
+    ts2es_report(h_ts, TS2ES_DEBUG, "writing TS packet, PID[%d], pts: %lld\n", pid, pts);
+    ts2es_atomic_add64(&h_ts->total_bytes, total);
+}
@@ -0,0 +1,228 @@
+/*
+    ts_stats.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Statistics. The packet counters of all PIDs and the classification time
+ * are kept in ts2es_stats_t by the thread classifying the packets; the ES
+ * counters and the times of the other stages are kept in each ts2es_es_t by
+ * the thread owning the ES, and added up per PID in a snapshot.
+ */
+#include "ts2es.h"
+#include "ts_thread.h"
+#include <string.h>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define HAVE_RDTSC  1
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_RDTSC  1
+#endif
+
+/* ---------------------------------------------------------------------------
+ * returns the time stamp counter, or the time in ns where there is none
+ */
+uint64_t ts2es_ticks(void)
+{
+#if HAVE_RDTSC
+    return __rdtsc();
+#else
+    return (uint64_t)ts2es_time_us() * 1000;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the statistics, or NULL if out of memory
+ */
+ts2es_stats_t *ts2es_stats_create(ts2es_t *h_ts)
+{
+    ts2es_stats_t *p_stats = (ts2es_stats_t *)calloc(1, sizeof(ts2es_stats_t));
+
+    if (p_stats == NULL) {
+        return NULL;
+    }
+    memset(p_stats->last_cc, 0xFF, sizeof(p_stats->last_cc));
+    p_stats->start_us    = ts2es_time_us();
+    p_stats->start_ticks = ts2es_ticks();
+    p_stats->dump_us     = p_stats->start_us;
+
+    if (strcmp(h_ts->param.s_stats, "-") == 0) {
+        p_stats->fp = stderr;
+    } else if (h_ts->param.s_stats[0] != '\0' && (p_stats->fp = fopen(h_ts->param.s_stats, "a")) == NULL) {
+        ts2es_report(h_ts, TS2ES_WARNING, "Failed to open statistics file %s\n", h_ts->param.s_stats);
+    } else if (p_stats->fp != NULL) {
+        setvbuf(p_stats->fp, NULL, _IOFBF, 1 << 16);    // a line is written at once
+    }
+    return p_stats;
+}
+
+/* ---------------------------------------------------------------------------
+ * dump the final statistics and free them
+ */
+void ts2es_stats_destroy(ts2es_t *h_ts)
+{
+    ts2es_stats_t *p_stats = h_ts->stats;
+
+    if (p_stats == NULL) {
+        return;
+    }
+    if (p_stats->fp != NULL) {
+        ts2es_stats_json(h_ts, p_stats->fp);
+        if (p_stats->fp != stderr) {
+            fclose(p_stats->fp);
+        }
+    }
+    free(p_stats);
+    h_ts->stats = NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * Take a snapshot of the statistics of a handle, with the ES counters added
+ * to the counters of their PIDs. The workers are not waited for, the ES
+ * counters they keep may lag behind the packet counters
+ */
+static void stats_snapshot(ts2es_t *h_ts, ts2es_stats_t *p_stats)
+{
+    int64_t now_us = ts2es_time_us();
+    int i, k;
+
+    if (h_ts->stats != NULL) {
+        memcpy(p_stats, h_ts->stats, sizeof(ts2es_stats_t));
+        p_stats->fp = NULL;
+        p_stats->elapsed_us = now_us - p_stats->start_us;
+        if (p_stats->elapsed_us > 0) {
+            p_stats->ticks_per_us = (double)(ts2es_ticks() - p_stats->start_ticks) / p_stats->elapsed_us;
+        }
+    } else {
+        memset(p_stats, 0, sizeof(ts2es_stats_t));
+        p_stats->packets = h_ts->total_packets;
+    }
+    p_stats->output_bytes = ts2es_atomic_load64(&h_ts->total_bytes);
+
+    for (i = 0; i < h_ts->num_es; i++) {
+        ts2es_es_t *p_es = &h_ts->es[i];
+        ts2es_pid_stats_t *p_pid = &p_stats->pids[p_es->pid & (TS_NUM_PIDS - 1)];
+        p_pid->pes_count     += p_es->pes_count;
+        p_pid->resyncs       += p_es->resyncs;
+        p_pid->skipped_bytes += p_es->skipped_bytes;
+        p_pid->skipped_pes   += p_es->skipped_pes;
+        for (k = TS2ES_STAGE_PES; k < TS2ES_NUM_STAGES; k++) {
+            p_stats->stage_ticks[k] += p_es->stage_ticks[k];
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Take a snapshot of the statistics of a handle once the workers have
+ * demuxed all packets passed so far
+ */
+void ts2es_get_stats(ts2es_t *h_ts, ts2es_stats_t *p_stats)
+{
+    ts2es_wait_workers(h_ts);
+    stats_snapshot(h_ts, p_stats);
+}
+
+/* ---------------------------------------------------------------------------
+ * Write a snapshot as one line of JSON
+ */
+static void stats_write(ts2es_t *h_ts, ts2es_stats_t *p_stats, FILE *fp)
+{
+    static const char *s_stages[TS2ES_NUM_STAGES] = {
+        "classify", "pes", "sync", "copy", "output"
+    };
+    const char *sep = "";
+    int i;
+
+    fprintf(fp, "{\"input\":\"");
+    for (i = 0; h_ts->param.s_input[i] != '\0'; i++) {
+        int c = (uint8_t)h_ts->param.s_input[i];
+        fprintf(fp, c == '"' || c == '\\' ? "\\%c" : c < 0x20 ? "\\u%04x" : "%c", c);
+    }
+    fprintf(fp, "\",\"elapsed_us\":%lld,\"ticks_per_us\":%.1f,\"packets\":%llu,"
+            "\"ts_resyncs\":%llu,\"ts_skipped_bytes\":%llu,\"output_bytes\":%llu,\"stages\":{",
+            (long long)p_stats->elapsed_us, p_stats->ticks_per_us, (unsigned long long)p_stats->packets,
+            (unsigned long long)p_stats->ts_resyncs, (unsigned long long)p_stats->ts_skipped_bytes,
+            (unsigned long long)p_stats->output_bytes);
+    for (i = 0; i < TS2ES_NUM_STAGES; i++) {
+        fprintf(fp, "%s\"%s\":{\"ticks\":%llu,\"us\":%.0f}", i ? "," : "", s_stages[i],
+                (unsigned long long)p_stats->stage_ticks[i],
+                p_stats->ticks_per_us > 0 ? p_stats->stage_ticks[i] / p_stats->ticks_per_us : 0.0);
+    }
+    fprintf(fp, "},\"pids\":[");
+    for (i = 0; i < TS_NUM_PIDS; i++) {
+        ts2es_pid_stats_t *p_pid = &p_stats->pids[i];
+        if (p_pid->packets == 0 && p_pid->pes_count == 0) {
+            continue;
+        }
+        fprintf(fp, "%s{\"pid\":%d,\"packets\":%llu,\"payload_bytes\":%llu,\"pes\":%llu,\"cc_errors\":%llu,"
+                "\"te_errors\":%llu,\"scrambled\":%llu,\"resyncs\":%llu,\"skipped_bytes\":%llu,\"skipped_pes\":%llu}", sep, i,
+                (unsigned long long)p_pid->packets, (unsigned long long)p_pid->payload_bytes,
+                (unsigned long long)p_pid->pes_count, (unsigned long long)p_pid->cc_errors,
+                (unsigned long long)p_pid->te_errors, (unsigned long long)p_pid->scrambled,
+                (unsigned long long)p_pid->resyncs, (unsigned long long)p_pid->skipped_bytes,
+                (unsigned long long)p_pid->skipped_pes);
+        sep = ",";
+    }
+    fprintf(fp, "]}\n");
+    fflush(fp);
+}
+
+/* ---------------------------------------------------------------------------
+ * Write the statistics of a handle as one line of JSON
+ * returns 1 on success, or 0 on failure
+ */
+int ts2es_stats_json(ts2es_t *h_ts, FILE *fp)
+{
+    ts2es_stats_t *p_stats = (ts2es_stats_t *)malloc(sizeof(ts2es_stats_t));
+
+    if (p_stats == NULL) {
+        return 0;
+    }
+    ts2es_get_stats(h_ts, p_stats);
+    stats_write(h_ts, p_stats, fp);
+    free(p_stats);
+    return !ferror(fp);
+}
+
+/* ---------------------------------------------------------------------------
+ * Dump the statistics if param.i_stats_interval has passed since the last
+ * dump, called by the demux every few thousand packets. The -j pipeline is
+ * not drained for it, the ES counters are those reached by the workers
+ */
+void ts2es_stats_poll(ts2es_t *h_ts)
+{
+    ts2es_stats_t *p_stats = h_ts->stats;
+    int64_t now_us;
+
+    if (p_stats == NULL || p_stats->fp == NULL || h_ts->param.i_stats_interval <= 0) {
+        return;
+    }
+    now_us = ts2es_time_us();
+    if (now_us - p_stats->dump_us >= (int64_t)h_ts->param.i_stats_interval * 1000) {
+        ts2es_stats_t *p_snap = (ts2es_stats_t *)malloc(sizeof(ts2es_stats_t));
+        p_stats->dump_us = now_us;
+        if (p_snap != NULL) {
+            stats_snapshot(h_ts, p_snap);
+            stats_write(h_ts, p_snap, p_stats->fp);
+            free(p_snap);
+        }
+    }
+}
@@ -0,0 +1,365 @@
+/*
+    ts_sync.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Transport stream synchronisation: find the next run of TS_SYNC_CHECK sync
+ * bytes at the packet stride, and detect the packet size from that stride.
+ */
+#include "ts2es.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HAVE_SSE2   1
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_AVX2   1
+#define AVX2_TARGET __attribute__((target("avx2")))
+#include <immintrin.h>
+#elif defined(__AVX2__)
+#define HAVE_AVX2   1
+#define AVX2_TARGET
+#include <immintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+static int ctz32(uint32_t x) { unsigned long i; _BitScanForward(&i, x); return (int)i; }
+#else
+#define ctz32(x)    __builtin_ctz(x)
+#endif
+
+/* ---------------------------------------------------------------------------
+ * CPU features, detected at startup by the compiler runtime so that any
+ * thread may ask
+ */
+int ts2es_cpu_has_avx2(void)
+{
+#if defined(HAVE_AVX2) && defined(__GNUC__)
+    return __builtin_cpu_supports("avx2") ? 1 : 0;
+#elif defined(HAVE_AVX2)
+    return 1;       // built for AVX2
+#else
+    return 0;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static int sync_run_at(const uint8_t *p, int stride)
+{
+    int k;
+    for (k = 0; k < TS_SYNC_CHECK; k++) {
+        if (p[k * stride] != 0x47) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+#if HAVE_AVX2
+/* ---------------------------------------------------------------------------
+ * scan candidate positions [*p_i, n) 32 at a time
+ * returns 1 with the position of the run in *p_i, or 0 with the first
+ * position not scanned in *p_i
+ */
+AVX2_TARGET
+static int sync_scan_avx2(const uint8_t *buf, size_t n, int stride, size_t *p_i)
+{
+    const __m256i sync = _mm256_set1_epi8(0x47);
+    size_t i;
+
+    for (i = *p_i; i + 32 <= n; i += 32) {
+        __m256i m = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), sync);
+        int k;
+        for (k = 1; k < TS_SYNC_CHECK && !_mm256_testz_si256(m, m); k++) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i + k * stride));
+            m = _mm256_and_si256(m, _mm256_cmpeq_epi8(v, sync));
+        }
+        if (!_mm256_testz_si256(m, m)) {
+            *p_i = i + ctz32((uint32_t)_mm256_movemask_epi8(m));
+            return 1;
+        }
+    }
+    *p_i = i;
+    return 0;
+}
+#endif
+
+#if HAVE_SSE2
+/* ---------------------------------------------------------------------------
+ * scan candidate positions [*p_i, n) 16 at a time, see sync_scan_avx2()
+ */
+static int sync_scan_sse2(const uint8_t *buf, size_t n, int stride, size_t *p_i)
+{
+    const __m128i sync = _mm_set1_epi8(0x47);
+    size_t i;
+
+    for (i = *p_i; i + 16 <= n; i += 16) {
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), sync));
+        int k;
+        for (k = 1; k < TS_SYNC_CHECK && mask; k++) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(buf + i + k * stride));
+            mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(v, sync));
+        }
+        if (mask) {
+            *p_i = i + ctz32((uint32_t)mask);
+            return 1;
+        }
+    }
+    *p_i = i;
+    return 0;
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * find the first run of TS_SYNC_CHECK sync bytes spaced by "stride"
+ * returns the offset of the run, or -1 if there is none
+ */
+static int64_t sync_scan(const uint8_t *buf, size_t len, int stride)
+{
+    size_t span = (size_t)(TS_SYNC_CHECK - 1) * stride;
+    size_t n, i = 0;
+
+    if (len <= span) {
+        return -1;
+    }
+    n = len - span;     // number of candidate positions
+
+#if HAVE_AVX2
+    if (ts2es_cpu_has_avx2() && sync_scan_avx2(buf, n, stride, &i)) {
+        return (int64_t)i;
+    }
+#endif
+#if HAVE_SSE2
+    if (sync_scan_sse2(buf, n, stride, &i)) {
+        return (int64_t)i;
+    }
+#endif
+
+    // remaining positions, or all of them without SIMD
+    for (; i < n; i++) {
+        if (buf[i] == 0x47 && sync_run_at(buf + i, stride)) {
+            return (int64_t)i;
+        }
+    }
+    return -1;
+}
+
+/* ---------------------------------------------------------------------------
+ * find the next synchronised packet. If *p_packet_size is 0 the packet size
+ * (188, 192 for M2TS or 204 with RS code) is detected and stored
+ * returns the offset of the sync byte, or -1 if there is no sync in buf
+ */
+int64_t ts2es_sync_find(const uint8_t *buf, size_t len, int *p_packet_size)
+{
+    static const int sizes[] = { TS_PACKET_SIZE, TS_PACKET_SIZE_M2TS, TS_PACKET_SIZE_RS };
+    int64_t best = -1;
+    int i;
+
+    if (*p_packet_size != 0) {
+        return sync_scan(buf, len, *p_packet_size);
+    }
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+        // only look before the best offset found so far
+        size_t n = best < 0 ? len : (size_t)best + (TS_SYNC_CHECK - 1) * sizes[i];
+        int64_t offset = sync_scan(buf, n < len ? n : len, sizes[i]);
+        if (offset >= 0 && (best < 0 || offset < best)) {
+            best = offset;
+            *p_packet_size = sizes[i];
+        }
+    }
+
+    return best;
+}
+
+/* ---------------------------------------------------------------------------
+ * Elementary stream sync: a position can only start a video start-code
+ * (00 00 xx) or an MPEG audio frame header (syncword 0xFFE) if
+ *     (buf[i] == 0x00 && buf[i + 1] == 0x00) ||
+ *     (buf[i] == 0xFF && (buf[i + 1] & 0xE0) == 0xE0)
+ * Candidates are found in bulk, the caller validates the few hits.
+ */
+static int es_candidate_at(const uint8_t *p)
+{
+    return (p[0] == 0x00 && p[1] == 0x00) || (p[0] == 0xFF && (p[1] & 0xE0) == 0xE0);
+}
+
+#if HAVE_AVX2
+/* ---------------------------------------------------------------------------
+ */
+AVX2_TARGET
+static int es_scan_avx2(const uint8_t *buf, size_t len, size_t *p_i)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi8((char)0xFF);
+    const __m256i sync = _mm256_set1_epi8((char)0xE0);
+    size_t i;
+
+    for (i = *p_i; i + 33 <= len; i += 32) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(buf + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(buf + i + 1));
+        __m256i m_video = _mm256_and_si256(_mm256_cmpeq_epi8(v0, zero), _mm256_cmpeq_epi8(v1, zero));
+        __m256i m_audio = _mm256_and_si256(_mm256_cmpeq_epi8(v0, ones),
+                                           _mm256_cmpeq_epi8(_mm256_and_si256(v1, sync), sync));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(m_video, m_audio));
+        if (mask) {
+            *p_i = i + ctz32(mask);
+            return 1;
+        }
+    }
+    *p_i = i;
+    return 0;
+}
+#endif
+
+#if HAVE_SSE2
+/* ---------------------------------------------------------------------------
+ */
+static int es_scan_sse2(const uint8_t *buf, size_t len, size_t *p_i)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi8((char)0xFF);
+    const __m128i sync = _mm_set1_epi8((char)0xE0);
+    size_t i;
+
+    for (i = *p_i; i + 17 <= len; i += 16) {
+        __m128i v0 = _mm_loadu_si128((const __m128i *)(buf + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i *)(buf + i + 1));
+        __m128i m_video = _mm_and_si128(_mm_cmpeq_epi8(v0, zero), _mm_cmpeq_epi8(v1, zero));
+        __m128i m_audio = _mm_and_si128(_mm_cmpeq_epi8(v0, ones),
+                                        _mm_cmpeq_epi8(_mm_and_si128(v1, sync), sync));
+        int mask = _mm_movemask_epi8(_mm_or_si128(m_video, m_audio));
+        if (mask) {
+            *p_i = i + ctz32((uint32_t)mask);
+            return 1;
+        }
+    }
+    *p_i = i;
+    return 0;
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * find the first position which may start a video start-code or an MPEG
+ * audio frame header, with at least 4 bytes left from it
+ * returns the offset of the position, or len - 3 if there is none
+ */
+size_t ts2es_es_sync_scan(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    if (len < 4) {
+        return 0;
+    }
+
+#if HAVE_AVX2
+    if (ts2es_cpu_has_avx2() && es_scan_avx2(buf, len, &i)) {
+        return i < len - 3 ? i : len - 3;
+    }
+#endif
+#if HAVE_SSE2
+    if (es_scan_sse2(buf, len, &i)) {
+        return i < len - 3 ? i : len - 3;
+    }
+#endif
+
+    for (; i < len - 3; i++) {
+        if (es_candidate_at(buf + i)) {
+            return i;
+        }
+    }
+    return len - 3;
+}
+
+/* ---------------------------------------------------------------------------
+ * PID filter: a packet is of interest if its sync byte is lost, or if its
+ * PID is not ignored by the dispatch table. Null packets are never of
+ * interest. Only the 4 header bytes of each packet are read
+ */
+static int pid_interesting_at(const uint8_t *p, const uint16_t *pid_map)
+{
+    int pid = TS_PACKET_PID(p);
+    return p[0] != 0x47 || (pid != TS_NULL_PID && TS2ES_PID_TYPE(pid_map[pid]) != TS2ES_PID_IGNORE);
+}
+
+#if HAVE_AVX2
+/* ---------------------------------------------------------------------------
+ * headers of 8 packets at a time are gathered, then their entries of the
+ * dispatch table; the null PID, the last entry, is not gathered as a 32 bit
+ * load there would run past the table
+ */
+AVX2_TARGET
+static size_t pid_filter_avx2(const uint8_t *buf, size_t n, int stride, const uint16_t *pid_map,
+                              uint32_t *idx, size_t *p_i)
+{
+    const __m256i offsets  = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(stride));
+    const __m256i byte     = _mm256_set1_epi32(0xFF);
+    const __m256i sync     = _mm256_set1_epi32(0x47);
+    const __m256i pid_hi   = _mm256_set1_epi32(0x1F00);
+    const __m256i null_pid = _mm256_set1_epi32(TS_NULL_PID);
+    const __m256i type     = _mm256_set1_epi32(0xFF00);
+    const __m256i zero     = _mm256_setzero_si256();
+    size_t i, n_idx = 0;
+
+    for (i = *p_i; i + 8 <= n; i += 8) {
+        // little-endian header: sync byte, then the PID in the next two bytes
+        __m256i hdr = _mm256_i32gather_epi32((const int *)(buf + i * stride), offsets, 1);
+        __m256i pid = _mm256_or_si256(_mm256_and_si256(hdr, pid_hi),
+                                      _mm256_and_si256(_mm256_srli_epi32(hdr, 16), byte));
+        __m256i in_sync = _mm256_cmpeq_epi32(_mm256_and_si256(hdr, byte), sync);
+        __m256i live = _mm256_andnot_si256(_mm256_cmpeq_epi32(pid, null_pid), in_sync);
+        __m256i entry = _mm256_mask_i32gather_epi32(zero, (const int *)pid_map, pid, live, 2);
+        __m256i ignored = _mm256_cmpeq_epi32(_mm256_and_si256(entry, type), zero);
+        // lost sync, or a PID whose entry is not IGNORE; null packets gather 0
+        uint32_t mask = ~(uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(in_sync, ignored))) & 0xFF;
+        while (mask) {
+            idx[n_idx++] = (uint32_t)(i + ctz32(mask));
+            mask &= mask - 1;
+        }
+    }
+    *p_i = i;
+    return n_idx;
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * Filter n packets at the packet stride by their headers, the caller makes
+ * sure the 4 header bytes of each are in buf
+ * returns the number of packets of interest, their numbers are in idx
+ */
+size_t ts2es_pid_filter(const uint8_t *buf, size_t n, int stride, const uint16_t *pid_map, uint32_t *idx)
+{
+    size_t i = 0, n_idx = 0;
+
+#if HAVE_AVX2
+    if (ts2es_cpu_has_avx2()) {
+        n_idx = pid_filter_avx2(buf, n, stride, pid_map, idx, &i);
+    }
+#endif
+
+    for (; i < n; i++) {
+        idx[n_idx] = (uint32_t)i;
+        n_idx += pid_interesting_at(buf + i * stride, pid_map);
+    }
+    return n_idx;
+}
@@ -22,46 +22,25 @@
 */
 #include "ts2es.h"
 #include "mpa_header.h"
+#include "ts_thread.h"
+#include <string.h>
 
 #ifdef _MSC_VER
 #pragma warning(disable:4100)
-#pragma warning(disable:4101)
-#pragma warning(disable:4189)
 #endif
 
 /* ---------------------------------------------------------------------------
  */
 void ts2es_decode_pat(ts2es_t *h_ts, uint8_t *buf, int buf_len)
 {
-    int table_id = buf[0];
-    int section_syntax_indicator = buf[1] >> 7;
-    int zero = buf[1] >> 6 & 0x1;
-    int reserved_1 = buf[1] >> 4 & 0x3;
     int section_length = ((buf[1] & 0x0F) << 8) | buf[2];
-
-    int transport_stream_id = buf[3] << 8 | buf[4];
-
-    int reserved_2 = buf[5] >> 6;
-    int version_number = buf[5] >> 1 & 0x1F;
-    int current_next_indicator = (buf[5] << 7) >> 7;
-    int section_number = buf[6];
-    int last_section_number = buf[7];
-
-    int len = 0;
     int n = 0;
 
-    h_ts->pmt_pid = -1;
-    memset(h_ts->pmt, 0, sizeof(h_ts->pmt));
-
-    len = 3 + section_length;
-    int CRC_32 = (buf[len - 4] & 0x000000FF) << 24
-        | (buf[len - 3] & 0x000000FF) << 16
-        | (buf[len - 2] & 0x000000FF) << 8
-        | (buf[len - 1] & 0x000000FF);
+    h_ts->num_programs = 0;
 
+    // programs follow the 8-byte header, the CRC_32 is checked by ts2es_demux_psi()
     for (n = 0; n < section_length - 12; n += 4) {
         unsigned  program_num = buf[8 + n] << 8 | buf[9 + n];
-        int reserved_3 = buf[10 + n] >> 5;
         int network_PID = (buf[10 + n] & 0x1F) << 8 | buf[11 + n];
 
         if (program_num == 0x00) {
@@ -71,8 +50,18 @@ void ts2es_decode_pat(ts2es_t *h_ts, uint8_t *buf, int buf_len)
         } else {
             int program_map_PID = network_PID;
             int program_number = program_num;
+            ts2es_program_t *p_prog;
 
-            h_ts->pmt_pid = program_map_PID;
+            if (h_ts->num_programs == MAX_NUM_PROGRAMS) {
+                ts2es_report(h_ts, TS2ES_WARNING, "Too many programs, ignoring program %d.\n", program_number);
+                continue;
+            }
+            p_prog = &h_ts->programs[h_ts->num_programs++];
+            p_prog->program_number = program_number;
+            p_prog->pmt_pid        = program_map_PID;
+            p_prog->pcr_pid        = -1;
+            p_prog->num_streams    = 0;
+            ts2es_psi_reset(&p_prog->psi);  // the PMT is decoded again
             ts2es_report(h_ts, TS2ES_INFO, "program num %d, PMT pid: %d\n", program_number, program_map_PID);
             // ȫPATĿPATĿϢ
         }
@@ -83,33 +72,20 @@ void ts2es_decode_pat(ts2es_t *h_ts, uint8_t *buf, int buf_len)
  */
 void ts2es_decode_pmt(ts2es_t *h_ts, uint8_t *buf, int buf_len)
 {
-    int table_id = buf[0];
-    int section_syntax_indicator = buf[1] >> 7;
-    int zero = buf[1] >> 6 & 0x01;
-    int reserved_1 = buf[1] >> 4 & 0x03;
     int section_length = (buf[1] & 0x0F) << 8 | buf[2];
     int program_number = buf[3] << 8 | buf[4];
-    int reserved_2 = buf[5] >> 6;
-    int version_number = buf[5] >> 1 & 0x1F;
-    int current_next_indicator = (buf[5] << 7) >> 7;
-    int section_number = buf[6];
-    int last_section_number = buf[7];
-    int reserved_3 = buf[8] >> 5;
     int PCR_PID = ((buf[8] << 8) | buf[9]) & 0x1FFF;
-
-    int PCRID = PCR_PID;
-
-    int reserved_4 = buf[10] >> 4;
     int program_info_length = (buf[10] & 0x0F) << 8 | buf[11];
-    // Get CRC_32  
-    int len = section_length + 3;
-    // int CRC_32 = (buf[len - 4] & 0x000000FF) << 24
-    //     | (buf[len - 3] & 0x000000FF) << 16
-    //     | (buf[len - 2] & 0x000000FF) << 8
-    //     | (buf[len - 1] & 0x000000FF);
+    // the CRC_32 is checked by ts2es_demux_psi()
 
     int pos = 12;
     int i = 0;
+    ts2es_program_t *p_prog = ts2es_find_program(h_ts, program_number);
+
+    if (p_prog == NULL) {
+        return;     // not in the PAT
+    }
+    p_prog->pcr_pid = PCR_PID;
 
     // program info descriptor  
     if (program_info_length != 0) {
@@ -119,9 +95,7 @@ void ts2es_decode_pmt(ts2es_t *h_ts, uint8_t *buf, int buf_len)
     // Get stream type and PID      
     for (; pos <= (section_length + 2) - 4;) {
         int stream_type = buf[pos];
-        int reserved_5 = buf[pos + 1] >> 5;
         int elementary_PID = ((buf[pos + 1] << 8) | buf[pos + 2]) & 0x1FFF;
-        int reserved_6 = buf[pos + 3] >> 4;
         int ES_info_length = (buf[pos + 3] & 0x0F) << 8 | buf[pos + 4];
 
         int descriptor = 0x00;
@@ -136,14 +110,258 @@ void ts2es_decode_pmt(ts2es_t *h_ts, uint8_t *buf, int buf_len)
         }
         pos += 5;
 
-        h_ts->pmt[i].pid = elementary_PID;
-        h_ts->pmt[i].stream_type = stream_type;
-        h_ts->pmt[i].ES_info_length = ES_info_length;
-        h_ts->pmt[i].descriptor = descriptor;
+        if (i == MAX_NUM_ES) {
+            break;
+        }
+        p_prog->streams[i].pid = elementary_PID;
+        p_prog->streams[i].stream_type = stream_type;
+        p_prog->streams[i].ES_info_length = ES_info_length;
+        p_prog->streams[i].descriptor = descriptor;
         i++;
 
         // ts2es_report(h_ts, TS2ES_INFO, "PID %d, stream_type %d, length %d, descriptor %u",
         //     elementary_PID, stream_type, ES_info_length, descriptor);
     }
+    p_prog->num_streams = i;
+    ts2es_report(h_ts, TS2ES_INFO, "program num %d, PCR pid: %d, %d streams\n", program_number, PCR_PID, i);
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the program of the PAT with this program_number, or NULL if none
+ */
+ts2es_program_t *ts2es_find_program(ts2es_t *h_ts, int program_number)
+{
+    int i;
+    for (i = 0; i < h_ts->num_programs; i++) {
+        if (h_ts->programs[i].program_number == program_number) {
+            return &h_ts->programs[i];
+        }
+    }
+    return NULL;
+}
+
+
+/* ===========================================================================
+ * CRC_32 of PSI sections (MPEG-2 systems, annex A): polynomial 0x04C11DB7,
+ * most significant bit first, computed 8 bytes at a time (slice-by-8)
+ * ==========================================================================*/
+static uint32_t crc_table[8][256];
+static uint32_t crc_state;      // 0: tables not built, 1: building, 2: ready
+
+/* ---------------------------------------------------------------------------
+ */
+static void crc_init(void)
+{
+    int i, k;
+
+    if (ts2es_atomic_load(&crc_state) == 2) {
+        return;
+    }
+    if (!ts2es_atomic_cas(&crc_state, 0, 1)) {
+        while (ts2es_atomic_load(&crc_state) != 2) {
+            ts2es_thread_yield();   // another thread builds the tables
+        }
+        return;
+    }
+
+    for (i = 0; i < 256; i++) {
+        uint32_t crc = (uint32_t)i << 24;
+        for (k = 0; k < 8; k++) {
+            crc = (crc << 1) ^ ((crc & 0x80000000) ? 0x04C11DB7 : 0);
+        }
+        crc_table[0][i] = crc;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            uint32_t crc = crc_table[k - 1][i];
+            crc_table[k][i] = (crc << 8) ^ crc_table[0][crc >> 24];
+        }
+    }
+    ts2es_atomic_store(&crc_state, 2);
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the CRC_32 of buf, 0 over a whole section including its CRC_32
+ */
+uint32_t ts2es_crc32(const uint8_t *buf, size_t len)
+{
+    uint32_t crc = 0xFFFFFFFF;
+
+    crc_init();
+    for (; len >= 8; len -= 8, buf += 8) {
+        uint32_t a = crc ^ ((uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3]);
+        crc = crc_table[7][a >> 24] ^ crc_table[6][(a >> 16) & 0xFF] ^
+              crc_table[5][(a >> 8) & 0xFF] ^ crc_table[4][a & 0xFF] ^
+              crc_table[3][buf[4]] ^ crc_table[2][buf[5]] ^
+              crc_table[1][buf[6]] ^ crc_table[0][buf[7]];
+    }
+    for (; len > 0; len--, buf++) {
+        crc = (crc << 8) ^ crc_table[0][(crc >> 24) ^ *buf];
+    }
+    return crc;
+}
+
+/* ===========================================================================
+ * PSI section assembly
+ * ==========================================================================*/
+
+/* ---------------------------------------------------------------------------
+ */
+void ts2es_psi_reset(ts2es_psi_t *p_psi)
+{
+    p_psi->len              = 0;
+    p_psi->continuity_count = -1;
+    p_psi->version          = -1;
+    p_psi->crc              = 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * Decode a complete section, unless it is corrupt, not applicable yet, or
+ * the same as the last one decoded. Programs may share a PMT PID, so the
+ * version in use of a PMT is the one of the program it describes
+ * returns 1 if the table was decoded, or 0 if not
+ */
+static int psi_section_done(ts2es_t *h_ts, ts2es_psi_t *p_psi, int table_id)
+{
+    uint8_t *sec = p_psi->buf;
+    int len = p_psi->len;
+    ts2es_psi_t *p_table = p_psi;
+    int version;
+    uint32_t crc;
+
+    if (sec[0] != table_id) {
+        return 0;   // other tables may share the PID
+    }
+    if (len < 12 || ts2es_crc32(sec, len) != 0) {
+        ts2es_report(h_ts, TS2ES_WARNING, "CRC error in PSI section (table_id: 0x%x, length: %d).\n", table_id, len);
+        return 0;
+    }
+    if (!(sec[5] & 0x01)) {
+        return 0;   // current_next_indicator: next version, not applicable yet
+    }
+
+    if (table_id == TS_TABLE_ID_PMT) {
+        ts2es_program_t *p_prog = ts2es_find_program(h_ts, sec[3] << 8 | sec[4]);
+        if (p_prog == NULL) {
+            return 0;   // program not in the PAT
+        }
+        p_table = &p_prog->psi;
+    }
+
+    version = (sec[5] >> 1) & 0x1F;
+    crc     = (uint32_t)sec[len - 4] << 24 | (uint32_t)sec[len - 3] << 16 | (uint32_t)sec[len - 2] << 8 | sec[len - 1];
+    if (version == p_table->version && crc == p_table->crc) {
+        return 0;   // repetition of the table in use
+    }
+    p_table->version = version;
+    p_table->crc     = crc;
+
+    if (table_id == TS_TABLE_ID_PAT) {
+        ts2es_decode_pat(h_ts, sec, len);
+    } else {
+        ts2es_decode_pmt(h_ts, sec, len);
+    }
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * Collect up to n bytes of the current section
+ * returns the number of bytes used, the section ends there if p_psi->len is
+ * back to 0
+ */
+static int psi_section_append(ts2es_t *h_ts, ts2es_psi_t *p_psi, const uint8_t *p, int n,
+                              int table_id, int *p_decoded)
+{
+    int used = 0;
+
+    while (used < n) {
+        // the header tells the length after the first 3 bytes
+        int need = p_psi->len < 3 ? 3 : 3 + (((p_psi->buf[1] & 0x0F) << 8) | p_psi->buf[2]);
+        int take = need - p_psi->len < n - used ? need - p_psi->len : n - used;
+
+        if (need > TS_PSI_MAX_SIZE) {
+            ts2es_report(h_ts, TS2ES_WARNING, "Invalid PSI section length %d.\n", need);
+            p_psi->len = 0;
+            return n;
+        }
+
+        memcpy(p_psi->buf + p_psi->len, p + used, take);
+        p_psi->len += take;
+        used       += take;
+
+        if (p_psi->len >= 3 && p_psi->len == 3 + (((p_psi->buf[1] & 0x0F) << 8) | p_psi->buf[2])) {
+            *p_decoded += psi_section_done(h_ts, p_psi, table_id);
+            p_psi->len = 0;
+            break;
+        }
+    }
+    return used;
 }
 
+/* ---------------------------------------------------------------------------
+ * Demux one TS packet of a PID carrying the PAT (table_id 0x00) or a PMT
+ * (table_id 0x02). Sections may span several packets, and several sections
+ * may start in one packet
+ * returns the number of tables decoded
+ */
+int ts2es_demux_psi(ts2es_t *h_ts, ts2es_psi_t *p_psi, const uint8_t *buf, int table_id)
+{
+    const uint8_t *p = buf + 4;
+    int n = TS_PACKET_SIZE - 4;
+    int cc = TS_PACKET_CONT_COUNT(buf);
+    int n_decoded = 0;
+
+    if (TS_PACKET_TRANS_ERROR(buf) || !(TS_PACKET_ADAPTATION(buf) & 0x1)) {
+        return 0;
+    }
+    if (TS_PACKET_ADAPTATION(buf) == 0x3) {
+        n -= TS_PACKET_ADAPT_LEN(buf) + 1;
+        p += TS_PACKET_ADAPT_LEN(buf) + 1;
+        if (n <= 0) {
+            return 0;
+        }
+    }
+
+    // a section in progress continues in the next packet only
+    if (p_psi->len > 0) {
+        if (cc == p_psi->continuity_count) {
+            return 0;   // duplicate packet
+        }
+        if (cc != ((p_psi->continuity_count + 1) & 0x0F)) {
+            ts2es_report(h_ts, TS2ES_WARNING, "PSI continuity error, pid[%d]: (%d, %d)\n",
+                TS_PACKET_PID(buf), (p_psi->continuity_count + 1) & 0x0F, cc);
+            p_psi->len = 0;
+        }
+    }
+    p_psi->continuity_count = cc;
+
+    if (!TS_PACKET_PAYLOAD_START(buf)) {
+        if (p_psi->len > 0) {
+            psi_section_append(h_ts, p_psi, p, n, table_id, &n_decoded);
+        }
+        return n_decoded;
+    }
+
+    // pointer_field: the end of the previous section comes first
+    if (p[0] >= n) {
+        p_psi->len = 0;
+        return 0;
+    }
+    if (p_psi->len > 0) {
+        psi_section_append(h_ts, p_psi, p + 1, p[0], table_id, &n_decoded);
+        p_psi->len = 0;
+    }
+    n -= 1 + p[0];
+    p += 1 + p[0];
+
+    // then new sections, up to the stuffing bytes
+    while (n > 0 && p[0] != 0xFF) {
+        int used = psi_section_append(h_ts, p_psi, p, n, table_id, &n_decoded);
+        p += used;
+        n -= used;
+        if (p_psi->len > 0) {
+            break;      // continues in the next packet
+        }
+    }
+    return n_decoded;
+}
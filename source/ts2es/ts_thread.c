@@ -0,0 +1,477 @@
+/*
+    ts_thread.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+#include "ts_thread.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+// the producer publishes its slots to the consumer in batches of this size
+#define RING_PUBLISH_BATCH      32
+
+#ifdef _WIN32
+/* ---------------------------------------------------------------------------
+ */
+typedef struct thread_arg_t {
+    f_ts2es_thread p_fun;
+    void          *arg;
+} thread_arg_t;
+
+static DWORD WINAPI thread_entry(LPVOID arg)
+{
+    thread_arg_t t = *(thread_arg_t *)arg;
+    free(arg);
+    t.p_fun(t.arg);
+    return 0;
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * returns 1 on success, or 0 on failure
+ */
+int ts2es_thread_create(ts2es_thread_t *p_thread, f_ts2es_thread p_fun, void *arg)
+{
+#ifdef _WIN32
+    thread_arg_t *p_arg = (thread_arg_t *)malloc(sizeof(thread_arg_t));
+    if (p_arg == NULL) {
+        return 0;
+    }
+    p_arg->p_fun = p_fun;
+    p_arg->arg   = arg;
+    *p_thread = CreateThread(NULL, 0, thread_entry, p_arg, 0, NULL);
+    if (*p_thread == NULL) {
+        free(p_arg);
+        return 0;
+    }
+    return 1;
+#else
+    return pthread_create(p_thread, NULL, p_fun, arg) == 0;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ */
+void ts2es_thread_join(ts2es_thread_t thread)
+{
+#ifdef _WIN32
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, NULL);
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ */
+int ts2es_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * monotonic time in microseconds
+ */
+int64_t ts2es_time_us(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) {
+        QueryPerformanceFrequency(&freq);
+    }
+    QueryPerformanceCounter(&now);
+    return (int64_t)(now.QuadPart / freq.QuadPart * 1000000 + now.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+#ifndef _WIN32
+/* ---------------------------------------------------------------------------
+ */
+void ts2es_sleep_ms(int ms)
+{
+    struct timespec ts;
+    ts.tv_sec  = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+#endif
+
+/* ---------------------------------------------------------------------------
+ * returns 1 on success, or 0 if out of memory
+ */
+int ts2es_ring_init(ts2es_ring_t *p_ring, uint32_t num_slots, uint32_t slot_size)
+{
+    memset(p_ring, 0, sizeof(ts2es_ring_t));
+    p_ring->slots = (uint8_t *)malloc((size_t)num_slots * slot_size);
+    if (p_ring->slots == NULL) {
+        return 0;
+    }
+    p_ring->num_slots = num_slots;
+    p_ring->slot_size = slot_size;
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+void ts2es_ring_destroy(ts2es_ring_t *p_ring)
+{
+    free(p_ring->slots);
+    p_ring->slots = NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * producer: get the next free slot
+ * returns the slot, or NULL if the ring is full
+ */
+uint8_t *ts2es_ring_write_slot(ts2es_ring_t *p_ring)
+{
+    if (p_ring->head - p_ring->tail_cached >= p_ring->num_slots) {
+        p_ring->tail_cached = ts2es_atomic_load(&p_ring->tail);
+        if (p_ring->head - p_ring->tail_cached >= p_ring->num_slots) {
+            ts2es_ring_publish(p_ring);     // let the consumer make room
+            return NULL;
+        }
+    }
+    return p_ring->slots + (size_t)(p_ring->head & (p_ring->num_slots - 1)) * p_ring->slot_size;
+}
+
+/* ---------------------------------------------------------------------------
+ * producer: get up to max_slots free slots at once, e.g. for a batch of
+ * reads. They are filled and committed in order
+ * returns the number of slots, 0 if the ring is full
+ */
+uint32_t ts2es_ring_write_slots(ts2es_ring_t *p_ring, uint8_t **slots, uint32_t max_slots)
+{
+    uint32_t n, i;
+
+    p_ring->tail_cached = ts2es_atomic_load(&p_ring->tail);
+    n = p_ring->num_slots - (p_ring->head - p_ring->tail_cached);
+    n = n < max_slots ? n : max_slots;
+    for (i = 0; i < n; i++) {
+        slots[i] = p_ring->slots + (size_t)((p_ring->head + i) & (p_ring->num_slots - 1)) * p_ring->slot_size;
+    }
+    return n;
+}
+
+/* ---------------------------------------------------------------------------
+ * producer: the slot returned by ts2es_ring_write_slot() is filled
+ */
+void ts2es_ring_commit(ts2es_ring_t *p_ring)
+{
+    p_ring->head++;
+    if (p_ring->head - p_ring->head_shared >= RING_PUBLISH_BATCH) {
+        ts2es_ring_publish(p_ring);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * producer: make all committed slots visible to the consumer
+ */
+void ts2es_ring_publish(ts2es_ring_t *p_ring)
+{
+    if (p_ring->head != p_ring->head_shared) {
+        ts2es_atomic_store(&p_ring->head_shared, p_ring->head);
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * consumer: get the next filled slot
+ * returns the slot, or NULL if the ring is empty
+ */
+uint8_t *ts2es_ring_read_slot(ts2es_ring_t *p_ring)
+{
+    if (p_ring->tail == p_ring->head_cached) {
+        p_ring->head_cached = ts2es_atomic_load(&p_ring->head_shared);
+        if (p_ring->tail == p_ring->head_cached) {
+            return NULL;
+        }
+    }
+    return p_ring->slots + (size_t)(p_ring->tail & (p_ring->num_slots - 1)) * p_ring->slot_size;
+}
+
+/* ---------------------------------------------------------------------------
+ * consumer: the slot returned by ts2es_ring_read_slot() may be reused
+ */
+void ts2es_ring_release(ts2es_ring_t *p_ring)
+{
+    ts2es_atomic_store(&p_ring->tail, p_ring->tail + 1);
+}
+
+/* ===========================================================================
+ * work-stealing thread pool
+ * ==========================================================================*/
+typedef struct pool_task_t {
+    f_ts2es_task p_fun;
+    void        *arg;
+} pool_task_t;
+
+typedef struct pool_queue_t {
+    ts2es_mutex_t  lock;
+    pool_task_t   *tasks;       // queued tasks are tasks[head, tail)
+    int            head;        // oldest task, taken by other workers
+    int            tail;        // newest task, taken by the owner
+    int            size;
+} pool_queue_t;
+
+typedef struct pool_worker_t {
+    ts2es_pool_t  *p_pool;
+    pool_queue_t   queue;
+    ts2es_thread_t thread;
+    int            idx;
+} pool_worker_t;
+
+struct ts2es_pool_t {
+    ts2es_mutex_t  lock;
+    ts2es_cond_t   cv_work;     // a task was queued, or the pool stops
+    ts2es_cond_t   cv_idle;     // all tasks are done
+    int            num_queued;  // tasks in the queues
+    int            num_pending; // tasks not finished
+    int            b_stop;
+    int            next;        // queue of the next submitted task
+    int            num_workers;
+    int            num_started; // workers whose thread is running
+    pool_worker_t *workers;
+};
+
+/* ---------------------------------------------------------------------------
+ * returns 1 on success, or 0 if out of memory
+ */
+static int pool_queue_push(pool_queue_t *p_queue, f_ts2es_task p_fun, void *arg)
+{
+    ts2es_mutex_lock(&p_queue->lock);
+    if (p_queue->tail == p_queue->size) {
+        if (p_queue->head > 0) {    // reuse the room of taken tasks
+            memmove(p_queue->tasks, p_queue->tasks + p_queue->head,
+                    (p_queue->tail - p_queue->head) * sizeof(pool_task_t));
+            p_queue->tail -= p_queue->head;
+            p_queue->head  = 0;
+        } else {
+            int size = p_queue->size ? p_queue->size << 1 : 64;
+            pool_task_t *tasks = (pool_task_t *)realloc(p_queue->tasks, size * sizeof(pool_task_t));
+            if (tasks == NULL) {
+                ts2es_mutex_unlock(&p_queue->lock);
+                return 0;
+            }
+            p_queue->tasks = tasks;
+            p_queue->size  = size;
+        }
+    }
+    p_queue->tasks[p_queue->tail].p_fun = p_fun;
+    p_queue->tasks[p_queue->tail].arg   = arg;
+    p_queue->tail++;
+    ts2es_mutex_unlock(&p_queue->lock);
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * take the newest task (b_steal == 0) or the oldest one (b_steal == 1)
+ * returns 1 with the task in *p_task, or 0 if the queue is empty
+ */
+static int pool_queue_pop(pool_queue_t *p_queue, pool_task_t *p_task, int b_steal)
+{
+    int ret = 0;
+
+    ts2es_mutex_lock(&p_queue->lock);
+    if (p_queue->head < p_queue->tail) {
+        *p_task = b_steal ? p_queue->tasks[p_queue->head++] : p_queue->tasks[--p_queue->tail];
+        if (p_queue->head == p_queue->tail) {
+            p_queue->head = p_queue->tail = 0;
+        }
+        ret = 1;
+    }
+    ts2es_mutex_unlock(&p_queue->lock);
+    return ret;
+}
+
+/* ---------------------------------------------------------------------------
+ */
+static void *pool_worker_proc(void *arg)
+{
+    pool_worker_t *p_worker = (pool_worker_t *)arg;
+    ts2es_pool_t *p_pool = p_worker->p_pool;
+    pool_task_t task;
+
+    for (;;) {
+        int b_found = pool_queue_pop(&p_worker->queue, &task, 0);
+        int i;
+
+        // steal from the other workers, starting with the next one
+        for (i = 1; !b_found && i < p_pool->num_workers; i++) {
+            pool_worker_t *p_victim = &p_pool->workers[(p_worker->idx + i) % p_pool->num_workers];
+            b_found = pool_queue_pop(&p_victim->queue, &task, 1);
+        }
+
+        ts2es_mutex_lock(&p_pool->lock);
+        if (!b_found) {
+            while (p_pool->num_queued == 0 && !p_pool->b_stop) {
+                ts2es_cond_wait(&p_pool->cv_work, &p_pool->lock);
+            }
+            if (p_pool->num_queued == 0) {  // stopping
+                ts2es_mutex_unlock(&p_pool->lock);
+                break;
+            }
+            ts2es_mutex_unlock(&p_pool->lock);
+            continue;
+        }
+        p_pool->num_queued--;
+        ts2es_mutex_unlock(&p_pool->lock);
+
+        task.p_fun(task.arg);
+
+        ts2es_mutex_lock(&p_pool->lock);
+        if (--p_pool->num_pending == 0) {
+            ts2es_cond_broadcast(&p_pool->cv_idle);
+        }
+        ts2es_mutex_unlock(&p_pool->lock);
+    }
+    return NULL;
+}
+
+/* ---------------------------------------------------------------------------
+ * returns the pool, or NULL on failure
+ */
+ts2es_pool_t *ts2es_pool_create(int num_threads)
+{
+    ts2es_pool_t *p_pool = (ts2es_pool_t *)calloc(1, sizeof(ts2es_pool_t));
+    int i;
+
+    if (p_pool == NULL) {
+        return NULL;
+    }
+    if (num_threads < 1) {
+        num_threads = 1;
+    }
+    p_pool->workers = (pool_worker_t *)calloc(num_threads, sizeof(pool_worker_t));
+    if (p_pool->workers == NULL) {
+        free(p_pool);
+        return NULL;
+    }
+
+    ts2es_mutex_init(&p_pool->lock);
+    ts2es_cond_init(&p_pool->cv_work);
+    ts2es_cond_init(&p_pool->cv_idle);
+    for (i = 0; i < num_threads; i++) {
+        p_pool->workers[i].p_pool = p_pool;
+        p_pool->workers[i].idx    = i;
+        ts2es_mutex_init(&p_pool->workers[i].queue.lock);
+    }
+    // the queues are set up before any worker may steal from them
+    p_pool->num_workers = num_threads;
+    for (i = 0; i < num_threads; i++) {
+        if (!ts2es_thread_create(&p_pool->workers[i].thread, pool_worker_proc, &p_pool->workers[i])) {
+            ts2es_pool_destroy(p_pool);
+            return NULL;
+        }
+        p_pool->num_started++;
+    }
+    return p_pool;
+}
+
+/* ---------------------------------------------------------------------------
+ * queue a task, tasks are spread over the workers in turn
+ * returns 1 on success, or 0 if out of memory
+ */
+int ts2es_pool_submit(ts2es_pool_t *p_pool, f_ts2es_task p_fun, void *arg)
+{
+    pool_worker_t *p_worker = &p_pool->workers[p_pool->next];
+
+    p_pool->next = (p_pool->next + 1) % p_pool->num_workers;
+
+    // counted before it is queued: a worker may take it as soon as it is pushed
+    ts2es_mutex_lock(&p_pool->lock);
+    p_pool->num_queued++;
+    p_pool->num_pending++;
+    ts2es_mutex_unlock(&p_pool->lock);
+
+    if (!pool_queue_push(&p_worker->queue, p_fun, arg)) {
+        ts2es_mutex_lock(&p_pool->lock);
+        p_pool->num_queued--;
+        if (--p_pool->num_pending == 0) {
+            ts2es_cond_broadcast(&p_pool->cv_idle);
+        }
+        ts2es_mutex_unlock(&p_pool->lock);
+        return 0;
+    }
+
+    ts2es_mutex_lock(&p_pool->lock);
+    ts2es_cond_signal(&p_pool->cv_work);
+    ts2es_mutex_unlock(&p_pool->lock);
+    return 1;
+}
+
+/* ---------------------------------------------------------------------------
+ * wait until all submitted tasks are done
+ */
+void ts2es_pool_wait(ts2es_pool_t *p_pool)
+{
+    ts2es_mutex_lock(&p_pool->lock);
+    while (p_pool->num_pending > 0) {
+        ts2es_cond_wait(&p_pool->cv_idle, &p_pool->lock);
+    }
+    ts2es_mutex_unlock(&p_pool->lock);
+}
+
+/* ---------------------------------------------------------------------------
+ * finish all submitted tasks and stop the workers
+ */
+void ts2es_pool_destroy(ts2es_pool_t *p_pool)
+{
+    int i;
+
+    if (p_pool == NULL) {
+        return;
+    }
+
+    ts2es_mutex_lock(&p_pool->lock);
+    p_pool->b_stop = 1;
+    ts2es_cond_broadcast(&p_pool->cv_work);
+    ts2es_mutex_unlock(&p_pool->lock);
+
+    for (i = 0; i < p_pool->num_started; i++) {
+        ts2es_thread_join(p_pool->workers[i].thread);
+    }
+    for (i = 0; i < p_pool->num_workers; i++) {
+        ts2es_mutex_destroy(&p_pool->workers[i].queue.lock);
+        free(p_pool->workers[i].queue.tasks);
+    }
+    ts2es_cond_destroy(&p_pool->cv_work);
+    ts2es_cond_destroy(&p_pool->cv_idle);
+    ts2es_mutex_destroy(&p_pool->lock);
+    free(p_pool->workers);
+    free(p_pool);
+}
@@ -0,0 +1,141 @@
+/*
+    ts_thread.h
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+#ifndef _TS_THREAD_H_
+#define _TS_THREAD_H_
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* ===========================================================================
+ * threads and mutexes
+ * ==========================================================================*/
+#ifdef _WIN32
+typedef HANDLE              ts2es_thread_t;
+typedef CRITICAL_SECTION    ts2es_mutex_t;
+typedef CONDITION_VARIABLE  ts2es_cond_t;
+#define ts2es_mutex_init(m)         InitializeCriticalSection(m)
+#define ts2es_mutex_destroy(m)      DeleteCriticalSection(m)
+#define ts2es_mutex_lock(m)         EnterCriticalSection(m)
+#define ts2es_mutex_unlock(m)       LeaveCriticalSection(m)
+#define ts2es_cond_init(c)          InitializeConditionVariable(c)
+#define ts2es_cond_destroy(c)
+#define ts2es_cond_wait(c, m)       SleepConditionVariableCS(c, m, INFINITE)
+#define ts2es_cond_signal(c)        WakeConditionVariable(c)
+#define ts2es_cond_broadcast(c)     WakeAllConditionVariable(c)
+#define ts2es_thread_yield()        SwitchToThread()
+#define ts2es_sleep_ms(ms)          Sleep(ms)
+#else
+typedef pthread_t           ts2es_thread_t;
+typedef pthread_mutex_t     ts2es_mutex_t;
+typedef pthread_cond_t      ts2es_cond_t;
+#define ts2es_mutex_init(m)         pthread_mutex_init(m, NULL)
+#define ts2es_mutex_destroy(m)      pthread_mutex_destroy(m)
+#define ts2es_mutex_lock(m)         pthread_mutex_lock(m)
+#define ts2es_mutex_unlock(m)       pthread_mutex_unlock(m)
+#define ts2es_cond_init(c)          pthread_cond_init(c, NULL)
+#define ts2es_cond_destroy(c)       pthread_cond_destroy(c)
+#define ts2es_cond_wait(c, m)       pthread_cond_wait(c, m)
+#define ts2es_cond_signal(c)        pthread_cond_signal(c)
+#define ts2es_cond_broadcast(c)     pthread_cond_broadcast(c)
+#define ts2es_thread_yield()        sched_yield()
+void    ts2es_sleep_ms(int ms);
+#endif
+
+typedef void *(*f_ts2es_thread)(void *arg);
+
+int     ts2es_thread_create(ts2es_thread_t *p_thread, f_ts2es_thread p_fun, void *arg);
+void    ts2es_thread_join(ts2es_thread_t thread);
+int     ts2es_cpu_count(void);
+int64_t ts2es_time_us(void);
+
+/* ===========================================================================
+ * atomics, with acquire/release ordering
+ * ==========================================================================*/
+#ifdef _MSC_VER
+#define ts2es_atomic_load(p)        (_ReadWriteBarrier(), *(volatile uint32_t *)(p))
+#define ts2es_atomic_load64(p)      InterlockedCompareExchange64((volatile LONGLONG *)(p), 0, 0)
+#define ts2es_atomic_store(p, v)    InterlockedExchange((volatile LONG *)(p), (LONG)(v))
+#define ts2es_atomic_add(p, v)      InterlockedExchangeAdd((volatile LONG *)(p), (LONG)(v))
+#define ts2es_atomic_add64(p, v)    InterlockedExchangeAdd64((volatile LONGLONG *)(p), (LONGLONG)(v))
+#define ts2es_atomic_cas(p, o, n)   (InterlockedCompareExchange((volatile LONG *)(p), (LONG)(n), (LONG)(o)) == (LONG)(o))
+#else
+#define ts2es_atomic_load(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ts2es_atomic_load64(p)      __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define ts2es_atomic_store(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define ts2es_atomic_add(p, v)      __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL)
+#define ts2es_atomic_add64(p, v)    __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL)
+#define ts2es_atomic_cas(p, o, n)   __sync_bool_compare_and_swap(p, o, n)
+#endif
+
+/* ===========================================================================
+ * single producer, single consumer ring of fixed size slots
+ * ==========================================================================*/
+typedef struct ts2es_ring_t {
+    uint8_t *slots;
+    uint32_t num_slots;     // power of 2
+    uint32_t slot_size;
+    uint8_t  pad0[48];
+    uint32_t head;          // next slot to write, owned by the producer
+    uint32_t tail_cached;   // producer's copy of tail
+    uint8_t  pad1[56];
+    uint32_t head_shared;   // head published to the consumer
+    uint8_t  pad2[60];
+    uint32_t tail;          // next slot to read, owned by the consumer
+    uint32_t head_cached;   // consumer's copy of head_shared
+    uint8_t  pad3[56];
+} ts2es_ring_t;
+
+int      ts2es_ring_init(ts2es_ring_t *p_ring, uint32_t num_slots, uint32_t slot_size);
+void     ts2es_ring_destroy(ts2es_ring_t *p_ring);
+uint8_t *ts2es_ring_write_slot(ts2es_ring_t *p_ring);
+uint32_t ts2es_ring_write_slots(ts2es_ring_t *p_ring, uint8_t **slots, uint32_t max_slots);
+void     ts2es_ring_commit(ts2es_ring_t *p_ring);
+void     ts2es_ring_publish(ts2es_ring_t *p_ring);
+uint8_t *ts2es_ring_read_slot(ts2es_ring_t *p_ring);
+void     ts2es_ring_release(ts2es_ring_t *p_ring);
+
+/* ===========================================================================
+ * work-stealing thread pool: each worker runs the tasks of its own queue,
+ * newest first, and takes the oldest task of another queue when it runs dry
+ * ==========================================================================*/
+typedef void (*f_ts2es_task)(void *arg);
+typedef struct ts2es_pool_t ts2es_pool_t;
+
+ts2es_pool_t *ts2es_pool_create(int num_threads);
+int      ts2es_pool_submit(ts2es_pool_t *p_pool, f_ts2es_task p_fun, void *arg);
+void     ts2es_pool_wait(ts2es_pool_t *p_pool);
+void     ts2es_pool_destroy(ts2es_pool_t *p_pool);
+
+#ifdef __cplusplus
+};
+#endif
+#endif // _TS_THREAD_H_
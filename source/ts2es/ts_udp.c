@@ -0,0 +1,417 @@
+/*
+    ts_udp.c
+    (C) Falei Luo          <falei.luo@gmail.com> 2017
+
+    Copyright notice:
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * Live input: datagrams of TS packets, bare or in RTP, are received in
+ * batches (recvmmsg() on Linux) straight into the slots of a preallocated
+ * ring by a receiver thread, and demuxed from the ring by the calling thread.
+ * While the ring is full the datagrams are read and discarded, so that the
+ * socket buffer keeps draining and the loss is counted.
+ */
+#if !defined(_WIN32) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE     // recvmmsg()
+#endif
+#include "ts2es.h"
+#include "ts_thread.h"
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+/* ===========================================================================
+ * constant definitions
+ * ==========================================================================*/
+#define UDP_RING_SLOTS      8192    // default, power of 2
+#define UDP_SLOT_SIZE       2048    // a datagram and its length
+#define UDP_SLOT_HEADER     8
+#define UDP_BATCH           64      // datagrams received at a time
+#define UDP_RCVBUF          (8 << 20)
+#define UDP_POLL_MS         100     // the receiver checks for a stop this often
+
+/* ===========================================================================
+ * type definitions
+ * ==========================================================================*/
+struct ts2es_udp_t {
+    ts2es_t            *h_ts;
+    ts2es_ring_t        ring;       // slots: length (32 bit), pad, datagram
+    ts2es_thread_t      thread;     // receiver
+    int                 fd;
+    int                 b_started;
+    volatile int        b_stop;
+    volatile int        b_failed;   // the receiver stopped on an error
+    int                 rtp_seq;    // of the last RTP datagram, -1: none yet
+    ts2es_udp_stats_t   stats;
+};
+
+#ifndef _WIN32
+/* ---------------------------------------------------------------------------
+ * parse "[udp://|rtp://][[source]@][address]:port"
+ * returns 1 on success, or 0 if it is not valid
+ */
+static int udp_parse_address(const char *s_addr, struct sockaddr_in *p_sa)
+{
+    char host[256];
+    const char *p, *colon;
+
+    if ((p = strstr(s_addr, "://")) != NULL) {
+        s_addr = p + 3;
+    }
+    if ((p = strchr(s_addr, '@')) != NULL) {
+        s_addr = p + 1;             // source filters are not supported
+    }
+    if ((colon = strrchr(s_addr, ':')) == NULL || (size_t)(colon - s_addr) >= sizeof(host)) {
+        return 0;
+    }
+    memcpy(host, s_addr, colon - s_addr);
+    host[colon - s_addr] = '\0';
+
+    memset(p_sa, 0, sizeof(struct sockaddr_in));
+    p_sa->sin_family = AF_INET;
+    p_sa->sin_port   = htons((uint16_t)atoi(colon + 1));
+    if (host[0] == '\0') {
+        p_sa->sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if (inet_pton(AF_INET, host, &p_sa->sin_addr) != 1) {
+        struct addrinfo hints, *res;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_INET;
+        if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+            return 0;
+        }
+        p_sa->sin_addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+        freeaddrinfo(res);
+    }
+    return p_sa->sin_port != 0;
+}
+
+/* ---------------------------------------------------------------------------
+ * open the socket, joining the group of a multicast address
+ * returns the socket, or -1 on failure
+ */
+static int udp_socket_open(ts2es_t *h_ts, const struct sockaddr_in *p_sa)
+{
+    struct timeval tv;
+    int fd, on = 1, rcvbuf = UDP_RCVBUF;
+
+    if ((fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+#ifdef SO_RXQ_OVFL
+    setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));   // count the datagrams dropped
+#endif
+    tv.tv_sec  = 0;
+    tv.tv_usec = UDP_POLL_MS * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (bind(fd, (const struct sockaddr *)p_sa, sizeof(struct sockaddr_in)) != 0) {
+        ts2es_report(h_ts, TS2ES_ERROR, "Failed to bind to %s:%d\n", inet_ntoa(p_sa->sin_addr),
+            ntohs(p_sa->sin_port));
+        close(fd);
+        return -1;
+    }
+    if (IN_MULTICAST(ntohl(p_sa->sin_addr.s_addr))) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr        = p_sa->sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0) {
+            ts2es_report(h_ts, TS2ES_ERROR, "Failed to join the multicast group %s\n", inet_ntoa(p_sa->sin_addr));
+            close(fd);
+            return -1;
+        }
+    }
+    return fd;
+}
+
+/* ---------------------------------------------------------------------------
+ * receive datagrams into bufs[0, n), each of buf_size bytes; lens[] gets
+ * their sizes, 0 for truncated ones, and *p_dropped the count of datagrams
+ * dropped by the socket, if the system tells it
+ * returns the number of datagrams, 0 on timeout, or -1 on error
+ */
+static int udp_recv_batch(int fd, uint8_t **bufs, uint32_t *lens, int n, size_t buf_size, uint64_t *p_dropped)
+{
+#if defined(__linux__)
+    struct mmsghdr msgs[UDP_BATCH];
+    struct iovec iovs[UDP_BATCH];
+    uint8_t ctrl[UDP_BATCH][CMSG_SPACE(sizeof(uint32_t))];
+    int i, got;
+
+    for (i = 0; i < n; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len  = buf_size;
+        memset(&msgs[i], 0, sizeof(struct mmsghdr));
+        msgs[i].msg_hdr.msg_iov        = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen     = 1;
+        msgs[i].msg_hdr.msg_control    = ctrl[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+    }
+    got = recvmmsg(fd, msgs, n, MSG_WAITFORONE, NULL);
+    if (got < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR ? 0 : -1;
+    }
+    for (i = 0; i < got; i++) {
+        struct cmsghdr *cmsg;
+        lens[i] = (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) ? 0 : msgs[i].msg_len;
+        for (cmsg = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cmsg != NULL; cmsg = CMSG_NXTHDR(&msgs[i].msg_hdr, cmsg)) {
+#ifdef SO_RXQ_OVFL
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL) {
+                uint32_t dropped;
+                memcpy(&dropped, CMSG_DATA(cmsg), sizeof(dropped));
+                *p_dropped = dropped;
+            }
+#endif
+        }
+    }
+    return got;
+#else
+    int i;
+
+    (void)p_dropped;
+    for (i = 0; i < n; i++) {
+        ssize_t len = recv(fd, bufs[i], buf_size, i ? MSG_DONTWAIT : 0);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+                break;
+            }
+            return i ? i : -1;
+        }
+        lens[i] = (size_t)len < buf_size ? (uint32_t)len : 0;
+    }
+    return i;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * receiver thread: fill the ring, or discard the datagrams while it is full
+ */
+static void *udp_recv_proc(void *arg)
+{
+    ts2es_udp_t *p_udp = (ts2es_udp_t *)arg;
+    uint8_t *slots[UDP_BATCH];
+    uint8_t *bufs[UDP_BATCH];
+    uint32_t lens[UDP_BATCH];
+    uint8_t *scratch = (uint8_t *)malloc(UDP_SLOT_SIZE);
+
+    while (!p_udp->b_stop && scratch != NULL) {
+        uint32_t n = ts2es_ring_write_slots(&p_udp->ring, slots, UDP_BATCH);
+        int i, got;
+
+        if (n == 0) {
+            // ring full: keep the socket draining, one datagram at a time
+            bufs[0] = scratch;
+            got = udp_recv_batch(p_udp->fd, bufs, lens, 1, UDP_SLOT_SIZE, &p_udp->stats.dropped);
+            if (got < 0) {
+                break;
+            }
+            p_udp->stats.overflows += got;
+            continue;
+        }
+
+        for (i = 0; i < (int)n; i++) {
+            bufs[i] = slots[i] + UDP_SLOT_HEADER;
+        }
+        got = udp_recv_batch(p_udp->fd, bufs, lens, (int)n, UDP_SLOT_SIZE - UDP_SLOT_HEADER,
+                             &p_udp->stats.dropped);
+        if (got < 0) {
+            break;
+        }
+        for (i = 0; i < got; i++) {
+            memcpy(slots[i], &lens[i], sizeof(uint32_t));
+            p_udp->stats.datagrams++;
+            p_udp->stats.bytes     += lens[i];
+            p_udp->stats.truncated += lens[i] == 0;
+            ts2es_ring_commit(&p_udp->ring);
+        }
+        ts2es_ring_publish(&p_udp->ring);
+    }
+
+    if (!p_udp->b_stop) {
+        ts2es_report(p_udp->h_ts, TS2ES_ERROR, "Failed to receive datagrams, live input stopped.\n");
+    }
+    free(scratch);
+    ts2es_atomic_store(&p_udp->b_failed, 1);
+    return NULL;
+}
+#endif // !_WIN32
+
+/* ---------------------------------------------------------------------------
+ * strip the RTP header of a datagram, counting the datagrams missing from
+ * the RTP sequence; bare TS datagrams begin with the sync byte
+ * returns the TS payload, or NULL if there is none
+ */
+static const uint8_t *udp_payload(ts2es_udp_t *p_udp, const uint8_t *buf, size_t *p_len)
+{
+    size_t len = *p_len, hdr;
+    int seq;
+
+    if (len == 0 || buf[0] == 0x47 || (buf[0] >> 6) != 2 || len < 12) {
+        return len ? buf : NULL;
+    }
+
+    hdr = 12 + 4 * (buf[0] & 0x0F);                         // CSRC list
+    if ((buf[0] & 0x10) && hdr + 4 <= len) {                // header extension
+        hdr += 4 + 4 * ((buf[hdr + 2] << 8) | buf[hdr + 3]);
+    }
+    if (buf[0] & 0x20) {                                    // padding
+        len -= buf[len - 1] < len ? buf[len - 1] : len;
+    }
+    if (hdr >= len) {
+        return NULL;
+    }
+
+    seq = (buf[2] << 8) | buf[3];
+    if (p_udp->rtp_seq >= 0) {
+        int gap = (seq - p_udp->rtp_seq - 1) & 0xFFFF;
+        if (gap < 0x8000) {
+            p_udp->stats.lost += gap;       // else late or duplicate
+        }
+    }
+    p_udp->rtp_seq = seq;
+    *p_len = len - hdr;
+    return buf + hdr;
+}
+
+/* ---------------------------------------------------------------------------
+ * Open a live input on "[udp://|rtp://][@][address]:port" and start receiving
+ * into a ring of ring_slots datagrams (0: default). Multicast groups are
+ * joined on the default interface
+ * returns the input, or NULL on failure
+ */
+ts2es_udp_t *ts2es_udp_open(ts2es_t *h_ts, const char *s_addr, int ring_slots)
+{
+#ifdef _WIN32
+    ts2es_report(h_ts, TS2ES_ERROR, "Live input is not available on this system.\n");
+    (void)s_addr;
+    (void)ring_slots;
+    return NULL;
+#else
+    struct sockaddr_in sa;
+    ts2es_udp_t *p_udp;
+    uint32_t num_slots = UDP_RING_SLOTS;
+
+    if (!udp_parse_address(s_addr, &sa)) {
+        ts2es_report(h_ts, TS2ES_ERROR, "Invalid live input address %s\n", s_addr);
+        return NULL;
+    }
+    if (ring_slots > 0) {
+        for (num_slots = UDP_BATCH; num_slots < (uint32_t)ring_slots && num_slots < (1u << 24); num_slots <<= 1) {
+        }
+    }
+
+    if ((p_udp = (ts2es_udp_t *)calloc(1, sizeof(ts2es_udp_t))) == NULL) {
+        return NULL;
+    }
+    p_udp->h_ts    = h_ts;
+    p_udp->rtp_seq = -1;
+    if ((p_udp->fd = udp_socket_open(h_ts, &sa)) < 0) {
+        free(p_udp);
+        return NULL;
+    }
+    if (!ts2es_ring_init(&p_udp->ring, num_slots, UDP_SLOT_SIZE)) {
+        ts2es_report(h_ts, TS2ES_ERROR, "Failed to allocate the ring of the live input.\n");
+        ts2es_udp_close(p_udp);
+        return NULL;
+    }
+    if (!ts2es_thread_create(&p_udp->thread, udp_recv_proc, p_udp)) {
+        ts2es_report(h_ts, TS2ES_ERROR, "Failed to start the receiver of the live input.\n");
+        ts2es_udp_close(p_udp);
+        return NULL;
+    }
+    p_udp->b_started = 1;
+    ts2es_report(h_ts, TS2ES_INFO, "Receiving from %s:%d\n", inet_ntoa(sa.sin_addr), ntohs(sa.sin_port));
+    return p_udp;
+#endif
+}
+
+/* ---------------------------------------------------------------------------
+ * Demux the datagrams as they arrive, until the handle is interrupted, the
+ * receiver fails or, if idle_ms > 0, no datagram came for idle_ms
+ */
+void ts2es_udp_demux(ts2es_udp_t *p_udp, int idle_ms)
+{
+    ts2es_t *h_ts = p_udp->h_ts;
+    int64_t t_last = ts2es_time_us();
+
+    while (!h_ts->Interrupted) {
+        uint8_t *slot = ts2es_ring_read_slot(&p_udp->ring);
+        const uint8_t *payload;
+        uint32_t len;
+        size_t ts_len;
+
+        if (slot == NULL) {
+            if (ts2es_atomic_load(&p_udp->b_failed) ||
+                (idle_ms > 0 && ts2es_time_us() - t_last > (int64_t)idle_ms * 1000)) {
+                break;
+            }
+            ts2es_sleep_ms(1);
+            continue;
+        }
+
+        memcpy(&len, slot, sizeof(uint32_t));
+        ts_len = len;
+        if ((payload = udp_payload(p_udp, slot + UDP_SLOT_HEADER, &ts_len)) != NULL) {
+            ts2es_demux_ts_buffer(h_ts, (uint8_t *)payload, ts_len);
+        }
+        ts2es_ring_release(&p_udp->ring);
+        if (idle_ms > 0) {
+            t_last = ts2es_time_us();
+        }
+    }
+}
+
+/* ---------------------------------------------------------------------------
+ * Copy the counters of a live input; those of the receiver may lag a little
+ */
+void ts2es_udp_get_stats(ts2es_udp_t *p_udp, ts2es_udp_stats_t *p_stats)
+{
+    *p_stats = p_udp->stats;
+}
+
+/* ---------------------------------------------------------------------------
+ * Stop receiving and close a live input; datagrams not demuxed are dropped
+ */
+void ts2es_udp_close(ts2es_udp_t *p_udp)
+{
+    if (p_udp == NULL) {
+        return;
+    }
+#ifndef _WIN32
+    p_udp->b_stop = 1;
+    if (p_udp->b_started) {
+        ts2es_thread_join(p_udp->thread);
+    }
+    if (p_udp->fd >= 0) {
+        close(p_udp->fd);
+    }
+#endif
+    ts2es_ring_destroy(&p_udp->ring);
+    free(p_udp);
+}